@@ -15,6 +15,7 @@
 #include <dirent.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <time.h>
 
 #include "ccan/list/list.h"
 
@@ -27,6 +28,9 @@
 #include "target.h"
 #include "alua.h"
 
+/* How long a cached copy of the groups is used without re-reading */
+#define TCMU_ALUA_CACHE_MS	1000
+
 static char *tcmu_get_alua_str_setting(struct alua_grp *group,
 				       const char *setting)
 {
@@ -264,6 +268,158 @@ void tcmu_release_alua_grps(struct list_head *group_list)
 	}
 }
 
+static struct alua_grp *tcmu_copy_alua_grp(struct alua_grp *src)
+{
+	struct alua_grp *group;
+	struct tgt_port *src_port, *port;
+
+	group = malloc(sizeof(*group));
+	if (!group)
+		return NULL;
+	*group = *src;
+	list_head_init(&group->tgt_ports);
+	list_node_init(&group->entry);
+	group->num_tgt_ports = 0;
+	group->name = strdup(src->name);
+	if (!group->name)
+		goto free_group;
+
+	list_for_each(&src->tgt_ports, src_port, entry) {
+		port = calloc(1, sizeof(*port));
+		if (!port)
+			goto free_group;
+		*port = *src_port;
+		list_node_init(&port->entry);
+		port->grp = group;
+		port->wwn = strdup(src_port->wwn);
+		port->fabric = strdup(src_port->fabric);
+		list_add_tail(&group->tgt_ports, &port->entry);
+		group->num_tgt_ports++;
+		if (!port->wwn || !port->fabric)
+			goto free_group;
+	}
+	return group;
+
+free_group:
+	tcmu_free_alua_grp(group);
+	return NULL;
+}
+
+static int tcmu_copy_alua_grps(struct list_head *src_list,
+			       struct list_head *group_list)
+{
+	struct alua_grp *src, *group;
+
+	list_for_each(src_list, src, entry) {
+		group = tcmu_copy_alua_grp(src);
+		if (!group) {
+			tcmu_release_alua_grps(group_list);
+			return -ENOMEM;
+		}
+		list_add_tail(group_list, &group->entry);
+	}
+	return 0;
+}
+
+/* bumped by tcmu_invalidate_all_alua_grps */
+static unsigned int alua_cache_epoch;
+
+static bool tcmu_alua_cache_fresh(struct tcmur_device *rdev)
+{
+	struct timespec now;
+	int64_t ms;
+
+	if (!rdev->alua_cache_valid ||
+	    rdev->alua_cache_epoch != __atomic_load_n(&alua_cache_epoch,
+						      __ATOMIC_ACQUIRE))
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	ms = (int64_t)(now.tv_sec - rdev->alua_cache_time.tv_sec) * 1000 +
+	     (now.tv_nsec - rdev->alua_cache_time.tv_nsec) / 1000000;
+	return ms < TCMU_ALUA_CACHE_MS;
+}
+
+/*
+ * Returns 0 if group_list was filled from the cache, else the gen and
+ * epoch to pass to tcmu_alua_cache_store in *gen and *epoch.
+ */
+static int tcmu_alua_cache_lookup(struct tcmur_device *rdev,
+				  struct list_head *group_list,
+				  unsigned int *gen, unsigned int *epoch)
+{
+	int ret = -ENOENT;
+
+	*epoch = __atomic_load_n(&alua_cache_epoch, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&rdev->alua_cache_lock);
+	if (tcmu_alua_cache_fresh(rdev))
+		ret = tcmu_copy_alua_grps(&rdev->alua_cache, group_list);
+	*gen = rdev->alua_cache_gen;
+	pthread_mutex_unlock(&rdev->alua_cache_lock);
+
+	return ret;
+}
+
+/* Cache the groups just read, unless they were invalidated meanwhile */
+static void tcmu_alua_cache_store(struct tcmur_device *rdev,
+				  struct list_head *group_list,
+				  unsigned int gen, unsigned int epoch)
+{
+	struct list_head cache, old;
+
+	list_head_init(&cache);
+	list_head_init(&old);
+	if (tcmu_copy_alua_grps(group_list, &cache))
+		return;
+
+	pthread_mutex_lock(&rdev->alua_cache_lock);
+	if (gen == rdev->alua_cache_gen) {
+		list_append_list(&old, &rdev->alua_cache);
+		list_append_list(&rdev->alua_cache, &cache);
+		rdev->alua_cache_valid = true;
+		rdev->alua_cache_epoch = epoch;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &rdev->alua_cache_time);
+	}
+	pthread_mutex_unlock(&rdev->alua_cache_lock);
+
+	tcmu_release_alua_grps(&old);
+	tcmu_release_alua_grps(&cache);
+}
+
+/**
+ * tcmu_invalidate_alua_grps: Drop the device's cached groups
+ * @dev: device whose ALUA setup or state changed.
+ *
+ * Called after we change the ALUA state in configfs and on reconfig
+ * events, so the next tcmu_get_alua_grps reads configfs again.
+ */
+void tcmu_invalidate_alua_grps(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct list_head cache;
+
+	list_head_init(&cache);
+
+	pthread_mutex_lock(&rdev->alua_cache_lock);
+	rdev->alua_cache_gen++;
+	rdev->alua_cache_valid = false;
+	list_append_list(&cache, &rdev->alua_cache);
+	pthread_mutex_unlock(&rdev->alua_cache_lock);
+
+	tcmu_release_alua_grps(&cache);
+}
+
+/**
+ * tcmu_invalidate_all_alua_grps: Drop the cached groups of all devices
+ *
+ * Called after we enable or disable a target port group, which changes
+ * the port state every device exported through it reports.
+ */
+void tcmu_invalidate_all_alua_grps(void)
+{
+	__atomic_add_fetch(&alua_cache_epoch, 1, __ATOMIC_RELEASE);
+}
+
 static int alua_filter(const struct dirent *dir)
 {
         return strcmp(dir->d_name, ".") && strcmp(dir->d_name, "..");
@@ -275,7 +431,8 @@ static int alua_filter(const struct dirent *dir)
  * @group_list: list allocated by the caller to add groups to.
  *
  * User must call tcmu_release_alua_grps when finished with the list of
- * groups.
+ * groups. The groups are copies of a per device cache that is re-read
+ * from configfs after TCMU_ALUA_CACHE_MS or tcmu_invalidate_alua_grps.
  *
  * For now, we will only support ALUA if the user has defined groups.
  * tcmu ALUA support was added in 4.11, but not all fabric modules support
@@ -291,12 +448,17 @@ static int alua_filter(const struct dirent *dir)
 int tcmu_get_alua_grps(struct tcmu_device *dev,
 			   struct list_head *group_list)
 {
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	struct alua_grp *group;
 	struct dirent **namelist;
 	char path[PATH_MAX];
+	unsigned int gen, epoch;
 	int i, n;
 	int ret = 0;
 
+	if (!tcmu_alua_cache_lookup(rdev, group_list, &gen, &epoch))
+		return 0;
+
 	snprintf(path, sizeof(path), CFGFS_CORE"/%s/%s/alua",
 		 dev->tcm_hba_name, dev->tcm_dev_name);
 	n = scandir(path, &namelist, alua_filter, alphasort);
@@ -318,6 +480,7 @@ int tcmu_get_alua_grps(struct tcmu_device *dev,
 		}
 		list_add_tail(group_list, &group->entry);
 	}
+	tcmu_alua_cache_store(rdev, group_list, gen, epoch);
 	ret = 0;
 	goto free_names;
 
@@ -362,6 +525,7 @@ static int alua_set_state(struct tcmu_device *dev, struct alua_grp *group,
 	int ret;
 
 	ret = tcmu_set_alua_int_setting(group, "alua_access_state", new_state);
+	tcmu_invalidate_alua_grps(dev);
 	if (ret) {
 		tcmu_dev_err(dev, "Could not change kernel state to %u\n",
 			     new_state);
@@ -429,7 +593,7 @@ static int alua_sync_state(struct tcmu_device *dev,
 				pthread_mutex_lock(&rdev->state_lock);
 				if (rdev->lock_state == TCMUR_DEV_LOCK_LOCKED) {
 					tcmu_dev_dbg(dev, "Dropping lock\n");
-					rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+					tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 				}
 				pthread_mutex_unlock(&rdev->state_lock);
 			}
@@ -537,22 +701,27 @@ bool lock_is_required(struct tcmu_device *dev)
 	return !!rhandler->lock;
 }
 
-static void *alua_lock_thread_fn(void *arg)
+static void alua_lock_work_fn(struct tcmur_recovery_work *work)
 {
+	struct tcmur_device *rdev = container_of(work, struct tcmur_device,
+						 lock_work);
+
 	/* TODO: set UA based on bgly's patches */
-	tcmu_acquire_dev_lock(arg, false, -1);
-	return NULL;
+	tcmu_acquire_dev_lock(rdev->dev, false, -1);
 }
 
 int alua_implicit_transition(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
-	pthread_attr_t attr;
 	int ret = TCMU_STS_OK;
 
 	if (!lock_is_required(dev))
 		return ret;
 
+	/* fast path, there is nothing to start or wait for once locked */
+	if (tcmur_dev_get_lock_state(rdev) == TCMUR_DEV_LOCK_LOCKED)
+		return ret;
+
 	pthread_mutex_lock(&rdev->state_lock);
 	if (rdev->lock_state == TCMUR_DEV_LOCK_LOCKED) {
 		goto done;
@@ -564,23 +733,19 @@ int alua_implicit_transition(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	tcmu_dev_info(dev, "Starting lock acquisition operation.\n");
 
-	rdev->lock_state = TCMUR_DEV_LOCK_LOCKING;
-
-	/*
-	 * Make the lock_thread as detached to fix the memory leakage bug.
-	 */
-	pthread_attr_init (&attr);
-	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_LOCKING);
 
 	/*
 	 * The initiator is going to be queueing commands, so do this
-	 * in the background to avoid command timeouts.
+	 * in the background to avoid command timeouts. Cmds are waiting
+	 * on it, so it goes before reopens of idle devices.
 	 */
-	if (pthread_create(&rdev->lock_thread, &attr, alua_lock_thread_fn,
-			   dev)) {
-		tcmu_dev_err(dev, "Could not start implicit transition thread:%s\n",
-			     strerror(errno));
-		rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+	tcmur_recovery_work_init(&rdev->lock_work, alua_lock_work_fn);
+	ret = tcmur_recovery_queue(&rdev->lock_work, true, 0);
+	if (ret) {
+		tcmu_dev_err(dev, "Could not queue implicit transition:%s\n",
+			     strerror(-ret));
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 		ret = TCMU_STS_IMPL_TRANSITION_ERR;
 	} else {
 		ret = TCMU_STS_BUSY;
@@ -767,7 +932,7 @@ int alua_check_state(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 
 	if (rdev->failover_type == TMCUR_DEV_FAILOVER_EXPLICIT) {
-		if (rdev->lock_state != TCMUR_DEV_LOCK_LOCKED) {
+		if (tcmur_dev_get_lock_state(rdev) != TCMUR_DEV_LOCK_LOCKED) {
 			tcmu_dev_dbg(dev, "device lock not held.\n");
 			return TCMU_STS_FENCED;
 		}
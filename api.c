@@ -17,10 +17,12 @@
 #include <limits.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <string.h>
 #include <scsi/scsi.h>
 #include <endian.h>
 #include <errno.h>
+#include <linux/fs.h>
 
 #include "libtcmu_log.h"
 #include "libtcmu_common.h"
@@ -97,6 +99,24 @@ uint32_t tcmu_get_xfer_length(uint8_t *cdb)
 	}
 }
 
+/* Offset of the first byte that differs, a word at a time until close */
+static size_t mem_mismatch(const char *a, const char *b, size_t len)
+{
+	uint64_t x, y;
+	size_t pos;
+
+	for (pos = 0; pos + sizeof(x) <= len; pos += sizeof(x)) {
+		memcpy(&x, a + pos, sizeof(x));
+		memcpy(&y, b + pos, sizeof(y));
+		if (x != y)
+			break;
+	}
+
+	while (pos < len && a[pos] == b[pos])
+		pos++;
+	return pos;
+}
+
 /*
  * Returns location of first mismatch between bytes in mem and the iovec.
  * If they are the same, return -1.
@@ -112,21 +132,12 @@ off_t tcmu_compare_with_iovec(void *mem, struct iovec *iovec, size_t size)
 
 		ret = memcmp(mem + mem_off, iovec->iov_base, part);
 		if (ret) {
-			size_t pos;
-			char *spos = mem + mem_off;
-			char *dpos = iovec->iov_base;
-
 			/*
 			 * Data differed, this is assumed to be 'rare'
-			 * so use a much more expensive byte-by-byte
-			 * comparison to find out at which offset the
-			 * data differs.
+			 * so only now look for the offset it differs at.
 			 */
-			for (pos = 0; pos < part && *spos++ == *dpos++;
-			     pos++)
-				;
-
-			return pos + mem_off;
+			return mem_mismatch(mem + mem_off, iovec->iov_base,
+					    part) + mem_off;
 		}
 
 		size -= part;
@@ -182,6 +193,201 @@ size_t tcmu_iovec_length(struct iovec *iovec, size_t iov_cnt)
 	return length;
 }
 
+/*
+ * Check that every buffer and length in an iovec is a multiple of align,
+ * as O_DIRECT needs.
+ */
+bool tcmu_iovec_aligned(struct iovec *iovec, size_t iov_cnt, size_t align)
+{
+	while (iov_cnt) {
+		if ((uintptr_t)iovec->iov_base % align ||
+		    iovec->iov_len % align)
+			return false;
+
+		iovec++;
+		iov_cnt--;
+	}
+
+	return true;
+}
+
+/*
+ * Get the alignment the buffers, offsets and lengths of O_DIRECT io to
+ * fd need, for a device with block_size blocks. dev may be NULL, it is
+ * only used for logging.
+ *
+ * Block devices need their logical block size. Files report theirs with
+ * statx on newer kernels, else the file system block size is assumed,
+ * which is never too small. Fails if the blocks are not aligned to it,
+ * or the file can not do direct io at all.
+ */
+int tcmu_get_dio_align(struct tcmu_device *dev, int fd, uint32_t block_size,
+		       uint32_t *align)
+{
+	uint32_t mem_align, off_align;
+	struct stat st;
+	int lbs;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+#endif
+
+	if (fstat(fd, &st))
+		goto fail;
+
+	mem_align = off_align = st.st_blksize;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKSSZGET, &lbs))
+			goto fail;
+		mem_align = off_align = lbs;
+	}
+#ifdef STATX_DIOALIGN
+	else if (!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) &&
+		 (stx.stx_mask & STATX_DIOALIGN)) {
+		if (!stx.stx_dio_offset_align) {
+			tcmu_dev_err(dev, "The file system does not support direct io.\n");
+			return -EOPNOTSUPP;
+		}
+		mem_align = stx.stx_dio_mem_align;
+		off_align = stx.stx_dio_offset_align;
+	}
+#endif
+
+	if (block_size % off_align) {
+		tcmu_dev_err(dev, "Block size %u is not a multiple of the %u byte alignment direct io needs.\n",
+			     block_size, off_align);
+		return -EINVAL;
+	}
+
+	*align = max(mem_align, off_align);
+	return 0;
+
+fail:
+	tcmu_dev_err(dev, "Could not get the direct io alignment: %m\n");
+	return -errno;
+}
+
+/* Copy into an iovec without consuming it */
+static void copy_into_iovec(struct iovec *iovec, size_t iov_cnt,
+			    const char *src, size_t len)
+{
+	size_t part;
+
+	for (; len && iov_cnt; iovec++, iov_cnt--) {
+		part = min(len, iovec->iov_len);
+		memcpy(iovec->iov_base, src, part);
+		src += part;
+		len -= part;
+	}
+}
+
+static void copy_from_iovec(char *dst, size_t len, struct iovec *iovec,
+			    size_t iov_cnt)
+{
+	size_t part;
+
+	for (; len && iov_cnt; iovec++, iov_cnt--) {
+		part = min(len, iovec->iov_len);
+		memcpy(dst, iovec->iov_base, part);
+		dst += part;
+		len -= part;
+	}
+}
+
+/*
+ * preadv for fds opened O_DIRECT, where align is from tcmu_get_dio_align.
+ * Misaligned buffers, and reads that do not start or end on align, go
+ * through an aligned bounce buffer. An align of 0 is a plain preadv.
+ */
+ssize_t tcmu_preadv_aligned(int fd, struct iovec *iovec, size_t iov_cnt,
+			    off_t offset, size_t align)
+{
+	size_t len = tcmu_iovec_length(iovec, iov_cnt);
+	off_t start, end;
+	ssize_t ret;
+	void *buf;
+	int err;
+
+	if (!align || (!(offset % align) && !(len % align) &&
+		       tcmu_iovec_aligned(iovec, iov_cnt, align)))
+		return preadv(fd, iovec, iov_cnt, offset);
+
+	start = offset - offset % align;
+	end = offset + len + align - 1;
+	end -= end % align;
+
+	err = posix_memalign(&buf, align, end - start);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	ret = pread(fd, buf, end - start, start);
+	if (ret > 0) {
+		/* only the part of the request that was read */
+		ret -= offset - start;
+		ret = ret < 0 ? 0 : min((size_t)ret, len);
+		copy_into_iovec(iovec, iov_cnt, buf + (offset - start), ret);
+	}
+
+	err = errno;
+	free(buf);
+	errno = err;
+	return ret;
+}
+
+/*
+ * pwritev for fds opened O_DIRECT, where align is from tcmu_get_dio_align.
+ * Misaligned buffers are bounced, but the write must start and end on
+ * align. An align of 0 is a plain pwritev.
+ */
+ssize_t tcmu_pwritev_aligned(int fd, struct iovec *iovec, size_t iov_cnt,
+			     off_t offset, size_t align)
+{
+	size_t len = tcmu_iovec_length(iovec, iov_cnt);
+	ssize_t ret;
+	void *buf;
+	int err;
+
+	if (!align || tcmu_iovec_aligned(iovec, iov_cnt, align))
+		return pwritev(fd, iovec, iov_cnt, offset);
+
+	if (offset % align || len % align) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	err = posix_memalign(&buf, align, len);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	copy_from_iovec(buf, len, iovec, iov_cnt);
+
+	ret = pwrite(fd, buf, len, offset);
+
+	err = errno;
+	free(buf);
+	errno = err;
+	return ret;
+}
+
+ssize_t tcmu_pread_aligned(int fd, void *buf, size_t count, off_t offset,
+			   size_t align)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return tcmu_preadv_aligned(fd, &iov, 1, offset, align);
+}
+
+ssize_t tcmu_pwrite_aligned(int fd, const void *buf, size_t count,
+			    off_t offset, size_t align)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+
+	return tcmu_pwritev_aligned(fd, &iov, 1, offset, align);
+}
+
 void __tcmu_set_sense_data(uint8_t *sense_buf, uint8_t key, uint16_t asc_ascq)
 {
 	sense_buf[0] |= 0x70;	/* fixed, current */
@@ -229,6 +435,43 @@ void tcmu_zero_iovec(struct iovec *iovec, size_t iov_cnt)
 	}
 }
 
+static const char zero_page[4096];
+
+/*
+ * Check if an iovec is all zeros, e.g. the block of a WRITE SAME.
+ *
+ * The data is compared with a page of zeros that stays in the L1 cache,
+ * so each byte is only loaded once and memcmp's vector code does the
+ * work. Most data that is not zeroed differs in its first word.
+ */
+bool tcmu_iovec_zeroed(struct iovec *iovec, size_t iov_cnt)
+{
+	const char *buf;
+	size_t len, part;
+	uint64_t word;
+
+	while (iov_cnt) {
+		buf = iovec->iov_base;
+		len = iovec->iov_len;
+
+		if (len >= sizeof(word)) {
+			memcpy(&word, buf, sizeof(word));
+			if (word)
+				return false;
+		}
+
+		for (; len; buf += part, len -= part) {
+			part = min(len, sizeof(zero_page));
+			if (memcmp(buf, zero_page, part))
+				return false;
+		}
+
+		iovec++;
+		iov_cnt--;
+	}
+	return true;
+}
+
 /*
  * Copy data into an iovec, and consume the space in the iovec.
  *
@@ -623,7 +866,7 @@ finish_page83:
 		/* Optimal xfer length */
 		memcpy(&data[12], &val32, 4);
 
-		if (rhandler->unmap) {
+		if (rhandler->unmap || rhandler->unmapv) {
 			/* MAXIMUM UNMAP LBA COUNT */
 			val32 = htobe32(tcmu_get_dev_max_unmap_len(dev));
 			memcpy(&data[20], &val32, 4);
@@ -719,7 +962,7 @@ finish_page83:
 		 * This will enable the UNMAP command for the device server and write
 		 * same(10|16) command.
 		 */
-		if (rhandler->unmap)
+		if (rhandler->unmap || rhandler->unmapv)
 			data[5] |= 0xe0;
 
 		tcmu_memcpy_into_iovec(iovec, iov_cnt, data, sizeof(data));
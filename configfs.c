@@ -51,25 +51,70 @@ int tcmu_get_cfgfs_int(const char *path)
 	return val;
 }
 
+/*
+ * Drop the cached configfs values. Called for reconfig events and
+ * after we write to the device's configfs dir.
+ */
+void tcmu_cfgfs_invalidate(struct tcmu_device *dev)
+{
+	pthread_mutex_lock(&dev->cfgfs_lock);
+	dev->cfgfs_gen++;
+	dev->nr_cfgfs_attrs = 0;
+	free(dev->cfgfs_wwn);
+	dev->cfgfs_wwn = NULL;
+	pthread_mutex_unlock(&dev->cfgfs_lock);
+}
+
 int tcmu_get_attribute(struct tcmu_device *dev, const char *name)
 {
+	struct tcmu_cfgfs_attr *attr;
 	char path[PATH_MAX];
+	unsigned int i, gen;
+	int val;
+
+	pthread_mutex_lock(&dev->cfgfs_lock);
+	for (i = 0; i < dev->nr_cfgfs_attrs; i++) {
+		attr = &dev->cfgfs_attrs[i];
+		if (!strcmp(attr->name, name)) {
+			val = attr->val;
+			pthread_mutex_unlock(&dev->cfgfs_lock);
+			return val;
+		}
+	}
+	gen = dev->cfgfs_gen;
+	pthread_mutex_unlock(&dev->cfgfs_lock);
 
 	snprintf(path, sizeof(path), CFGFS_CORE"/%s/%s/attrib/%s",
 		 dev->tcm_hba_name, dev->tcm_dev_name, name);
-	return tcmu_get_cfgfs_int(path);
+	val = tcmu_get_cfgfs_int(path);
+	if (val < 0 || strlen(name) >= sizeof(attr->name))
+		return val;
+
+	pthread_mutex_lock(&dev->cfgfs_lock);
+	if (gen == dev->cfgfs_gen &&
+	    dev->nr_cfgfs_attrs < TCMU_CFGFS_CACHE_ATTRS) {
+		attr = &dev->cfgfs_attrs[dev->nr_cfgfs_attrs++];
+		strcpy(attr->name, name);
+		attr->val = val;
+	}
+	pthread_mutex_unlock(&dev->cfgfs_lock);
+
+	return val;
 }
 
 int tcmu_set_control(struct tcmu_device *dev, const char *key, unsigned long val)
 {
 	char path[PATH_MAX];
 	char buf[CFGFS_BUF_SIZE];
+	int ret;
 
 	snprintf(path, sizeof(path), CFGFS_CORE"/%s/%s/control",
 		 dev->tcm_hba_name, dev->tcm_dev_name);
 	snprintf(buf, sizeof(buf), "%s=%lu", key, val);
 
-	return tcmu_set_cfgfs_str(path, buf, strlen(buf) + 1);
+	ret = tcmu_set_cfgfs_str(path, buf, strlen(buf) + 1);
+	tcmu_cfgfs_invalidate(dev);
+	return ret;
 }
 
 static bool tcmu_cfgfs_mod_param_is_supported(const char *name)
@@ -169,9 +214,19 @@ char *tcmu_get_wwn(struct tcmu_device *dev)
 	int fd;
 	char path[PATH_MAX];
 	char buf[CFGFS_BUF_SIZE];
-	char *ret_buf;
+	char *ret_buf, *cached;
+	unsigned int gen;
 	int ret;
 
+	pthread_mutex_lock(&dev->cfgfs_lock);
+	if (dev->cfgfs_wwn) {
+		ret_buf = strdup(dev->cfgfs_wwn);
+		pthread_mutex_unlock(&dev->cfgfs_lock);
+		return ret_buf;
+	}
+	gen = dev->cfgfs_gen;
+	pthread_mutex_unlock(&dev->cfgfs_lock);
+
 	snprintf(path, sizeof(path),
 		 CFGFS_CORE"/%s/%s/wwn/vpd_unit_serial",
 		 dev->tcm_hba_name, dev->tcm_dev_name);
@@ -202,6 +257,15 @@ char *tcmu_get_wwn(struct tcmu_device *dev)
 		return NULL;
 	}
 
+	cached = strdup(ret_buf);
+	pthread_mutex_lock(&dev->cfgfs_lock);
+	if (cached && gen == dev->cfgfs_gen && !dev->cfgfs_wwn) {
+		dev->cfgfs_wwn = cached;
+		cached = NULL;
+	}
+	pthread_mutex_unlock(&dev->cfgfs_lock);
+	free(cached);
+
 	return ret_buf;
 }
 
@@ -176,19 +176,25 @@ int main(int argc, char **argv)
 
 		for (i = 0; i < dev_array_len; i++) {
 			if (pollfds[i+1].revents) {
-				struct tcmulib_cmd *cmd;
+				struct tcmulib_cmd *cmds[16], *cmd;
+				int rcs[16];
 				struct tcmu_device *dev = tcmu_dev_array[i];
+				int j, n;
 
 				tcmulib_processing_start(dev);
 
-				while ((cmd = tcmulib_get_next_command(dev)) != NULL) {
-					ret = foo_handle_cmd(dev,
-							     cmd->cdb,
-							     cmd->iovec,
-							     cmd->iov_cnt,
-							     cmd->sense_buf);
-					tcmulib_command_complete(dev, cmd, ret);
-				}
+				do {
+					n = tcmulib_get_next_commands(dev, cmds, 16);
+					for (j = 0; j < n; j++) {
+						cmd = cmds[j];
+						rcs[j] = foo_handle_cmd(dev,
+									cmd->cdb,
+									cmd->iovec,
+									cmd->iov_cnt,
+									cmd->sense_buf);
+					}
+					tcmulib_command_complete_batch(dev, cmds, rcs, n);
+				} while (n == 16);
 
 				tcmulib_processing_complete(dev);
 			}
@@ -22,6 +22,8 @@ if [ y`uname`y = yLinuxy ]; then
 		$SUDO yum install -y librados2 librados2-devel librbd1
 		yum search librbd-devel | grep -q "N/S matched" && LIBRBD=librbd || LIBRBD=librbd1
 	        $SUDO yum install -y $LIBRBD-devel
+		# for the io_uring file handler
+		$SUDO yum install -y liburing liburing-devel
 		;;
 	*)
 		echo "TODO: only fedora/rhel/centos are supported for now!"
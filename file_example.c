@@ -31,6 +31,9 @@
 #include <endian.h>
 #include <errno.h>
 #include <scsi/scsi.h>
+#ifdef HAVE_LINUX_FALLOC
+#include <linux/falloc.h>
+#endif
 
 #include "scsi_defs.h"
 #include "libtcmu.h"
@@ -38,12 +41,15 @@
 
 struct file_state {
 	int fd;
+	/* O_DIRECT alignment, 0 without it */
+	uint32_t dio_align;
 };
 
 static int file_open(struct tcmu_device *dev, bool reopen)
 {
 	struct file_state *state;
-	char *config;
+	char *cfgstring, *config, *opt;
+	int flags = O_CREAT | O_RDWR;
 
 	state = calloc(1, sizeof(*state));
 	if (!state)
@@ -51,26 +57,51 @@ static int file_open(struct tcmu_device *dev, bool reopen)
 
 	tcmu_set_dev_private(dev, state);
 
-	config = strchr(tcmu_get_dev_cfgstring(dev), '/');
+	cfgstring = strdup(tcmu_get_dev_cfgstring(dev));
+	if (!cfgstring)
+		goto free_state;
+
+	config = strchr(cfgstring, '/');
 	if (!config) {
 		tcmu_err("no configuration found in cfgstring\n");
-		goto err;
+		goto free_config;
 	}
 	config += 1; /* get past '/' */
 
+	opt = strchr(config, ';');
+	if (opt) {
+		*opt++ = '\0';
+		if (strcmp(opt, "direct=1")) {
+			tcmu_err("unknown option %s\n", opt);
+			goto free_config;
+		}
+		/* bypass the page cache, the initiator has its own */
+		flags |= O_DIRECT;
+	}
+
 	tcmu_set_dev_write_cache_enabled(dev, 1);
 
-	state->fd = open(config, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	state->fd = open(config, flags, S_IRUSR | S_IWUSR);
 	if (state->fd == -1) {
 		tcmu_err("could not open %s: %m\n", config);
-		goto err;
+		goto free_config;
+	}
+
+	if ((flags & O_DIRECT) &&
+	    tcmu_get_dio_align(dev, state->fd, tcmu_get_dev_block_size(dev),
+			       &state->dio_align)) {
+		close(state->fd);
+		goto free_config;
 	}
 
 	tcmu_dbg("config %s\n", tcmu_get_dev_cfgstring(dev));
 
+	free(cfgstring);
 	return 0;
 
-err:
+free_config:
+	free(cfgstring);
+free_state:
 	free(state);
 	return -EINVAL;
 }
@@ -92,7 +123,8 @@ static int file_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	ssize_t ret;
 
 	while (remaining) {
-		ret = preadv(state->fd, iov, iov_cnt, offset);
+		ret = tcmu_preadv_aligned(state->fd, iov, iov_cnt, offset,
+					  state->dio_align);
 		if (ret < 0) {
 			tcmu_err("read failed: %m\n");
 			ret = TCMU_STS_RD_ERR;
@@ -124,7 +156,8 @@ static int file_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	ssize_t ret;
 
 	while (remaining) {
-		ret = pwritev(state->fd, iov, iov_cnt, offset);
+		ret = tcmu_pwritev_aligned(state->fd, iov, iov_cnt, offset,
+					   state->dio_align);
 		if (ret < 0) {
 			tcmu_err("write failed: %m\n");
 			ret = TCMU_STS_WR_ERR;
@@ -156,6 +189,157 @@ done:
 	return TCMU_STS_OK;
 }
 
+#ifdef HAVE_LINUX_FALLOC
+/*
+ * Zeroing a range only updates the file's extents. Other patterns are
+ * written out by the runner.
+ */
+static int file_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  uint64_t off, uint64_t len, struct iovec *iov,
+			  size_t iov_cnt)
+{
+	struct file_state *state = tcmu_get_dev_private(dev);
+	int ret;
+
+	if (!tcmu_iovec_zeroed(iov, iov_cnt))
+		return TCMU_STS_NOT_HANDLED;
+
+	if (fallocate(state->fd, FALLOC_FL_ZERO_RANGE, off, len)) {
+		if (errno == EOPNOTSUPP)
+			return TCMU_STS_NOT_HANDLED;
+		tcmu_err("zero range failed: %m\n");
+		ret = TCMU_STS_WR_ERR;
+		goto done;
+	}
+	ret = TCMU_STS_OK;
+done:
+	cmd->done(dev, cmd, ret);
+	return TCMU_STS_OK;
+}
+
+/*
+ * Punch a hole for each extent, so unmapped blocks read back as zeros
+ * and free their space in the file.
+ */
+static int file_unmapv(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		       struct tcmur_unmap_extent *extents, size_t nr_extents)
+{
+	struct file_state *state = tcmu_get_dev_private(dev);
+	int ret = TCMU_STS_OK;
+	size_t i;
+
+	for (i = 0; i < nr_extents; i++) {
+		if (fallocate(state->fd,
+			      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      extents[i].off, extents[i].len)) {
+			tcmu_err("punch hole failed: %m\n");
+			ret = TCMU_STS_WR_ERR;
+			break;
+		}
+	}
+
+	cmd->done(dev, cmd, ret);
+	return TCMU_STS_OK;
+}
+#endif
+
+/*
+ * Holes in the file, including past its end, are deallocated. If the
+ * filesystem can not tell, the rest of the range is reported as mapped.
+ */
+static int file_get_lba_status(struct tcmu_device *dev,
+			       struct tcmulib_cmd *cmd, uint64_t off,
+			       uint64_t len, struct tcmur_lba_status *status,
+			       size_t *nr_status)
+{
+	struct file_state *state = tcmu_get_dev_private(dev);
+	uint64_t end = off + len;
+	off_t next;
+	size_t i;
+
+	for (i = 0; i < *nr_status && off < end; i++) {
+		next = lseek(state->fd, off, SEEK_DATA);
+		if (next < 0 && errno == ENXIO)
+			next = end;
+		if (next < 0)
+			goto mapped;
+
+		status[i].mapped = next == off;
+		if (status[i].mapped) {
+			next = lseek(state->fd, off, SEEK_HOLE);
+			if (next < 0)
+				goto mapped;
+		}
+
+		status[i].off = off;
+		status[i].len = min((uint64_t)next, end) - off;
+		off += status[i].len;
+	}
+	goto done;
+
+mapped:
+	tcmu_dev_dbg(dev, "Can not find holes: %m\n");
+	status[i].off = off;
+	status[i].len = end - off;
+	status[i].mapped = true;
+	i++;
+done:
+	*nr_status = i;
+	cmd->done(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/*
+ * Let the filesystem copy, or share the extents of, the range between
+ * the two files. Hand it back to the runner if it can not, nothing has
+ * been written to dst yet in that case.
+ */
+static int file_copy(struct tcmu_device *dst_dev, struct tcmulib_cmd *cmd,
+		     uint64_t dst_off, struct tcmu_device *src_dev,
+		     uint64_t src_off, uint64_t len)
+{
+	struct file_state *dst_state = tcmu_get_dev_private(dst_dev);
+	struct file_state *src_state = tcmu_get_dev_private(src_dev);
+	loff_t in_off = src_off, out_off = dst_off;
+	uint64_t remaining = len;
+	ssize_t ret;
+
+	while (remaining) {
+		ret = copy_file_range(src_state->fd, &in_off, dst_state->fd,
+				      &out_off, remaining, 0);
+		if (ret < 0) {
+			if (remaining == len &&
+			    (errno == EXDEV || errno == EINVAL ||
+			     errno == ENOSYS || errno == EOPNOTSUPP)) {
+				ret = TCMU_STS_NOT_HANDLED;
+				goto done;
+			}
+			tcmu_err("copy failed: %m\n");
+			ret = TCMU_STS_WR_ERR;
+			goto done;
+		}
+
+		/*
+		 * Past the end of src, which reads back as zeros. The runner
+		 * copies the whole range again, which is fine since the
+		 * ranges can not overlap or copy_file_range would have
+		 * refused them.
+		 */
+		if (ret == 0) {
+			ret = TCMU_STS_NOT_HANDLED;
+			goto done;
+		}
+
+		remaining -= ret;
+	}
+	ret = TCMU_STS_OK;
+done:
+	cmd->done(dst_dev, cmd, ret);
+	return TCMU_STS_OK;
+}
+#endif
+
 static int file_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
 	switch (cfg->type) {
@@ -174,7 +358,8 @@ static int file_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 }
 
 static const char file_cfg_desc[] =
-	"The path to the file to use as a backstore.";
+	"The path to the file to use as a backstore, optionally followed by\n"
+	"\";direct=1\" to open it with O_DIRECT.";
 
 static struct tcmur_handler file_handler = {
 	.cfg_desc = file_cfg_desc,
@@ -186,9 +371,18 @@ static struct tcmur_handler file_handler = {
 	.read = file_read,
 	.write = file_write,
 	.flush = file_flush,
+	.get_lba_status = file_get_lba_status,
+#ifdef HAVE_LINUX_FALLOC
+	.writesame = file_writesame,
+	.unmapv = file_unmapv,
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	.copy = file_copy,
+#endif
 	.name = "File-backed Handler (example code)",
 	.subtype = "file",
 	.nr_threads = 2,
+	.max_threads = TCMUR_MAX_IO_THREADS,
 };
 
 /* Entry point must be named "handler_init". */
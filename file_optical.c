@@ -56,6 +56,7 @@
 
 struct fbo_state {
 	int fd;
+	uint32_t dio_align;
 	uint64_t num_lbas;
 	uint32_t block_size;
 	uint32_t cur_lba;
@@ -66,6 +67,7 @@ struct fbo_state {
 #define FBO_BUSY_EVENT		0x08
 #define FBO_FORMATTING		0x10
 #define FBO_FORMAT_IMMED	0x20
+#define FBO_DIRECT		0x40
 	uint32_t flags;
 	uint32_t format_progress;
 	uint8_t event_op_ch_code;
@@ -93,6 +95,7 @@ static int fbo_open(struct tcmu_device *dev, bool reopen)
 	int64_t size;
 	char *options;
 	char *path;
+	int oflags = 0;
 
 	state = calloc(1, sizeof(*state));
 	if (!state)
@@ -135,6 +138,8 @@ static int fbo_open(struct tcmu_device *dev, bool reopen)
 	while (options[0] != '/') {
 		if (!strncasecmp(options, "ro/", 3))
 			state->flags |= FBO_READ_ONLY;
+		else if (!strncasecmp(options, "direct/", 7))
+			state->flags |= FBO_DIRECT;
 		else
 			tcmu_err("Ignoring unknown option %s\n", options);
 
@@ -152,19 +157,29 @@ static int fbo_open(struct tcmu_device *dev, bool reopen)
 		goto err;
 	}
 
+	if (state->flags & FBO_DIRECT)
+		oflags |= O_DIRECT;
+
 	if (access(path, F_OK) == -1)
-		state->fd = open(path, O_CREAT | O_RDWR | O_EXCL,
+		state->fd = open(path, O_CREAT | O_RDWR | O_EXCL | oflags,
 				 S_IRUSR | S_IWUSR);
 	else if (state->flags & FBO_READ_ONLY)
-		state->fd = open(path, O_RDONLY, 0);
+		state->fd = open(path, O_RDONLY | oflags, 0);
 	else
-		state->fd = open(path, O_RDWR, 0);
+		state->fd = open(path, O_RDWR | oflags, 0);
 	if (state->fd == -1) {
 		tcmu_err("could not open %s: %m\n", path);
 		goto err;
 	}
 	tcmu_dbg("FBO Open: fd %d\n", state->fd);
 
+	if ((state->flags & FBO_DIRECT) &&
+	    tcmu_get_dio_align(dev, state->fd, state->block_size,
+			       &state->dio_align)) {
+		close(state->fd);
+		goto err;
+	}
+
 	pthread_mutex_init(&state->state_mtx, NULL);
 
 	/* Record that we've changed our Operational state */
@@ -1098,7 +1113,8 @@ static int fbo_read(struct tcmu_device *dev, uint8_t *cdb, struct iovec *iovec,
 	remaining = length;
 
 	while (remaining) {
-		ret = preadv(state->fd, iovec, iov_cnt, offset);
+		ret = tcmu_preadv_aligned(state->fd, iovec, iov_cnt, offset,
+					  state->dio_align);
 		if (ret < 0) {
 			tcmu_err("read failed: %m\n");
 			rc = TCMU_STS_RD_ERR;
@@ -1146,7 +1162,8 @@ static int fbo_do_verify(struct fbo_state *state, struct iovec *iovec,
 	remaining = length;
 
 	while (remaining) {
-		ret = pread(state->fd, buf, remaining, offset);
+		ret = tcmu_pread_aligned(state->fd, buf, remaining, offset,
+					 state->dio_align);
 		if (ret < 0) {
 			tcmu_err("read failed: %m\n");
 			rc = TCMU_STS_RD_ERR;
@@ -1209,7 +1226,8 @@ static int fbo_write(struct tcmu_device *dev, uint8_t *cdb, struct iovec *iovec,
 	memcpy(write_iovec, iovec, sizeof(write_iovec));
 
 	while (remaining) {
-		ret = pwritev(state->fd, write_iovec, iov_cnt, offset);
+		ret = tcmu_pwritev_aligned(state->fd, write_iovec, iov_cnt,
+					   offset, state->dio_align);
 		if (ret < 0) {
 			tcmu_err("write failed: %m\n");
 			rc = TCMU_STS_WR_ERR;
@@ -1289,7 +1307,8 @@ static int fbo_do_format(struct tcmu_device *dev, uint8_t *sense)
 		    length)
 			length = (state->num_lbas - done_blocks) *
 				state->block_size;
-		ret = pwrite(state->fd, buf, length, offset);
+		ret = tcmu_pwrite_aligned(state->fd, buf, length, offset,
+					  state->dio_align);
 		if (ret == -1) {
 			tcmu_err("Could not write: %m\n");
 			rc = TCMU_STS_WR_ERR;
@@ -1548,7 +1567,8 @@ static int fbo_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 }
 
 static const char fbo_cfg_desc[] =
-	"The path to the file to use as a backstore.";
+	"The path to the file to use as a backstore, optionally preceded\n"
+	"by ro/ to open it read only and direct/ to open it with O_DIRECT.";
 
 static struct tcmur_handler fbo_handler = {
 	.cfg_desc = fbo_cfg_desc,
@@ -0,0 +1,849 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * File backed handler that does its io with io_uring.
+ *
+ * Cmds are submitted from the runner's cmdproc thread, so there are no
+ * io worker threads. The completions are reaped in batches, by the
+ * submitter if they are already done, else by a thread per device.
+ * Optionally the ring's data area is registered as fixed buffers, a
+ * kernel thread polls the submission queue and the file is opened
+ * O_DIRECT.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <linux/falloc.h>
+#include <liburing.h>
+
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+
+#define URING_QUEUE_DEPTH	256
+#define URING_SQPOLL_IDLE_MS	1000
+/* The kernel does not take larger fixed buffers */
+#define URING_FIXED_BUF_SHIFT	30
+#define URING_FIXED_BUF_SIZE	(1UL << URING_FIXED_BUF_SHIFT)
+
+enum {
+	URING_IO_READ,
+	URING_IO_WRITE,
+	URING_IO_FLUSH,
+	URING_IO_UNMAP,
+	URING_IO_ZERO,
+};
+
+struct uring_state {
+	int fd;
+	/* fd to put in sqes, 0 if the file is registered */
+	int sqe_fd;
+	unsigned sqe_flags;
+
+	struct io_uring ring;
+	/*
+	 * Callouts are made from the cmdproc and completion threads, and
+	 * both reap completions.
+	 */
+	pthread_mutex_t sq_lock;
+	pthread_mutex_t cq_lock;
+	pthread_t reaper_thread;
+
+	/* the registered data area, NULL if fixed buffers are not used */
+	char *bufs;
+	size_t bufs_len;
+
+	/* O_DIRECT alignment, 0 without it */
+	uint32_t dio_align;
+};
+
+struct uring_io {
+	struct tcmu_device *dev;
+	struct tcmulib_cmd *cmd;
+	int op;
+
+	off_t offset;
+	size_t length;
+	size_t remaining;
+
+	/* UNMAP extents left to complete, and the first error */
+	unsigned int pending;
+	int ret;
+
+	/* O_DIRECT copy of misaligned buffers */
+	void *bounce;
+	struct iovec bounce_iov;
+
+	size_t iov_cnt;
+	struct iovec iov[];
+};
+
+/*
+ * Called with sq_lock held. Once an sqe is in the sq it can not be taken
+ * back, so busy rings are retried, and on errors the sqes are left for
+ * the next submit.
+ */
+static int uring_submit(struct tcmu_device *dev, struct uring_state *state)
+{
+	int ret;
+
+	do {
+		ret = io_uring_submit(&state->ring);
+		if (ret == -EBUSY || ret == -EAGAIN)
+			sched_yield();
+	} while (ret == -EBUSY || ret == -EAGAIN || ret == -EINTR);
+
+	if (ret < 0)
+		tcmu_dev_err(dev, "could not submit io: %s\n", strerror(-ret));
+	return ret;
+}
+
+/* Called with sq_lock held */
+static struct io_uring_sqe *uring_get_sqe(struct tcmu_device *dev,
+					  struct uring_state *state)
+{
+	struct io_uring_sqe *sqe;
+
+	/*
+	 * The sq is full, so push it to the kernel. Without SQPOLL that
+	 * empties it, with it the poll thread has to catch up.
+	 */
+	while (!(sqe = io_uring_get_sqe(&state->ring))) {
+		if (uring_submit(dev, state) <= 0)
+			sched_yield();
+	}
+	return sqe;
+}
+
+/* Called with sq_lock held */
+static void uring_prep_rw(struct uring_state *state, struct uring_io *io)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(io->dev, state);
+	struct iovec *iov = io->iov;
+	size_t iov_cnt = io->iov_cnt;
+	char *base;
+	size_t idx;
+
+	if (io->bounce) {
+		iov = &io->bounce_iov;
+		iov_cnt = 1;
+	}
+
+	/* skip the buffers a short read or write already filled */
+	while (iov_cnt > 1 && !iov->iov_len) {
+		iov++;
+		iov_cnt--;
+	}
+
+	/* the kernel only takes fixed buffers that are within one of them */
+	base = iov->iov_base;
+	if (state->bufs && iov_cnt == 1 && iov->iov_len &&
+	    base >= state->bufs &&
+	    base + iov->iov_len <= state->bufs + state->bufs_len) {
+		idx = (base - state->bufs) >> URING_FIXED_BUF_SHIFT;
+
+		if (idx == (base + iov->iov_len - 1 - state->bufs) >>
+			   URING_FIXED_BUF_SHIFT) {
+			if (io->op == URING_IO_READ)
+				io_uring_prep_read_fixed(sqe, state->sqe_fd,
+							 iov->iov_base,
+							 iov->iov_len,
+							 io->offset, idx);
+			else
+				io_uring_prep_write_fixed(sqe, state->sqe_fd,
+							  iov->iov_base,
+							  iov->iov_len,
+							  io->offset, idx);
+			goto done;
+		}
+	}
+
+	if (io->op == URING_IO_READ)
+		io_uring_prep_readv(sqe, state->sqe_fd, iov, iov_cnt,
+				    io->offset);
+	else
+		io_uring_prep_writev(sqe, state->sqe_fd, iov, iov_cnt,
+				     io->offset);
+done:
+	io_uring_sqe_set_flags(sqe, state->sqe_flags);
+	io_uring_sqe_set_data(sqe, io);
+}
+
+/* set on the cmdproc thread between submit_batch and unplug */
+static __thread struct uring_state *uring_plugged;
+
+/* set while completing, so a cmd the completion starts does not recurse */
+static __thread bool uring_reaping;
+
+static bool uring_is_plugged(struct uring_state *state)
+{
+	return uring_plugged == state && !uring_reaping;
+}
+
+static void uring_submit_rw(struct uring_state *state, struct uring_io *io)
+{
+	pthread_mutex_lock(&state->sq_lock);
+	uring_prep_rw(state, io);
+	if (!uring_is_plugged(state))
+		uring_submit(io->dev, state);
+	pthread_mutex_unlock(&state->sq_lock);
+}
+
+static void uring_io_free(struct uring_io *io)
+{
+	free(io->bounce);
+	free(io);
+}
+
+static void uring_io_done(struct uring_io *io, int ret)
+{
+	struct tcmu_device *dev = io->dev;
+	struct tcmulib_cmd *cmd = io->cmd;
+
+	if (ret == TCMU_STS_OK && io->bounce && io->op == URING_IO_READ)
+		tcmu_memcpy_into_iovec(io->iov, io->iov_cnt, io->bounce,
+				       io->length);
+
+	uring_io_free(io);
+	cmd->done(dev, cmd, ret);
+}
+
+static void uring_complete_rw(struct uring_io *io, int res)
+{
+	struct uring_state *state = tcmu_get_dev_private(io->dev);
+	bool read = io->op == URING_IO_READ;
+
+	if (res < 0) {
+		tcmu_dev_err(io->dev, "%s failed: %s\n",
+			     read ? "read" : "write", strerror(-res));
+		uring_io_done(io, read ? TCMU_STS_RD_ERR : TCMU_STS_WR_ERR);
+		return;
+	}
+
+	if (!res && read) {
+		/* EOF, then zeros the iovecs left */
+		if (io->bounce)
+			memset(io->bounce_iov.iov_base, 0,
+			       io->bounce_iov.iov_len);
+		else
+			tcmu_zero_iovec(io->iov, io->iov_cnt);
+		uring_io_done(io, TCMU_STS_OK);
+		return;
+	}
+
+	io->remaining -= res;
+	if (!io->remaining) {
+		uring_io_done(io, TCMU_STS_OK);
+		return;
+	}
+
+	if (io->bounce) {
+		io->bounce_iov.iov_base += res;
+		io->bounce_iov.iov_len -= res;
+	} else {
+		tcmu_seek_in_iovec(io->iov, res);
+	}
+	io->offset += res;
+
+	uring_submit_rw(state, io);
+}
+
+static void uring_complete(struct uring_io *io, int res)
+{
+	int ret = TCMU_STS_OK;
+
+	switch (io->op) {
+	case URING_IO_READ:
+	case URING_IO_WRITE:
+		uring_complete_rw(io, res);
+		return;
+	case URING_IO_FLUSH:
+		if (res < 0) {
+			tcmu_dev_err(io->dev, "sync failed: %s\n",
+				     strerror(-res));
+			ret = TCMU_STS_WR_ERR;
+		}
+		break;
+	case URING_IO_ZERO:
+		if (res == -EOPNOTSUPP || res == -EINVAL) {
+			ret = TCMU_STS_NOT_HANDLED;
+		} else if (res < 0) {
+			tcmu_dev_err(io->dev, "zero range failed: %s\n",
+				     strerror(-res));
+			ret = TCMU_STS_WR_ERR;
+		}
+		break;
+	case URING_IO_UNMAP:
+		if (res < 0) {
+			tcmu_dev_err(io->dev, "punch hole failed: %s\n",
+				     strerror(-res));
+			io->ret = TCMU_STS_WR_ERR;
+		}
+		if (__atomic_sub_fetch(&io->pending, 1, __ATOMIC_ACQ_REL))
+			return;
+		ret = io->ret;
+		break;
+	}
+
+	uring_io_done(io, ret);
+}
+
+#define URING_REAP_BATCH 32
+
+/*
+ * Complete everything that is done, in batches so the cq is only locked
+ * once per batch. Returns true once the NOP queued by close is reaped.
+ */
+static bool uring_reap(struct uring_state *state)
+{
+	struct uring_io *ios[URING_REAP_BATCH];
+	int res[URING_REAP_BATCH];
+	struct io_uring_cqe *cqe;
+	unsigned head, nr = 0, i;
+	bool stop = false;
+
+	pthread_mutex_lock(&state->cq_lock);
+	io_uring_for_each_cqe(&state->ring, head, cqe) {
+		if (nr == URING_REAP_BATCH)
+			break;
+		ios[nr] = io_uring_cqe_get_data(cqe);
+		res[nr] = cqe->res;
+		nr++;
+	}
+	io_uring_cq_advance(&state->ring, nr);
+	pthread_mutex_unlock(&state->cq_lock);
+
+	uring_reaping = true;
+	for (i = 0; i < nr; i++) {
+		if (!ios[i])
+			stop = true;
+		else
+			uring_complete(ios[i], res[i]);
+	}
+	uring_reaping = false;
+	return stop;
+}
+
+static void *uring_reaper(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct uring_state *state = tcmu_get_dev_private(dev);
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	for (;;) {
+		ret = io_uring_wait_cqe(&state->ring, &cqe);
+		if (ret) {
+			if (ret == -EINTR)
+				continue;
+			tcmu_dev_err(dev, "could not wait for completions: %s\n",
+				     strerror(-ret));
+			break;
+		}
+		if (uring_reap(state))
+			break;
+	}
+	return NULL;
+}
+
+static struct uring_io *uring_io_alloc(struct tcmu_device *dev,
+				       struct tcmulib_cmd *cmd, int op,
+				       size_t iov_cnt)
+{
+	struct uring_io *io;
+
+	io = calloc(1, sizeof(*io) + iov_cnt * sizeof(struct iovec));
+	if (!io) {
+		tcmu_dev_err(dev, "Could not allocate io.\n");
+		return NULL;
+	}
+	io->dev = dev;
+	io->cmd = cmd;
+	io->op = op;
+	io->ret = TCMU_STS_OK;
+	io->iov_cnt = iov_cnt;
+	return io;
+}
+
+static int uring_rw(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		    struct iovec *iov, size_t iov_cnt, size_t length,
+		    off_t offset, int op)
+{
+	struct uring_state *state = tcmu_get_dev_private(dev);
+	struct uring_io *io;
+
+	io = uring_io_alloc(dev, cmd, op, iov_cnt);
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+	memcpy(io->iov, iov, iov_cnt * sizeof(*iov));
+	io->offset = offset;
+	io->length = io->remaining = length;
+
+	/*
+	 * The data area is page aligned, but the runner's own buffers,
+	 * e.g. for COMPARE AND WRITE or XCOPY, might not be.
+	 */
+	if (state->dio_align &&
+	    !tcmu_iovec_aligned(iov, iov_cnt, state->dio_align)) {
+		if (posix_memalign(&io->bounce, state->dio_align, length)) {
+			tcmu_dev_err(dev, "Could not allocate bounce buffer.\n");
+			free(io);
+			return TCMU_STS_NO_RESOURCE;
+		}
+		io->bounce_iov.iov_base = io->bounce;
+		io->bounce_iov.iov_len = length;
+
+		if (op == URING_IO_WRITE)
+			tcmu_memcpy_from_iovec(io->bounce, length, io->iov,
+					       io->iov_cnt);
+	}
+
+	uring_submit_rw(state, io);
+
+	/*
+	 * Buffered io that hits the page cache is done by the time submit
+	 * returns, so complete it now instead of waking the reaper.
+	 */
+	if (!uring_reaping && !uring_is_plugged(state))
+		uring_reap(state);
+	return TCMU_STS_OK;
+}
+
+static int uring_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		      struct iovec *iov, size_t iov_cnt, size_t length,
+		      off_t offset)
+{
+	return uring_rw(dev, cmd, iov, iov_cnt, length, offset,
+			URING_IO_READ);
+}
+
+static int uring_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		       struct iovec *iov, size_t iov_cnt, size_t length,
+		       off_t offset)
+{
+	return uring_rw(dev, cmd, iov, iov_cnt, length, offset,
+			URING_IO_WRITE);
+}
+
+/*
+ * The reads and writes of a ring drain are only prepped, and all go to
+ * the kernel in one io_uring_submit from unplug. Other threads, and the
+ * completions, still submit right away.
+ */
+static void uring_submit_batch(struct tcmu_device *dev)
+{
+	uring_plugged = tcmu_get_dev_private(dev);
+}
+
+static void uring_unplug(struct tcmu_device *dev)
+{
+	struct uring_state *state = tcmu_get_dev_private(dev);
+
+	uring_plugged = NULL;
+
+	pthread_mutex_lock(&state->sq_lock);
+	uring_submit(dev, state);
+	pthread_mutex_unlock(&state->sq_lock);
+
+	uring_reap(state);
+}
+
+static int uring_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct uring_state *state = tcmu_get_dev_private(dev);
+	struct io_uring_sqe *sqe;
+	struct uring_io *io;
+
+	io = uring_io_alloc(dev, cmd, URING_IO_FLUSH, 0);
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+
+	pthread_mutex_lock(&state->sq_lock);
+	sqe = uring_get_sqe(dev, state);
+	io_uring_prep_fsync(sqe, state->sqe_fd, 0);
+	io_uring_sqe_set_flags(sqe, state->sqe_flags);
+	io_uring_sqe_set_data(sqe, io);
+	uring_submit(dev, state);
+	pthread_mutex_unlock(&state->sq_lock);
+
+	return TCMU_STS_OK;
+}
+
+/*
+ * Zeroing a range only updates the file's extents. Other patterns, or
+ * file systems that can not do it, are left to the runner.
+ */
+static int uring_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   uint64_t off, uint64_t len, struct iovec *iov,
+			   size_t iov_cnt)
+{
+	struct uring_state *state = tcmu_get_dev_private(dev);
+	struct io_uring_sqe *sqe;
+	struct uring_io *io;
+
+	if (!tcmu_iovec_zeroed(iov, iov_cnt))
+		return TCMU_STS_NOT_HANDLED;
+
+	io = uring_io_alloc(dev, cmd, URING_IO_ZERO, 0);
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+
+	pthread_mutex_lock(&state->sq_lock);
+	sqe = uring_get_sqe(dev, state);
+	io_uring_prep_fallocate(sqe, state->sqe_fd, FALLOC_FL_ZERO_RANGE,
+				off, len);
+	io_uring_sqe_set_flags(sqe, state->sqe_flags);
+	io_uring_sqe_set_data(sqe, io);
+	uring_submit(dev, state);
+	pthread_mutex_unlock(&state->sq_lock);
+
+	return TCMU_STS_OK;
+}
+
+/*
+ * Punch a hole for each extent. They all go to the kernel in one
+ * submit, and the cmd completes with the last of them.
+ */
+static int uring_unmapv(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			struct tcmur_unmap_extent *extents, size_t nr_extents)
+{
+	struct uring_state *state = tcmu_get_dev_private(dev);
+	struct io_uring_sqe *sqe;
+	struct uring_io *io;
+	size_t i;
+
+	io = uring_io_alloc(dev, cmd, URING_IO_UNMAP, 0);
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+	/* a full sq is pushed early, so hold a ref until all are queued */
+	io->pending = nr_extents + 1;
+
+	pthread_mutex_lock(&state->sq_lock);
+	for (i = 0; i < nr_extents; i++) {
+		sqe = uring_get_sqe(dev, state);
+		io_uring_prep_fallocate(sqe, state->sqe_fd,
+					FALLOC_FL_PUNCH_HOLE |
+					FALLOC_FL_KEEP_SIZE,
+					extents[i].off, extents[i].len);
+		io_uring_sqe_set_flags(sqe, state->sqe_flags);
+		io_uring_sqe_set_data(sqe, io);
+	}
+	uring_submit(dev, state);
+	pthread_mutex_unlock(&state->sq_lock);
+
+	if (!__atomic_sub_fetch(&io->pending, 1, __ATOMIC_ACQ_REL))
+		uring_io_done(io, io->ret);
+	return TCMU_STS_OK;
+}
+
+static int uring_parse_opts(struct tcmu_device *dev, char *opts, bool *sqpoll,
+			    bool *fixed_bufs, bool *direct)
+{
+	char *opt, *next;
+
+	for (opt = opts; opt; opt = next) {
+		next = strchr(opt, ';');
+		if (next)
+			*next++ = '\0';
+
+		if (!strcmp(opt, "sqpoll=1")) {
+			*sqpoll = true;
+		} else if (!strcmp(opt, "fixed_bufs=1")) {
+			*fixed_bufs = true;
+		} else if (!strcmp(opt, "direct=1")) {
+			*direct = true;
+		} else if (strcmp(opt, "sqpoll=0") &&
+			   strcmp(opt, "fixed_bufs=0") &&
+			   strcmp(opt, "direct=0")) {
+			tcmu_dev_err(dev, "Unknown option %s\n", opt);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The kernel frees idle data area blocks once the global pool runs out,
+ * which would leave registered buffers pointing at freed pages. Only
+ * allow fixed buffers if the part of the data area the device can use
+ * fits in the global pool.
+ */
+static bool uring_data_area_pinned(struct tcmu_device *dev, size_t len)
+{
+	int dev_mb, global_mb;
+	size_t used = len;
+
+	global_mb = tcmu_get_cfgfs_int(CFGFS_MOD_PARAM"/global_max_data_area_mb");
+	if (global_mb < 0) {
+		tcmu_dev_warn(dev, "Could not read global_max_data_area_mb, not using fixed buffers.\n");
+		return false;
+	}
+
+	/* the kernel does not hand out blocks past max_data_area_mb */
+	dev_mb = tcmu_get_attribute(dev, "max_data_area_mb");
+	if (dev_mb >= 0 && ((size_t)dev_mb << 20) < used)
+		used = (size_t)dev_mb << 20;
+
+	if (used > ((size_t)global_mb << 20)) {
+		tcmu_dev_warn(dev, "Data area of %zu bytes does not fit in global_max_data_area_mb %d, not using fixed buffers.\n",
+			      used, global_mb);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Register the data area in chunks the kernel accepts. Only iovs within
+ * one chunk can use it, which is nearly all of them since the kernel
+ * hands out data area blocks in order.
+ */
+static void uring_register_bufs(struct tcmu_device *dev)
+{
+	struct uring_state *state = tcmu_get_dev_private(dev);
+	struct iovec *bufs;
+	size_t len, nr, i;
+	char *area;
+	int ret;
+
+	area = tcmu_get_dev_data_area(dev, &len);
+	if (!uring_data_area_pinned(dev, len))
+		return;
+
+	nr = (len + URING_FIXED_BUF_SIZE - 1) >> URING_FIXED_BUF_SHIFT;
+
+	bufs = calloc(nr, sizeof(*bufs));
+	if (!bufs)
+		return;
+	for (i = 0; i < nr; i++) {
+		bufs[i].iov_base = area + (i << URING_FIXED_BUF_SHIFT);
+		bufs[i].iov_len = min(len - (i << URING_FIXED_BUF_SHIFT),
+				      (size_t)URING_FIXED_BUF_SIZE);
+	}
+
+	ret = io_uring_register_buffers(&state->ring, bufs, nr);
+	free(bufs);
+	if (ret) {
+		tcmu_dev_warn(dev, "Could not register data area, not using fixed buffers: %s\n",
+			      strerror(-ret));
+		return;
+	}
+	state->bufs = area;
+	state->bufs_len = len;
+}
+
+static int uring_open(struct tcmu_device *dev, bool reopen)
+{
+	struct io_uring_params params;
+	struct uring_state *state;
+	bool sqpoll = false, fixed_bufs = false, direct = false;
+	char *cfgstring, *config, *opts;
+	int ret = -EINVAL;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+
+	tcmu_set_dev_private(dev, state);
+
+	cfgstring = strdup(tcmu_get_dev_cfgstring(dev));
+	if (!cfgstring) {
+		ret = -ENOMEM;
+		goto free_state;
+	}
+
+	config = strchr(cfgstring, '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		goto free_config;
+	}
+	config += 1; /* get past '/' */
+
+	opts = strchr(config, ';');
+	if (opts) {
+		*opts++ = '\0';
+		ret = uring_parse_opts(dev, opts, &sqpoll, &fixed_bufs,
+				       &direct);
+		if (ret)
+			goto free_config;
+	}
+
+	tcmu_set_dev_write_cache_enabled(dev, 1);
+
+	state->fd = open(config, O_CREAT | O_RDWR | (direct ? O_DIRECT : 0),
+			 S_IRUSR | S_IWUSR);
+	if (state->fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "could not open %s: %m\n", config);
+		goto free_config;
+	}
+
+	if (direct) {
+		ret = tcmu_get_dio_align(dev, state->fd,
+					 tcmu_get_dev_block_size(dev),
+					 &state->dio_align);
+		if (ret)
+			goto close_fd;
+	}
+
+	memset(&params, 0, sizeof(params));
+	if (sqpoll) {
+		params.flags = IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = URING_SQPOLL_IDLE_MS;
+	}
+	ret = io_uring_queue_init_params(URING_QUEUE_DEPTH, &state->ring,
+					 &params);
+	if (ret && sqpoll) {
+		tcmu_dev_warn(dev, "Could not setup SQPOLL ring, using a plain one: %s\n",
+			      strerror(-ret));
+		memset(&params, 0, sizeof(params));
+		ret = io_uring_queue_init_params(URING_QUEUE_DEPTH,
+						 &state->ring, &params);
+	}
+	if (ret) {
+		tcmu_dev_err(dev, "could not setup io_uring: %s\n",
+			     strerror(-ret));
+		goto close_fd;
+	}
+
+	/* saves the kernel an fget per io, and older SQPOLL needs it */
+	if (!io_uring_register_files(&state->ring, &state->fd, 1)) {
+		state->sqe_fd = 0;
+		state->sqe_flags = IOSQE_FIXED_FILE;
+	} else {
+		state->sqe_fd = state->fd;
+	}
+
+	if (fixed_bufs)
+		uring_register_bufs(dev);
+
+	ret = pthread_mutex_init(&state->sq_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto exit_ring;
+	}
+
+	ret = pthread_mutex_init(&state->cq_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_sq_lock;
+	}
+
+	ret = pthread_create(&state->reaper_thread, NULL, uring_reaper, dev);
+	if (ret) {
+		ret = -ret;
+		tcmu_dev_err(dev, "could not start reaper thread\n");
+		goto destroy_cq_lock;
+	}
+
+	tcmu_dev_dbg(dev, "config %s sqpoll %d fixed_bufs %d direct %d\n",
+		     config, !!(params.flags & IORING_SETUP_SQPOLL),
+		     !!state->bufs, !!state->dio_align);
+	free(cfgstring);
+	return 0;
+
+destroy_cq_lock:
+	pthread_mutex_destroy(&state->cq_lock);
+destroy_sq_lock:
+	pthread_mutex_destroy(&state->sq_lock);
+exit_ring:
+	io_uring_queue_exit(&state->ring);
+close_fd:
+	close(state->fd);
+free_config:
+	free(cfgstring);
+free_state:
+	free(state);
+	return ret;
+}
+
+static void uring_close(struct tcmu_device *dev)
+{
+	struct uring_state *state = tcmu_get_dev_private(dev);
+	struct io_uring_sqe *sqe;
+
+	/* the runner has waited for all cmds, so this completes last */
+	pthread_mutex_lock(&state->sq_lock);
+	sqe = uring_get_sqe(dev, state);
+	io_uring_prep_nop(sqe);
+	io_uring_sqe_set_data(sqe, NULL);
+	uring_submit(dev, state);
+	pthread_mutex_unlock(&state->sq_lock);
+
+	pthread_join(state->reaper_thread, NULL);
+
+	pthread_mutex_destroy(&state->cq_lock);
+	pthread_mutex_destroy(&state->sq_lock);
+	io_uring_queue_exit(&state->ring);
+	close(state->fd);
+	free(state);
+}
+
+static int uring_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
+{
+	switch (cfg->type) {
+	case TCMULIB_CFG_DEV_SIZE:
+		/* like the file handler, assume the file can grow */
+		return 0;
+	case TCMULIB_CFG_DEV_CFGSTR:
+	case TCMULIB_CFG_WRITE_CACHE:
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static const char uring_cfg_desc[] =
+	"io_uring file config string is of the form:\n"
+	"path[;option1;option2;...]\n"
+	"where:\n"
+	"path:		The path to the file to use as a backstore\n"
+	"optionN:	\"sqpoll=1\" to have a kernel thread poll for io\n"
+	"		\"direct=1\" to open the file with O_DIRECT\n"
+	"		\"fixed_bufs=1\" to register the data area with the\n"
+	"		kernel. Ignored if the device's data area does not fit\n"
+	"		in global_max_data_area_mb, and only safe if that is\n"
+	"		at least the data area size of all devices, so the\n"
+	"		kernel never frees data area blocks.\n";
+
+static struct tcmur_handler uring_handler = {
+	.cfg_desc = uring_cfg_desc,
+
+	.reconfig = uring_reconfig,
+
+	.open = uring_open,
+	.close = uring_close,
+	.read = uring_read,
+	.write = uring_write,
+	.flush = uring_flush,
+	.writesame = uring_writesame,
+	.unmapv = uring_unmapv,
+	.submit_batch = uring_submit_batch,
+	.unplug = uring_unplug,
+	.name = "File-backed io_uring Handler",
+	.subtype = "uring",
+	/* io is submitted from the cmdproc thread and completes async */
+	.nr_threads = 0,
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&uring_handler);
+}
@@ -25,8 +25,14 @@
 #include <fcntl.h>
 #include <endian.h>
 #include <errno.h>
+#include <pthread.h>
 #include <scsi/scsi.h>
 #include <linux/types.h>
+#ifdef HAVE_LINUX_FALLOC
+#include <linux/falloc.h>
+#endif
+
+#include "ccan/list/list.h"
 
 #include "scsi_defs.h"
 #include "libtcmu.h"
@@ -65,6 +71,14 @@
 #define ASC_READ_BOUNDARY_VIOLATION		0x2107
 #define ASC_INSUFFICIENT_ZONE_RESOURCES		0x550E
 
+/* Largest buffer a non-zero WRITE SAME block is repeated in */
+#define ZBC_WRITE_SAME_BUF_SIZE			(1024 * 1024)
+
+/*
+ * Bits per bitmap word.
+ */
+#define ZBC_BITS_PER_WORD			(8 * sizeof(unsigned long))
+
 /*
  * Device zone model.
  */
@@ -96,6 +110,8 @@ enum zbc_zone_cond {
 	ZBC_ZONE_COND_OFFLINE	= 0xF,
 };
 
+#define ZBC_NR_ZONE_CONDS	0x10
+
 /*
  * Metadata zone descriptor.
  */
@@ -241,6 +257,7 @@ struct zbc_dev_config {
 
 	/* Configuration options */
 	bool			need_format;
+	bool			direct;
 	enum zbc_dev_model	model;
 	size_t			lba_size;
 	size_t			zone_size;
@@ -255,6 +272,13 @@ struct zbc_dev_config {
 #define ZBC_CONF_DEFAULT_CONV_NUM	(unsigned int)(-1)
 #define ZBC_CONF_DEFAULT_OPEN_NUM	128
 
+/*
+ * In memory zone entry, for the implicitly open zone LRU.
+ */
+struct zbc_zone_entry {
+	struct list_node	node;
+};
+
 /*
  * Emulated device descriptor private data.
  */
@@ -266,9 +290,21 @@ struct zbc_dev {
 
 	int			fd;
 
+	/* Guest data fd, opened O_DIRECT when asked for */
+	int			data_fd;
+	uint32_t		dio_align;
+
 	size_t			meta_size;
 	struct zbc_meta		*meta;
 
+	/*
+	 * Metadata pages changed since the last flush, one bit per page,
+	 * so that flushes only write back the zones that changed.
+	 */
+	size_t			pg_size;
+	size_t			nr_meta_pages;
+	unsigned long		*dirty_pages;
+
 	enum zbc_dev_model	model;
 	unsigned long long	capacity;
 	size_t			lba_size;
@@ -281,6 +317,26 @@ struct zbc_dev {
 	unsigned int		nr_imp_open;
 	unsigned int		nr_exp_open;
 
+	/*
+	 * Zones indexed by condition, one bitmap per condition, and the
+	 * implicitly open zones in the order they were opened. Protected
+	 * by state_lock.
+	 */
+	unsigned long		*cond_zones[ZBC_NR_ZONE_CONDS];
+	unsigned int		nr_cond_zones[ZBC_NR_ZONE_CONDS];
+	struct zbc_zone_entry	*zone_entries;
+	struct list_head	imp_open_list;
+
+	/*
+	 * A zone lock is held by a write from its write pointer check to
+	 * its write pointer update, so writes to different zones run in
+	 * parallel. state_lock protects zone conditions, write pointers
+	 * and the open zone counters and is never held across I/O. Zone
+	 * locks are taken in ascending zone order, then state_lock.
+	 */
+	pthread_mutex_t		*zone_locks;
+	pthread_mutex_t		state_lock;
+
 };
 
 static char *zbc_parse_model(char *val, struct zbc_dev_config *cfg, char **msg)
@@ -351,17 +407,38 @@ static char *zbc_parse_open(char *val, struct zbc_dev_config *cfg, char **msg)
 	return end;
 }
 
-#define ZBC_PARAMS	5
+static char *zbc_parse_direct(char *val, struct zbc_dev_config *cfg, char **msg)
+{
+	char *end;
+
+	switch (strtoul(val, &end, 10)) {
+	case 0:
+		cfg->direct = false;
+		break;
+	case 1:
+		cfg->direct = true;
+		break;
+	default:
+		*msg = "Invalid direct value";
+		return NULL;
+	}
+
+	return end;
+}
+
+#define ZBC_PARAMS	6
 
 struct zbc_dev_config_param {
 	char	*name;
 	char	*(*parse)(char *, struct zbc_dev_config *, char **);
+	bool	format;		/* changes the layout, so forces a format */
 } zbc_params[ZBC_PARAMS] = {
-	{ "model-",	zbc_parse_model	},
-	{ "lba-",	zbc_parse_lba	},
-	{ "zsize-",	zbc_parse_zsize	},
-	{ "conv-",	zbc_parse_conv	},
-	{ "open-",	zbc_parse_open	},
+	{ "model-",	zbc_parse_model,	true	},
+	{ "lba-",	zbc_parse_lba,		true	},
+	{ "zsize-",	zbc_parse_zsize,	true	},
+	{ "conv-",	zbc_parse_conv,		true	},
+	{ "open-",	zbc_parse_open,		true	},
+	{ "direct-",	zbc_parse_direct,	false	},
 };
 
 /*
@@ -411,6 +488,10 @@ static bool zbc_parse_config(const char *cfgstring, struct zbc_dev_config *cfg,
 			if (!str)
 				goto failed;
 
+			/* Format options were specified */
+			if (zbc_params[i].format)
+				cfg->need_format = true;
+
 			if (*str != '/')
 				break;
 
@@ -422,9 +503,6 @@ static bool zbc_parse_config(const char *cfgstring, struct zbc_dev_config *cfg,
 			goto err;
 		str++;
 
-		/* Options were specified */
-		cfg->need_format = true;
-
 	}
 
 	cfg->path = strdup(str);
@@ -468,13 +546,141 @@ static size_t zbc_meta_size_aligned(unsigned int nr_zones)
 	return (meta_size + pg_size - 1) & (~(pg_size - 1));
 }
 
+static inline void zbc_set_bit(unsigned long *map, unsigned int nr)
+{
+	map[nr / ZBC_BITS_PER_WORD] |= 1UL << (nr % ZBC_BITS_PER_WORD);
+}
+
+static inline void zbc_clear_bit(unsigned long *map, unsigned int nr)
+{
+	map[nr / ZBC_BITS_PER_WORD] &= ~(1UL << (nr % ZBC_BITS_PER_WORD));
+}
+
+/*
+ * Return the first set bit at or after nr, or size if there is none.
+ */
+static unsigned int zbc_find_next_bit(unsigned long *map, unsigned int size,
+				      unsigned int nr)
+{
+	unsigned int i = nr / ZBC_BITS_PER_WORD;
+	unsigned long word;
+
+	if (nr >= size)
+		return size;
+
+	word = map[i] & (~0UL << (nr % ZBC_BITS_PER_WORD));
+	while (!word) {
+		if (++i * ZBC_BITS_PER_WORD >= size)
+			return size;
+		word = map[i];
+	}
+
+	nr = i * ZBC_BITS_PER_WORD + __builtin_ctzl(word);
+	return min(nr, size);
+}
+
+/*
+ * Allocate the zone condition index.
+ */
+static int zbc_alloc_index(struct zbc_dev *zdev)
+{
+	size_t nr_words = (zdev->nr_zones + ZBC_BITS_PER_WORD - 1) /
+		ZBC_BITS_PER_WORD;
+	unsigned long *maps;
+	int i;
+
+	zdev->zone_entries = calloc(zdev->nr_zones,
+				    sizeof(struct zbc_zone_entry));
+	maps = calloc(ZBC_NR_ZONE_CONDS * nr_words, sizeof(unsigned long));
+	if (!zdev->zone_entries || !maps) {
+		free(zdev->zone_entries);
+		zdev->zone_entries = NULL;
+		free(maps);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < ZBC_NR_ZONE_CONDS; i++)
+		zdev->cond_zones[i] = maps + i * nr_words;
+	list_head_init(&zdev->imp_open_list);
+
+	return 0;
+}
+
+static void zbc_free_index(struct zbc_dev *zdev)
+{
+	free(zdev->cond_zones[0]);
+	memset(zdev->cond_zones, 0, sizeof(zdev->cond_zones));
+	free(zdev->zone_entries);
+	zdev->zone_entries = NULL;
+}
+
+/*
+ * Index the zones by their condition read from the metadata.
+ */
+static void zbc_index_zones(struct zbc_dev *zdev)
+{
+	struct zbc_zone *zone;
+	unsigned int i;
+
+	for (i = 0; i < zdev->nr_zones; i++) {
+		zone = &zdev->zones[i];
+		zbc_set_bit(zdev->cond_zones[zone->cond], i);
+		zdev->nr_cond_zones[zone->cond]++;
+		if (zbc_zone_imp_open(zone))
+			list_add_tail(&zdev->imp_open_list,
+				      &zdev->zone_entries[i].node);
+	}
+}
+
+/*
+ * Change the condition of a zone and update the index.
+ */
+static void zbc_set_cond(struct zbc_dev *zdev, struct zbc_zone *zone,
+			 uint8_t cond)
+{
+	unsigned int zno = zone - zdev->zones;
+
+	if (zone->cond == cond)
+		return;
+
+	zbc_clear_bit(zdev->cond_zones[zone->cond], zno);
+	zdev->nr_cond_zones[zone->cond]--;
+	if (zbc_zone_imp_open(zone))
+		list_del(&zdev->zone_entries[zno].node);
+
+	zone->cond = cond;
+
+	zbc_set_bit(zdev->cond_zones[cond], zno);
+	zdev->nr_cond_zones[cond]++;
+	if (zbc_zone_imp_open(zone))
+		list_add_tail(&zdev->imp_open_list,
+			      &zdev->zone_entries[zno].node);
+}
+
 /*
  * Mmap the metadata portion of the backstore file.
  */
 static int zbc_map_meta(struct zbc_dev *zdev)
 {
+	size_t nr_words;
 	int ret;
 
+	zdev->pg_size = sysconf(_SC_PAGESIZE);
+	zdev->nr_meta_pages = (zdev->meta_size + zdev->pg_size - 1) /
+		zdev->pg_size;
+	nr_words = (zdev->nr_meta_pages + ZBC_BITS_PER_WORD - 1) /
+		ZBC_BITS_PER_WORD;
+	zdev->dirty_pages = calloc(nr_words, sizeof(unsigned long));
+	if (!zdev->dirty_pages)
+		return -ENOMEM;
+
+	ret = zbc_alloc_index(zdev);
+	if (ret) {
+		free(zdev->dirty_pages);
+		zdev->dirty_pages = NULL;
+		return ret;
+	}
+
 	/* Mmap metadata */
 	zdev->meta = mmap(NULL, zdev->meta_size, PROT_READ | PROT_WRITE,
 			  MAP_SHARED, zdev->fd, 0);
@@ -483,6 +689,9 @@ static int zbc_map_meta(struct zbc_dev *zdev)
 		tcmu_dev_err(zdev->dev, "mmap %s failed (%m)\n",
 			     zdev->cfg.path);
 		zdev->meta = NULL;
+		zbc_free_index(zdev);
+		free(zdev->dirty_pages);
+		zdev->dirty_pages = NULL;
 		return ret;
 	}
 
@@ -503,23 +712,92 @@ static void zbc_unmap_meta(struct zbc_dev *zdev)
 		munmap(zdev->meta, zdev->meta_size);
 		zdev->meta = NULL;
 	}
+	zbc_free_index(zdev);
+	free(zdev->dirty_pages);
+	zdev->dirty_pages = NULL;
 }
 
 /*
- * Flush metadata.
+ * Mark the metadata pages of a range for the next flush. Called
+ * after the range was modified, so a flush racing with the change
+ * either writes it back or leaves the page marked.
  */
-static int zbc_flush_meta(struct zbc_dev *zdev)
+static void zbc_meta_dirty(struct zbc_dev *zdev, void *addr, size_t len)
 {
+	size_t pg = ((char *)addr - (char *)zdev->meta) / zdev->pg_size;
+	size_t last = ((char *)addr + len - 1 - (char *)zdev->meta) /
+		zdev->pg_size;
+
+	for (; pg <= last; pg++)
+		__atomic_fetch_or(&zdev->dirty_pages[pg / ZBC_BITS_PER_WORD],
+				  1UL << (pg % ZBC_BITS_PER_WORD),
+				  __ATOMIC_RELEASE);
+}
+
+#define zbc_zone_dirty(zdev, zone) \
+	zbc_meta_dirty((zdev), (zone), sizeof(struct zbc_zone))
+
+/*
+ * Write back metadata pages [start, end). On failure the pages are
+ * marked again so that the next flush retries them.
+ */
+static int zbc_sync_meta_pages(struct zbc_dev *zdev, size_t start,
+			       size_t end)
+{
+	void *addr = (char *)zdev->meta + start * zdev->pg_size;
+	size_t len = min(end * zdev->pg_size, zdev->meta_size) -
+		start * zdev->pg_size;
 	int ret;
 
-	ret = msync(zdev->meta, zdev->meta_size, MS_SYNC | MS_INVALIDATE);
-	if (ret) {
-		ret = -errno;
-		tcmu_dev_err(zdev->dev, "msync metadata failed (%m)\n");
-		return ret;
+	if (!msync(addr, len, MS_SYNC))
+		return 0;
+
+	ret = -errno;
+	tcmu_dev_err(zdev->dev, "msync metadata failed (%m)\n");
+	zbc_meta_dirty(zdev, addr, len);
+	return ret;
+}
+
+/*
+ * Flush metadata: write back contiguous runs of dirty pages.
+ */
+static int zbc_flush_meta(struct zbc_dev *zdev)
+{
+	size_t nr_words = (zdev->nr_meta_pages + ZBC_BITS_PER_WORD - 1) /
+		ZBC_BITS_PER_WORD;
+	size_t i, pg, start = 0, end = 0;
+	unsigned long word;
+	int ret = 0, err;
+
+	for (i = 0; i < nr_words; i++) {
+		word = __atomic_exchange_n(&zdev->dirty_pages[i], 0,
+					   __ATOMIC_ACQ_REL);
+		while (word) {
+			pg = i * ZBC_BITS_PER_WORD + __builtin_ctzl(word);
+			word &= word - 1;
+
+			if (pg == end) {
+				end++;
+				continue;
+			}
+
+			if (end > start) {
+				err = zbc_sync_meta_pages(zdev, start, end);
+				if (err && !ret)
+					ret = err;
+			}
+			start = pg;
+			end = pg + 1;
+		}
 	}
 
-	return 0;
+	if (end > start) {
+		err = zbc_sync_meta_pages(zdev, start, end);
+		if (err && !ret)
+			ret = err;
+	}
+
+	return ret;
 }
 
 /*
@@ -555,6 +833,9 @@ static bool zbc_check_zone(struct zbc_dev *zdev,
 	if (zbc_zone_conv(&zone) && zone.cond != ZBC_ZONE_COND_NOT_WP)
 		return false;
 
+	if (zone.cond >= ZBC_NR_ZONE_CONDS)
+		return false;
+
 	if (zone.start % meta->zone_size ||
 	    zone.len > meta->zone_size)
 		return false;
@@ -730,6 +1011,9 @@ static int zbc_format_meta(struct zbc_dev *zdev)
 
 	}
 
+	zbc_index_zones(zdev);
+
+	zbc_meta_dirty(zdev, meta, zdev->meta_size);
 	ret = zbc_flush_meta(zdev);
 	if (ret) {
 		zbc_unmap_meta(zdev);
@@ -755,6 +1039,8 @@ static int zbc_init_meta(struct zbc_dev *zdev)
 	if (ret)
 		return ret;
 
+	zbc_index_zones(zdev);
+
 	/* Close all zones */
 	zone = zdev->zones;
 	for (i = 0; i < zdev->nr_zones; i++) {
@@ -767,6 +1053,55 @@ static int zbc_init_meta(struct zbc_dev *zdev)
 	return 0;
 }
 
+/*
+ * Open the fd used for zone data. Metadata stays mmapped from the
+ * buffered fd, so only the data range is accessed with O_DIRECT.
+ */
+static int zbc_open_data(struct zbc_dev *zdev)
+{
+	int ret;
+
+	zdev->data_fd = zdev->fd;
+	zdev->dio_align = 0;
+	if (!zdev->cfg.direct)
+		return 0;
+
+	zdev->data_fd = open(zdev->cfg.path, O_RDWR | O_LARGEFILE | O_DIRECT);
+	if (zdev->data_fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(zdev->dev, "Open %s with O_DIRECT failed (%m)\n",
+			     zdev->cfg.path);
+		goto err;
+	}
+
+	ret = tcmu_get_dio_align(zdev->dev, zdev->data_fd, zdev->lba_size,
+				 &zdev->dio_align);
+	if (ret)
+		goto close_fd;
+
+	if (zdev->meta_size % zdev->dio_align) {
+		tcmu_dev_err(zdev->dev,
+			     "Metadata size %zu B is not aligned for O_DIRECT\n",
+			     zdev->meta_size);
+		ret = -EINVAL;
+		goto close_fd;
+	}
+
+	return 0;
+
+close_fd:
+	close(zdev->data_fd);
+err:
+	zdev->data_fd = zdev->fd;
+	return ret;
+}
+
+static void zbc_close_data(struct zbc_dev *zdev)
+{
+	if (zdev->data_fd != zdev->fd)
+		close(zdev->data_fd);
+}
+
 /*
  * Open the emulated backstore file.
  * If the file does not exist, it is created and metadata formatted.
@@ -811,6 +1146,10 @@ static int zbc_open_backstore(struct tcmu_device *dev)
 	if (ret)
 		goto err;
 
+	ret = zbc_open_data(zdev);
+	if (ret)
+		goto err_unmap;
+
 	tcmu_set_dev_block_size(dev, zdev->lba_size);
 	tcmu_set_dev_num_lbas(dev, zdev->capacity);
 
@@ -851,12 +1190,45 @@ static int zbc_open_backstore(struct tcmu_device *dev)
 
 	return 0;
 
+err_unmap:
+	zbc_unmap_meta(zdev);
 err:
 	close(zdev->fd);
 
 	return ret;
 }
 
+/*
+ * Initialize the zone locks.
+ */
+static int zbc_init_locks(struct zbc_dev *zdev)
+{
+	unsigned int i;
+
+	zdev->zone_locks = calloc(zdev->nr_zones, sizeof(pthread_mutex_t));
+	if (!zdev->zone_locks)
+		return -ENOMEM;
+
+	for (i = 0; i < zdev->nr_zones; i++)
+		pthread_mutex_init(&zdev->zone_locks[i], NULL);
+	pthread_mutex_init(&zdev->state_lock, NULL);
+
+	return 0;
+}
+
+/*
+ * Destroy the zone locks.
+ */
+static void zbc_free_locks(struct zbc_dev *zdev)
+{
+	unsigned int i;
+
+	for (i = 0; i < zdev->nr_zones; i++)
+		pthread_mutex_destroy(&zdev->zone_locks[i]);
+	pthread_mutex_destroy(&zdev->state_lock);
+	free(zdev->zone_locks);
+}
+
 /*
  * Ready the emulated device.
  */
@@ -899,8 +1271,16 @@ static int zbc_open(struct tcmu_device *dev, bool reopen)
 	if (ret)
 		goto err;
 
+	ret = zbc_init_locks(zdev);
+	if (ret)
+		goto err_close;
+
 	return 0;
 
+err_close:
+	zbc_unmap_meta(zdev);
+	zbc_close_data(zdev);
+	close(zdev->fd);
 err:
 	free(zdev->cfg.path);
 	free(zdev);
@@ -914,8 +1294,10 @@ static void zbc_close(struct tcmu_device *dev)
 {
 	struct zbc_dev *zdev = tcmu_get_dev_private(dev);
 
+	zbc_free_locks(zdev);
 	zbc_unmap_meta(zdev);
 
+	zbc_close_data(zdev);
 	close(zdev->fd);
 	free(zdev->cfg.path);
 	free(zdev);
@@ -1210,6 +1592,71 @@ static struct zbc_zone *zbc_get_zone(struct zbc_dev *zdev, uint64_t lba,
 	return zone;
 }
 
+/*
+ * Lock the sequential zones written by a command, in ascending zone
+ * order. Conventional zones have no write pointer and are not locked.
+ */
+static void zbc_lock_zones(struct zbc_dev *zdev, uint64_t lba, size_t nr_lbas)
+{
+	unsigned int zno, last;
+
+	if (!nr_lbas)
+		return;
+
+	last = (lba + nr_lbas - 1) / zdev->zone_size;
+	for (zno = lba / zdev->zone_size; zno <= last; zno++) {
+		if (zbc_zone_seq(&zdev->zones[zno]))
+			pthread_mutex_lock(&zdev->zone_locks[zno]);
+	}
+}
+
+static void zbc_unlock_zones(struct zbc_dev *zdev, uint64_t lba,
+			     size_t nr_lbas)
+{
+	unsigned int zno, last;
+
+	if (!nr_lbas)
+		return;
+
+	last = (lba + nr_lbas - 1) / zdev->zone_size;
+	for (zno = lba / zdev->zone_size; zno <= last; zno++) {
+		if (zbc_zone_seq(&zdev->zones[zno]))
+			pthread_mutex_unlock(&zdev->zone_locks[zno]);
+	}
+}
+
+/*
+ * Lock a zone for a zone management operation changing its write
+ * pointer: wait for the writes in flight in the zone, then take the
+ * state lock.
+ */
+static void zbc_lock_zone_state(struct zbc_dev *zdev, struct zbc_zone *zone)
+{
+	pthread_mutex_lock(&zdev->zone_locks[zone - zdev->zones]);
+	pthread_mutex_lock(&zdev->state_lock);
+}
+
+static void zbc_unlock_zone_state(struct zbc_dev *zdev, struct zbc_zone *zone)
+{
+	pthread_mutex_unlock(&zdev->state_lock);
+	pthread_mutex_unlock(&zdev->zone_locks[zone - zdev->zones]);
+}
+
+/*
+ * Get a zone write pointer. Data below it is stable, so reads do
+ * not need the zone lock.
+ */
+static uint64_t zbc_zone_wp(struct zbc_dev *zdev, struct zbc_zone *zone)
+{
+	uint64_t wp;
+
+	pthread_mutex_lock(&zdev->state_lock);
+	wp = zone->wp;
+	pthread_mutex_unlock(&zdev->state_lock);
+
+	return wp;
+}
+
 /*
  * Test if a zone must be reported.
  */
@@ -1246,6 +1693,62 @@ static bool zbc_should_report_zone(struct zbc_zone *zone,
 	}
 }
 
+/*
+ * Return the first zone at or after zone number zno that must be
+ * reported, or NULL. Options filtering on a condition only visit the
+ * matching zones.
+ */
+static struct zbc_zone *zbc_next_report_zone(struct zbc_dev *zdev,
+					     unsigned int zno,
+					     enum zbc_reporting_options ro)
+{
+	int cond;
+
+	switch (ro & (~ZBC_RO_PARTIAL)) {
+	case ZBC_RO_EMPTY:
+		cond = ZBC_ZONE_COND_EMPTY;
+		break;
+	case ZBC_RO_IMP_OPEN:
+		cond = ZBC_ZONE_COND_IMP_OPEN;
+		break;
+	case ZBC_RO_EXP_OPEN:
+		cond = ZBC_ZONE_COND_EXP_OPEN;
+		break;
+	case ZBC_RO_CLOSED:
+		cond = ZBC_ZONE_COND_CLOSED;
+		break;
+	case ZBC_RO_FULL:
+		cond = ZBC_ZONE_COND_FULL;
+		break;
+	case ZBC_RO_READONLY:
+		cond = ZBC_ZONE_COND_READONLY;
+		break;
+	case ZBC_RO_OFFLINE:
+		cond = ZBC_ZONE_COND_OFFLINE;
+		break;
+	case ZBC_RO_NOT_WP:
+		cond = ZBC_ZONE_COND_NOT_WP;
+		break;
+	default:
+		cond = -1;
+		break;
+	}
+
+	if (cond >= 0) {
+		zno = zbc_find_next_bit(zdev->cond_zones[cond],
+					zdev->nr_zones, zno);
+	} else {
+		while (zno < zdev->nr_zones &&
+		       !zbc_should_report_zone(&zdev->zones[zno], ro))
+			zno++;
+	}
+
+	if (zno >= zdev->nr_zones)
+		return NULL;
+
+	return &zdev->zones[zno];
+}
+
 /*
  * Report zones command emulation.
  */
@@ -1290,27 +1793,26 @@ static int zbc_report_zones(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_LBA_OUT_OF_RANGE);
 
+	pthread_mutex_lock(&zdev->state_lock);
+
 	/* First pass: count zones */
 	len = tcmu_get_xfer_length(cdb);
 	if (len > 64)
 		len -= 64;
 	else
 		len = 0;
-	zone = zbc_get_zone(zdev, lba, false);
-	while (lba < zdev->capacity) {
+	zone = zbc_next_report_zone(zdev, lba / zdev->zone_size, ro);
+	while (zone) {
 
-		if (zbc_should_report_zone(zone, ro)) {
-			if (partial && len < 64)
-				break;
-			if (len > 64)
-				len -= 64;
-			else
-				len = 0;
-			nr_zones++;
-		}
+		if (partial && len < 64)
+			break;
+		if (len > 64)
+			len -= 64;
+		else
+			len = 0;
+		nr_zones++;
 
-		lba = zone->start + zone->len;
-		zone++;
+		zone = zbc_next_report_zone(zdev, zone - zdev->zones + 1, ro);
 
 	}
 
@@ -1326,35 +1828,31 @@ static int zbc_report_zones(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	/* Second pass: get zone information */
 	len = tcmu_iovec_length(iovec, iov_cnt);
-	lba = tcmu_get_lba(cdb);
-	zone = zbc_get_zone(zdev, lba, false);
-	while (lba < zdev->capacity && len >= 64) {
-
-		if (zbc_should_report_zone(zone, ro)) {
-
-			memset(data, 0, sizeof(data));
-			data[0] = zone->type & 0x0f;
-			data[1] = (zone->cond << 4) & 0xf0;
-			if (zone->reset)
-				data[1] |= 0x01;
-			if (zone->non_seq)
-				data[1] |= 0x02;
-			val64 = htobe64(zone->len);
-			memcpy(&data[8], &val64, 8);
-			val64 = htobe64(zone->start);
-			memcpy(&data[16], &val64, 8);
-			val64 = htobe64(zone->wp);
-			memcpy(&data[24], &val64, 8);
-
-			tcmu_memcpy_into_iovec(iovec, iov_cnt, data, 64);
-			len -= 64;
-		}
+	zone = zbc_next_report_zone(zdev, lba / zdev->zone_size, ro);
+	while (zone && len >= 64) {
+
+		memset(data, 0, sizeof(data));
+		data[0] = zone->type & 0x0f;
+		data[1] = (zone->cond << 4) & 0xf0;
+		if (zone->reset)
+			data[1] |= 0x01;
+		if (zone->non_seq)
+			data[1] |= 0x02;
+		val64 = htobe64(zone->len);
+		memcpy(&data[8], &val64, 8);
+		val64 = htobe64(zone->start);
+		memcpy(&data[16], &val64, 8);
+		val64 = htobe64(zone->wp);
+		memcpy(&data[24], &val64, 8);
 
-		lba = zone->start + zone->len;
-		zone++;
+		tcmu_memcpy_into_iovec(iovec, iov_cnt, data, 64);
+		len -= 64;
+
+		zone = zbc_next_report_zone(zdev, zone - zdev->zones + 1, ro);
 	}
 
 out:
+	pthread_mutex_unlock(&zdev->state_lock);
 	return TCMU_STS_OK;
 }
 
@@ -1376,24 +1874,22 @@ static void __zbc_close_zone(struct zbc_dev *zdev, struct zbc_zone *zone)
 		zdev->nr_exp_open--;
 
 	if (zone->wp == zone->start)
-		zone->cond = ZBC_ZONE_COND_EMPTY;
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_EMPTY);
 	else
-		zone->cond = ZBC_ZONE_COND_CLOSED;
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_CLOSED);
+	zbc_zone_dirty(zdev, zone);
 }
 
 /*
- * Close an implicitly open zone.
+ * Close the least recently used implicitly open zone.
  */
 static void __zbc_close_imp_open_zone(struct zbc_dev *zdev)
 {
-	int i;
+	struct zbc_zone_entry *ent;
 
-	for (i = 0; i < zdev->nr_zones; i++) {
-		if (zbc_zone_imp_open(&zdev->zones[i])) {
-			__zbc_close_zone(zdev, &zdev->zones[i]);
-			return;
-		}
-	}
+	ent = list_top(&zdev->imp_open_list, struct zbc_zone_entry, node);
+	if (ent)
+		__zbc_close_zone(zdev, &zdev->zones[ent - zdev->zone_entries]);
 }
 
 /*
@@ -1412,13 +1908,13 @@ static void __zbc_open_zone(struct zbc_dev *zdev, struct zbc_zone *zone,
 		__zbc_close_imp_open_zone(zdev);
 
 	if (explicit) {
-		zone->cond = ZBC_ZONE_COND_EXP_OPEN;
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_EXP_OPEN);
 		zdev->nr_exp_open++;
-		return;
+	} else {
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_IMP_OPEN);
+		zdev->nr_imp_open++;
 	}
-
-	zone->cond = ZBC_ZONE_COND_IMP_OPEN;
-	zdev->nr_imp_open++;
+	zbc_zone_dirty(zdev, zone);
 }
 
 /*
@@ -1431,29 +1927,31 @@ static int zbc_open_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	uint8_t *cdb = cmd->cdb;
 	bool all = cdb[14] & 0x01;
 	uint64_t lba;
+	int ret = TCMU_STS_OK;
 	int i;
 
 	if (all) {
-		unsigned int nr_closed = 0;
+		unsigned long *closed = zdev->cond_zones[ZBC_ZONE_COND_CLOSED];
 
-		/* Check if all closed zones can be open */
-		for (i = 0; i < zdev->nr_zones; i++) {
-			if (zbc_zone_closed(&zdev->zones[i]))
-				nr_closed++;
-		}
+		pthread_mutex_lock(&zdev->state_lock);
 
-		if ((zdev->nr_exp_open + nr_closed) > zdev->nr_open_zones)
-			return tcmu_set_sense_data(cmd->sense_buf,
+		/* Check if all closed zones can be open */
+		if ((zdev->nr_exp_open +
+		     zdev->nr_cond_zones[ZBC_ZONE_COND_CLOSED]) >
+		    zdev->nr_open_zones) {
+			ret = tcmu_set_sense_data(cmd->sense_buf,
 					   DATA_PROTECT,
 					   ASC_INSUFFICIENT_ZONE_RESOURCES);
+			goto unlock;
+		}
 
 		/* Open all closed zones */
-		for (i = 0; i < zdev->nr_zones; i++) {
-			if (zbc_zone_closed(&zdev->zones[i]))
-				__zbc_open_zone(zdev, &zdev->zones[i], true);
-		}
+		for (i = zbc_find_next_bit(closed, zdev->nr_zones, 0);
+		     i < zdev->nr_zones;
+		     i = zbc_find_next_bit(closed, zdev->nr_zones, i + 1))
+			__zbc_open_zone(zdev, &zdev->zones[i], true);
 
-		return TCMU_STS_OK;
+		goto unlock;
 	}
 
 	/* Open the specified zone */
@@ -1469,20 +1967,40 @@ static int zbc_open_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_INVALID_FIELD_IN_CDB);
 
+	pthread_mutex_lock(&zdev->state_lock);
+
 	if (zbc_zone_exp_open(zone) || zbc_zone_full(zone))
-		return TCMU_STS_OK;
+		goto unlock;
 
-	if ((zdev->nr_exp_open + 1) > zdev->nr_open_zones)
-		return tcmu_set_sense_data(cmd->sense_buf,
-					   DATA_PROTECT,
-					   ASC_INSUFFICIENT_ZONE_RESOURCES);
+	if ((zdev->nr_exp_open + 1) > zdev->nr_open_zones) {
+		ret = tcmu_set_sense_data(cmd->sense_buf,
+					  DATA_PROTECT,
+					  ASC_INSUFFICIENT_ZONE_RESOURCES);
+		goto unlock;
+	}
 
 	if (zbc_zone_imp_open(zone))
 		__zbc_close_zone(zdev, zone);
 
 	__zbc_open_zone(zdev, zone, true);
 
-	return TCMU_STS_OK;
+unlock:
+	pthread_mutex_unlock(&zdev->state_lock);
+	return ret;
+}
+
+/*
+ * Close all the zones in an open condition.
+ */
+static void __zbc_close_zones(struct zbc_dev *zdev, uint8_t cond)
+{
+	unsigned long *map = zdev->cond_zones[cond];
+	unsigned int i;
+
+	for (i = zbc_find_next_bit(map, zdev->nr_zones, 0);
+	     i < zdev->nr_zones;
+	     i = zbc_find_next_bit(map, zdev->nr_zones, i + 1))
+		__zbc_close_zone(zdev, &zdev->zones[i]);
 }
 
 /*
@@ -1495,12 +2013,13 @@ static int zbc_close_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	uint8_t *cdb = cmd->cdb;
 	bool all = cdb[14] & 0x01;
 	uint64_t lba;
-	int i;
 
 	if (all) {
 		/* Close all open zones */
-		for (i = 0; i < zdev->nr_zones; i++)
-			__zbc_close_zone(zdev, &zdev->zones[i]);
+		pthread_mutex_lock(&zdev->state_lock);
+		__zbc_close_zones(zdev, ZBC_ZONE_COND_IMP_OPEN);
+		__zbc_close_zones(zdev, ZBC_ZONE_COND_EXP_OPEN);
+		pthread_mutex_unlock(&zdev->state_lock);
 		return TCMU_STS_OK;
 	}
 
@@ -1517,7 +2036,9 @@ static int zbc_close_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_INVALID_FIELD_IN_CDB);
 
+	pthread_mutex_lock(&zdev->state_lock);
 	__zbc_close_zone(zdev, zone);
+	pthread_mutex_unlock(&zdev->state_lock);
 
 	return TCMU_STS_OK;
 }
@@ -1540,9 +2061,10 @@ static void __zbc_finish_zone(struct zbc_dev *zdev, struct zbc_zone *zone,
 			__zbc_close_zone(zdev, zone);
 
 		zone->wp = zone->start + zone->len;
-		zone->cond = ZBC_ZONE_COND_FULL;
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_FULL);
 		zone->non_seq = 0;
 		zone->reset = 0;
+		zbc_zone_dirty(zdev, zone);
 
 	}
 }
@@ -1561,8 +2083,12 @@ static int zbc_finish_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	if (all) {
 		/* Finish all zones */
-		for (i = 0; i < zdev->nr_zones; i++)
-			__zbc_finish_zone(zdev, &zdev->zones[i], false);
+		for (i = 0; i < zdev->nr_zones; i++) {
+			zone = &zdev->zones[i];
+			zbc_lock_zone_state(zdev, zone);
+			__zbc_finish_zone(zdev, zone, false);
+			zbc_unlock_zone_state(zdev, zone);
+		}
 		return TCMU_STS_OK;
 	}
 
@@ -1579,7 +2105,9 @@ static int zbc_finish_zone(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_INVALID_FIELD_IN_CDB);
 
+	zbc_lock_zone_state(zdev, zone);
 	__zbc_finish_zone(zdev, zone, true);
+	zbc_unlock_zone_state(zdev, zone);
 
 	return TCMU_STS_OK;
 }
@@ -1597,9 +2125,10 @@ static void __zbc_reset_wp(struct zbc_dev *zdev, struct zbc_zone *zone)
 		__zbc_close_zone(zdev, zone);
 
 	zone->wp = zone->start;
-	zone->cond = ZBC_ZONE_COND_EMPTY;
+	zbc_set_cond(zdev, zone, ZBC_ZONE_COND_EMPTY);
 	zone->non_seq = 0;
 	zone->reset = 0;
+	zbc_zone_dirty(zdev, zone);
 }
 
 /*
@@ -1616,8 +2145,12 @@ static int zbc_reset_wp(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	if (all) {
 		/* Reset all zones */
-		for (i = 0; i < zdev->nr_zones; i++)
-			__zbc_reset_wp(zdev, &zdev->zones[i]);
+		for (i = 0; i < zdev->nr_zones; i++) {
+			zone = &zdev->zones[i];
+			zbc_lock_zone_state(zdev, zone);
+			__zbc_reset_wp(zdev, zone);
+			zbc_unlock_zone_state(zdev, zone);
+		}
 		return TCMU_STS_OK;
 	}
 
@@ -1634,7 +2167,9 @@ static int zbc_reset_wp(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 					   ILLEGAL_REQUEST,
 					   ASC_INVALID_FIELD_IN_CDB);
 
+	zbc_lock_zone_state(zdev, zone);
 	__zbc_reset_wp(zdev, zone);
+	zbc_unlock_zone_state(zdev, zone);
 
 	return TCMU_STS_OK;
 }
@@ -1933,17 +2468,17 @@ static ssize_t __zbc_read(struct zbc_dev *zdev, void *buf,
 			}
 		}
 
-		if (zbc_zone_seq(zone) && lba >= zone->wp) {
+		if (zbc_zone_seq(zone))
+			boundary = zbc_zone_wp(zdev, zone);
+		else
+			boundary = zone->start + zone->len;
+
+		if (zbc_zone_seq(zone) && lba >= boundary) {
 			/* Read zeroes */
 			bytes = lba_count * zdev->lba_size;
 			memset(buf, 0, bytes);
 			break;
 		}
-
-		if (zbc_zone_seq(zone))
-			boundary = zone->wp;
-		else
-			boundary = zone->start + zone->len;
 		if (lba + nr_lbas > boundary)
 			count = boundary - lba;
 		else
@@ -1951,8 +2486,9 @@ static ssize_t __zbc_read(struct zbc_dev *zdev, void *buf,
 		bytes = count * zdev->lba_size;
 
 		/* Read written data */
-		ret = pread(zdev->fd, buf, bytes,
-			    zdev->meta_size + lba * zdev->lba_size);
+		ret = tcmu_pread_aligned(zdev->data_fd, buf, bytes,
+					 zdev->meta_size + lba * zdev->lba_size,
+					 zdev->dio_align);
 		if (ret != bytes) {
 			tcmu_dev_err(zdev->dev, "Read failed %zd / %zu B\n",
 				     ret, bytes);
@@ -2095,6 +2631,69 @@ static int zbc_write_check_zones(struct tcmu_device *dev,
 	return TCMU_STS_OK;
 }
 
+/*
+ * Adjust the write pointer of a zone after count LBAs were written
+ * at lba.
+ */
+static void __zbc_advance_wp(struct zbc_dev *zdev, struct zbc_zone *zone,
+			     uint64_t lba, size_t count)
+{
+	if (zbc_zone_seq_req(zone)) {
+		zone->wp += count;
+	} else if (zbc_zone_seq_pref(zone)) {
+		if (lba + count >= zone->wp)
+			zone->wp = lba + count;
+	}
+
+	/* The zone may have been closed while the write was in flight */
+	if (zbc_zone_empty(zone) && zone->wp != zone->start)
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_CLOSED);
+
+	if (zbc_zone_seq(zone) &&
+	    zone->wp >= zone->start + zone->len) {
+		if (zbc_zone_is_open(zone))
+			__zbc_close_zone(zdev, zone);
+		zone->wp = zone->start + zone->len;
+		zbc_set_cond(zdev, zone, ZBC_ZONE_COND_FULL);
+	}
+
+	if (zbc_zone_seq(zone))
+		zbc_zone_dirty(zdev, zone);
+}
+
+/*
+ * Implicitly open a sequential zone before writing it.
+ */
+static int zbc_implicit_open_zone(struct zbc_dev *zdev,
+				  struct tcmulib_cmd *cmd,
+				  struct zbc_zone *zone)
+{
+	struct zbc_zone_entry *ent;
+	int ret = TCMU_STS_OK;
+
+	if (zbc_zone_conv(zone))
+		return TCMU_STS_OK;
+
+	pthread_mutex_lock(&zdev->state_lock);
+	if (zbc_zone_imp_open(zone)) {
+		/* Keep the implicitly open zones in LRU order */
+		ent = &zdev->zone_entries[zone - zdev->zones];
+		list_del(&ent->node);
+		list_add_tail(&zdev->imp_open_list, &ent->node);
+	} else if (!zbc_zone_is_open(zone)) {
+		/* Too many explicit open ? */
+		if (zdev->nr_exp_open >= zdev->nr_open_zones)
+			ret = tcmu_set_sense_data(cmd->sense_buf,
+						  DATA_PROTECT,
+						  ASC_INSUFFICIENT_ZONE_RESOURCES);
+		else
+			__zbc_open_zone(zdev, zone, false);
+	}
+	pthread_mutex_unlock(&zdev->state_lock);
+
+	return ret;
+}
+
 /*
  * Write command emulation.
  */
@@ -2104,6 +2703,8 @@ static int zbc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	uint8_t *cdb = cmd->cdb;
 	uint64_t lba = tcmu_get_lba(cdb);
 	size_t nr_lbas = tcmu_get_xfer_length(cdb);
+	uint64_t start_lba = lba;
+	size_t start_nr_lbas = nr_lbas;
 	size_t count, lba_count;
 	struct iovec *iovec = cmd->iovec;
 	struct zbc_zone *zone;
@@ -2118,10 +2719,14 @@ static int zbc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret != TCMU_STS_OK)
 		return ret;
 
+	zbc_lock_zones(zdev, start_lba, start_nr_lbas);
+
 	/* Check zone boundary crossing */
+	pthread_mutex_lock(&zdev->state_lock);
 	ret = zbc_write_check_zones(dev, cmd, nr_lbas, lba);
+	pthread_mutex_unlock(&zdev->state_lock);
 	if (ret != TCMU_STS_OK)
-		return ret;
+		goto unlock;
 
 	/* Do write */
 	while (nr_lbas) {
@@ -2132,20 +2737,15 @@ static int zbc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 			tcmu_dev_err(dev,
 				     "Write boundary violation lba %"PRIu64", xfer len %zu\n",
 				     lba, nr_lbas);
-			return tcmu_set_sense_data(cmd->sense_buf,
-						   ILLEGAL_REQUEST,
-						   ASC_WRITE_BOUNDARY_VIOLATION);
+			ret = tcmu_set_sense_data(cmd->sense_buf,
+						  ILLEGAL_REQUEST,
+						  ASC_WRITE_BOUNDARY_VIOLATION);
+			goto unlock;
 		}
 
-		/* If the zone is not open, implicitly open it */
-		if (zbc_zone_seq(zone) && !zbc_zone_is_open(zone)) {
-			/* Too many explicit open ? */
-			if (zdev->nr_exp_open >= zdev->nr_open_zones)
-				return tcmu_set_sense_data(cmd->sense_buf,
-							   DATA_PROTECT,
-							   ASC_INSUFFICIENT_ZONE_RESOURCES);
-			__zbc_open_zone(zdev, zone, false);
-		}
+		ret = zbc_implicit_open_zone(zdev, cmd, zone);
+		if (ret != TCMU_STS_OK)
+			goto unlock;
 
 		/* Do write */
 		if (lba + nr_lbas > zone->start + zone->len)
@@ -2156,40 +2756,158 @@ static int zbc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		if (lba_count < count)
 			count = lba_count;
 
-		ret = pwrite(zdev->fd, iovec->iov_base, count * zdev->lba_size,
-			     zdev->meta_size + lba * zdev->lba_size);
+		ret = tcmu_pwrite_aligned(zdev->data_fd, iovec->iov_base,
+					  count * zdev->lba_size,
+					  zdev->meta_size + lba * zdev->lba_size,
+					  zdev->dio_align);
 		if (ret <= 0) {
 			tcmu_dev_err(dev, "Write failed: %m\n");
-			return tcmu_set_sense_data(cmd->sense_buf,
-						   MEDIUM_ERROR,
-						   ASC_WRITE_ERROR);
+			ret = tcmu_set_sense_data(cmd->sense_buf,
+						  MEDIUM_ERROR,
+						  ASC_WRITE_ERROR);
+			goto unlock;
 		}
 
 		iovec += tcmu_seek_in_iovec(iovec, ret);
 		count = ret / zdev->lba_size;
 
-		/* Adjust write pointer */
-		if (zbc_zone_seq_req(zone)) {
-			zone->wp += count;
-		} else if (zbc_zone_seq_pref(zone)) {
-			if (lba + count >= zone->wp)
-				zone->wp = lba + count;
-		}
+		pthread_mutex_lock(&zdev->state_lock);
+		__zbc_advance_wp(zdev, zone, lba, count);
+		pthread_mutex_unlock(&zdev->state_lock);
+
+		lba += count;
+		nr_lbas -= count;
+
+	}
+
+	ret = TCMU_STS_OK;
+unlock:
+	zbc_unlock_zones(zdev, start_lba, start_nr_lbas);
+	return ret;
+}
+
+/*
+ * Write the same block to count LBAs at lba. Zeros are written by
+ * zeroing the backstore range when the filesystem can, anything else
+ * by repeating the block in a buffer.
+ */
+static ssize_t __zbc_write_same(struct zbc_dev *zdev, void *block,
+				bool zero, uint64_t lba, size_t count)
+{
+	off_t off = zdev->meta_size + lba * zdev->lba_size;
+	size_t len = count * zdev->lba_size, buf_len, bytes;
+	ssize_t ret;
+	void *buf;
+	size_t i;
+
+#ifdef HAVE_LINUX_FALLOC
+	if (zero && !fallocate(zdev->fd, FALLOC_FL_ZERO_RANGE, off, len))
+		return len;
+#endif
 
-		if (zbc_zone_seq(zone) &&
-		    zone->wp >= zone->start + zone->len) {
-			if (zbc_zone_is_open(zone))
-				__zbc_close_zone(zdev, zone);
-			zone->wp = zone->start + zone->len;
-			zone->cond = ZBC_ZONE_COND_FULL;
+	buf_len = min(len, (size_t)ZBC_WRITE_SAME_BUF_SIZE);
+	buf = malloc(buf_len);
+	if (!buf)
+		return -ENOMEM;
+	for (i = 0; i < buf_len; i += zdev->lba_size)
+		memcpy(buf + i, block, zdev->lba_size);
+
+	for (bytes = 0; bytes < len; bytes += ret) {
+		ret = tcmu_pwrite_aligned(zdev->data_fd, buf,
+					  min(len - bytes, buf_len),
+					  off + bytes, zdev->dio_align);
+		if (ret <= 0)
+			break;
+	}
+
+	free(buf);
+	return bytes < len ? -EIO : len;
+}
+
+/*
+ * Write same command emulation.
+ */
+static int zbc_write_same(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct zbc_dev *zdev = tcmu_get_dev_private(dev);
+	uint8_t *cdb = cmd->cdb;
+	uint64_t lba = tcmu_get_lba(cdb);
+	size_t nr_lbas = tcmu_get_xfer_length(cdb);
+	uint64_t start_lba = lba;
+	size_t start_nr_lbas = nr_lbas;
+	struct iovec *iovec = cmd->iovec;
+	struct zbc_zone *zone;
+	size_t count;
+	bool zero;
+	ssize_t ret;
+
+	tcmu_dev_dbg(dev, "Write same LBA %llu+%zu\n",
+		     (unsigned long long)lba, nr_lbas);
+
+	if (cmd->iov_cnt != 1 || iovec->iov_len != zdev->lba_size ||
+	    !nr_lbas || nr_lbas > VPD_MAX_WRITE_SAME_LENGTH) {
+		tcmu_dev_err(dev, "Invalid write same: iov len %zu, xfer len %zu\n",
+			     tcmu_iovec_length(iovec, cmd->iov_cnt), nr_lbas);
+		return tcmu_set_sense_data(cmd->sense_buf,
+					   ILLEGAL_REQUEST,
+					   ASC_INVALID_FIELD_IN_CDB);
+	}
+
+	if (lba + nr_lbas > zdev->capacity || lba + nr_lbas < lba) {
+		tcmu_dev_err(dev, "cmd exceeds last lba %llu (lba %"PRIu64", xfer len %zu)\n",
+			     zdev->capacity, lba, nr_lbas);
+		return tcmu_set_sense_data(cmd->sense_buf,
+					   ILLEGAL_REQUEST,
+					   ASC_LBA_OUT_OF_RANGE);
+	}
+
+	zbc_lock_zones(zdev, start_lba, start_nr_lbas);
+
+	/* Check zone boundary crossing */
+	pthread_mutex_lock(&zdev->state_lock);
+	ret = zbc_write_check_zones(dev, cmd, nr_lbas, lba);
+	pthread_mutex_unlock(&zdev->state_lock);
+	if (ret != TCMU_STS_OK)
+		goto unlock;
+
+	zero = tcmu_iovec_zeroed(iovec, 1);
+
+	while (nr_lbas) {
+
+		/* Get the zone of the current LBA */
+		zone = zbc_get_zone(zdev, lba, false);
+
+		ret = zbc_implicit_open_zone(zdev, cmd, zone);
+		if (ret != TCMU_STS_OK)
+			goto unlock;
+
+		if (lba + nr_lbas > zone->start + zone->len)
+			count = zone->start + zone->len - lba;
+		else
+			count = nr_lbas;
+
+		ret = __zbc_write_same(zdev, iovec->iov_base, zero, lba, count);
+		if (ret < 0) {
+			tcmu_dev_err(dev, "Write same failed: %zd\n", ret);
+			ret = tcmu_set_sense_data(cmd->sense_buf,
+						  MEDIUM_ERROR,
+						  ASC_WRITE_ERROR);
+			goto unlock;
 		}
 
+		pthread_mutex_lock(&zdev->state_lock);
+		__zbc_advance_wp(zdev, zone, lba, count);
+		pthread_mutex_unlock(&zdev->state_lock);
+
 		lba += count;
 		nr_lbas -= count;
 
 	}
 
-	return TCMU_STS_OK;
+	ret = TCMU_STS_OK;
+unlock:
+	zbc_unlock_zones(zdev, start_lba, start_nr_lbas);
+	return ret;
 }
 
 /*
@@ -2216,7 +2934,7 @@ static int zbc_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
  * Handle command emulation.
  * Return scsi status or TCMU_STS_NOT_HANDLED
  */
-static int zbc_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+static int __zbc_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	uint8_t *cdb = cmd->cdb;
 	struct iovec *iovec = cmd->iovec;
@@ -2263,6 +2981,10 @@ static int zbc_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	case WRITE_16:
 		return zbc_write(dev, cmd);
 
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		return zbc_write_same(dev, cmd);
+
 	case SYNCHRONIZE_CACHE:
 	case SYNCHRONIZE_CACHE_16:
 		return zbc_flush(dev, cmd);
@@ -2272,6 +2994,20 @@ static int zbc_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	return TCMU_STS_NOT_HANDLED;
 }
 
+/*
+ * Commands run on the io worker threads, so complete them here.
+ */
+static int zbc_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	int ret = __zbc_handle_cmd(dev, cmd);
+
+	if (ret == TCMU_STS_NOT_HANDLED)
+		return ret;
+
+	cmd->done(dev, cmd, ret);
+	return TCMU_STS_OK;
+}
+
 static const char zbc_cfg_desc[] =
 	"ZBC emulation device configuration string must be of the form:\n"
 	"\"[opt1[/opt2][...]@]<backstore file path>\n"
@@ -2286,6 +3022,9 @@ static const char zbc_cfg_desc[] =
 	"                      The default is 1%% of the device capacity\n"
 	"  open-<num>        : Optimal (HA) or maximum (HM) number of open zones\n"
 	"                      The default is 128\n"
+	"  direct-<0|1>      : Access zone data with O_DIRECT. Unlike the\n"
+	"                      other options, this does not reformat the file\n"
+	"                      The default is 0\n"
 	"Ex:\n"
 	"  cfgstring=model-HM/zsize-128/conv-100@/var/local/zbc.raw\n"
 	"  will create a host-managed disk with 128 MiB zones and 100\n"
@@ -2300,7 +3039,8 @@ static struct tcmur_handler zbc_handler = {
 	.open = zbc_open,
 	.close = zbc_close,
 	.handle_cmd = zbc_handle_cmd,
-	.nr_threads = 0,
+	.nr_threads = 2,
+	.max_threads = TCMUR_MAX_IO_THREADS,
 };
 
 /*
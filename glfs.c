@@ -33,8 +33,16 @@
 #define TCMU_GLFS_LOG_FILENAME "tcmu-runner-glfs.log"  /* MAX 32 CHAR */
 #define TCMU_GLFS_DEBUG_LEVEL  7
 
+/* upper bound for the conns= option */
+#define TCMU_GLFS_MAX_CONNS    16
+
+/* completed cookies kept per device for reuse */
+#define TCMU_GLFS_MAX_FREE_COOKIES 128
+
 /* cache protection */
 pthread_mutex_t glfs_lock;
+/* signalled when a cached glfs object finishes glfs_init */
+pthread_cond_t glfs_init_cond;
 
 typedef enum gluster_transport {
 	GLUSTER_TRANSPORT_TCP,
@@ -64,6 +72,9 @@ typedef struct gluster_server {
 	char *volname;     /* volume name*/
 	char *path;        /* path of file in the volume */
 	gluster_hostdef *server; /* gluster server definition */
+	unsigned int conns;         /* glfs objects to spread devices over */
+	unsigned int event_threads; /* client event-threads, 0 for default */
+	unsigned int io_threads;    /* client io-threads, 0 for default */
 } gluster_server;
 
 struct glfs_state {
@@ -71,6 +82,11 @@ struct glfs_state {
 	glfs_fd_t *gfd;
 	gluster_server *hosts;
 
+	/* cookies are completed from gfapi threads */
+	pthread_mutex_t cookie_lock;
+	struct glfs_cbk_cookie *free_cookies;
+	unsigned int nr_free_cookies;
+
 	/*
 	 * Current tcmu helper API reports WCE=1, but doesn't
 	 * implement inquiry VPD 0xb2, so clients will not know UNMAP
@@ -86,14 +102,21 @@ typedef struct glfs_cbk_cookie {
 		TCMU_GLFS_READ  = 1,
 		TCMU_GLFS_WRITE = 2,
 		TCMU_GLFS_FLUSH = 3,
-		TCMU_GLFS_DISCARD = 4
+		TCMU_GLFS_DISCARD = 4,
+		TCMU_GLFS_WRITESAME = 5
 	} op;
+	struct glfs_cbk_cookie *next; /* cookie_lock, while free */
 } glfs_cbk_cookie;
 
 struct gluster_cacheconn {
 	char *volname;
 	gluster_hostdef *server;
 	glfs_t *fs;
+	unsigned int index;	/* which of the volume's conns this is */
+	/* glfs_init is still running, wait for it on glfs_init_cond */
+	bool initing;
+	/* glfs_init failed, new devices must not use it */
+	bool failed;
 	darray(char *) cfgstring;
 } gluster_cacheconn;
 
@@ -152,7 +175,8 @@ gluster_compare_hosts(gluster_hostdef *src_server, gluster_hostdef *dst_server)
 	return false;
 }
 
-static int gluster_cache_add(gluster_server *dst, glfs_t *fs, char* cfgstring)
+static int gluster_cache_add(gluster_server *dst, glfs_t *fs, char* cfgstring,
+			     unsigned int index)
 {
 	struct gluster_cacheconn *entry;
 	char* cfg_copy = NULL;
@@ -177,6 +201,8 @@ static int gluster_cache_add(gluster_server *dst, glfs_t *fs, char* cfgstring)
 	}
 
 	entry->fs = fs;
+	entry->index = index;
+	entry->initing = true;
 
 	cfg_copy = strdup(cfgstring);
 	darray_init(entry->cfgstring);
@@ -194,36 +220,80 @@ error:
 	return -1;
 }
 
-static glfs_t* gluster_cache_query(gluster_server *dst, char *cfgstring)
+/*
+ * Each volume/server pair can have up to dst->conns glfs objects. A
+ * device that is not attached yet goes to the one with the fewest
+ * devices. Whole devices are spread rather than individual commands,
+ * because every glfs object has its own client side caching and a read
+ * sent through one object could miss a write still cached by another.
+ *
+ * Returns NULL and sets *index if a new object must be created.
+ */
+static glfs_t* gluster_cache_query(gluster_server *dst, char *cfgstring,
+				   unsigned int *index)
 {
-	struct gluster_cacheconn **entry;
+	struct gluster_cacheconn **entry, *best = NULL;
+	unsigned int users[TCMU_GLFS_MAX_CONNS] = { 0 };
+	bool present[TCMU_GLFS_MAX_CONNS] = { false };
 	char** config;
 	char* cfg_copy = NULL;
-	bool cfgmatch = false;
+	unsigned int i;
 
 	darray_foreach(entry, glfs_cache) {
+		if ((*entry)->failed)
+			continue;
 		if (strcmp((*entry)->volname, dst->volname))
 			continue;
-		if (gluster_compare_hosts((*entry)->server, dst->server)) {
+		if (!gluster_compare_hosts((*entry)->server, dst->server))
+			continue;
 
-			darray_foreach(config, (*entry)->cfgstring) {
-				if (!strcmp(*config, cfgstring)) {
-					cfgmatch = true;
-					break;
-				}
-			}
-			if (!cfgmatch) {
-				cfg_copy = strdup(cfgstring);
-				darray_append((*entry)->cfgstring, cfg_copy);
-			}
-			return (*entry)->fs;
+		darray_foreach(config, (*entry)->cfgstring) {
+			if (!strcmp(*config, cfgstring))
+				return (*entry)->fs;
+		}
+
+		if ((*entry)->index < TCMU_GLFS_MAX_CONNS) {
+			users[(*entry)->index] = darray_size((*entry)->cfgstring);
+			present[(*entry)->index] = true;
+		}
+	}
+
+	*index = 0;
+	for (i = 1; i < dst->conns; i++) {
+		if (users[i] < users[*index])
+			*index = i;
+	}
+
+	if (!present[*index])
+		return NULL;
+
+	darray_foreach(entry, glfs_cache) {
+		if (!(*entry)->failed &&
+		    !strcmp((*entry)->volname, dst->volname) &&
+		    gluster_compare_hosts((*entry)->server, dst->server) &&
+		    (*entry)->index == *index) {
+			best = *entry;
+			break;
 		}
 	}
 
+	cfg_copy = strdup(cfgstring);
+	darray_append(best->cfgstring, cfg_copy);
+	return best->fs;
+}
+
+static struct gluster_cacheconn *gluster_cache_lookup(glfs_t *fs)
+{
+	struct gluster_cacheconn **entry;
+
+	darray_foreach(entry, glfs_cache) {
+		if ((*entry)->fs == fs)
+			return *entry;
+	}
 	return NULL;
 }
 
-static void gluster_cache_refresh(glfs_t *fs, const char *cfgstring)
+static void __gluster_cache_refresh(glfs_t *fs, const char *cfgstring)
 {
 	struct gluster_cacheconn **entry;
 	char** config;
@@ -270,17 +340,56 @@ static void gluster_thread_cleanup(void *arg)
 	pthread_mutex_unlock(arg);
 }
 
+static void gluster_cache_refresh(glfs_t *fs, const char *cfgstring)
+{
+	pthread_mutex_lock(&glfs_lock);
+	__gluster_cache_refresh(fs, cfgstring);
+	pthread_mutex_unlock(&glfs_lock);
+}
+
+/*
+ * Called by the device that created fs once glfs_init has run, so the
+ * devices that picked up fs from the cache in the meantime can go on.
+ */
+static void gluster_cache_init_done(glfs_t *fs, const char *cfgstring,
+				    bool ok)
+{
+	struct gluster_cacheconn *conn;
+
+	pthread_mutex_lock(&glfs_lock);
+	conn = gluster_cache_lookup(fs);
+	if (conn) {
+		conn->initing = false;
+		conn->failed = !ok;
+	}
+	pthread_cond_broadcast(&glfs_init_cond);
+	if (!ok)
+		__gluster_cache_refresh(fs, cfgstring);
+	pthread_mutex_unlock(&glfs_lock);
+}
+
 static int gluster_cache_query_or_add(struct tcmu_device *dev,
                                       glfs_t **fs, gluster_server *entry,
                                       char *config, bool *init)
 {
+	struct gluster_cacheconn *conn;
+	unsigned int index;
 	int ret = -1;
 
 	pthread_cleanup_push(gluster_thread_cleanup, &glfs_lock);
 	pthread_mutex_lock(&glfs_lock);
 
-	*fs = gluster_cache_query(entry, config);
+retry:
+	*fs = gluster_cache_query(entry, config, &index);
 	if (*fs) {
+		conn = gluster_cache_lookup(*fs);
+		if (conn->initing) {
+			pthread_cond_wait(&glfs_init_cond, &glfs_lock);
+			/* drop our ref on a failed object and make a new one */
+			if (conn->failed)
+				__gluster_cache_refresh(*fs, config);
+			goto retry;
+		}
 		*init = false;
 		ret = 0;
 		goto out;
@@ -292,7 +401,7 @@ static int gluster_cache_query_or_add(struct tcmu_device *dev,
 		goto out;
 	}
 
-	ret = gluster_cache_add(entry, *fs, config);
+	ret = gluster_cache_add(entry, *fs, config, index);
 	if (ret) {
 		tcmu_dev_err(dev, "gluster_cache_add(vol=%s, config=%s) failed: %m\n",
 		             entry->volname, config);
@@ -322,15 +431,68 @@ static void gluster_free_server(gluster_server **hosts)
 	*hosts = NULL;
 }
 
+static int parse_uint_opt(const char *val, unsigned int max,
+			  unsigned int *res)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(val, &end, 10);
+	if (errno || end == val || *end || v > max)
+		return -1;
+
+	*res = v;
+	return 0;
+}
+
 /*
- * Break image string into server, volume, and path components.
+ * Parse the ;key=val options following the file path.
+ * Returns -1 on failure.
+ */
+static int parse_options(char *opts, gluster_server *entry)
+{
+	char *opt, *next;
+
+	for (opt = opts; opt; opt = next) {
+		next = strchr(opt, ';');
+		if (next)
+			*next++ = '\0';
+
+		if (!strlen(opt))
+			continue;
+
+		if (!strncmp(opt, "conns=", 6)) {
+			if (parse_uint_opt(opt + 6, TCMU_GLFS_MAX_CONNS,
+					   &entry->conns) || !entry->conns)
+				goto fail;
+		} else if (!strncmp(opt, "event_threads=", 14)) {
+			if (parse_uint_opt(opt + 14, 32, &entry->event_threads))
+				goto fail;
+		} else if (!strncmp(opt, "io_threads=", 11)) {
+			if (parse_uint_opt(opt + 11, 64, &entry->io_threads))
+				goto fail;
+		} else {
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	tcmu_err("invalid glfs option %s\n", opt);
+	return -1;
+}
+
+/*
+ * Break image string into server, volume, path and option components.
  * Returns -1 on failure.
  */
 static int parse_imagepath(char *cfgstring, gluster_server **hosts)
 {
 	gluster_server *entry = NULL;
 	char *origp = strdup(cfgstring);
-	char *p, *sep;
+	char *p, *sep, *opts;
 
 	if (!origp)
 		goto fail;
@@ -368,8 +530,16 @@ static int parse_imagepath(char *cfgstring, gluster_server **hosts)
 		goto fail;
 	entry->server->u.inet.port = strdup(GLUSTER_PORT); /* FIXME: Get port dynamically */
 
-	/* The rest is the path name */
+	/* The rest is the path name, followed by the options */
 	p = sep + 1;
+	opts = strchr(p, ';');
+	if (opts)
+		*opts++ = '\0';
+
+	entry->conns = 1;
+	if (opts && parse_options(opts, entry))
+		goto fail;
+
 	entry->path = strdup(p);
 	if (!entry->path)
 		goto fail;
@@ -445,22 +615,111 @@ static glfs_t* tcmu_create_glfs_object(struct tcmu_device *dev,
 		goto unref;
 	}
 
+	/*
+	 * Both are protocol/client and io-threads xlator options, so they
+	 * only apply to the glfs object being created. Devices that share
+	 * it later get whatever the first one asked for.
+	 */
+	if (entry->event_threads) {
+		char val[16];
+
+		snprintf(val, sizeof(val), "%u", entry->event_threads);
+		ret = glfs_set_xlator_option(fs, "*-client-*", "event-threads",
+					     val);
+		if (ret) {
+			tcmu_dev_err(dev, "glfs_set_xlator_option(vol=%s, event-threads=%s) failed: %m\n",
+				     entry->volname, val);
+			goto unref;
+		}
+	}
+
+	if (entry->io_threads) {
+		char val[16];
+
+		snprintf(val, sizeof(val), "%u", entry->io_threads);
+		ret = glfs_set_xlator_option(fs, "*-io-threads", "thread-count",
+					     val);
+		if (ret) {
+			tcmu_dev_err(dev, "glfs_set_xlator_option(vol=%s, thread-count=%s) failed: %m\n",
+				     entry->volname, val);
+			goto unref;
+		}
+	}
+
 	ret = glfs_init(fs);
 	if (ret) {
 		tcmu_dev_err(dev, "glfs_init(vol=%s) failed: %m\n", entry->volname);
 		goto unref;
 	}
 
+	gluster_cache_init_done(fs, config, true);
 	return fs;
 
 unref:
-	gluster_cache_refresh(fs, config);
+	gluster_cache_init_done(fs, config, false);
 
 fail:
 	gluster_free_server(hosts);
 	return NULL;
 }
 
+static glfs_cbk_cookie *glfs_cookie_get(struct tcmu_device *dev,
+					struct tcmulib_cmd *cmd,
+					size_t length, int op)
+{
+	struct glfs_state *state = tcmu_get_dev_private(dev);
+	glfs_cbk_cookie *cookie;
+
+	pthread_mutex_lock(&state->cookie_lock);
+	cookie = state->free_cookies;
+	if (cookie) {
+		state->free_cookies = cookie->next;
+		state->nr_free_cookies--;
+	}
+	pthread_mutex_unlock(&state->cookie_lock);
+
+	if (!cookie) {
+		cookie = malloc(sizeof(*cookie));
+		if (!cookie) {
+			tcmu_dev_err(dev, "Could not allocate cookie: %m\n");
+			return NULL;
+		}
+	}
+
+	cookie->dev = dev;
+	cookie->cmd = cmd;
+	cookie->length = length;
+	cookie->op = op;
+	cookie->next = NULL;
+	return cookie;
+}
+
+static void glfs_cookie_put(struct glfs_state *state, glfs_cbk_cookie *cookie)
+{
+	pthread_mutex_lock(&state->cookie_lock);
+	if (state->nr_free_cookies < TCMU_GLFS_MAX_FREE_COOKIES) {
+		cookie->next = state->free_cookies;
+		state->free_cookies = cookie;
+		state->nr_free_cookies++;
+		cookie = NULL;
+	}
+	pthread_mutex_unlock(&state->cookie_lock);
+
+	free(cookie);
+}
+
+static void glfs_cookie_pool_destroy(struct glfs_state *state)
+{
+	glfs_cbk_cookie *cookie;
+
+	while ((cookie = state->free_cookies)) {
+		state->free_cookies = cookie->next;
+		free(cookie);
+	}
+	state->nr_free_cookies = 0;
+	pthread_mutex_destroy(&state->cookie_lock);
+}
+
 static char* tcmu_get_path( struct tcmu_device *dev)
 {
 	char *config;
@@ -487,6 +746,7 @@ static int tcmu_glfs_open(struct tcmu_device *dev, bool reopen)
 	gfsp = calloc(1, sizeof(*gfsp));
 	if (!gfsp)
 		return -ENOMEM;
+	pthread_mutex_init(&gfsp->cookie_lock, NULL);
 
 	tcmu_set_dev_private(dev, gfsp);
 	tcmu_set_dev_write_cache_enabled(dev, 1);
@@ -552,6 +812,7 @@ unref:
 	gluster_cache_refresh(gfsp->fs, tcmu_get_path(dev));
 	gluster_free_server(&gfsp->hosts);
 fail:
+	glfs_cookie_pool_destroy(gfsp);
 	free(gfsp);
 
 	return ret;
@@ -564,6 +825,7 @@ static void tcmu_glfs_close(struct tcmu_device *dev)
 	glfs_close(gfsp->gfd);
 	gluster_cache_refresh(gfsp->fs, tcmu_get_path(dev));
 	gluster_free_server(&gfsp->hosts);
+	glfs_cookie_pool_destroy(gfsp);
 	free(gfsp);
 }
 
@@ -583,6 +845,7 @@ static void glfs_async_cbk(glfs_fd_t *fd, ssize_t ret, void *data)
 		case TCMU_GLFS_WRITE:
 		case TCMU_GLFS_FLUSH:
 		case TCMU_GLFS_DISCARD:
+		case TCMU_GLFS_WRITESAME:
 			ret = TCMU_STS_WR_ERR;
 			break;
 		}
@@ -590,8 +853,9 @@ static void glfs_async_cbk(glfs_fd_t *fd, ssize_t ret, void *data)
 		ret = TCMU_STS_OK;
 	}
 
+	/* recycle before done, the device may be closed right after */
+	glfs_cookie_put(tcmu_get_dev_private(dev), cookie);
 	cmd->done(dev, cmd, ret);
-	free(cookie);
 }
 
 static int tcmu_glfs_read(struct tcmu_device *dev,
@@ -602,27 +866,21 @@ static int tcmu_glfs_read(struct tcmu_device *dev,
 	struct glfs_state *state = tcmu_get_dev_private(dev);
 	glfs_cbk_cookie *cookie;
 
-	cookie = calloc(1, sizeof(*cookie));
-	if (!cookie) {
-		tcmu_dev_err(dev, "Could not allocate cookie: %m\n");
-		goto out;
-	}
-	cookie->dev = dev;
-	cookie->cmd = cmd;
-	cookie->length = length;
-	cookie->op = TCMU_GLFS_READ;
+	cookie = glfs_cookie_get(dev, cmd, length, TCMU_GLFS_READ);
+	if (!cookie)
+		return TCMU_STS_NO_RESOURCE;
 
 	if (glfs_preadv_async(state->gfd, iov, iov_cnt, offset, SEEK_SET,
 	                      glfs_async_cbk, cookie) < 0) {
-		tcmu_dev_err(dev, "glfs_preadv_async(vol=%s, file=%s) failed: %m\n",
-		             state->hosts->volname, state->hosts->path);
+		tcmu_dev_err_ratelimited(dev, "glfs_preadv_async(vol=%s, file=%s) failed: %m\n",
+					 state->hosts->volname, state->hosts->path);
 		goto out;
 	}
 
 	return TCMU_STS_OK;
 
 out:
-	free(cookie);
+	glfs_cookie_put(state, cookie);
 	return TCMU_STS_NO_RESOURCE;
 }
 
@@ -634,27 +892,21 @@ static int tcmu_glfs_write(struct tcmu_device *dev,
 	struct glfs_state *state = tcmu_get_dev_private(dev);
 	glfs_cbk_cookie *cookie;
 
-	cookie = calloc(1, sizeof(*cookie));
-	if (!cookie) {
-		tcmu_dev_err(dev, "Could not allocate cookie: %m\n");
-		goto out;
-	}
-	cookie->dev = dev;
-	cookie->cmd = cmd;
-	cookie->length = length;
-	cookie->op = TCMU_GLFS_WRITE;
+	cookie = glfs_cookie_get(dev, cmd, length, TCMU_GLFS_WRITE);
+	if (!cookie)
+		return TCMU_STS_NO_RESOURCE;
 
 	if (glfs_pwritev_async(state->gfd, iov, iov_cnt, offset,
 	                       ALLOWED_BSOFLAGS, glfs_async_cbk, cookie) < 0) {
-		tcmu_dev_err(dev, "glfs_pwritev_async(vol=%s, file=%s) failed: %m\n",
-		             state->hosts->volname, state->hosts->path);
+		tcmu_dev_err_ratelimited(dev, "glfs_pwritev_async(vol=%s, file=%s) failed: %m\n",
+					 state->hosts->volname, state->hosts->path);
 		goto out;
 	}
 
 	return TCMU_STS_OK;
 
 out:
-	free(cookie);
+	glfs_cookie_put(state, cookie);
 	return TCMU_STS_NO_RESOURCE;
 }
 
@@ -694,26 +946,20 @@ static int tcmu_glfs_flush(struct tcmu_device *dev,
 	struct glfs_state *state = tcmu_get_dev_private(dev);
 	glfs_cbk_cookie *cookie;
 
-	cookie = calloc(1, sizeof(*cookie));
-	if (!cookie) {
-		tcmu_dev_err(dev, "Could not allocate cookie: %m\n");
-		goto out;
-	}
-	cookie->dev = dev;
-	cookie->cmd = cmd;
-	cookie->length = 0;
-	cookie->op = TCMU_GLFS_FLUSH;
+	cookie = glfs_cookie_get(dev, cmd, 0, TCMU_GLFS_FLUSH);
+	if (!cookie)
+		return TCMU_STS_NO_RESOURCE;
 
 	if (glfs_fdatasync_async(state->gfd, glfs_async_cbk, cookie) < 0) {
-		tcmu_dev_err(dev, "glfs_fdatasync_async(vol=%s, file=%s) failed: %m\n",
-		             state->hosts->volname, state->hosts->path);
+		tcmu_dev_err_ratelimited(dev, "glfs_fdatasync_async(vol=%s, file=%s) failed: %m\n",
+					 state->hosts->volname, state->hosts->path);
 		goto out;
 	}
 
 	return TCMU_STS_OK;
 
 out:
-	free(cookie);
+	glfs_cookie_put(state, cookie);
 	return TCMU_STS_NO_RESOURCE;
 }
 
@@ -724,30 +970,105 @@ static int tcmu_glfs_discard(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	glfs_cbk_cookie *cookie;
 	ssize_t ret;
 
-	cookie = calloc(1, sizeof(*cookie));
-	if (!cookie) {
-		tcmu_dev_err(dev, "Could not allocate cookie: %m\n");
+	cookie = glfs_cookie_get(dev, cmd, 0, TCMU_GLFS_DISCARD);
+	if (!cookie)
+		return TCMU_STS_NO_RESOURCE;
+
+	ret = glfs_discard_async(state->gfd, offset, length, glfs_async_cbk, cookie);
+	if (ret < 0) {
+		tcmu_dev_err_ratelimited(dev, "glfs_discard_async(vol=%s, file=%s) failed: %m\n",
+					 state->hosts->volname, state->hosts->path);
 		goto out;
 	}
-	cookie->dev = dev;
-	cookie->cmd = cmd;
-	cookie->length = 0;
-	cookie->op = TCMU_GLFS_DISCARD;
 
-	ret = glfs_discard_async(state->gfd, offset, length, glfs_async_cbk, cookie);
+	return TCMU_STS_OK;
+
+out:
+	glfs_cookie_put(state, cookie);
+	return TCMU_STS_NO_RESOURCE;
+}
+
+/* Zeros are filled in by the bricks, other patterns are left to runner */
+static int tcmu_glfs_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+                               uint64_t offset, uint64_t length,
+                               struct iovec *iov, size_t iov_cnt)
+{
+	struct glfs_state *state = tcmu_get_dev_private(dev);
+	glfs_cbk_cookie *cookie;
+	ssize_t ret;
+
+	if (!tcmu_iovec_zeroed(iov, iov_cnt))
+		return TCMU_STS_NOT_HANDLED;
+
+	cookie = glfs_cookie_get(dev, cmd, 0, TCMU_GLFS_WRITESAME);
+	if (!cookie)
+		return TCMU_STS_NO_RESOURCE;
+
+	ret = glfs_zerofill_async(state->gfd, offset, length, glfs_async_cbk,
+	                          cookie);
 	if (ret < 0) {
-		tcmu_dev_err(dev, "glfs_discard_async(vol=%s, file=%s) failed: %m\n",
-		             state->hosts->volname, state->hosts->path);
+		tcmu_dev_err_ratelimited(dev, "glfs_zerofill_async(vol=%s, file=%s) failed: %m\n",
+					 state->hosts->volname, state->hosts->path);
 		goto out;
 	}
 
 	return TCMU_STS_OK;
 
 out:
-	free(cookie);
+	glfs_cookie_put(state, cookie);
 	return TCMU_STS_NO_RESOURCE;
 }
 
+/*
+ * Same as the file handler, holes are found with SEEK_DATA and
+ * SEEK_HOLE. Volumes that do not support them report the rest of the
+ * range as mapped. glfs_lseek is synchronous, the runner calls this
+ * from a thread of its own.
+ */
+static int tcmu_glfs_get_lba_status(struct tcmu_device *dev,
+                                    struct tcmulib_cmd *cmd, uint64_t off,
+                                    uint64_t len,
+                                    struct tcmur_lba_status *status,
+                                    size_t *nr_status)
+{
+	struct glfs_state *state = tcmu_get_dev_private(dev);
+	uint64_t end = off + len;
+	off_t next;
+	size_t i;
+
+	for (i = 0; i < *nr_status && off < end; i++) {
+		next = glfs_lseek(state->gfd, off, SEEK_DATA);
+		if (next < 0 && errno == ENXIO)
+			next = end;
+		if (next < 0)
+			goto mapped;
+
+		status[i].mapped = next == off;
+		if (status[i].mapped) {
+			next = glfs_lseek(state->gfd, off, SEEK_HOLE);
+			if (next < 0)
+				goto mapped;
+		}
+
+		status[i].off = off;
+		status[i].len = min((uint64_t)next, end) - off;
+		off += status[i].len;
+	}
+	goto done;
+
+mapped:
+	tcmu_dev_dbg(dev, "glfs_lseek(vol=%s, file=%s) can not find holes: %m\n",
+	             state->hosts->volname, state->hosts->path);
+	status[i].off = off;
+	status[i].len = end - off;
+	status[i].mapped = true;
+	i++;
+done:
+	*nr_status = i;
+	cmd->done(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
 /*
  * For backstore creation
  *
@@ -762,11 +1083,15 @@ out:
  */
 static const char glfs_cfg_desc[] =
 	"glfs config string is of the form:\n"
-	"\"$volume@$hostname/$filepath\"\n"
+	"\"$volume@$hostname/$filepath[;conns=N][;event_threads=N][;io_threads=N]\"\n"
 	"where:\n"
 	"  volume:    The volume on the Gluster server\n"
 	"  hostname:  The server's hostname\n"
-	"  filepath:  The path of the backing file";
+	"  filepath:  The path of the backing file\n"
+	"  conns:     Spread the volume's devices over up to N (<= 16)\n"
+	"             gluster connections, default 1\n"
+	"  event_threads: Client event threads per connection (<= 32)\n"
+	"  io_threads: Client io-threads thread count per connection (<= 64)";
 
 struct tcmur_handler glfs_handler = {
 	.name           = "Gluster glfs handler",
@@ -780,6 +1105,8 @@ struct tcmur_handler glfs_handler = {
 	.reconfig       = tcmu_glfs_reconfig,
 	.flush          = tcmu_glfs_flush,
 	.unmap          = tcmu_glfs_discard,
+	.writesame      = tcmu_glfs_writesame,
+	.get_lba_status = tcmu_glfs_get_lba_status,
 };
 
 /* Entry point must be named "handler_init". */
@@ -792,8 +1119,15 @@ int handler_init(void)
 		return -1;
 	}
 
+	ret = pthread_cond_init(&glfs_init_cond, NULL);
+	if (ret != 0) {
+		pthread_mutex_destroy(&glfs_lock);
+		return -1;
+	}
+
 	ret = tcmur_register_handler(&glfs_handler);
 	if (ret != 0) {
+		pthread_cond_destroy(&glfs_init_cond);
 		pthread_mutex_destroy(&glfs_lock);
 	}
 
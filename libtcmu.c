@@ -31,9 +31,37 @@
 #include "tcmur_cmd_handler.h"
 #include "tcmu-runner.h"
 #include "tcmur_device.h"
+#include "libtcmu_trace.h"
+
+TCMU_TRACE_SEMAPHORE(cmd_dequeue);
+TCMU_TRACE_SEMAPHORE(cmd_complete);
 
 #define TCMU_NL_VERSION 2
 
+/* Used when the device attributes cannot be read */
+#define TCMU_CMD_POOL_DEF_DEPTH		128
+#define TCMU_CMD_POOL_DEF_IOV_CNT	16
+
+#define TCMU_CMD_POOL_MAX_DEPTH		1024
+#define TCMU_CMD_POOL_MAX_IOV_CNT	64
+/* Large enough for all but variable length CDBs */
+#define TCMU_CMD_POOL_CDB_LEN		32
+
+/* Devices opened at the same time, see tcmulib_set_open_threads */
+static unsigned int tcmulib_open_threads = 1;
+/* Daemon private bytes with each cmd, see tcmulib_set_cmd_private_size */
+static size_t tcmulib_cmd_private_size;
+
+struct tcmulib_open_work {
+	struct list_node entry;
+	char dev_name[32];
+	char *cfgstring;
+	bool reopen;
+	/* if set, reply_cmd is sent for dev_id when the open is done */
+	int reply_cmd;
+	uint32_t dev_id;
+};
+
 static struct nla_policy tcmu_attr_policy[TCMU_ATTR_MAX+1] = {
 	[TCMU_ATTR_DEVICE]	= { .type = NLA_STRING },
 	[TCMU_ATTR_MINOR]	= { .type = NLA_U32 },
@@ -49,6 +77,10 @@ static int add_device(struct tcmulib_context *ctx, char *dev_name,
 		      char *cfgstring, bool reopen);
 static void remove_device(struct tcmulib_context *ctx, char *dev_name,
 			  char *cfgstring, bool should_block);
+static int queue_open(struct tcmulib_context *ctx, char *dev_name,
+		      char *cfgstring, bool reopen, int reply_cmd,
+		      uint32_t dev_id);
+static void flush_opens(struct tcmulib_context *ctx);
 static int handle_netlink(struct nl_cache_ops *unused, struct genl_cmd *cmd,
 			  struct genl_info *info, void *arg);
 
@@ -108,7 +140,9 @@ static int send_netlink_reply(struct tcmulib_context *ctx, int reply_cmd,
 		goto free_msg;
 
 	/* Ignore ack. There is nothing we can do. */
+	pthread_mutex_lock(&ctx->nl_lock);
 	ret = nl_send_auto(sock, msg);
+	pthread_mutex_unlock(&ctx->nl_lock);
 free_msg:
 	nlmsg_free(msg);
 
@@ -148,13 +182,17 @@ static int reconfig_device(struct tcmulib_context *ctx, char *dev_name,
 
 	memset(&cfg, 0, sizeof(cfg));
 
+	pthread_mutex_lock(&ctx->devices_lock);
 	dev = lookup_dev_by_name(ctx, dev_name, &i);
+	pthread_mutex_unlock(&ctx->devices_lock);
 	if (!dev) {
 		tcmu_err("Could not reconfigure device %s: not found.\n",
 			 dev_name);
 		return -ENODEV;
 	}
 
+	tcmu_cfgfs_invalidate(dev);
+
 	if (!dev->handler->reconfig) {
 		tcmu_dev_err(dev, "Reconfiguration is not supported with this device.\n");
 		return -EOPNOTSUPP;
@@ -212,12 +250,24 @@ static int handle_netlink(struct nl_cache_ops *unused, struct genl_cmd *cmd,
 	switch (cmd->c_id) {
 	case TCMU_CMD_ADDED_DEVICE:
 		reply_cmd = TCMU_CMD_ADDED_DEVICE_DONE;
+		if (ctx->nr_open_workers) {
+			/* the open worker sends the reply */
+			ret = queue_open(ctx, buf,
+				nla_get_string(info->attrs[TCMU_ATTR_DEVICE]),
+				false, version > 1 ? reply_cmd : 0,
+				version > 1 ?
+				nla_get_u32(info->attrs[TCMU_ATTR_DEVICE_ID]) : 0);
+			if (!ret)
+				return 0;
+		}
 		ret = add_device(ctx, buf,
 				 nla_get_string(info->attrs[TCMU_ATTR_DEVICE]),
 				 false);
 		break;
 	case TCMU_CMD_REMOVED_DEVICE:
 		reply_cmd = TCMU_CMD_REMOVED_DEVICE_DONE;
+		/* the device may still be getting opened */
+		flush_opens(ctx);
 		remove_device(ctx, buf,
 			      nla_get_string(info->attrs[TCMU_ATTR_DEVICE]),
 			      false);
@@ -225,6 +275,7 @@ static int handle_netlink(struct nl_cache_ops *unused, struct genl_cmd *cmd,
 		break;
 	case TCMU_CMD_RECONFIG_DEVICE:
 		reply_cmd = TCMU_CMD_RECONFIG_DEVICE_DONE;
+		flush_opens(ctx);
 		ret = reconfig_device(ctx, buf, info);
 		break;
 	default:
@@ -418,6 +469,178 @@ void tcmu_unblock_device(struct tcmu_device *dev)
 	tcmu_dev_dbg(dev, "unblock done\n");
 }
 
+static void cleanup_cmd_pool(struct tcmu_device *dev)
+{
+	struct tcmulib_cmd_pool *pool = &dev->cmd_pool;
+
+	if (!pool->slots)
+		return;
+
+	if (pool->nr_free != pool->depth)
+		tcmu_dev_warn(dev, "%u pooled cmds still in use\n",
+			      pool->depth - pool->nr_free);
+
+	pthread_spin_destroy(&pool->lock);
+	free(pool->free_slots);
+	free(pool->slots);
+	memset(pool, 0, sizeof(*pool));
+}
+
+/* The daemon's part of a cmd goes after its cdb */
+static size_t cmd_private_off(uint32_t iov_cnt, int cdb_len)
+{
+	return round_up(sizeof(struct tcmulib_cmd_priv) +
+			sizeof(struct iovec) * iov_cnt + cdb_len,
+			sizeof(uint64_t));
+}
+
+int tcmulib_setup_cmd_pool(struct tcmu_device *dev, uint32_t depth,
+			   uint32_t max_iov_cnt)
+{
+	struct tcmulib_cmd_pool *pool = &dev->cmd_pool;
+	uint32_t *free_slots;
+	size_t slot_size;
+	void *slots;
+	uint32_t i;
+	int ret;
+
+	if (!depth)
+		return -EINVAL;
+
+	/* Keep each cmd on its own cacheline(s) */
+	slot_size = round_up(cmd_private_off(max_iov_cnt, TCMU_CMD_POOL_CDB_LEN) +
+			     tcmulib_cmd_private_size, (size_t)ALIGN_SIZE);
+
+	ret = posix_memalign(&slots, ALIGN_SIZE, slot_size * depth);
+	if (ret)
+		return -ret;
+
+	free_slots = malloc(sizeof(*free_slots) * depth);
+	if (!free_slots) {
+		free(slots);
+		return -ENOMEM;
+	}
+
+	cleanup_cmd_pool(dev);
+
+	ret = pthread_spin_init(&pool->lock, 0);
+	if (ret) {
+		free(free_slots);
+		free(slots);
+		return -ret;
+	}
+
+	/* Hand out the lowest slots first */
+	for (i = 0; i < depth; i++)
+		free_slots[i] = depth - i - 1;
+
+	pool->slots = slots;
+	pool->slot_size = slot_size;
+	pool->depth = depth;
+	pool->max_iov_cnt = max_iov_cnt;
+	pool->free_slots = free_slots;
+	pool->nr_free = depth;
+
+	tcmu_dev_dbg(dev, "cmd pool depth %u max iov cnt %u slot size %zu\n",
+		     depth, max_iov_cnt, slot_size);
+	return 0;
+}
+
+/*
+ * Size the pool from the queue depth LIO will send us and the iovec count
+ * of a max sized command, which in the worst case is one iovec per data
+ * area page. Free slots are reused LIFO, so only the slots needed for the
+ * running queue depth end up getting touched.
+ */
+static void setup_default_cmd_pool(struct tcmu_device *dev)
+{
+	int depth, block_size, max_sectors, iov_cnt, ret;
+
+	depth = tcmu_get_attribute(dev, "hw_queue_depth");
+	if (depth <= 0)
+		depth = TCMU_CMD_POOL_DEF_DEPTH;
+	else if (depth > TCMU_CMD_POOL_MAX_DEPTH)
+		depth = TCMU_CMD_POOL_MAX_DEPTH;
+
+	block_size = tcmu_get_attribute(dev, "hw_block_size");
+	max_sectors = tcmu_get_attribute(dev, "hw_max_sectors");
+	if (block_size <= 0 || max_sectors <= 0) {
+		iov_cnt = TCMU_CMD_POOL_DEF_IOV_CNT;
+	} else {
+		iov_cnt = (int64_t)max_sectors * block_size / getpagesize() + 1;
+		if (iov_cnt > TCMU_CMD_POOL_MAX_IOV_CNT)
+			iov_cnt = TCMU_CMD_POOL_MAX_IOV_CNT;
+	}
+
+	ret = tcmulib_setup_cmd_pool(dev, depth, iov_cnt);
+	if (ret)
+		tcmu_dev_warn(dev, "Could not setup cmd pool %d. Using malloc.\n",
+			      ret);
+}
+
+static bool cmd_is_pooled(struct tcmulib_cmd_pool *pool,
+			  struct tcmulib_cmd *cmd)
+{
+	void *p = cmd;
+
+	return pool->slots && p >= pool->slots &&
+	       p < pool->slots + pool->slot_size * pool->depth;
+}
+
+static struct tcmulib_cmd *tcmulib_cmd_alloc(struct tcmu_device *dev,
+					     uint32_t iov_cnt, int cdb_len)
+{
+	struct tcmulib_cmd_pool *pool = &dev->cmd_pool;
+	struct tcmulib_cmd_priv *priv = NULL;
+	size_t private_off;
+	uint32_t slot;
+
+	if (pool->slots && iov_cnt <= pool->max_iov_cnt &&
+	    cdb_len <= TCMU_CMD_POOL_CDB_LEN) {
+		pthread_spin_lock(&pool->lock);
+		if (pool->nr_free) {
+			slot = pool->free_slots[--pool->nr_free];
+			priv = pool->slots + slot * pool->slot_size;
+		}
+		pthread_spin_unlock(&pool->lock);
+	}
+
+	if (priv) {
+		private_off = cmd_private_off(pool->max_iov_cnt,
+					      TCMU_CMD_POOL_CDB_LEN);
+	} else {
+		/* Oversized command or pool exhausted */
+		private_off = cmd_private_off(iov_cnt, cdb_len);
+		priv = malloc(private_off + tcmulib_cmd_private_size);
+		if (!priv)
+			return NULL;
+	}
+
+	priv->cmd.d_private = NULL;
+	if (tcmulib_cmd_private_size) {
+		priv->cmd.d_private = (void *)priv + private_off;
+		memset(priv->cmd.d_private, 0, tcmulib_cmd_private_size);
+	}
+	return &priv->cmd;
+}
+
+static void tcmulib_cmd_free(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmulib_cmd_pool *pool = &dev->cmd_pool;
+	uint32_t slot;
+
+	if (!cmd_is_pooled(pool, cmd)) {
+		free(container_of(cmd, struct tcmulib_cmd_priv, cmd));
+		return;
+	}
+
+	slot = ((void *)cmd - pool->slots) / pool->slot_size;
+
+	pthread_spin_lock(&pool->lock);
+	pool->free_slots[pool->nr_free++] = slot;
+	pthread_spin_unlock(&pool->lock);
+}
+
 static int add_device(struct tcmulib_context *ctx, char *dev_name,
 		      char *cfgstring, bool reopen)
 {
@@ -435,6 +658,7 @@ static int add_device(struct tcmulib_context *ctx, char *dev_name,
 		tcmu_err("calloc failed in add_device\n");
 		return -ENOMEM;
 	}
+	pthread_mutex_init(&dev->cfgfs_lock, NULL);
 
 	snprintf(dev->dev_name, sizeof(dev->dev_name), "%s", dev_name);
 
@@ -553,19 +777,26 @@ static int add_device(struct tcmulib_context *ctx, char *dev_name,
 	dev->cmd_tail = mb->cmd_tail;
 	dev->ctx = ctx;
 
+	/* The handler can resize this in its added callback */
+	setup_default_cmd_pool(dev);
+
 	ret = dev->handler->added(dev);
 	if (ret != 0) {
 		tcmu_err("handler open failed for %s\n", dev->dev_name);
-		goto err_munmap;
+		goto err_cmd_pool;
 	}
 
+	pthread_mutex_lock(&ctx->devices_lock);
 	darray_append(ctx->devices, dev);
+	pthread_mutex_unlock(&ctx->devices_lock);
 
 	if (reopen)
 		tcmu_unblock_device(dev);
 
 	return 0;
 
+err_cmd_pool:
+	cleanup_cmd_pool(dev);
 err_munmap:
 	munmap(dev->map, dev->map_len);
 err_fd_close:
@@ -574,11 +805,141 @@ err_unblock:
 	if (reopen)
 		tcmu_unblock_device(dev);
 err_free:
+	tcmu_log_dev_release(dev);
+	free(dev->cfgfs_wwn);
+	pthread_mutex_destroy(&dev->cfgfs_lock);
 	free(dev);
 
 	return -ENOENT;
 }
 
+static void *open_worker(void *arg)
+{
+	struct tcmulib_context *ctx = arg;
+	struct tcmulib_open_work *work;
+	int ret;
+
+	pthread_mutex_lock(&ctx->open_lock);
+	for (;;) {
+		work = list_pop(&ctx->open_queue, struct tcmulib_open_work,
+				entry);
+		if (!work) {
+			if (ctx->open_stop)
+				break;
+			pthread_cond_wait(&ctx->open_cond, &ctx->open_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&ctx->open_lock);
+
+		ret = add_device(ctx, work->dev_name, work->cfgstring,
+				 work->reopen);
+		if (work->reply_cmd)
+			send_netlink_reply(ctx, work->reply_cmd, work->dev_id,
+					   ret);
+		free(work->cfgstring);
+		free(work);
+
+		pthread_mutex_lock(&ctx->open_lock);
+		if (!ret)
+			ctx->open_good++;
+		if (!--ctx->open_pending)
+			pthread_cond_broadcast(&ctx->open_done_cond);
+	}
+	pthread_mutex_unlock(&ctx->open_lock);
+
+	return NULL;
+}
+
+/*
+ * Hand the device to the open workers. Returns -ENOMEM if it could not
+ * be queued, so the caller can open it inline instead.
+ */
+static int queue_open(struct tcmulib_context *ctx, char *dev_name,
+		      char *cfgstring, bool reopen, int reply_cmd,
+		      uint32_t dev_id)
+{
+	struct tcmulib_open_work *work;
+
+	work = calloc(1, sizeof(*work));
+	if (!work)
+		return -ENOMEM;
+
+	work->cfgstring = strdup(cfgstring);
+	if (!work->cfgstring) {
+		free(work);
+		return -ENOMEM;
+	}
+	snprintf(work->dev_name, sizeof(work->dev_name), "%s", dev_name);
+	work->reopen = reopen;
+	work->reply_cmd = reply_cmd;
+	work->dev_id = dev_id;
+
+	pthread_mutex_lock(&ctx->open_lock);
+	list_add_tail(&ctx->open_queue, &work->entry);
+	ctx->open_pending++;
+	pthread_cond_signal(&ctx->open_cond);
+	pthread_mutex_unlock(&ctx->open_lock);
+
+	return 0;
+}
+
+/* Wait for the queued and running opens */
+static void flush_opens(struct tcmulib_context *ctx)
+{
+	if (!ctx->nr_open_workers)
+		return;
+
+	pthread_mutex_lock(&ctx->open_lock);
+	while (ctx->open_pending)
+		pthread_cond_wait(&ctx->open_done_cond, &ctx->open_lock);
+	pthread_mutex_unlock(&ctx->open_lock);
+}
+
+/* Finishes the queued opens, then stops the workers */
+static void stop_open_workers(struct tcmulib_context *ctx)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&ctx->open_lock);
+	ctx->open_stop = true;
+	pthread_cond_broadcast(&ctx->open_cond);
+	pthread_mutex_unlock(&ctx->open_lock);
+
+	for (i = 0; i < ctx->nr_open_workers; i++)
+		pthread_join(ctx->open_workers[i], NULL);
+	free(ctx->open_workers);
+	ctx->open_workers = NULL;
+	ctx->nr_open_workers = 0;
+}
+
+static int setup_open_workers(struct tcmulib_context *ctx)
+{
+	unsigned int i;
+	int ret;
+
+	if (tcmulib_open_threads <= 1)
+		return 0;
+
+	ctx->open_workers = calloc(tcmulib_open_threads,
+				   sizeof(*ctx->open_workers));
+	if (!ctx->open_workers)
+		return -ENOMEM;
+
+	for (i = 0; i < tcmulib_open_threads; i++) {
+		ret = pthread_create(&ctx->open_workers[i], NULL, open_worker,
+				     ctx);
+		if (ret) {
+			tcmu_err("Could not start device open thread: %d\n",
+				 ret);
+			stop_open_workers(ctx);
+			return -ret;
+		}
+		ctx->nr_open_workers++;
+	}
+
+	return 0;
+}
+
 static void close_devices(struct tcmulib_context *ctx)
 {
 	struct tcmu_device **dev_ptr;
@@ -597,7 +958,9 @@ static void remove_device(struct tcmulib_context *ctx, char *dev_name,
 	struct tcmu_device *dev;
 	int i, ret;
 
+	pthread_mutex_lock(&ctx->devices_lock);
 	dev = lookup_dev_by_name(ctx, dev_name, &i);
+	pthread_mutex_unlock(&ctx->devices_lock);
 	if (!dev) {
 		tcmu_err("Could not remove device %s: not found.\n", dev_name);
 		return;
@@ -613,10 +976,15 @@ static void remove_device(struct tcmulib_context *ctx, char *dev_name,
 		tcmu_flush_device(dev);
 	}
 
+	pthread_mutex_lock(&ctx->devices_lock);
+	lookup_dev_by_name(ctx, dev_name, &i);
 	darray_remove(ctx->devices, i);
+	pthread_mutex_unlock(&ctx->devices_lock);
 
 	dev->handler->removed(dev);
 
+	cleanup_cmd_pool(dev);
+
 	ret = close(dev->fd);
 	if (ret != 0) {
 		tcmu_err("could not close device fd %s: %d\n", dev_name, errno);
@@ -630,6 +998,9 @@ static void remove_device(struct tcmulib_context *ctx, char *dev_name,
 		tcmu_unblock_device(dev);
 
 	tcmu_dev_dbg(dev, "removed from tcmulib.\n");
+	tcmu_log_dev_release(dev);
+	free(dev->cfgfs_wwn);
+	pthread_mutex_destroy(&dev->cfgfs_lock);
 	free(dev);
 }
 
@@ -708,6 +1079,13 @@ static int open_devices(struct tcmulib_context *ctx)
 		if (read_uio_name(dirent_list[i]->d_name, &dev_name))
 			continue;
 
+		if (ctx->nr_open_workers &&
+		    !queue_open(ctx, dirent_list[i]->d_name, dev_name, true,
+				0, 0)) {
+			free(dev_name);
+			continue;
+		}
+
 		if (add_device(ctx, dirent_list[i]->d_name, dev_name, true) < 0) {
 			free (dev_name);
 			continue;
@@ -717,6 +1095,11 @@ static int open_devices(struct tcmulib_context *ctx)
 		num_good_devs++;
 	}
 
+	if (ctx->nr_open_workers) {
+		flush_opens(ctx);
+		num_good_devs += ctx->open_good;
+	}
+
 	for (i = 0; i < num_devs; i++)
 		free(dirent_list[i]);
 	free(dirent_list);
@@ -726,12 +1109,29 @@ static int open_devices(struct tcmulib_context *ctx)
 
 static void release_resources(struct tcmulib_context *ctx)
 {
-	teardown_netlink(ctx->nl_sock);
+	stop_open_workers(ctx);
+	if (ctx->nl_sock)
+		teardown_netlink(ctx->nl_sock);
 	darray_free(ctx->handlers);
 	darray_free(ctx->devices);
+	pthread_cond_destroy(&ctx->open_done_cond);
+	pthread_cond_destroy(&ctx->open_cond);
+	pthread_mutex_destroy(&ctx->open_lock);
+	pthread_mutex_destroy(&ctx->nl_lock);
+	pthread_mutex_destroy(&ctx->devices_lock);
 	free(ctx);
 }
 
+void tcmulib_set_open_threads(unsigned int nr)
+{
+	tcmulib_open_threads = nr;
+}
+
+void tcmulib_set_cmd_private_size(size_t size)
+{
+	tcmulib_cmd_private_size = size;
+}
+
 struct tcmulib_context *tcmulib_initialize(
 	struct tcmulib_handler *handlers,
 	size_t handler_count)
@@ -744,21 +1144,33 @@ struct tcmulib_context *tcmulib_initialize(
 	if (!ctx)
 		return NULL;
 
+	pthread_mutex_init(&ctx->devices_lock, NULL);
+	pthread_mutex_init(&ctx->nl_lock, NULL);
+	pthread_mutex_init(&ctx->open_lock, NULL);
+	pthread_cond_init(&ctx->open_cond, NULL);
+	pthread_cond_init(&ctx->open_done_cond, NULL);
+	list_head_init(&ctx->open_queue);
+	darray_init(ctx->handlers);
+	darray_init(ctx->devices);
+
 	ctx->nl_sock = setup_netlink(ctx);
 	if (!ctx->nl_sock) {
-		free(ctx);
+		release_resources(ctx);
 		return NULL;
 	}
 
-	darray_init(ctx->handlers);
-	darray_init(ctx->devices);
-
 	for (i = 0; i < handler_count; i++) {
 		struct tcmulib_handler handler = handlers[i];
 		handler.ctx = ctx;
 		darray_append(ctx->handlers, handler);
 	}
 
+	ret = setup_open_workers(ctx);
+	if (ret < 0) {
+		release_resources(ctx);
+		return NULL;
+	}
+
 	ret = open_devices(ctx);
 	if (ret < 0) {
 		release_resources(ctx);
@@ -770,6 +1182,7 @@ struct tcmulib_context *tcmulib_initialize(
 
 void tcmulib_close(struct tcmulib_context *ctx)
 {
+	stop_open_workers(ctx);
 	close_devices(ctx);
 	release_resources(ctx);
 }
@@ -868,6 +1281,22 @@ uint32_t tcmu_get_dev_opt_xcopy_rw_len(struct tcmu_device *dev)
 	return dev->opt_xcopy_rw_len;
 }
 
+/**
+ * tcmu_set/get_dev_opt_split_len - set/get device's RW split boundary
+ * @dev: tcmu device
+ * @len: len in block_size sectors large READs and WRITEs split by runner
+ * should be cut at multiples of, 0 if the backend has no preference
+ */
+void tcmu_set_dev_opt_split_len(struct tcmu_device *dev, uint32_t len)
+{
+	dev->opt_split_len = len;
+}
+
+uint32_t tcmu_get_dev_opt_split_len(struct tcmu_device *dev)
+{
+	return dev->opt_split_len;
+}
+
 /**
  * tcmu_set/get_dev_opt_unmap_gran - set/get device's optimal unmap granularity
  * @dev: tcmu device
@@ -946,11 +1375,30 @@ char *tcmu_get_dev_cfgstring(struct tcmu_device *dev)
 	return dev->cfgstring;
 }
 
+char *tcmu_get_dev_name(struct tcmu_device *dev)
+{
+	return dev->tcm_dev_name;
+}
+
 struct tcmulib_handler *tcmu_get_dev_handler(struct tcmu_device *dev)
 {
 	return dev->handler;
 }
 
+/*
+ * The part of the mmapped ring that cmd iovecs point into. It is mapped
+ * for as long as the device is, so handlers can register it with their
+ * io engine when they open the device.
+ */
+void *tcmu_get_dev_data_area(struct tcmu_device *dev, size_t *len)
+{
+	struct tcmu_mailbox *mb = dev->map;
+	size_t off = mb->cmdr_off + mb->cmdr_size;
+
+	*len = dev->map_len - off;
+	return (char *)mb + off;
+}
+
 struct tcmur_handler *tcmu_get_runner_handler(struct tcmu_device *dev)
 {
 	struct tcmulib_handler *handler = tcmu_get_dev_handler(dev);
@@ -958,85 +1406,122 @@ struct tcmur_handler *tcmu_get_runner_handler(struct tcmu_device *dev)
 	return handler->hm_private;
 }
 
-static inline struct tcmu_cmd_entry *
-device_cmd_head(struct tcmu_device *dev)
+bool tcmulib_has_pending_command(struct tcmu_device *dev)
 {
-	struct tcmu_mailbox *mb = dev->map;
+	volatile struct tcmu_mailbox *mb = dev->map;
 
-	return (struct tcmu_cmd_entry *) ((char *) mb + mb->cmdr_off + mb->cmd_head);
+	if (mb->cmd_head == dev->cmd_tail)
+		return false;
+
+	/* Order the head read before the entry reads done by the caller */
+	__sync_synchronize();
+	return true;
 }
 
-static inline struct tcmu_cmd_entry *
-device_cmd_tail(struct tcmu_device *dev)
+/*
+ * Build a tcmulib_cmd for the TCMU_OP_CMD entry ent. Returns NULL and
+ * sets *skip for entries that are dropped, or NULL without *skip if the
+ * cmd could not be allocated and the entry must be retried later.
+ */
+static struct tcmulib_cmd *tcmulib_ent_to_cmd(struct tcmu_device *dev,
+					      struct tcmu_cmd_entry *ent,
+					      bool *skip)
 {
 	struct tcmu_mailbox *mb = dev->map;
+	struct tcmulib_cmd *cmd;
+	uint8_t *cdb = (uint8_t *) mb + ent->req.cdb_off;
+	int cdb_len = tcmu_get_cdb_length(cdb);
+	int i;
 
-	return (struct tcmu_cmd_entry *) ((char *) mb + mb->cmdr_off + dev->cmd_tail);
-}
+	*skip = false;
+	if (cdb_len < 0) {
+		/*
+		 * This should never happen so just drop cmd
+		 * for now instead of adding a lock in the
+		 * main IO path.
+		 */
+		*skip = true;
+		return NULL;
+	}
 
-/* update the tcmu_device's tail */
-#define TCMU_UPDATE_DEV_TAIL(dev, mb, ent) \
-do { \
-	dev->cmd_tail = (dev->cmd_tail + tcmu_hdr_get_len((ent)->hdr.len_op)) % mb->cmdr_size; \
-} while (0)
+	/* Get memory for cmd itself, iovec and cdb */
+	cmd = tcmulib_cmd_alloc(dev, ent->req.iov_cnt, cdb_len);
+	if (!cmd)
+		return NULL;
+	cmd->cmd_id = ent->hdr.cmd_id;
+	cmd->cmdstate = NULL;
+	cmd->done = NULL;
+
+	/* Convert iovec addrs in-place to not be offsets */
+	cmd->iov_cnt = ent->req.iov_cnt;
+	cmd->iovec = (struct iovec *) (cmd + 1);
+	for (i = 0; i < ent->req.iov_cnt; i++) {
+		cmd->iovec[i].iov_base = (void *) mb +
+			(size_t) ent->req.iov[i].iov_base;
+		cmd->iovec[i].iov_len = ent->req.iov[i].iov_len;
+	}
 
-struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev)
+	/* Copy cdb that currently points to the command ring */
+	cmd->cdb = (uint8_t *) (cmd->iovec + cmd->iov_cnt);
+	memcpy(cmd->cdb, cdb, cdb_len);
+
+	TCMU_TRACE_CMD(cmd_dequeue, dev->tcm_dev_name, cmd);
+	return cmd;
+}
+
+int tcmulib_get_next_commands(struct tcmu_device *dev,
+			      struct tcmulib_cmd **cmds, int max)
 {
 	struct tcmu_mailbox *mb = dev->map;
+	void *cmdr = (void *) mb + mb->cmdr_off;
 	struct tcmu_cmd_entry *ent;
-
-	while ((ent = device_cmd_tail(dev)) != device_cmd_head(dev)) {
+	struct tcmulib_cmd *cmd;
+	uint32_t head, tail = dev->cmd_tail, next;
+	bool skip;
+	int n = 0;
+
+	/* The kernel fills entries before it moves the head past them */
+	head = *(volatile uint32_t *) &mb->cmd_head;
+	__sync_synchronize();
+
+	while (n < max && tail != head) {
+		ent = cmdr + tail;
+		next = (tail + tcmu_hdr_get_len(ent->hdr.len_op)) %
+			mb->cmdr_size;
+		if (next != head)
+			__builtin_prefetch(cmdr + next);
 
 		switch (tcmu_hdr_get_op(ent->hdr.len_op)) {
 		case TCMU_OP_PAD:
 			/* do nothing */
 			break;
-		case TCMU_OP_CMD: {
-			int i;
-			struct tcmulib_cmd *cmd;
-			uint8_t *cdb = (uint8_t *) mb + ent->req.cdb_off;
-			int cdb_len = tcmu_get_cdb_length(cdb);
-
-			if (cdb_len < 0) {
-				/*
-				 * This should never happen so just drop cmd
-				 * for now instead of adding a lock in the
-				 * main IO path.
-				 */
-				break;
-			}
-
-			/* Alloc memory for cmd itself, iovec and cdb */
-			cmd = malloc(sizeof(*cmd) + sizeof(*cmd->iovec) * ent->req.iov_cnt + cdb_len);
-			if (!cmd)
-				return NULL;
-			cmd->cmd_id = ent->hdr.cmd_id;
-
-			/* Convert iovec addrs in-place to not be offsets */
-			cmd->iov_cnt = ent->req.iov_cnt;
-			cmd->iovec = (struct iovec *) (cmd + 1);
-			for (i = 0; i < ent->req.iov_cnt; i++) {
-				cmd->iovec[i].iov_base = (void *) mb +
-					(size_t) ent->req.iov[i].iov_base;
-				cmd->iovec[i].iov_len = ent->req.iov[i].iov_len;
-			}
-
-			/* Copy cdb that currently points to the command ring */
-			cmd->cdb = (uint8_t *) (cmd->iovec + cmd->iov_cnt);
-			memcpy(cmd->cdb, (void *) mb + ent->req.cdb_off, cdb_len);
-
-			TCMU_UPDATE_DEV_TAIL(dev, mb, ent);
-			return cmd;
-		}
+		case TCMU_OP_CMD:
+			cmd = tcmulib_ent_to_cmd(dev, ent, &skip);
+			if (!cmd && !skip)
+				goto out;
+			if (cmd)
+				cmds[n++] = cmd;
+			break;
 		default:
 			/* We don't even know how to handle this TCMU opcode. */
 			ent->hdr.uflags |= TCMU_UFLAG_UNKNOWN_OP;
 		}
 
-		TCMU_UPDATE_DEV_TAIL(dev, mb, ent);
+		tail = next;
 	}
 
-	return NULL;
+out:
+	dev->cmd_tail = tail;
+	return n;
+}
+
+struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev)
+{
+	struct tcmulib_cmd *cmd;
+
+	if (!tcmulib_get_next_commands(dev, &cmd, 1))
+		return NULL;
+	return cmd;
 }
 
 static int tcmu_sts_to_scsi(int tcmu_sts, uint8_t *sense)
@@ -1157,26 +1642,29 @@ static int tcmu_sts_to_scsi(int tcmu_sts, uint8_t *sense)
 	return SAM_STAT_CHECK_CONDITION;
 }
 
-/* update the ring buffer's tail */
-#define TCMU_UPDATE_RB_TAIL(mb, ent) \
-do { \
-	mb->cmd_tail = (mb->cmd_tail + tcmu_hdr_get_len((ent)->hdr.len_op)) % mb->cmdr_size; \
-} while (0)
-
-void tcmulib_command_complete(
-	struct tcmu_device *dev,
-	struct tcmulib_cmd *cmd,
-	int result)
+/*
+ * Write the completion into the first cmd entry at or after tail and
+ * return the tail past it. mb->cmd_tail is left to the caller, so the
+ * kernel sees a batch of completions at once.
+ */
+static uint32_t __tcmulib_command_complete(struct tcmu_device *dev,
+					   uint32_t tail,
+					   struct tcmulib_cmd *cmd,
+					   int result)
 {
 	struct tcmu_mailbox *mb = dev->map;
-	struct tcmu_cmd_entry *ent = (void *) mb + mb->cmdr_off + mb->cmd_tail;
+	void *cmdr = (void *) mb + mb->cmdr_off;
+	struct tcmu_cmd_entry *ent = cmdr + tail;
+
+	TCMU_TRACE_CMD_RESULT(cmd_complete, dev->tcm_dev_name, cmd, result);
 
 	/* current command could be PAD in async case */
-	while (ent != (void *) mb + mb->cmdr_off + mb->cmd_head) {
+	while (tail != mb->cmd_head) {
 		if (tcmu_hdr_get_op(ent->hdr.len_op) == TCMU_OP_CMD)
 			break;
-		TCMU_UPDATE_RB_TAIL(mb, ent);
-		ent = (void *) mb + mb->cmdr_off + mb->cmd_tail;
+		tail = (tail + tcmu_hdr_get_len(ent->hdr.len_op)) %
+			mb->cmdr_size;
+		ent = cmdr + tail;
 	}
 
 	/* cmd_id could be different in async case */
@@ -1190,8 +1678,106 @@ void tcmulib_command_complete(
 		       TCMU_SENSE_BUFFERSIZE);
 	}
 
-	TCMU_UPDATE_RB_TAIL(mb, ent);
-	free(cmd);
+	tail = (tail + tcmu_hdr_get_len(ent->hdr.len_op)) % mb->cmdr_size;
+	tcmulib_cmd_free(dev, cmd);
+	return tail;
+}
+
+/* Publish the completions written up to tail */
+static void tcmulib_update_ring_tail(struct tcmu_device *dev, uint32_t tail)
+{
+	struct tcmu_mailbox *mb = dev->map;
+
+	__sync_synchronize();
+	mb->cmd_tail = tail;
+}
+
+void tcmulib_command_complete(
+	struct tcmu_device *dev,
+	struct tcmulib_cmd *cmd,
+	int result)
+{
+	struct tcmu_mailbox *mb = dev->map;
+
+	tcmulib_update_ring_tail(dev, __tcmulib_command_complete(dev,
+						mb->cmd_tail, cmd, result));
+}
+
+void tcmulib_command_complete_batch(struct tcmu_device *dev,
+				    struct tcmulib_cmd **cmds, int *results,
+				    int count)
+{
+	struct tcmu_mailbox *mb = dev->map;
+	uint32_t tail = mb->cmd_tail;
+	int i;
+
+	if (!count)
+		return;
+
+	for (i = 0; i < count; i++)
+		tail = __tcmulib_command_complete(dev, tail, cmds[i],
+						  results[i]);
+	tcmulib_update_ring_tail(dev, tail);
+}
+
+bool tcmulib_queue_command_complete(struct tcmu_device *dev,
+				    struct tcmulib_cmd *cmd, int result)
+{
+	struct tcmulib_cmd_priv *priv;
+	struct tcmulib_cmd_priv *head;
+
+	priv = container_of(cmd, struct tcmulib_cmd_priv, cmd);
+	priv->cmpl_result = result;
+
+	head = __atomic_load_n(&dev->cmpl_list, __ATOMIC_RELAXED);
+	do {
+		priv->cmpl_next = head;
+	} while (!__atomic_compare_exchange_n(&dev->cmpl_list, &head, priv,
+					      true, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	return !head;
+}
+
+bool tcmulib_has_queued_completions(struct tcmu_device *dev)
+{
+	return __atomic_load_n(&dev->cmpl_list, __ATOMIC_RELAXED) != NULL;
+}
+
+int tcmulib_reap_completions(struct tcmu_device *dev)
+{
+	struct tcmu_mailbox *mb = dev->map;
+	struct tcmulib_cmd_priv *list, *prev = NULL, *next;
+	uint32_t tail;
+	int count = 0;
+
+	/*
+	 * Only the ring thread takes entries off, and it always takes the
+	 * whole list, so the pushers' compare and swap cannot hit ABA.
+	 */
+	list = __atomic_exchange_n(&dev->cmpl_list, NULL, __ATOMIC_ACQUIRE);
+
+	/* Complete them in the order they were queued */
+	while (list) {
+		next = list->cmpl_next;
+		list->cmpl_next = prev;
+		prev = list;
+		list = next;
+	}
+
+	if (!prev)
+		return 0;
+
+	tail = mb->cmd_tail;
+	while (prev) {
+		next = prev->cmpl_next;
+		tail = __tcmulib_command_complete(dev, tail, &prev->cmd,
+						  prev->cmpl_result);
+		prev = next;
+		count++;
+	}
+	tcmulib_update_ring_tail(dev, tail);
+
+	return count;
 }
 
 void tcmulib_processing_start(struct tcmu_device *dev)
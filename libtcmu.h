@@ -82,6 +82,21 @@ struct tcmulib_handler {
 /* Opaque (private) type */
 struct tcmulib_context;
 
+/*
+ * Open up to nr devices at the same time, both in tcmulib_initialize
+ * and for netlink add events. Call before tcmulib_initialize. With the
+ * default of 1 the handlers' added callbacks run in the caller of
+ * tcmulib_initialize or tcmulib_master_fd_ready, else they run in
+ * libtcmu's open threads and must be thread safe.
+ */
+void tcmulib_set_open_threads(unsigned int nr);
+
+/*
+ * Hand out size bytes of zeroed daemon private memory with every cmd,
+ * as cmd->d_private. Call before tcmulib_initialize.
+ */
+void tcmulib_set_cmd_private_size(size_t size);
+
 /* Claim subtypes you wish to handle. Returns libtcmu's master fd or -error.*/
 struct tcmulib_context *tcmulib_initialize(
 	struct tcmulib_handler *handlers,
@@ -107,6 +122,21 @@ int tcmulib_master_fd_ready(struct tcmulib_context *ctx);
  */
 struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev);
 
+/*
+ * Batched tcmulib_get_next_command(). Fills cmds with up to max
+ * commands queued when it was called and returns how many it got.
+ * Repeat until it returns less than max.
+ */
+int tcmulib_get_next_commands(struct tcmu_device *dev,
+			      struct tcmulib_cmd **cmds, int max);
+
+/*
+ * Returns true if the kernel has queued commands that have not been
+ * retrieved by tcmulib_get_next_command() yet. It only looks at the
+ * mailbox, so it is cheap enough to busy poll the ring with.
+ */
+bool tcmulib_has_pending_command(struct tcmu_device *dev);
+
 /*
  * Mark the command as complete.
  * Must be called before get_next_command() is called again.
@@ -115,6 +145,53 @@ struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev);
  */
 void tcmulib_command_complete(struct tcmu_device *dev, struct tcmulib_cmd *cmd, int result);
 
+/*
+ * Complete count commands with results[i] for cmds[i]. The ring tail is
+ * only moved once, after all of them are written.
+ */
+void tcmulib_command_complete_batch(struct tcmu_device *dev,
+				    struct tcmulib_cmd **cmds, int *results,
+				    int count);
+
+/*
+ * Lock-free tcmulib_command_complete() for threads other than the one
+ * processing the ring. The completion is only queued. It is written to
+ * the ring by the next tcmulib_reap_completions() call.
+ *
+ * Returns true if the queue was empty, in which case the caller must make
+ * sure the ring thread is woken up to reap it.
+ */
+bool tcmulib_queue_command_complete(struct tcmu_device *dev,
+				    struct tcmulib_cmd *cmd, int result);
+
+/* Returns true if tcmulib_reap_completions() has work to do */
+bool tcmulib_has_queued_completions(struct tcmu_device *dev);
+
+/*
+ * Write all queued completions to the ring. Must only be called by the
+ * thread processing the ring, and tcmulib_processing_complete() should be
+ * called once afterwards if it returned non zero.
+ *
+ * Returns the number of completions written.
+ */
+int tcmulib_reap_completions(struct tcmu_device *dev);
+
+/*
+ * Size the per device command pool tcmulib_get_next_command() allocates
+ * from. depth is the number of commands that can be outstanding before
+ * falling back to malloc and max_iov_cnt is the largest iovec count a
+ * pooled command can hold.
+ *
+ * This is optional. Before added() is called libtcmu sizes the pool from
+ * the device's hw_queue_depth and hw_max_sectors attributes. Handlers can
+ * override that from their added() callback. It must not be called while
+ * commands are outstanding.
+ *
+ * Returns 0 or -error.
+ */
+int tcmulib_setup_cmd_pool(struct tcmu_device *dev, uint32_t depth,
+			   uint32_t max_iov_cnt);
+
 /* Call when start processing commands (before calling tcmulib_get_next_command()) */
 void tcmulib_processing_start(struct tcmu_device *dev);
 
@@ -119,6 +119,9 @@ struct tcmulib_cmd {
 
 	/* callback to finish/continue command processing */
 	cmd_done_t done;
+
+	/* private ptr for the daemon, see tcmulib_set_cmd_private_size */
+	void *d_private;
 };
 
 /* Set/Get methods for the opaque tcmu_device */
@@ -128,6 +131,7 @@ void *tcmu_get_daemon_dev_private(struct tcmu_device *dev);
 void tcmu_set_daemon_dev_private(struct tcmu_device *dev, void *priv);
 int tcmu_get_dev_fd(struct tcmu_device *dev);
 char *tcmu_get_dev_cfgstring(struct tcmu_device *dev);
+char *tcmu_get_dev_name(struct tcmu_device *dev);
 void tcmu_set_dev_num_lbas(struct tcmu_device *dev, uint64_t num_lbas);
 uint64_t tcmu_get_dev_num_lbas(struct tcmu_device *dev);
 int tcmu_update_num_lbas(struct tcmu_device *dev, uint64_t new_size);
@@ -137,6 +141,8 @@ void tcmu_set_dev_max_xfer_len(struct tcmu_device *dev, uint32_t len);
 uint32_t tcmu_get_dev_max_xfer_len(struct tcmu_device *dev);
 void tcmu_set_dev_opt_xcopy_rw_len(struct tcmu_device *dev, uint32_t len);
 uint32_t tcmu_get_dev_opt_xcopy_rw_len(struct tcmu_device *dev);
+void tcmu_set_dev_opt_split_len(struct tcmu_device *dev, uint32_t len);
+uint32_t tcmu_get_dev_opt_split_len(struct tcmu_device *dev);
 void tcmu_set_dev_max_unmap_len(struct tcmu_device *dev, uint32_t len);
 uint32_t tcmu_get_dev_max_unmap_len(struct tcmu_device *dev);
 void tcmu_set_dev_opt_unmap_gran(struct tcmu_device *dev, uint32_t len,
@@ -149,6 +155,7 @@ bool tcmu_get_dev_write_cache_enabled(struct tcmu_device *dev);
 void tcmu_set_dev_solid_state_media(struct tcmu_device *dev, bool solid_state);
 bool tcmu_get_dev_solid_state_media(struct tcmu_device *dev);
 struct tcmulib_handler *tcmu_get_dev_handler(struct tcmu_device *dev);
+void *tcmu_get_dev_data_area(struct tcmu_device *dev, size_t *len);
 struct tcmur_handler *tcmu_get_runner_handler(struct tcmu_device *dev);
 void tcmu_block_device(struct tcmu_device *dev);
 void tcmu_unblock_device(struct tcmu_device *dev);
@@ -177,9 +184,21 @@ off_t tcmu_compare_with_iovec(void *mem, struct iovec *iovec, size_t size);
 size_t tcmu_seek_in_iovec(struct iovec *iovec, size_t count);
 void tcmu_seek_in_cmd_iovec(struct tcmulib_cmd *cmd, size_t count);
 void tcmu_zero_iovec(struct iovec *iovec, size_t iov_cnt);
+bool tcmu_iovec_zeroed(struct iovec *iovec, size_t iov_cnt);
 size_t tcmu_memcpy_into_iovec(struct iovec *iovec, size_t iov_cnt, void *src, size_t len);
 size_t tcmu_memcpy_from_iovec(void *dest, size_t len, struct iovec *iovec, size_t iov_cnt);
 size_t tcmu_iovec_length(struct iovec *iovec, size_t iov_cnt);
+bool tcmu_iovec_aligned(struct iovec *iovec, size_t iov_cnt, size_t align);
+int tcmu_get_dio_align(struct tcmu_device *dev, int fd, uint32_t block_size,
+		       uint32_t *align);
+ssize_t tcmu_preadv_aligned(int fd, struct iovec *iovec, size_t iov_cnt,
+			    off_t offset, size_t align);
+ssize_t tcmu_pwritev_aligned(int fd, struct iovec *iovec, size_t iov_cnt,
+			     off_t offset, size_t align);
+ssize_t tcmu_pread_aligned(int fd, void *buf, size_t count, off_t offset,
+			   size_t align);
+ssize_t tcmu_pwrite_aligned(int fd, const void *buf, size_t count,
+			    off_t offset, size_t align);
 bool char_to_hex(unsigned char *val, char c);
 
 /* Basic implementations of mandatory SCSI commands */
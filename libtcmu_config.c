@@ -171,6 +171,60 @@ static void tcmu_conf_set_options(struct tcmu_config *cfg)
 	TCMU_PARSE_CFG_STR(cfg, log_dir_path, TCMU_LOG_DIR_DEFAULT);
 	tcmu_resetup_log_file(cfg->log_dir_path);
 
+	/* set cmdproc busy poll budget option */
+	TCMU_PARSE_CFG_INT(cfg, busy_poll_usecs, 0);
+	if (cfg->busy_poll_usecs < 0)
+		cfg->busy_poll_usecs = 0;
+
+	/* set shared cmdproc thread count option */
+	TCMU_PARSE_CFG_INT(cfg, cmdproc_threads, 0);
+
+	/* set parallel device open option */
+	TCMU_PARSE_CFG_INT(cfg, open_threads, 16);
+	if (cfg->open_threads < 1)
+		cfg->open_threads = 1;
+
+	/* set io worker thread count options */
+	TCMU_PARSE_CFG_INT(cfg, io_threads, 0);
+	TCMU_PARSE_CFG_INT(cfg, io_threads_max, 0);
+
+	/* set cmdproc and io worker thread affinity options */
+	TCMU_PARSE_CFG_STR(cfg, affinity, "");
+	TCMU_PARSE_CFG_BOOL(cfg, affinity_mem, false);
+
+	/* set per device read cache options */
+	TCMU_PARSE_CFG_INT(cfg, read_cache_mb, 0);
+	TCMU_PARSE_CFG_INT(cfg, read_ahead_kb, 512);
+
+	/* set per device write-back cache options */
+	TCMU_PARSE_CFG_INT(cfg, write_back_mb, 0);
+	TCMU_PARSE_CFG_INT(cfg, write_back_delay_ms, 50);
+	TCMU_PARSE_CFG_INT(cfg, write_back_max_io_kb, 1024);
+
+	/* set per device zeroed write detection option */
+	TCMU_PARSE_CFG_BOOL(cfg, zero_detect, false);
+
+	/* set per device local flash tier cache options */
+	TCMU_PARSE_CFG_INT(cfg, tier_mb, 1024);
+	TCMU_PARSE_CFG_BOOL(cfg, tier_write_through, false);
+
+	/* set per device failover queueing options */
+	TCMU_PARSE_CFG_INT(cfg, failover_queue_depth, 0);
+	TCMU_PARSE_CFG_INT(cfg, failover_queue_timeout_ms, 10000);
+
+	/* set reopen and lock acquisition pool options */
+	TCMU_PARSE_CFG_INT(cfg, recovery_threads, 8);
+	if (cfg->recovery_threads < 1)
+		cfg->recovery_threads = 1;
+	TCMU_PARSE_CFG_INT(cfg, recovery_backoff_max_ms, 8000);
+
+	/* set per device compound cmd scratch memory options */
+	TCMU_PARSE_CFG_INT(cfg, scratch_cache_mb, 8);
+	TCMU_PARSE_CFG_INT(cfg, scratch_limit_mb, 0);
+
+	/* set per device large READ/WRITE splitting option */
+	TCMU_PARSE_CFG_INT(cfg, split_kb, 0);
+
 	/* add your new config options */
 }
 
@@ -182,6 +236,7 @@ static void tcmu_conf_free_str_keys(struct tcmu_config *cfg)
 	 * TCMU_FREE_CFG_STR_KEY(cfg, 'STR KEY');
 	 */
 	TCMU_FREE_CFG_STR_KEY(cfg, log_dir_path);
+	TCMU_FREE_CFG_STR_KEY(cfg, affinity);
 }
 
 #define TCMU_MAX_CFG_FILE_SIZE (2 * 1024 * 1024)
@@ -20,6 +20,31 @@ struct tcmu_config {
 
 	int log_level;
 	char *log_dir_path;
+
+	int busy_poll_usecs;
+	int cmdproc_threads;
+	int open_threads;
+
+	int io_threads;
+	int io_threads_max;
+
+	char *affinity;
+	bool affinity_mem;
+	int read_cache_mb;
+	int read_ahead_kb;
+	int write_back_mb;
+	int write_back_delay_ms;
+	int write_back_max_io_kb;
+	bool zero_detect;
+	int tier_mb;
+	bool tier_write_through;
+	int failover_queue_depth;
+	int failover_queue_timeout_ms;
+	int recovery_threads;
+	int recovery_backoff_max_ms;
+	int scratch_cache_mb;
+	int scratch_limit_mb;
+	int split_kb;
 };
 
 /*
@@ -16,6 +16,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "libtcmu_log.h"
 #include "libtcmu_config.h"
@@ -23,10 +25,21 @@
 #include "libtcmu_priv.h"
 #include "string_priv.h"
 
-/* tcmu ring buffer for log */
-#define LOG_ENTRY_LEN 256 /* rb[0] is reserved for pri */
-#define LOG_MSG_LEN (LOG_ENTRY_LEN - 1) /* the length of the log message */
-#define LOG_ENTRYS (1024 * 32)
+/*
+ * Every thread that logs gets its own ring, so callers never share
+ * a lock. The log thread drains the rings. When a thread's ring is
+ * full, new messages are dropped and counted, except errors: the last
+ * LOG_RING_ERR_RESERVE entries are kept for them, and when even those
+ * are used an error waits up to LOG_ERR_WAIT_MS for the log thread.
+ */
+#define LOG_MSG_LEN 255 /* the length of the log message */
+#define LOG_RING_ENTRIES 128 /* must be a power of 2 */
+#define LOG_RING_ERR_RESERVE 16
+#define LOG_ERR_WAIT_MS 1000
+
+/* Rate limited messages: at most BURST per INTERVAL per device */
+#define LOG_RATELIMIT_INTERVAL_MS 5000
+#define LOG_RATELIMIT_BURST 10
 
 #define TCMU_LOG_FILENAME_MAX	32
 #define TCMU_LOG_FILENAME	"tcmu-runner.log"
@@ -42,24 +55,48 @@ struct log_output {
 	void *data;
 };
 
+struct log_entry {
+	struct timeval tv;
+	uint8_t pri;
+	char msg[LOG_MSG_LEN];
+};
+
+struct log_ring {
+	struct log_ring *next;
+
+	unsigned int head;	/* only written by the owner thread */
+	unsigned int tail;	/* only written by the log thread */
+	unsigned int dropped;
+	bool dead;		/* the owner thread exited */
+
+	struct log_entry entries[LOG_RING_ENTRIES];
+};
+
 struct log_buf {
 	pthread_cond_t cond;
 	pthread_mutex_t lock;
 
-	bool thread_active;
+	/* the log thread is, or is about to be, waiting on cond */
+	bool sleeping;
+
+	/* new rings are pushed on the head, under rings_lock */
+	struct log_ring *rings;
+	pthread_mutex_t rings_lock;
+	pthread_key_t ring_key;
 
-	unsigned int head;
-	unsigned int tail;
-	char buf[LOG_ENTRYS][LOG_ENTRY_LEN];
 	struct log_output *syslog_out;
 	struct log_output *file_out;
 	pthread_mutex_t file_out_lock;
 	pthread_t thread_id;
 };
 
-static int tcmu_log_level = TCMU_LOG_INFO;
+int tcmu_log_level = TCMU_LOG_INFO;
 static struct log_buf *tcmu_logbuf;
 
+/* devices with suppressed messages, for the log thread to summarize */
+static LIST_HEAD(log_rl_devs);
+static pthread_mutex_t log_rl_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static char *tcmu_log_dir;
 static pthread_mutex_t tcmu_log_dir_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -96,46 +133,8 @@ void tcmu_set_log_level(int level)
 		level = TCMU_CONF_LOG_LEVEL_MIN;
 
 	tcmu_info("log level now is %s\n", log_level_lookup[level]);
-	tcmu_log_level = to_syslog_level(level);
-}
-
-static inline uint8_t rb_get_pri(struct log_buf *logbuf, unsigned int cur)
-{
-	return logbuf->buf[cur][0];
-}
-
-static inline void rb_set_pri(struct log_buf *logbuf, unsigned int cur, uint8_t pri)
-{
-	logbuf->buf[cur][0] = (char)pri;
-}
-
-static inline char *rb_get_msg(struct log_buf *logbuf, unsigned int cur)
-{
-	return logbuf->buf[cur] + 1;
-}
-
-static inline bool rb_is_empty(struct log_buf *logbuf)
-{
-	return logbuf->tail == logbuf->head;
-}
-
-static inline bool rb_is_full(struct log_buf *logbuf)
-{
-	return logbuf->tail == (logbuf->head + 1) % LOG_ENTRYS;
-}
-
-static inline void rb_update_tail(struct log_buf *logbuf)
-{
-	logbuf->tail = (logbuf->tail + 1) % LOG_ENTRYS;
-}
-
-static inline void rb_update_head(struct log_buf *logbuf)
-{
-	/* when the ring buffer is full, the oldest log will be dropped */
-	if (rb_is_full(logbuf))
-		rb_update_tail(logbuf);
-
-	logbuf->head = (logbuf->head + 1) % LOG_ENTRYS;
+	__atomic_store_n(&tcmu_log_level, to_syslog_level(level),
+			 __ATOMIC_RELAXED);
 }
 
 static void log_cleanup_output(struct log_output *output)
@@ -156,9 +155,17 @@ static void tcmu_log_dir_free(void)
 static void log_cleanup(void *arg)
 {
 	struct log_buf *logbuf = arg;
+	struct log_ring *ring, *next;
+
+	pthread_key_delete(logbuf->ring_key);
+	for (ring = logbuf->rings; ring; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
 
 	pthread_cond_destroy(&logbuf->cond);
 	pthread_mutex_destroy(&logbuf->lock);
+	pthread_mutex_destroy(&logbuf->rings_lock);
 	pthread_mutex_destroy(&logbuf->file_out_lock);
 
 	if (logbuf->syslog_out)
@@ -171,49 +178,93 @@ static void log_cleanup(void *arg)
 }
 
 static void log_output(struct log_buf *logbuf, int pri, const char *msg,
-		       struct log_output *output)
+		       const struct timeval *tv, struct log_output *output)
 {
 	char timestamp[TCMU_TIME_STRING_BUFLEN] = {0, };
 
-	if (time_string_now(timestamp) < 0)
+	if (!output)
+		return;
+
+	if (time_string(timestamp, tv) < 0)
 		return;
 
 	output->output_fn(pri, timestamp, msg, output->data);
 }
 
-static void log_queue_msg(struct log_buf *logbuf, int pri, char *buf)
+static void log_ring_release(void *arg)
 {
-	unsigned int head;
-	char *msg;
+	struct log_ring *ring = arg;
 
-	pthread_mutex_lock(&logbuf->lock);
+	/* The log thread frees it once drained */
+	__atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+}
 
-	head = logbuf->head;
-	rb_set_pri(logbuf, head, pri);
-	msg = rb_get_msg(logbuf, head);
-	memcpy(msg, buf, LOG_MSG_LEN);
-	rb_update_head(logbuf);
+static struct log_ring *log_get_ring(struct log_buf *logbuf)
+{
+	struct log_ring *ring;
+
+	ring = pthread_getspecific(logbuf->ring_key);
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
 
-	if (logbuf->thread_active == false)
-		pthread_cond_signal(&logbuf->cond);
+	if (pthread_setspecific(logbuf->ring_key, ring)) {
+		free(ring);
+		return NULL;
+	}
 
+	pthread_mutex_lock(&logbuf->rings_lock);
+	ring->next = logbuf->rings;
+	__atomic_store_n(&logbuf->rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&logbuf->rings_lock);
+
+	return ring;
+}
+
+static void log_wake(struct log_buf *logbuf)
+{
+	/* Pairs with the barrier in log_thread_start() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&logbuf->sleeping, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&logbuf->lock);
+	pthread_cond_signal(&logbuf->cond);
 	pthread_mutex_unlock(&logbuf->lock);
 }
 
-static void cleanup_file_out_lock(void *arg)
+/*
+ * Wait a bit for the log thread to make room in a full ring. Returns
+ * false if the caller is the log thread, or waited for too long.
+ */
+static bool log_wait_for_room(struct log_buf *logbuf, unsigned int *waited_ms)
 {
-	struct log_buf *logbuf = arg;
+	struct timespec ts = { 0, 1000000 };
 
-	pthread_mutex_unlock(&logbuf->file_out_lock);
+	if (pthread_equal(pthread_self(), logbuf->thread_id) ||
+	    *waited_ms >= LOG_ERR_WAIT_MS)
+		return false;
+
+	log_wake(logbuf);
+	nanosleep(&ts, NULL);
+	(*waited_ms)++;
+	return true;
 }
 
 static void
 log_internal(int pri, struct tcmu_device *dev, const char *funcname,
 	     int linenr, const char *fmt, va_list args)
 {
-	char buf[LOG_MSG_LEN];
-	int n;
+	unsigned int size = LOG_RING_ENTRIES, waited_ms = 0;
 	struct tcmur_handler *rhandler;
+	struct log_entry *ent;
+	struct log_ring *ring;
+	unsigned int head;
+	char *buf;
+	int n;
 
 	if (pri > tcmu_log_level)
 		return;
@@ -227,31 +278,171 @@ log_internal(int pri, struct tcmu_device *dev, const char *funcname,
 		return;
 	}
 
+	ring = log_get_ring(tcmu_logbuf);
+	if (!ring)
+		return;
+
+	if (pri > TCMU_LOG_ERROR)
+		size -= LOG_RING_ERR_RESERVE;
+
+	head = ring->head;
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= size) {
+		if (pri > TCMU_LOG_ERROR ||
+		    !log_wait_for_room(tcmu_logbuf, &waited_ms)) {
+			__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	ent = &ring->entries[head & (LOG_RING_ENTRIES - 1)];
+	buf = ent->msg;
+
 	/* Format the log msg */
 	if (dev) {
 		rhandler = tcmu_get_runner_handler(dev);
-		n = sprintf(buf, "%s:%d %s/%s: ", funcname, linenr,
-		            rhandler ? rhandler->subtype: "",
-		            dev ? dev->tcm_dev_name: "");
+		n = snprintf(buf, LOG_MSG_LEN, "%s:%d %s/%s: ", funcname,
+			     linenr, rhandler ? rhandler->subtype: "",
+			     dev ? dev->tcm_dev_name: "");
 	} else {
-		n = sprintf(buf, "%s:%d: ", funcname, linenr);
+		n = snprintf(buf, LOG_MSG_LEN, "%s:%d: ", funcname, linenr);
 	}
+	if (n >= LOG_MSG_LEN)
+		n = LOG_MSG_LEN - 1;
 
 	vsnprintf(buf + n, LOG_MSG_LEN - n, fmt, args);
+	gettimeofday(&ent->tv, NULL);
+	ent->pri = pri;
 
-	/*
-	 * Avoid overflowing the log buf with SCSI CDBs.
-	 */
-	if (pri < TCMU_LOG_DEBUG_SCSI_CMD)
-		log_queue_msg(tcmu_logbuf, pri, buf);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	log_wake(tcmu_logbuf);
+}
+
+static void cleanup_file_out_lock(void *arg)
+{
+	struct log_buf *logbuf = arg;
 
-	pthread_cleanup_push(cleanup_file_out_lock, tcmu_logbuf);
-	pthread_mutex_lock(&tcmu_logbuf->file_out_lock);
+	pthread_mutex_unlock(&logbuf->file_out_lock);
+}
 
-	log_output(tcmu_logbuf, pri, buf, tcmu_logbuf->file_out);
+static uint64_t log_now_ms(void)
+{
+	struct timespec ts;
 
-	pthread_mutex_unlock(&tcmu_logbuf->file_out_lock);
-	pthread_cleanup_pop(0);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+__attribute__ ((format (printf, 5, 6)))
+static void log_message(int pri, struct tcmu_device *dev,
+			const char *funcname, int linenr, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	log_internal(pri, dev, funcname, linenr, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Start a new interval if the current one is over, and log how many
+ * messages were suppressed in it. Returns false if it is not over.
+ */
+static bool log_ratelimit_reset(int pri, struct tcmu_device *dev,
+				const char *funcname, int linenr, uint64_t now)
+{
+	uint64_t begin = __atomic_load_n(&dev->log_rl_begin, __ATOMIC_RELAXED);
+	unsigned int missed;
+
+	if (now - begin < LOG_RATELIMIT_INTERVAL_MS)
+		return false;
+
+	/* if another thread won, it logs the summary */
+	if (__atomic_compare_exchange_n(&dev->log_rl_begin, &begin, now, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&dev->log_rl_printed, 0, __ATOMIC_RELAXED);
+		missed = __atomic_exchange_n(&dev->log_rl_missed, 0,
+					     __ATOMIC_RELAXED);
+		if (missed)
+			log_message(pri, dev, funcname, linenr,
+				    "%u rate limited messages suppressed\n",
+				    missed);
+	}
+	return true;
+}
+
+/* So the summary is logged when the interval ends, see log_flush_ratelimit */
+static void log_ratelimit_queue(struct tcmu_device *dev)
+{
+	if (!tcmu_logbuf)
+		return;
+
+	pthread_mutex_lock(&log_rl_lock);
+	if (!dev->log_rl_queued) {
+		list_add_tail(&log_rl_devs, &dev->log_rl_entry);
+		dev->log_rl_queued = true;
+	}
+	pthread_mutex_unlock(&log_rl_lock);
+	log_wake(tcmu_logbuf);
+}
+
+/*
+ * Let through LOG_RATELIMIT_BURST messages per device every
+ * LOG_RATELIMIT_INTERVAL_MS and count the others.
+ */
+static bool log_ratelimit(int pri, struct tcmu_device *dev,
+			  const char *funcname, int linenr)
+{
+	log_ratelimit_reset(pri, dev, funcname, linenr, log_now_ms());
+
+	if (__atomic_fetch_add(&dev->log_rl_printed, 1, __ATOMIC_RELAXED) <
+	    LOG_RATELIMIT_BURST)
+		return true;
+
+	__atomic_store_n(&dev->log_rl_pri, pri, __ATOMIC_RELAXED);
+	if (!__atomic_fetch_add(&dev->log_rl_missed, 1, __ATOMIC_RELAXED))
+		log_ratelimit_queue(dev);
+	return false;
+}
+
+/*
+ * Called by the log thread. Logs the summaries of the intervals that
+ * are over, and returns the ms until the next one ends or -1.
+ */
+static int log_flush_ratelimit(void)
+{
+	struct tcmu_device *dev, *next;
+	uint64_t now = log_now_ms(), left;
+	int timeout = -1;
+
+	pthread_mutex_lock(&log_rl_lock);
+	list_for_each_safe(&log_rl_devs, dev, next, log_rl_entry) {
+		if (log_ratelimit_reset(__atomic_load_n(&dev->log_rl_pri,
+							__ATOMIC_RELAXED),
+					dev, __func__, __LINE__, now)) {
+			list_del(&dev->log_rl_entry);
+			dev->log_rl_queued = false;
+			continue;
+		}
+
+		left = LOG_RATELIMIT_INTERVAL_MS -
+			(now - __atomic_load_n(&dev->log_rl_begin,
+					       __ATOMIC_RELAXED));
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+	pthread_mutex_unlock(&log_rl_lock);
+
+	return timeout;
+}
+
+/* Called before the device is freed */
+void tcmu_log_dev_release(struct tcmu_device *dev)
+{
+	pthread_mutex_lock(&log_rl_lock);
+	if (dev->log_rl_queued) {
+		list_del(&dev->log_rl_entry);
+		dev->log_rl_queued = false;
+	}
+	pthread_mutex_unlock(&log_rl_lock);
 }
 
 void tcmu_err_message(struct tcmu_device *dev, const char *funcname,
@@ -305,6 +496,20 @@ void tcmu_dbg_scsi_cmd_message(struct tcmu_device *dev, const char *funcname,
 	va_end(args);
 }
 
+void tcmu_ratelimited_message(int pri, struct tcmu_device *dev,
+			      const char *funcname, int linenr,
+			      const char *fmt, ...)
+{
+	va_list args;
+
+	if (dev && !log_ratelimit(pri, dev, funcname, linenr))
+		return;
+
+	va_start(args, fmt);
+	log_internal(pri, dev, funcname, linenr, fmt, args);
+	va_end(args);
+}
+
 static struct log_output *
 create_output(log_output_fn_t output_fn, log_close_fn_t close_fn, void *data,
 	      int pri)
@@ -462,51 +667,160 @@ static int create_file_output(struct log_buf *logbuf, int pri,
 	return 0;
 }
 
-static bool log_dequeue_msg(struct log_buf *logbuf)
+static void log_output_entry(struct log_buf *logbuf, struct log_entry *ent)
 {
-	unsigned int tail;
-	uint8_t pri;
-	char *msg, buf[LOG_MSG_LEN];
+	/*
+	 * This may block due to rsyslog and syslog-ng, etc.
+	 * The log producers keep queueing messages into their
+	 * rings meanwhile, and drop them when their ring is full.
+	 *
+	 * Avoid overflowing syslog with SCSI CDBs.
+	 */
+	if (ent->pri < TCMU_LOG_DEBUG_SCSI_CMD)
+		log_output(logbuf, ent->pri, ent->msg, &ent->tv,
+			   logbuf->syslog_out);
 
-	pthread_mutex_lock(&logbuf->lock);
-	if (rb_is_empty(logbuf)) {
-		logbuf->thread_active = false;
-		pthread_mutex_unlock(&logbuf->lock);
+	pthread_cleanup_push(cleanup_file_out_lock, logbuf);
+	pthread_mutex_lock(&logbuf->file_out_lock);
+
+	log_output(logbuf, ent->pri, ent->msg, &ent->tv, logbuf->file_out);
+
+	pthread_mutex_unlock(&logbuf->file_out_lock);
+	pthread_cleanup_pop(0);
+}
+
+static bool log_drain_ring(struct log_buf *logbuf, struct log_ring *ring)
+{
+	unsigned int tail = ring->tail, head, dropped;
+	struct log_entry ent;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (head == tail)
 		return false;
-	}
 
-	tail = logbuf->tail;
-	pri = rb_get_pri(logbuf, tail);
-	msg = rb_get_msg(logbuf, tail);
-	memcpy(buf, msg, LOG_MSG_LEN);
-	rb_update_tail(logbuf);
-	pthread_mutex_unlock(&logbuf->lock);
+	for (; tail != head; tail++) {
+		ent = ring->entries[tail & (LOG_RING_ENTRIES - 1)];
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+		log_output_entry(logbuf, &ent);
+	}
 
-	/*
-	 * This may block due to rsyslog and syslog-ng, etc.
-	 * And the log productors could still insert their log
-	 * messages into the ring buffer without blocking. But
-	 * the ring buffer may lose some old log rbs if the
-	 * ring buffer is full.
-	 */
-	log_output(logbuf, pri, buf, logbuf->syslog_out);
+	dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		gettimeofday(&ent.tv, NULL);
+		ent.pri = TCMU_LOG_WARN;
+		snprintf(ent.msg, LOG_MSG_LEN,
+			 "%s: %u messages dropped, log ring full\n",
+			 __func__, dropped);
+		log_output_entry(logbuf, &ent);
+	}
 
 	return true;
 }
 
+/* Free the rings of exited threads once they are drained */
+static void log_reap_rings(struct log_buf *logbuf)
+{
+	struct log_ring **prev, *ring;
+
+	pthread_mutex_lock(&logbuf->rings_lock);
+	prev = &logbuf->rings;
+	while ((ring = *prev)) {
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+		    ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			*prev = ring->next;
+			free(ring);
+			continue;
+		}
+		prev = &ring->next;
+	}
+	pthread_mutex_unlock(&logbuf->rings_lock);
+}
+
+/*
+ * Drain all the rings. Rings are only unlinked by this thread, so
+ * the list can be walked without rings_lock.
+ */
+static bool log_drain(struct log_buf *logbuf)
+{
+	struct log_ring *ring;
+	bool drained = false, dead = false;
+
+	ring = __atomic_load_n(&logbuf->rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		if (log_drain_ring(logbuf, ring))
+			drained = true;
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE))
+			dead = true;
+	}
+
+	if (dead)
+		log_reap_rings(logbuf);
+
+	return drained;
+}
+
+static bool log_pending(struct log_buf *logbuf)
+{
+	struct log_ring *ring;
+
+	ring = __atomic_load_n(&logbuf->rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		if (ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+			return true;
+	}
+
+	return false;
+}
+
+static void cleanup_log_lock(void *arg)
+{
+	struct log_buf *logbuf = arg;
+
+	pthread_mutex_unlock(&logbuf->lock);
+}
+
 static void *log_thread_start(void *arg)
 {
+	struct timespec ts;
+	int timeout;
+
 	tcmu_logbuf = arg;
 
 	pthread_cleanup_push(log_cleanup, arg);
 
 	while (1) {
+		while (log_drain(tcmu_logbuf));
+		timeout = log_flush_ratelimit();
+
+		pthread_cleanup_push(cleanup_log_lock, tcmu_logbuf);
 		pthread_mutex_lock(&tcmu_logbuf->lock);
-		pthread_cond_wait(&tcmu_logbuf->cond, &tcmu_logbuf->lock);
-		tcmu_logbuf->thread_active = true;
-		pthread_mutex_unlock(&tcmu_logbuf->lock);
 
-		while (log_dequeue_msg(tcmu_logbuf));
+		__atomic_store_n(&tcmu_logbuf->sleeping, true,
+				 __ATOMIC_RELAXED);
+		/* Pairs with the barrier in log_wake() */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (log_pending(tcmu_logbuf)) {
+			/* e.g. the summaries logged above */
+		} else if (timeout < 0) {
+			pthread_cond_wait(&tcmu_logbuf->cond,
+					  &tcmu_logbuf->lock);
+		} else {
+			/* wake up to log the next summary */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += timeout / 1000;
+			ts.tv_nsec += (long)(timeout % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&tcmu_logbuf->cond,
+					       &tcmu_logbuf->lock, &ts);
+		}
+		__atomic_store_n(&tcmu_logbuf->sleeping, false,
+				 __ATOMIC_RELAXED);
+
+		pthread_mutex_unlock(&tcmu_logbuf->lock);
+		pthread_cleanup_pop(0);
 	}
 
 	pthread_cleanup_pop(1);
@@ -655,11 +969,13 @@ int tcmu_setup_log(char *log_dir)
 	if (!logbuf)
 		goto free_log_dir;
 
-	logbuf->thread_active = false;
-	logbuf->head = 0;
-	logbuf->tail = 0;
+	if (pthread_key_create(&logbuf->ring_key, log_ring_release)) {
+		free(logbuf);
+		goto free_log_dir;
+	}
 	pthread_cond_init(&logbuf->cond, NULL);
 	pthread_mutex_init(&logbuf->lock, NULL);
+	pthread_mutex_init(&logbuf->rings_lock, NULL);
 	pthread_mutex_init(&logbuf->file_out_lock, NULL);
 
 	ret = create_syslog_output(logbuf, TCMU_LOG_INFO, NULL);
@@ -25,6 +25,13 @@
 
 struct tcmu_device;
 
+extern int tcmu_log_level;
+
+/* Checked before the message arguments are evaluated */
+#define tcmu_log_enabled(pri) \
+	__builtin_expect((pri) <= __atomic_load_n(&tcmu_log_level, \
+						  __ATOMIC_RELAXED), 0)
+
 void tcmu_set_log_level(int level);
 unsigned int tcmu_get_log_level(void);
 int tcmu_setup_log(char *log_dir);
@@ -42,17 +49,23 @@ __attribute__ ((format (printf, 4, 5)))
 void tcmu_dbg_message(struct tcmu_device *dev, const char *funcname, int linenr, const char *fmt, ...);
 __attribute__ ((format (printf, 4, 5)))
 void tcmu_dbg_scsi_cmd_message(struct tcmu_device *dev, const char *funcname, int linenr, const char *fmt, ...);
+__attribute__ ((format (printf, 5, 6)))
+void tcmu_ratelimited_message(int pri, struct tcmu_device *dev, const char *funcname, int linenr, const char *fmt, ...);
+
+#define tcmu_dev_err(dev, ...)  do { if (tcmu_log_enabled(TCMU_LOG_ERROR)) tcmu_err_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_dev_warn(dev, ...) do { if (tcmu_log_enabled(TCMU_LOG_WARN)) tcmu_warn_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_dev_info(dev, ...) do { if (tcmu_log_enabled(TCMU_LOG_INFO)) tcmu_info_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_dev_dbg(dev, ...)  do { if (tcmu_log_enabled(TCMU_LOG_DEBUG)) tcmu_dbg_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_dev_dbg_scsi_cmd(dev, ...)  do { if (tcmu_log_enabled(TCMU_LOG_DEBUG_SCSI_CMD)) tcmu_dbg_scsi_cmd_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
 
-#define tcmu_dev_err(dev, ...)  do { tcmu_err_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dev_warn(dev, ...) do { tcmu_warn_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dev_info(dev, ...) do { tcmu_info_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dev_dbg(dev, ...)  do { tcmu_dbg_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dev_dbg_scsi_cmd(dev, ...)  do { tcmu_dbg_scsi_cmd_message(dev, __func__, __LINE__, __VA_ARGS__);} while (0)
+/* For messages that can repeat for every cmd of a device */
+#define tcmu_dev_err_ratelimited(dev, ...)  do { if (tcmu_log_enabled(TCMU_LOG_ERROR)) tcmu_ratelimited_message(TCMU_LOG_ERROR, dev, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_dev_warn_ratelimited(dev, ...) do { if (tcmu_log_enabled(TCMU_LOG_WARN)) tcmu_ratelimited_message(TCMU_LOG_WARN, dev, __func__, __LINE__, __VA_ARGS__);} while (0)
 
 
-#define tcmu_err(...)  do { tcmu_err_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_warn(...) do { tcmu_warn_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_info(...) do { tcmu_info_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dbg(...)  do { tcmu_dbg_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
-#define tcmu_dbg_scsi_cmd(...)  do { tcmu_dbg_scsi_cmd_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_err(...)  do { if (tcmu_log_enabled(TCMU_LOG_ERROR)) tcmu_err_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_warn(...) do { if (tcmu_log_enabled(TCMU_LOG_WARN)) tcmu_warn_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_info(...) do { if (tcmu_log_enabled(TCMU_LOG_INFO)) tcmu_info_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_dbg(...)  do { if (tcmu_log_enabled(TCMU_LOG_DEBUG)) tcmu_dbg_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
+#define tcmu_dbg_scsi_cmd(...)  do { if (tcmu_log_enabled(TCMU_LOG_DEBUG_SCSI_CMD)) tcmu_dbg_scsi_cmd_message(NULL, __func__, __LINE__, __VA_ARGS__);} while (0)
 #endif /* __TCMU_LOG_H */
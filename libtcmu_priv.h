@@ -27,18 +27,74 @@
 
 #define KERN_IFACE_VER 2
 
+/* attrib/ values remembered per device by tcmu_get_attribute */
+#define TCMU_CFGFS_CACHE_ATTRS 8
+
+struct tcmu_cfgfs_attr {
+	char name[32];
+	int val;
+};
+
 // The full (private) declaration
 struct tcmulib_context {
 	darray(struct tcmulib_handler) handlers;
 
 	/* Just keep ptrs b/c we hand these to clients */
 	darray(struct tcmu_device*) devices;
+	/* devices is changed by the open workers */
+	pthread_mutex_t devices_lock;
 
 	struct nl_sock *nl_sock;
+	/* netlink replies are sent by the open workers too */
+	pthread_mutex_t nl_lock;
+
+	/*
+	 * Devices are opened by nr_open_workers threads when there are
+	 * any, else inline. open_lock protects the queue and counters.
+	 */
+	pthread_t *open_workers;
+	unsigned int nr_open_workers;
+	pthread_mutex_t open_lock;
+	pthread_cond_t open_cond;
+	pthread_cond_t open_done_cond;
+	struct list_head open_queue;
+	/* queued or running opens */
+	unsigned int open_pending;
+	unsigned int open_good;
+	bool open_stop;
 
 	GDBusConnection *connection;
 };
 
+/*
+ * Per device cache of tcmulib_cmds handed out by tcmulib_get_next_command.
+ * Slots are carved out of one allocation and recycled through a stack of
+ * free slot indexes, so the ring fast path does not go through malloc.
+ */
+struct tcmulib_cmd_pool {
+	pthread_spinlock_t lock;
+
+	void *slots;
+	size_t slot_size;
+	uint32_t depth;
+	uint32_t max_iov_cnt;
+
+	uint32_t *free_slots;
+	uint32_t nr_free;
+};
+
+/*
+ * libtcmu's private part of every cmd handed out by
+ * tcmulib_get_next_command. The cmd must be last, because its iovecs
+ * and cdb are stored right after it, followed by the daemon's part.
+ */
+struct tcmulib_cmd_priv {
+	struct tcmulib_cmd_priv *cmpl_next;
+	int cmpl_result;
+
+	struct tcmulib_cmd cmd;
+};
+
 struct tcmu_device {
 	int fd;
 
@@ -51,6 +107,7 @@ struct tcmu_device {
 	uint32_t block_size;
 	uint32_t max_xfer_len;
 	uint32_t opt_xcopy_rw_len;
+	uint32_t opt_split_len;
 	bool split_unmaps;
 	uint32_t max_unmap_len;
 	uint32_t opt_unmap_gran;
@@ -66,8 +123,35 @@ struct tcmu_device {
 	struct tcmulib_handler *handler;
 	struct tcmulib_context *ctx;
 
+	struct tcmulib_cmd_pool cmd_pool;
+	/* lock-free LIFO of completions queued for the ring thread */
+	struct tcmulib_cmd_priv *cmpl_list;
+
 	void *d_private; /* private ptr for the daemon */
 	void *hm_private; /* private ptr for handler module */
+
+	/*
+	 * configfs values that only change with a reconfig or our own
+	 * writes. cfgfs_gen is bumped when they are dropped, so a read
+	 * that raced with that is not cached.
+	 */
+	pthread_mutex_t cfgfs_lock;
+	struct tcmu_cfgfs_attr cfgfs_attrs[TCMU_CFGFS_CACHE_ATTRS];
+	unsigned int nr_cfgfs_attrs;
+	char *cfgfs_wwn;
+	unsigned int cfgfs_gen;
+
+	/* tcmu_dev_*_ratelimited() state */
+	uint64_t log_rl_begin;
+	unsigned int log_rl_printed;
+	unsigned int log_rl_missed;
+	int log_rl_pri;
+	/* on the log thread's list while messages are suppressed */
+	struct list_node log_rl_entry;
+	bool log_rl_queued;
 };
 
+void tcmu_cfgfs_invalidate(struct tcmu_device *dev);
+void tcmu_log_dev_release(struct tcmu_device *dev);
+
 #endif
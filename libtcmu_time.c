@@ -6,6 +6,7 @@
  * later), or the Apache License 2.0.
  */
 
+#define _GNU_SOURCE
 #include <sys/time.h>
 #include <time.h>
 #include <stdio.h>
@@ -14,28 +15,32 @@
 
 #include "libtcmu_time.h"
 
-int time_string_now(char* buf)
+int time_string(char *buf, const struct timeval *tv)
 {
-	struct tm *tm;
-	struct timeval tv;
+	struct tm tm;
 
-	if (gettimeofday (&tv, NULL) < 0)
+	if (localtime_r(&tv->tv_sec, &tm) == NULL)
 		return -1;
 
-	/* The value maybe changed in multi-thread*/
-	tm = localtime(&tv.tv_sec);
-	if (tm == NULL)
-		return -1;
-
-	tm->tm_year += 1900;
-	tm->tm_mon += 1;
+	tm.tm_year += 1900;
+	tm.tm_mon += 1;
 
 	if (snprintf(buf, TCMU_TIME_STRING_BUFLEN,
 	    "%4d-%02d-%02d %02d:%02d:%02d.%03d",
-	    tm->tm_year, tm->tm_mon, tm->tm_mday,
-	    tm->tm_hour, tm->tm_min, tm->tm_sec,
-	    (int) (tv.tv_usec / 1000ull % 1000)) >= TCMU_TIME_STRING_BUFLEN)
+	    tm.tm_year, tm.tm_mon, tm.tm_mday,
+	    tm.tm_hour, tm.tm_min, tm.tm_sec,
+	    (int) (tv->tv_usec / 1000ull % 1000)) >= TCMU_TIME_STRING_BUFLEN)
 		return ERANGE;
 
 	return 0;
 }
+
+int time_string_now(char* buf)
+{
+	struct timeval tv;
+
+	if (gettimeofday (&tv, NULL) < 0)
+		return -1;
+
+	return time_string(buf, &tv);
+}
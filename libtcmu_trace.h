@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * USDT probes on the cmd lifecycle, provider "tcmu". Every probe gets
+ * the device's configfs name, cmd_id, opcode, LBA and transfer length,
+ * the done and complete probes also get the TCMU_STS result:
+ *
+ *   cmd_dequeue	taken off the ring by tcmulib_get_next_command
+ *   cmd_dispatch	passed to the runner's cmd handler
+ *   cmd_enqueue	queued to the device's io workers
+ *   cmd_pickup		dequeued by an io worker
+ *   cmd_submit		handed to the handler's callout
+ *   cmd_done		handler completed it
+ *   cmd_complete	response written to the ring
+ *
+ * Each probe has a semaphore, so the arguments are only computed while
+ * a tracer is attached, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/bin/tcmu-runner:tcmu:cmd_done { ... }'
+ */
+
+#ifndef __LIBTCMU_TRACE_H
+#define __LIBTCMU_TRACE_H
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#include <stdint.h>
+#include <endian.h>
+
+/* Unlike tcmu_get_lba(), does not assert on variable length cdbs */
+static inline uint64_t tcmu_trace_cdb_lba(uint8_t *cdb)
+{
+	switch (cdb[0] >> 5) {
+	case 0:
+		return ((cdb[1] & 0x1f) << 16) | (cdb[2] << 8) | cdb[3];
+	case 1:
+	case 2:
+	case 5:
+		return be32toh(*((uint32_t *)&cdb[2]));
+	case 4:
+		return be64toh(*((uint64_t *)&cdb[2]));
+	default:
+		return 0;
+	}
+}
+
+static inline uint32_t tcmu_trace_cdb_len(uint8_t *cdb)
+{
+	switch (cdb[0] >> 5) {
+	case 0:
+		return cdb[4];
+	case 1:
+	case 2:
+		return be16toh(*((uint16_t *)&cdb[7]));
+	case 5:
+		return be32toh(*((uint32_t *)&cdb[6]));
+	case 4:
+		return be32toh(*((uint32_t *)&cdb[10]));
+	default:
+		return 0;
+	}
+}
+
+/* Must be used once, in the file using the probe */
+#define TCMU_TRACE_SEMAPHORE(probe) \
+	static unsigned short tcmu_##probe##_semaphore \
+	__attribute__((section(".probes"), used))
+
+#define TCMU_TRACE_CMD(probe, dev_name, cmd) do {			\
+	if (__builtin_expect(tcmu_##probe##_semaphore, 0))		\
+		DTRACE_PROBE5(tcmu, probe, dev_name, (cmd)->cmd_id,	\
+			      (cmd)->cdb[0],				\
+			      tcmu_trace_cdb_lba((cmd)->cdb),		\
+			      tcmu_trace_cdb_len((cmd)->cdb));		\
+} while (0)
+
+#define TCMU_TRACE_CMD_RESULT(probe, dev_name, cmd, result) do {	\
+	if (__builtin_expect(tcmu_##probe##_semaphore, 0))		\
+		DTRACE_PROBE6(tcmu, probe, dev_name, (cmd)->cmd_id,	\
+			      (cmd)->cdb[0],				\
+			      tcmu_trace_cdb_lba((cmd)->cdb),		\
+			      tcmu_trace_cdb_len((cmd)->cdb), result);	\
+} while (0)
+
+#else
+
+#define TCMU_TRACE_SEMAPHORE(probe)
+#define TCMU_TRACE_CMD(probe, dev_name, cmd) do { } while (0)
+#define TCMU_TRACE_CMD_RESULT(probe, dev_name, cmd, result) do { } while (0)
+
+#endif
+
+#endif
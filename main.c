@@ -32,6 +32,8 @@
 #include <scsi/scsi.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 
 #include <libkmod.h>
 #include <sys/utsname.h>
@@ -55,11 +57,48 @@ static struct tcmu_config *tcmu_cfg;
 
 darray(struct tcmur_handler *) g_runner_handlers = darray_new();
 
+/*
+ * Handlers listed in the manifest in the handler directory are only
+ * registered with a placeholder at startup. Their module is opened and
+ * its handler_init run the first time a device or a check_config needs
+ * them, and the handler it registers is copied over the placeholder, so
+ * the pointer libtcmu and dbus were handed stays valid.
+ */
+#define TCMUR_HANDLER_MANIFEST "handlers.manifest"
+
+struct tcmur_lazy_handler {
+	struct tcmur_handler handler;
+	char *subtype;
+	char *file;
+	bool loaded;
+	bool failed;
+};
+
+static darray(struct tcmur_lazy_handler *) g_lazy_handlers = darray_new();
+/* serializes loads, and protects loaded and failed */
+static pthread_mutex_t lazy_handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Set while the thread loading a placeholder's module runs its
+ * handler_init, so what it registers is not added as a new handler.
+ */
+static __thread struct tcmur_lazy_handler *loading_handler;
+static __thread struct tcmur_handler *loaded_handler;
+
 int tcmur_register_handler(struct tcmur_handler *handler)
 {
 	struct tcmur_handler *h;
 	int i;
 
+	if (loading_handler) {
+		if (strcmp(loading_handler->subtype, handler->subtype)) {
+			tcmu_err("Handler %s registered %s, not the subtype in the manifest\n",
+				 loading_handler->file, handler->subtype);
+			return -1;
+		}
+		loaded_handler = handler;
+		return 0;
+	}
+
 	for (i = 0; i < darray_size(g_runner_handlers); i++) {
 		h = darray_item(g_runner_handlers, i);
 		if (!strcmp(h->subtype, handler->subtype)) {
@@ -121,14 +160,228 @@ static int is_handler(const struct dirent *dirent)
 	return 1;
 }
 
+/* dlopen the handler module at path and run its handler_init */
+static int open_handler(const char *path)
+{
+	int (*handler_init)(void);
+	void *handle;
+	char *error;
+
+	handle = dlopen(path, RTLD_NOW|RTLD_LOCAL);
+	if (!handle) {
+		tcmu_err("Could not open handler at %s: %s\n", path, dlerror());
+		return -1;
+	}
+
+	dlerror();
+	handler_init = dlsym(handle, "handler_init");
+	if ((error = dlerror())) {
+		tcmu_err("dlsym failure on %s: (%s)\n", path, error);
+		return -1;
+	}
+
+	if (handler_init()) {
+		tcmu_err("handler init failed on path %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static struct tcmur_lazy_handler *find_lazy_handler(const char *subtype,
+						    size_t len)
+{
+	struct tcmur_lazy_handler **lh;
+
+	darray_foreach(lh, g_lazy_handlers) {
+		if (!strncmp((*lh)->subtype, subtype, len) &&
+		    !(*lh)->subtype[len])
+			return *lh;
+	}
+	return NULL;
+}
+
+static bool is_lazy_file(const char *file)
+{
+	struct tcmur_lazy_handler **lh;
+
+	darray_foreach(lh, g_lazy_handlers) {
+		if (!strcmp((*lh)->file, file))
+			return true;
+	}
+	return false;
+}
+
+static struct tcmur_lazy_handler *to_lazy_handler(struct tcmur_handler *handler)
+{
+	struct tcmur_lazy_handler **lh;
+
+	darray_foreach(lh, g_lazy_handlers) {
+		if (&(*lh)->handler == handler)
+			return *lh;
+	}
+	return NULL;
+}
+
+/*
+ * Open the module of a handler registered from the manifest if it is
+ * not open yet. Returns 0 if the handler can be used.
+ */
+static int load_lazy_handler(struct tcmur_lazy_handler *lh)
+{
+	char *path;
+	int ret = 0;
+
+	pthread_mutex_lock(&lazy_handlers_lock);
+	if (lh->loaded)
+		goto unlock;
+	ret = -ENOENT;
+	if (lh->failed)
+		goto unlock;
+
+	if (asprintf(&path, "%s/%s", handler_path, lh->file) == -1) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	tcmu_info("Loading handler %s from %s\n", lh->subtype, path);
+	loading_handler = lh;
+	loaded_handler = NULL;
+	if (open_handler(path)) {
+		/* handler_init may have run, so do not run it again */
+		lh->failed = true;
+	} else if (!loaded_handler) {
+		tcmu_err("Handler %s did not register %s\n", path, lh->subtype);
+		lh->failed = true;
+	} else {
+		lh->handler = *loaded_handler;
+		lh->loaded = true;
+		ret = 0;
+	}
+	loading_handler = NULL;
+	free(path);
+unlock:
+	pthread_mutex_unlock(&lazy_handlers_lock);
+	return ret;
+}
+
+static int tcmur_load_handler(struct tcmur_handler *handler)
+{
+	struct tcmur_lazy_handler *lh = to_lazy_handler(handler);
+
+	return lh ? load_lazy_handler(lh) : 0;
+}
+
+/*
+ * check_config of the placeholders, which libtcmu calls with the whole
+ * cfgstring before it adds a device.
+ */
+static bool lazy_check_config(const char *cfgstring, char **reason)
+{
+	struct tcmur_lazy_handler *lh;
+
+	lh = find_lazy_handler(cfgstring, strchrnul(cfgstring, '/') - cfgstring);
+	if (!lh || load_lazy_handler(lh)) {
+		if (asprintf(reason, "Could not load the handler") == -1)
+			*reason = NULL;
+		return false;
+	}
+
+	/* the placeholder now is the handler */
+	if (!lh->handler.check_config)
+		return true;
+	return lh->handler.check_config(cfgstring, reason);
+}
+
+static void add_lazy_handler(const char *subtype, const char *file)
+{
+	struct tcmur_lazy_handler *lh;
+	struct stat st;
+	char *path;
+	int ret;
+
+	if (asprintf(&path, "%s/%s", handler_path, file) == -1) {
+		tcmu_err("ENOMEM\n");
+		return;
+	}
+	ret = stat(path, &st);
+	free(path);
+	if (ret) {
+		tcmu_dbg("Handler %s in the manifest is not installed\n", file);
+		return;
+	}
+
+	if (find_lazy_handler(subtype, strlen(subtype))) {
+		tcmu_err("Handler %s has already been registered\n", subtype);
+		return;
+	}
+
+	lh = calloc(1, sizeof(*lh));
+	if (!lh)
+		goto nomem;
+	lh->subtype = strdup(subtype);
+	lh->file = strdup(file);
+	if (!lh->subtype || !lh->file)
+		goto free_lh;
+
+	lh->handler.name = lh->subtype;
+	lh->handler.subtype = lh->subtype;
+	lh->handler.cfg_desc = "";
+	lh->handler.check_config = lazy_check_config;
+	if (tcmur_register_handler(&lh->handler))
+		goto free_lh;
+
+	darray_append(g_lazy_handlers, lh);
+	tcmu_dbg("Handler %s in %s is loaded on first use\n", subtype, file);
+	return;
+
+free_lh:
+	free(lh->subtype);
+	free(lh->file);
+	free(lh);
+nomem:
+	tcmu_err("Could not register handler %s\n", subtype);
+}
+
+/*
+ * Each manifest line is "<subtype> <file>", naming a handler module in
+ * the handler directory and the subtype it registers.
+ */
+static void read_handler_manifest(void)
+{
+	char subtype[64], file[256];
+	char *path, *line = NULL;
+	size_t n = 0;
+	FILE *fp;
+
+	if (asprintf(&path, "%s/%s", handler_path,
+		     TCMUR_HANDLER_MANIFEST) == -1)
+		return;
+	fp = fopen(path, "r");
+	free(path);
+	if (!fp)
+		return;
+
+	while (getline(&line, &n, fp) != -1) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%63s %255s", subtype, file) != 2)
+			continue;
+		add_lazy_handler(subtype, file);
+	}
+	free(line);
+	fclose(fp);
+}
+
 static int open_handlers(void)
 {
 	struct dirent **dirent_list;
 	int num_handlers;
 	int num_good = 0;
-	char *error;
 	int i;
 
+	read_handler_manifest();
+	num_good = darray_size(g_lazy_handlers);
+
 	num_handlers = scandir(handler_path, &dirent_list, is_handler, alphasort);
 
 	if (num_handlers == -1)
@@ -136,42 +389,21 @@ static int open_handlers(void)
 
 	for (i = 0; i < num_handlers; i++) {
 		char *path;
-		void *handle;
-		int (*handler_init)(void);
 		int ret;
 
+		/* modules not in the manifest are opened right away */
+		if (is_lazy_file(dirent_list[i]->d_name))
+			continue;
+
 		ret = asprintf(&path, "%s/%s", handler_path, dirent_list[i]->d_name);
 		if (ret == -1) {
 			tcmu_err("ENOMEM\n");
 			continue;
 		}
 
-		handle = dlopen(path, RTLD_NOW|RTLD_LOCAL);
-		if (!handle) {
-			tcmu_err("Could not open handler at %s: %s\n", path, dlerror());
-			free(path);
-			continue;
-		}
-
-		dlerror();
-		handler_init = dlsym(handle, "handler_init");
-		if ((error = dlerror())) {
-			tcmu_err("dlsym failure on %s: (%s)\n", path, error);
-			free(path);
-			continue;
-		}
-
-		ret = handler_init();
-		if (ret) {
-			tcmu_err("handler init failed on path %s\n", path);
-			free(path);
-			continue;
-		}
-
-		free(path);
-
-		if (ret == 0)
+		if (!open_handler(path))
 			num_good++;
+		free(path);
 	}
 
 	for (i = 0; i < num_handlers; i++)
@@ -209,6 +441,10 @@ gboolean tcmulib_callback(GIOChannel *source,
 
 static GDBusObjectManagerServer *manager = NULL;
 
+/* devices whose stats are returned by Stats1.GetStats */
+static LIST_HEAD(stats_devs);
+static pthread_mutex_t stats_devs_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static gboolean
 on_check_config(TCMUService1 *interface,
 		GDBusMethodInvocation *invocation,
@@ -219,7 +455,10 @@ on_check_config(TCMUService1 *interface,
 	char *reason = NULL;
 	bool str_ok = true;
 
-	if (handler->check_config)
+	if (tcmur_load_handler(handler)) {
+		str_ok = false;
+		reason = strdup("Could not load the handler");
+	} else if (handler->check_config)
 		str_ok = handler->check_config(cfgstring, &reason);
 
 	if (str_ok)
@@ -433,6 +672,77 @@ void dbus_handler_manager1_init(GDBusConnection *connection)
 		g_error_free(error);
 }
 
+static gboolean
+on_get_stats(TCMUService1Stats1 *interface,
+	     GDBusMethodInvocation *invocation,
+	     gpointer user_data)
+{
+	GVariantBuilder devs, ops, queue_lat, handler_lat;
+	struct tcmur_dev_stats snap;
+	struct tcmur_op_stats *op;
+	struct tcmur_device *rdev;
+	int i, j;
+
+	g_variant_builder_init(&devs, G_VARIANT_TYPE("a(sa(stttatat)tt)"));
+
+	pthread_mutex_lock(&stats_devs_lock);
+	list_for_each(&stats_devs, rdev, stats_entry) {
+		tcmur_stats_read(&rdev->stats, &snap);
+
+		g_variant_builder_init(&ops, G_VARIANT_TYPE("a(stttatat)"));
+		for (i = 0; i < TCMUR_STATS_OP_MAX; i++) {
+			op = &snap.ops[i];
+
+			g_variant_builder_init(&queue_lat, G_VARIANT_TYPE("at"));
+			g_variant_builder_init(&handler_lat, G_VARIANT_TYPE("at"));
+			for (j = 0; j < TCMUR_STATS_NR_BUCKETS; j++) {
+				g_variant_builder_add(&queue_lat, "t",
+						      op->queue_lat[j]);
+				g_variant_builder_add(&handler_lat, "t",
+						      op->handler_lat[j]);
+			}
+
+			g_variant_builder_add(&ops, "(stttatat)",
+					      tcmur_stats_op_names[i],
+					      op->cmds, op->bytes, op->errors,
+					      &queue_lat, &handler_lat);
+		}
+
+		g_variant_builder_add(&devs, "(sa(stttatat)tt)",
+				      tcmu_get_dev_name(rdev->dev), &ops,
+				      snap.busy_poll_hits,
+				      snap.busy_poll_misses);
+	}
+	pthread_mutex_unlock(&stats_devs_lock);
+
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(a(sa(stttatat)tt))", &devs));
+	return TRUE;
+}
+
+static void dbus_stats1_init(GDBusConnection *connection)
+{
+	GError *error = NULL;
+	TCMUService1Stats1 *interface;
+	gboolean ret;
+
+	interface = tcmuservice1_stats1_skeleton_new();
+	ret = g_dbus_interface_skeleton_export(
+			G_DBUS_INTERFACE_SKELETON(interface),
+			connection,
+			"/org/kernel/TCMUService1/Stats1",
+			&error);
+	g_signal_connect(interface,
+			 "handle-get-stats",
+			 G_CALLBACK(on_get_stats),
+			 NULL);
+	if (!ret)
+		tcmu_err("Stats export failed: %s\n",
+			 error ? error->message : "unknown error");
+	if (error)
+		g_error_free(error);
+}
+
 static void dbus_bus_acquired(GDBusConnection *connection,
 			      const gchar *name,
 			      gpointer user_data)
@@ -448,6 +758,7 @@ static void dbus_bus_acquired(GDBusConnection *connection,
 	}
 
 	dbus_handler_manager1_init(connection);
+	dbus_stats1_init(connection);
 	g_dbus_object_manager_server_set_connection(manager, connection);
 }
 
@@ -555,131 +866,117 @@ static int load_our_module(void)
 	return ret;
 }
 
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __sync_synchronize()
+#endif
+
+static int tcmur_busy_poll_usecs(struct tcmur_device *rdev)
+{
+	if (rdev->busy_poll_usecs >= 0)
+		return rdev->busy_poll_usecs;
+	return tcmu_cfg ? tcmu_cfg->busy_poll_usecs : 0;
+}
+
 /*
- * tcmur_stop_device - stop device for removal
- * @arg: tcmu_device to stop
+ * Spin on the ring for up to the device's busy poll budget, so a command
+ * or completion queued right after we drained the ring does not have to
+ * pay for a sleep and wakeup in ppoll.
  *
- * Stop internal tcmur device operations like lock and recovery and close
- * the device. Running IO must be stopped before calling this.
+ * Returns true if new commands or completions were queued while spinning.
  */
-static void tcmur_stop_device(void *arg)
+static bool tcmur_cmdproc_busy_poll(struct tcmu_device *dev)
 {
-	struct tcmu_device *dev = arg;
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
-	bool is_open = false;
-
-	pthread_mutex_lock(&rdev->state_lock);
-	/* check if this was already called due to thread cancelation */
-	if (rdev->flags & TCMUR_DEV_FLAG_STOPPED) {
-		pthread_mutex_unlock(&rdev->state_lock);
-		return;
-	}
-	rdev->flags |= TCMUR_DEV_FLAG_STOPPING;
-	pthread_mutex_unlock(&rdev->state_lock);
+	struct timespec start, now;
+	int64_t budget_ns;
+
+	budget_ns = (int64_t)tcmur_busy_poll_usecs(rdev) * 1000;
+	if (!budget_ns)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (tcmulib_has_pending_command(dev) ||
+		    tcmulib_has_queued_completions(dev)) {
+			tcmur_stats_busy_poll(&rdev->stats, true);
+			return true;
+		}
+		cpu_relax();
 
-	/*
-	 * The lock thread can fire off the recovery thread, so make sure
-	 * it is done first.
-	 */
-	tcmu_cancel_lock_thread(dev);
-	tcmu_cancel_recovery(dev);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000000000LL +
+		 (now.tv_nsec - start.tv_nsec) < budget_ns);
 
-	pthread_mutex_lock(&rdev->state_lock);
-	if (rdev->flags & TCMUR_DEV_FLAG_IS_OPEN) {
-		rdev->flags &= ~TCMUR_DEV_FLAG_IS_OPEN;
-		is_open = true;
-	}
-	pthread_mutex_unlock(&rdev->state_lock);
+	tcmur_stats_busy_poll(&rdev->stats, false);
+	return false;
+}
 
-	if (is_open) {
-		tcmu_release_dev_lock(dev);
-		rhandler->close(dev);
-	}
+/*
+ * LIO will wait for outstanding requests and prevent new ones
+ * from being sent to runner during device removal, but if the
+ * tcmu cmd_time_out has fired tcmu-runner may still be executing
+ * requests that LIO has completed. We only need to wait for replies
+ * for outstanding requests so throttle the cmdproc thread then.
+ */
+static bool tcmur_cmdproc_dev_stopping(struct tcmur_device *rdev)
+{
+	bool dev_stopping;
 
 	pthread_mutex_lock(&rdev->state_lock);
-	rdev->flags |= TCMUR_DEV_FLAG_STOPPED;
+	dev_stopping = !!(rdev->flags & TCMUR_DEV_FLAG_STOPPING);
 	pthread_mutex_unlock(&rdev->state_lock);
 
-	tcmu_dev_dbg(dev, "cmdproc cleanup done\n");
+	return dev_stopping;
 }
 
 static void *tcmur_cmdproc_thread(void *arg)
 {
 	struct tcmu_device *dev = arg;
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
-	struct pollfd pfd;
+	struct pollfd pfd[2];
+	eventfd_t kicks;
 	int ret;
 	bool dev_stopping = false;
 
+	tcmur_dev_set_thread_affinity(dev);
+
 	pthread_cleanup_push(tcmur_stop_device, dev);
 
 	while (1) {
-		int completed = 0;
-		struct tcmulib_cmd *cmd;
-
-		tcmulib_processing_start(dev);
-
-		while (!dev_stopping && (cmd = tcmulib_get_next_command(dev)) != NULL) {
-
-			if (tcmu_get_log_level() == TCMU_LOG_DEBUG_SCSI_CMD)
-				tcmu_print_cdb_info(dev, cmd, NULL);
-
-			if (tcmur_handler_is_passthrough_only(rhandler))
-				ret = tcmur_cmd_passthrough_handler(dev, cmd);
-			else
-				ret = tcmur_generic_handle_cmd(dev, cmd);
-
-			if (ret == TCMU_STS_NOT_HANDLED)
-				tcmu_print_cdb_info(dev, cmd, "is not supported");
-
-			/*
-			 * command (processing) completion is called in the following
-			 * scenarios:
-			 *   - handle_cmd: synchronous handlers
-			 *   - generic_handle_cmd: non tcmur handler calls (see generic_cmd())
-			 *			   and on errors when calling tcmur handler.
-			 */
-			if (ret != TCMU_STS_ASYNC_HANDLED) {
-				completed = 1;
-				tcmur_command_complete(dev, cmd, ret);
+		tcmur_process_ring(dev, dev_stopping);
+
+		if (dev_stopping || !tcmur_cmdproc_busy_poll(dev)) {
+			pfd[0].fd = tcmu_get_dev_fd(dev);
+			pfd[0].events = POLLIN;
+			pfd[0].revents = 0;
+			pfd[1].fd = rdev->cmpl_efd;
+			pfd[1].events = POLLIN;
+			pfd[1].revents = 0;
+
+			/* Use ppoll instead poll to avoid poll call reschedules
+			 * during signal handling. If we were removing a device,
+			 * then the uio device's memory could be freed, but the
+			 * poll would be rescheduled and end up accessing the
+			 * released device. */
+			ret = ppoll(pfd, 2, NULL, NULL);
+			if (ret == -1) {
+				tcmu_err("ppoll() returned %d\n", ret);
+				break;
 			}
-		}
 
-		if (completed)
-			tcmulib_processing_complete(dev);
-
-		pfd.fd = tcmu_get_dev_fd(dev);
-		pfd.events = POLLIN;
-		pfd.revents = 0;
-
-		/* Use ppoll instead poll to avoid poll call reschedules during signal
-		 * handling. If we were removing a device, then the uio device's memory
-		 * could be freed, but the poll would be rescheduled and end up accessing
-		 * the released device. */
-		ret = ppoll(&pfd, 1, NULL, NULL);
-		if (ret == -1) {
-			tcmu_err("ppoll() returned %d\n", ret);
-			break;
-		}
+			if ((pfd[0].revents | pfd[1].revents) & ~POLLIN) {
+				tcmu_err("ppoll received unexpected revent: 0x%x 0x%x\n",
+					 pfd[0].revents, pfd[1].revents);
+				break;
+			}
 
-		if (pfd.revents != POLLIN) {
-			tcmu_err("ppoll received unexpected revent: 0x%x\n", pfd.revents);
-			break;
+			if (pfd[1].revents)
+				eventfd_read(rdev->cmpl_efd, &kicks);
 		}
 
-		/*
-		 * LIO will wait for outstanding requests and prevent new ones
-		 * from being sent to runner during device removal, but if the
-		 * tcmu cmd_time_out has fired tcmu-runner may still be executing
-		 * requests that LIO has completed. We only need to wait for replies
-		 * for outstanding requests so throttle the cmdproc thread now.
-		 */
-		pthread_mutex_lock(&rdev->state_lock);
-		if (rdev->flags & TCMUR_DEV_FLAG_STOPPING)
-			dev_stopping = true;
-		pthread_mutex_unlock(&rdev->state_lock);
+		dev_stopping = tcmur_cmdproc_dev_stopping(rdev);
 	}
 
 	/*
@@ -691,6 +988,276 @@ static void *tcmur_cmdproc_thread(void *arg)
 	return NULL;
 }
 
+/*
+ * Shared cmdproc threads
+ *
+ * When cmdproc_threads is set in tcmu.conf devices do not get their own
+ * cmdproc thread. Instead each device is handed to the pool thread with
+ * the fewest devices, which waits on the UIO and completion fds of all
+ * its devices with epoll. A device stays on the same thread until it is
+ * removed, so there is still only one ring thread per device.
+ */
+#define TCMUR_CMDPROC_MAX_EVENTS	64
+/* Set in the epoll data of a device's completion eventfd */
+#define TCMUR_CMDPROC_CMPL_EVENT	1UL
+
+struct tcmur_cmdproc_worker {
+	pthread_t thread;
+	int epoll_fd;
+	int ctrl_efd; /* wakes the thread up to handle detach requests */
+
+	pthread_mutex_t lock;
+	pthread_cond_t detach_cond;
+	struct list_head detach_list;
+
+	unsigned int nr_devs; /* protected by cmdproc_pool_lock */
+};
+
+static struct tcmur_cmdproc_worker *cmdproc_workers;
+static int nr_cmdproc_workers;
+static pthread_mutex_t cmdproc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void tcmur_cmdproc_worker_detach_devs(struct tcmur_cmdproc_worker *w)
+{
+	struct tcmur_device *rdev, *tmp;
+	eventfd_t kicks;
+
+	pthread_mutex_lock(&w->lock);
+	eventfd_read(w->ctrl_efd, &kicks);
+
+	list_for_each_safe(&w->detach_list, rdev, tmp, cmdproc_entry) {
+		epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, tcmu_get_dev_fd(rdev->dev),
+			  NULL);
+		epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, rdev->cmpl_efd, NULL);
+
+		list_del(&rdev->cmdproc_entry);
+		rdev->cmdproc_worker = NULL;
+	}
+	pthread_cond_broadcast(&w->detach_cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *tcmur_cmdproc_worker_thread(void *arg)
+{
+	struct tcmur_cmdproc_worker *w = arg;
+	struct epoll_event events[TCMUR_CMDPROC_MAX_EVENTS];
+	struct tcmur_device *rdev;
+	struct tcmu_device *dev;
+	eventfd_t kicks;
+	uint64_t data;
+	int i, nr, ret;
+
+	/* shared by many devices, so only tcmu.conf's affinity applies */
+	if (tcmu_cfg && tcmu_cfg->affinity && tcmu_cfg->affinity[0]) {
+		ret = tcmur_set_thread_affinity(tcmu_cfg->affinity,
+						tcmu_cfg->affinity_mem);
+		if (ret)
+			tcmu_warn("Could not set cmdproc thread affinity to %s %d\n",
+				  tcmu_cfg->affinity, ret);
+	}
+
+	while (1) {
+		nr = epoll_wait(w->epoll_fd, events, TCMUR_CMDPROC_MAX_EVENTS,
+				-1);
+		if (nr == -1) {
+			if (errno == EINTR)
+				continue;
+			tcmu_err("epoll_wait() failed %d\n", errno);
+			break;
+		}
+
+		/*
+		 * Devices being removed wait for us to get through the
+		 * batch, so all devs in it are valid.
+		 */
+		for (i = 0; i < nr; i++) {
+			data = events[i].data.u64;
+			if (!data)
+				continue; /* ctrl_efd */
+
+			dev = (void *)(uintptr_t)(data & ~TCMUR_CMDPROC_CMPL_EVENT);
+			rdev = tcmu_get_daemon_dev_private(dev);
+
+			if (events[i].events & ~EPOLLIN)
+				tcmu_dev_err(dev, "epoll received unexpected event: 0x%x\n",
+					     events[i].events);
+
+			if (data & TCMUR_CMDPROC_CMPL_EVENT)
+				eventfd_read(rdev->cmpl_efd, &kicks);
+
+			tcmur_process_ring(dev,
+					   tcmur_cmdproc_dev_stopping(rdev));
+		}
+
+		tcmur_cmdproc_worker_detach_devs(w);
+	}
+
+	return NULL;
+}
+
+static int tcmur_cmdproc_pool_attach(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cmdproc_worker *w;
+	struct epoll_event ev;
+	int i, ret;
+
+	pthread_mutex_lock(&cmdproc_pool_lock);
+	w = &cmdproc_workers[0];
+	for (i = 1; i < nr_cmdproc_workers; i++) {
+		if (cmdproc_workers[i].nr_devs < w->nr_devs)
+			w = &cmdproc_workers[i];
+	}
+	w->nr_devs++;
+	pthread_mutex_unlock(&cmdproc_pool_lock);
+
+	/* The level triggered fds pick up cmds already on the ring */
+	rdev->cmdproc_thread = w->thread;
+	rdev->cmdproc_worker = w;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uintptr_t)dev | TCMUR_CMDPROC_CMPL_EVENT;
+	ret = epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, rdev->cmpl_efd, &ev);
+	if (ret)
+		goto fail;
+
+	ev.data.u64 = (uintptr_t)dev;
+	ret = epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, tcmu_get_dev_fd(dev), &ev);
+	if (ret) {
+		epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, rdev->cmpl_efd, NULL);
+		goto fail;
+	}
+
+	tcmu_dev_dbg(dev, "added to cmdproc thread %ld\n",
+		     (long)(w - cmdproc_workers));
+	return 0;
+
+fail:
+	ret = -errno;
+	rdev->cmdproc_worker = NULL;
+	pthread_mutex_lock(&cmdproc_pool_lock);
+	w->nr_devs--;
+	pthread_mutex_unlock(&cmdproc_pool_lock);
+	return ret;
+}
+
+static void tcmur_cmdproc_pool_detach(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cmdproc_worker *w = rdev->cmdproc_worker;
+
+	pthread_mutex_lock(&w->lock);
+	list_add_tail(&w->detach_list, &rdev->cmdproc_entry);
+	eventfd_write(w->ctrl_efd, 1);
+	while (rdev->cmdproc_worker)
+		pthread_cond_wait(&w->detach_cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_mutex_lock(&cmdproc_pool_lock);
+	w->nr_devs--;
+	pthread_mutex_unlock(&cmdproc_pool_lock);
+}
+
+static void cleanup_cmdproc_worker(struct tcmur_cmdproc_worker *w)
+{
+	pthread_cond_destroy(&w->detach_cond);
+	pthread_mutex_destroy(&w->lock);
+	close(w->ctrl_efd);
+	close(w->epoll_fd);
+}
+
+static int setup_cmdproc_worker(struct tcmur_cmdproc_worker *w)
+{
+	struct epoll_event ev;
+	int ret;
+
+	list_head_init(&w->detach_list);
+
+	w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epoll_fd == -1)
+		return -errno;
+
+	w->ctrl_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->ctrl_efd == -1) {
+		ret = -errno;
+		goto close_epoll_fd;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ret = epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->ctrl_efd, &ev);
+	if (ret) {
+		ret = -errno;
+		goto close_ctrl_efd;
+	}
+
+	ret = pthread_mutex_init(&w->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto close_ctrl_efd;
+	}
+
+	ret = pthread_cond_init(&w->detach_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	ret = pthread_create(&w->thread, NULL, tcmur_cmdproc_worker_thread, w);
+	if (ret) {
+		ret = -ret;
+		goto destroy_cond;
+	}
+
+	return 0;
+
+destroy_cond:
+	pthread_cond_destroy(&w->detach_cond);
+destroy_lock:
+	pthread_mutex_destroy(&w->lock);
+close_ctrl_efd:
+	close(w->ctrl_efd);
+close_epoll_fd:
+	close(w->epoll_fd);
+	return ret;
+}
+
+static void cleanup_cmdproc_pool(void)
+{
+	int i;
+
+	for (i = 0; i < nr_cmdproc_workers; i++) {
+		tcmu_cancel_thread(cmdproc_workers[i].thread);
+		cleanup_cmdproc_worker(&cmdproc_workers[i]);
+	}
+
+	free(cmdproc_workers);
+	cmdproc_workers = NULL;
+	nr_cmdproc_workers = 0;
+}
+
+static int setup_cmdproc_pool(int nr_threads)
+{
+	int ret;
+
+	cmdproc_workers = calloc(nr_threads, sizeof(*cmdproc_workers));
+	if (!cmdproc_workers)
+		return -ENOMEM;
+
+	for (nr_cmdproc_workers = 0; nr_cmdproc_workers < nr_threads;
+	     nr_cmdproc_workers++) {
+		ret = setup_cmdproc_worker(&cmdproc_workers[nr_cmdproc_workers]);
+		if (ret) {
+			cleanup_cmdproc_pool();
+			return ret;
+		}
+	}
+
+	tcmu_info("Using %d shared cmdproc threads\n", nr_threads);
+	return 0;
+}
+
 static int dev_resize(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
@@ -711,10 +1278,59 @@ static int dev_resize(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 	return ret;
 }
 
+/*
+ * The runner options are taken out of the new cfgstring, and the handler
+ * is only called if the rest of it changed. Of the runner options only
+ * the QoS limits can be changed.
+ */
+static int dev_reconfig_cfgstring(struct tcmu_device *dev,
+				  struct tcmulib_cfg_info *cfg)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_qos_limits limits;
+	char *cfgstring, *orig = cfg->data.dev_cfgstring;
+	int ret;
+
+	cfgstring = strdup(orig);
+	if (!cfgstring)
+		return -ENOMEM;
+
+	ret = tcmur_dev_parse_reconfig_opts(dev, cfgstring, &limits);
+	if (ret)
+		goto free_cfgstring;
+
+	if (strcmp(cfgstring, tcmu_get_dev_cfgstring(dev))) {
+		if (!rhandler->reconfig) {
+			ret = -EOPNOTSUPP;
+			goto free_cfgstring;
+		}
+
+		cfg->data.dev_cfgstring = cfgstring;
+		ret = rhandler->reconfig(dev, cfg);
+		cfg->data.dev_cfgstring = orig;
+		if (ret)
+			goto free_cfgstring;
+	}
+
+	ret = tcmur_qos_set_limits(dev, &limits);
+	if (!ret)
+		rdev->qos_limits = limits;
+
+free_cfgstring:
+	free(cfgstring);
+	return ret;
+}
+
 static int dev_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 
+	tcmu_invalidate_alua_grps(dev);
+
+	if (cfg->type == TCMULIB_CFG_DEV_CFGSTR)
+		return dev_reconfig_cfgstring(dev, cfg);
+
 	if (!rhandler->reconfig)
 		return -EOPNOTSUPP;
 
@@ -735,31 +1351,28 @@ static int dev_added(struct tcmu_device *dev)
 	int64_t dev_size;
 	int ret;
 
-	rdev = calloc(1, sizeof(*rdev));
-	if (!rdev)
-		return -ENOMEM;
-	tcmu_set_daemon_dev_private(dev, rdev);
-	list_node_init(&rdev->recovery_entry);
-	rdev->dev = dev;
+	/* libtcmu's check_config call normally loaded it already */
+	ret = tcmur_load_handler(rhandler);
+	if (ret)
+		return ret;
 
-	ret = -EINVAL;
 	block_size = tcmu_get_attribute(dev, "hw_block_size");
 	if (block_size <= 0) {
 		tcmu_dev_err(dev, "Could not get hw_block_size\n");
-		goto free_rdev;
+		return -EINVAL;
 	}
 	tcmu_set_dev_block_size(dev, block_size);
 
 	dev_size = tcmu_get_dev_size(dev);
 	if (dev_size < 0) {
 		tcmu_dev_err(dev, "Could not get device size\n");
-		goto free_rdev;
+		return -EINVAL;
 	}
 	tcmu_set_dev_num_lbas(dev, dev_size / block_size);
 
 	max_sectors = tcmu_get_attribute(dev, "hw_max_sectors");
 	if (max_sectors < 0)
-		goto free_rdev;
+		return -EINVAL;
 	tcmu_set_dev_max_xfer_len(dev, max_sectors);
 
 	/*
@@ -779,33 +1392,11 @@ static int dev_added(struct tcmu_device *dev)
 	tcmu_dev_dbg(dev, "Got block_size %d, size in bytes %"PRId64"\n",
 		     block_size, dev_size);
 
-	ret = pthread_spin_init(&rdev->lock, 0);
-	if (ret != 0)
-		goto free_rdev;
-
-	ret = pthread_mutex_init(&rdev->caw_lock, NULL);
-	if (ret != 0)
-		goto cleanup_dev_lock;
-
-	ret = pthread_mutex_init(&rdev->format_lock, NULL);
-	if (ret != 0)
-		goto cleanup_caw_lock;
-
-	ret = pthread_mutex_init(&rdev->state_lock, NULL);
-	if (ret != 0)
-		goto cleanup_format_lock;
-
-	ret = setup_io_work_queue(dev);
-	if (ret < 0)
-		goto cleanup_state_lock;
-
-	ret = setup_aio_tracking(rdev);
-	if (ret < 0)
-		goto cleanup_io_work_queue;
-
-	ret = rhandler->open(dev, false);
+	ret = tcmur_dev_setup(dev, tcmu_cfg);
 	if (ret)
-		goto cleanup_aio_tracking;
+		return ret;
+	rdev = tcmu_get_daemon_dev_private(dev);
+
 	/*
 	 * On the initial creation ALUA will probably not yet have been setup,
 	 * but for reopens it will be so we need to sync our failover state.
@@ -814,47 +1405,38 @@ static int dev_added(struct tcmu_device *dev)
 	tcmu_get_alua_grps(dev, &group_list);
 	tcmu_release_alua_grps(&group_list);
 
-	rdev->flags |= TCMUR_DEV_FLAG_IS_OPEN;
-
-	ret = pthread_cond_init(&rdev->lock_cond, NULL);
-	if (ret < 0)
-		goto close_dev;
+	if (nr_cmdproc_workers)
+		ret = tcmur_cmdproc_pool_attach(dev);
+	else
+		ret = pthread_create(&rdev->cmdproc_thread, NULL,
+				     tcmur_cmdproc_thread, dev);
+	if (ret)
+		goto cleanup_dev;
 
-	ret = pthread_create(&rdev->cmdproc_thread, NULL, tcmur_cmdproc_thread,
-			     dev);
-	if (ret < 0)
-		goto cleanup_lock_cond;
+	pthread_mutex_lock(&stats_devs_lock);
+	list_add_tail(&stats_devs, &rdev->stats_entry);
+	pthread_mutex_unlock(&stats_devs_lock);
 
 	return 0;
 
-cleanup_lock_cond:
-	pthread_cond_destroy(&rdev->lock_cond);
-close_dev:
-	rhandler->close(dev);
-cleanup_aio_tracking:
-	cleanup_aio_tracking(rdev);
-cleanup_io_work_queue:
-	cleanup_io_work_queue(dev, true);
-cleanup_state_lock:
-	pthread_mutex_destroy(&rdev->state_lock);
-cleanup_format_lock:
-	pthread_mutex_destroy(&rdev->format_lock);
-cleanup_caw_lock:
-	pthread_mutex_destroy(&rdev->caw_lock);
-cleanup_dev_lock:
-	pthread_spin_destroy(&rdev->lock);
-free_rdev:
-	free(rdev);
+cleanup_dev:
+	tcmur_dev_stop_io(dev);
+	cleanup_io_work_queue_threads(dev);
+	tcmur_stop_device(dev);
+	tcmur_dev_cleanup(dev);
 	return ret;
 }
 
 static void dev_removed(struct tcmu_device *dev)
 {
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
-	int ret;
+
+	pthread_mutex_lock(&stats_devs_lock);
+	list_del(&rdev->stats_entry);
+	pthread_mutex_unlock(&stats_devs_lock);
 
 	pthread_mutex_lock(&rdev->state_lock);
-	rdev->flags |= TCMUR_DEV_FLAG_STOPPING;
+	tcmur_dev_set_flags(rdev, TCMUR_DEV_FLAG_STOPPING);
 	pthread_mutex_unlock(&rdev->state_lock);
 
 	/*
@@ -864,38 +1446,28 @@ static void dev_removed(struct tcmu_device *dev)
 	 * ->close() callout) in order to ensure that no handler callouts
 	 * are getting invoked when shutting down the handler.
 	 */
+	tcmur_dev_stop_io(dev);
 	cleanup_io_work_queue_threads(dev);
 
 	if (aio_wait_for_empty_queue(rdev))
 		tcmu_dev_err(dev, "could not flush queue.\n");
 
-	tcmu_cancel_thread(rdev->cmdproc_thread);
+	if (rdev->cmdproc_worker)
+		tcmur_cmdproc_pool_detach(dev);
+	else
+		tcmu_cancel_thread(rdev->cmdproc_thread);
 	tcmur_stop_device(dev);
 
-	cleanup_io_work_queue(dev, false);
-	cleanup_aio_tracking(rdev);
-
-	ret = pthread_cond_destroy(&rdev->lock_cond);
-	if (ret != 0)
-		tcmu_err("could not cleanup lock cond %d\n", ret);
-
-	ret = pthread_mutex_destroy(&rdev->state_lock);
-	if (ret != 0)
-		tcmu_err("could not cleanup state lock %d\n", ret);
-
-	ret = pthread_mutex_destroy(&rdev->format_lock);
-	if (ret != 0)
-		tcmu_err("could not cleanup format lock %d\n", ret);
+	/* cmdproc is gone, so we are the ring thread now */
+	if (tcmulib_reap_completions(dev))
+		tcmulib_processing_complete(dev);
 
-	ret = pthread_mutex_destroy(&rdev->caw_lock);
-	if (ret != 0)
-		tcmu_err("could not cleanup caw lock %d\n", ret);
+	if (rdev->stats.busy_poll_hits || rdev->stats.busy_poll_misses)
+		tcmu_dev_info(dev, "busy poll hits %"PRIu64" misses %"PRIu64"\n",
+			      rdev->stats.busy_poll_hits,
+			      rdev->stats.busy_poll_misses);
 
-	ret = pthread_spin_destroy(&rdev->lock);
-	if (ret != 0)
-		tcmu_err("could not cleanup mailbox lock %d\n", ret);
-
-	free(rdev);
+	tcmur_dev_cleanup(dev);
 
 	tcmu_dev_dbg(dev, "removed from tcmu-runner\n");
 }
@@ -1113,10 +1685,23 @@ int main(int argc, char **argv)
 		darray_append(handlers, tmp_handler);
 	}
 
+	/* Must be up before tcmulib_initialize adds the existing devices */
+	if (tcmu_cfg->cmdproc_threads > 0) {
+		ret = setup_cmdproc_pool(tcmu_cfg->cmdproc_threads);
+		if (ret) {
+			tcmu_err("couldn't setup cmdproc threads %d\n", ret);
+			goto err_free_handlers;
+		}
+	}
+
+	tcmulib_set_open_threads(tcmu_cfg->open_threads);
+	tcmulib_set_cmd_private_size(sizeof(struct tcmur_cmd));
+	tcmur_recovery_set_limits(tcmu_cfg->recovery_threads,
+				  tcmu_cfg->recovery_backoff_max_ms);
 	tcmulib_context = tcmulib_initialize(handlers.item, handlers.size);
 	if (!tcmulib_context) {
 		tcmu_err("tcmulib_initialize failed\n");
-		goto err_free_handlers;
+		goto err_cmdproc_pool;
 	}
 
 	loop = g_main_loop_new(NULL, FALSE);
@@ -1155,6 +1740,7 @@ int main(int argc, char **argv)
 	g_io_channel_unref (libtcmu_gio);
 	g_object_unref(manager);
 	tcmulib_close(tcmulib_context);
+	cleanup_cmdproc_pool();
 
 	lock_fd.l_type = F_UNLCK;
 	if (fcntl(fd, F_SETLK, &lock_fd) == -1) {
@@ -1172,6 +1758,8 @@ int main(int argc, char **argv)
 
 err_tcmulib_close:
 	tcmulib_close(tcmulib_context);
+err_cmdproc_pool:
+	cleanup_cmdproc_pool();
 err_free_handlers:
 	darray_free(handlers);
 close_fd:
@@ -0,0 +1,1118 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Null and ramdisk handler, for load testing the kernel <-> runner path
+ * without a backend in the way and for rehearsing slow backends.
+ *
+ * "null/" discards writes and reads back zeros. "null/ram" keeps the
+ * data in memory, in pages that are allocated when they are first
+ * written and freed again by UNMAP, so it reads back zeros where nothing
+ * was written. The data is kept across a reopen and lost when the
+ * device is removed.
+ *
+ * Options model a backend: per op latency drawn from a distribution,
+ * read and write bandwidth caps, a queue depth beyond which cmds wait in
+ * the handler, and a rate of failed reads and writes. Cmds a model
+ * delays are completed by a thread per device when they are due, the
+ * others right away.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+
+#define NULL_NSEC_PER_SEC	1000000000ULL
+
+/* ram pages, and the pages per table of the page directory (1 GiB) */
+#define NULL_PAGE_SHIFT		16
+#define NULL_PAGE_SIZE		(1UL << NULL_PAGE_SHIFT)
+#define NULL_TABLE_SHIFT	14
+#define NULL_TABLE_SIZE		(1UL << NULL_TABLE_SHIFT)
+#define NULL_TABLE_BYTES_SHIFT	(NULL_PAGE_SHIFT + NULL_TABLE_SHIFT)
+#define NULL_TABLE_BYTES	((uint64_t)1 << NULL_TABLE_BYTES_SHIFT)
+
+enum {
+	NULL_OP_READ,
+	NULL_OP_WRITE,
+	NULL_OP_OTHER,
+	NULL_NR_OPS,
+};
+
+enum {
+	NULL_LAT_FIXED,
+	NULL_LAT_UNIFORM,
+	NULL_LAT_EXP,
+};
+
+struct null_io {
+	struct tcmu_device *dev;
+	struct tcmulib_cmd *cmd;
+	int op;
+	size_t len;
+	int ret;
+	uint64_t due_ns;
+	struct list_node entry;
+};
+
+struct null_state {
+	struct tcmu_device *dev;
+
+	/*
+	 * ram page directory. Pages and tables are added with ram_lock
+	 * held for reading and only freed with it held for writing.
+	 */
+	bool ram;
+	pthread_rwlock_t ram_lock;
+	char ***tables;
+	size_t nr_tables;
+	uint64_t nr_pages;
+
+	/* the model, fixed once the device is open */
+	uint64_t lat_ns[NULL_NR_OPS];
+	int lat_dist;
+	uint64_t bps[2];	/* read and write bytes per sec, 0 unlimited */
+	unsigned int qd;	/* 0 unlimited */
+	unsigned int err_ppm;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* wakes up the completer */
+	pthread_t thread;
+	bool stopping;
+	uint64_t rand;
+	uint64_t bw_next_ns[2];	/* when the read and write links are free */
+	unsigned int nr_active;
+	struct list_head waiting;	/* over qd, oldest first */
+	/* min heap of the active ios by due_ns */
+	struct null_io **heap;
+	size_t heap_nr;
+	size_t heap_size;
+};
+
+/*
+ * ram page directory of a device between the close and the open of a
+ * reopen, so recovering the device does not lose its data.
+ */
+struct null_parked {
+	struct tcmu_device *dev;
+	char ***tables;
+	size_t nr_tables;
+	uint64_t nr_pages;
+	struct list_node entry;
+};
+
+static pthread_mutex_t null_parked_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(null_parked);
+
+/* set while completing, so a cmd the completion starts does not recurse */
+static __thread bool null_completing;
+
+static uint64_t null_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NULL_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* xorshift64*, called with the lock held */
+static uint64_t null_rand(struct null_state *state)
+{
+	state->rand ^= state->rand >> 12;
+	state->rand ^= state->rand << 25;
+	state->rand ^= state->rand >> 27;
+	return state->rand * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, 1), called with the lock held */
+static double null_rand_unit(struct null_state *state)
+{
+	return (null_rand(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* Called with the lock held */
+static uint64_t null_lat_ns(struct null_state *state, int op)
+{
+	uint64_t mean = state->lat_ns[op];
+
+	if (!mean)
+		return 0;
+
+	switch (state->lat_dist) {
+	case NULL_LAT_UNIFORM:
+		return 2 * mean * null_rand_unit(state);
+	case NULL_LAT_EXP:
+		return -log(1 - null_rand_unit(state)) * mean;
+	default:
+		return mean;
+	}
+}
+
+/* Called with the lock held */
+static int null_heap_push(struct null_state *state, struct null_io *io)
+{
+	struct null_io **heap;
+	size_t i, parent, size;
+
+	if (state->heap_nr == state->heap_size) {
+		size = state->heap_size ? state->heap_size * 2 : 64;
+		heap = realloc(state->heap, size * sizeof(*heap));
+		if (!heap)
+			return -ENOMEM;
+		state->heap = heap;
+		state->heap_size = size;
+	}
+
+	for (i = state->heap_nr++; i; i = parent) {
+		parent = (i - 1) / 2;
+		if (state->heap[parent]->due_ns <= io->due_ns)
+			break;
+		state->heap[i] = state->heap[parent];
+	}
+	state->heap[i] = io;
+	return 0;
+}
+
+/* Called with the lock held */
+static struct null_io *null_heap_pop(struct null_state *state)
+{
+	struct null_io *top = state->heap[0], *last;
+	size_t i = 0, child;
+
+	last = state->heap[--state->heap_nr];
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= state->heap_nr)
+			break;
+		if (child + 1 < state->heap_nr &&
+		    state->heap[child + 1]->due_ns < state->heap[child]->due_ns)
+			child++;
+		if (last->due_ns <= state->heap[child]->due_ns)
+			break;
+		state->heap[i] = state->heap[child];
+		i = child;
+	}
+	if (state->heap_nr)
+		state->heap[i] = last;
+	return top;
+}
+
+/*
+ * Called with the lock held. The bytes go over the op's link after
+ * the ones before them, then the latency is added.
+ */
+static int null_start(struct null_state *state, struct null_io *io,
+		      uint64_t now)
+{
+	uint64_t due = now;
+	int dir;
+
+	if (io->op != NULL_OP_OTHER && state->bps[io->op]) {
+		dir = io->op;
+		if (state->bw_next_ns[dir] > due)
+			due = state->bw_next_ns[dir];
+		due += io->len * NULL_NSEC_PER_SEC / state->bps[dir];
+		state->bw_next_ns[dir] = due;
+	}
+	io->due_ns = due + null_lat_ns(state, io->op);
+
+	state->nr_active++;
+	if (null_heap_push(state, io)) {
+		state->nr_active--;
+		return -ENOMEM;
+	}
+	if (state->heap[0] == io)
+		pthread_cond_signal(&state->cond);
+	return 0;
+}
+
+static void null_io_done(struct null_io *io)
+{
+	struct tcmu_device *dev = io->dev;
+	struct tcmulib_cmd *cmd = io->cmd;
+	int ret = io->ret;
+	bool completing = null_completing;
+
+	free(io);
+
+	null_completing = true;
+	cmd->done(dev, cmd, ret);
+	null_completing = completing;
+}
+
+static bool null_modeled(struct null_state *state)
+{
+	return state->lat_ns[NULL_OP_READ] || state->lat_ns[NULL_OP_WRITE] ||
+	       state->lat_ns[NULL_OP_OTHER] || state->bps[NULL_OP_READ] ||
+	       state->bps[NULL_OP_WRITE] || state->qd;
+}
+
+/*
+ * Complete the cmd when the model says it is done. Called after the
+ * data has been moved, with the status it completes with.
+ */
+static int null_queue(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		      int op, size_t len, int ret)
+{
+	struct null_state *state = tcmu_get_dev_private(dev);
+	struct null_io *io;
+
+	if (!null_modeled(state) && !null_completing) {
+		null_completing = true;
+		cmd->done(dev, cmd, ret);
+		null_completing = false;
+		return TCMU_STS_OK;
+	}
+
+	io = malloc(sizeof(*io));
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+	io->dev = dev;
+	io->cmd = cmd;
+	io->op = op;
+	io->len = len;
+	io->ret = ret;
+
+	pthread_mutex_lock(&state->lock);
+	if (state->qd && state->nr_active >= state->qd) {
+		list_add_tail(&state->waiting, &io->entry);
+		ret = TCMU_STS_OK;
+	} else {
+		ret = null_start(state, io, null_now_ns()) ?
+					TCMU_STS_NO_RESOURCE : TCMU_STS_OK;
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	if (ret != TCMU_STS_OK)
+		free(io);
+	return ret;
+}
+
+/* Called with the lock held */
+static void null_start_waiting(struct null_state *state, uint64_t now)
+{
+	struct null_io *io;
+
+	while (state->nr_active < state->qd) {
+		io = list_pop(&state->waiting, struct null_io, entry);
+		if (!io)
+			break;
+		if (null_start(state, io, now)) {
+			/* try again when the next io completes */
+			list_add(&state->waiting, &io->entry);
+			break;
+		}
+	}
+}
+
+static void null_sleep(struct null_state *state, uint64_t wait_ns)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += wait_ns / NULL_NSEC_PER_SEC;
+	ts.tv_nsec += wait_ns % NULL_NSEC_PER_SEC;
+	if (ts.tv_nsec >= NULL_NSEC_PER_SEC) {
+		ts.tv_sec++;
+		ts.tv_nsec -= NULL_NSEC_PER_SEC;
+	}
+	pthread_cond_timedwait(&state->cond, &state->lock, &ts);
+}
+
+static void *null_completer(void *arg)
+{
+	struct null_state *state = arg;
+	struct null_io *io;
+	uint64_t now;
+
+	/* the default 50 usecs of slack would be added to short latencies */
+	prctl(PR_SET_TIMERSLACK, 1);
+
+	pthread_mutex_lock(&state->lock);
+	while (!state->stopping) {
+		if (!state->heap_nr) {
+			pthread_cond_wait(&state->cond, &state->lock);
+			continue;
+		}
+
+		now = null_now_ns();
+		if (state->heap[0]->due_ns > now) {
+			null_sleep(state, state->heap[0]->due_ns - now);
+			continue;
+		}
+
+		io = null_heap_pop(state);
+		state->nr_active--;
+		null_start_waiting(state, now);
+		pthread_mutex_unlock(&state->lock);
+
+		null_io_done(io);
+
+		pthread_mutex_lock(&state->lock);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+/* Walks an iovec without updating it, the runner may reuse it */
+struct null_iter {
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t off;
+};
+
+/* Copies len bytes from buf into the iovec, or zeros them if buf is NULL */
+static void null_iter_to_iov(struct null_iter *it, const char *buf, size_t len)
+{
+	size_t part;
+
+	while (len && it->iov_cnt) {
+		part = min(len, it->iov->iov_len - it->off);
+		if (buf) {
+			memcpy(it->iov->iov_base + it->off, buf, part);
+			buf += part;
+		} else {
+			memset(it->iov->iov_base + it->off, 0, part);
+		}
+		len -= part;
+		it->off += part;
+		if (it->off == it->iov->iov_len) {
+			it->iov++;
+			it->iov_cnt--;
+			it->off = 0;
+		}
+	}
+}
+
+static void null_iter_from_iov(struct null_iter *it, char *buf, size_t len)
+{
+	size_t part;
+
+	while (len && it->iov_cnt) {
+		part = min(len, it->iov->iov_len - it->off);
+		memcpy(buf, it->iov->iov_base + it->off, part);
+		buf += part;
+		len -= part;
+		it->off += part;
+		if (it->off == it->iov->iov_len) {
+			it->iov++;
+			it->iov_cnt--;
+			it->off = 0;
+		}
+	}
+}
+
+/*
+ * Called with ram_lock held. Returns NULL for a page that was never
+ * written, or if alloc is set and there is no memory for it.
+ */
+static char *null_ram_page(struct null_state *state, uint64_t pg, bool alloc)
+{
+	char ***tablep = &state->tables[pg >> NULL_TABLE_SHIFT];
+	char **table, **old_table, **pagep, *page, *old_page;
+
+	table = __atomic_load_n(tablep, __ATOMIC_ACQUIRE);
+	if (!table) {
+		if (!alloc)
+			return NULL;
+		table = calloc(NULL_TABLE_SIZE, sizeof(*table));
+		if (!table)
+			return NULL;
+		old_table = NULL;
+		if (!__atomic_compare_exchange_n(tablep, &old_table, table,
+						 false, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE)) {
+			free(table);
+			table = old_table;
+		}
+	}
+
+	pagep = &table[pg & (NULL_TABLE_SIZE - 1)];
+	page = __atomic_load_n(pagep, __ATOMIC_ACQUIRE);
+	if (page || !alloc)
+		return page;
+
+	page = calloc(1, NULL_PAGE_SIZE);
+	if (!page)
+		return NULL;
+	old_page = NULL;
+	if (!__atomic_compare_exchange_n(pagep, &old_page, page, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(page);
+		return old_page;
+	}
+	__atomic_add_fetch(&state->nr_pages, 1, __ATOMIC_RELAXED);
+	return page;
+}
+
+static void null_ram_read(struct null_state *state, struct iovec *iov,
+			  size_t iov_cnt, size_t length, off_t offset)
+{
+	struct null_iter it = { iov, iov_cnt, 0 };
+	uint64_t pos = offset, end = offset + length;
+	size_t in_page, part;
+	char *page;
+
+	pthread_rwlock_rdlock(&state->ram_lock);
+	for (; pos < end; pos += part) {
+		in_page = pos & (NULL_PAGE_SIZE - 1);
+		part = min(end - pos, NULL_PAGE_SIZE - in_page);
+		page = null_ram_page(state, pos >> NULL_PAGE_SHIFT, false);
+		null_iter_to_iov(&it, page ? page + in_page : NULL, part);
+	}
+	pthread_rwlock_unlock(&state->ram_lock);
+}
+
+static int null_ram_write(struct null_state *state, struct iovec *iov,
+			  size_t iov_cnt, size_t length, off_t offset)
+{
+	struct null_iter it = { iov, iov_cnt, 0 };
+	uint64_t pos = offset, end = offset + length;
+	size_t in_page, part;
+	int ret = 0;
+	char *page;
+
+	pthread_rwlock_rdlock(&state->ram_lock);
+	for (; pos < end; pos += part) {
+		in_page = pos & (NULL_PAGE_SIZE - 1);
+		part = min(end - pos, NULL_PAGE_SIZE - in_page);
+		page = null_ram_page(state, pos >> NULL_PAGE_SHIFT, true);
+		if (!page) {
+			ret = -ENOMEM;
+			break;
+		}
+		null_iter_from_iov(&it, page + in_page, part);
+	}
+	pthread_rwlock_unlock(&state->ram_lock);
+	return ret;
+}
+
+/* Bytes from pos to the end of its page table, or to end */
+static uint64_t null_to_next_table(uint64_t pos, uint64_t end)
+{
+	return min(end - pos, NULL_TABLE_BYTES -
+			      (pos & (NULL_TABLE_BYTES - 1)));
+}
+
+/*
+ * Called with ram_lock held for writing. Whole pages are freed, the
+ * parts of the ones at the ends are zeroed.
+ */
+static void null_ram_discard(struct null_state *state, uint64_t off,
+			     uint64_t len)
+{
+	uint64_t pos = off, end = off + len;
+	size_t in_page, part;
+	char **table, **pagep;
+
+	for (; pos < end; pos += part) {
+		in_page = pos & (NULL_PAGE_SIZE - 1);
+		part = min(end - pos, NULL_PAGE_SIZE - in_page);
+
+		table = state->tables[pos >> NULL_TABLE_BYTES_SHIFT];
+		if (!table) {
+			part = null_to_next_table(pos, end);
+			continue;
+		}
+
+		pagep = &table[(pos >> NULL_PAGE_SHIFT) & (NULL_TABLE_SIZE - 1)];
+		if (!*pagep)
+			continue;
+
+		if (part == NULL_PAGE_SIZE) {
+			free(*pagep);
+			*pagep = NULL;
+			state->nr_pages--;
+		} else {
+			memset(*pagep + in_page, 0, part);
+		}
+	}
+}
+
+static int null_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		     struct iovec *iov, size_t iov_cnt, size_t length,
+		     off_t offset)
+{
+	struct null_state *state = tcmu_get_dev_private(dev);
+	int ret = TCMU_STS_OK;
+
+	if (state->err_ppm) {
+		pthread_mutex_lock(&state->lock);
+		if (null_rand(state) % 1000000 < state->err_ppm)
+			ret = TCMU_STS_RD_ERR;
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	if (ret == TCMU_STS_OK) {
+		if (state->ram)
+			null_ram_read(state, iov, iov_cnt, length, offset);
+		else
+			tcmu_zero_iovec(iov, iov_cnt);
+	}
+
+	return null_queue(dev, cmd, NULL_OP_READ, length, ret);
+}
+
+static int null_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		      struct iovec *iov, size_t iov_cnt, size_t length,
+		      off_t offset)
+{
+	struct null_state *state = tcmu_get_dev_private(dev);
+	int ret = TCMU_STS_OK;
+
+	if (state->err_ppm) {
+		pthread_mutex_lock(&state->lock);
+		if (null_rand(state) % 1000000 < state->err_ppm)
+			ret = TCMU_STS_WR_ERR;
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	if (ret == TCMU_STS_OK && state->ram &&
+	    null_ram_write(state, iov, iov_cnt, length, offset)) {
+		tcmu_dev_err(dev, "Could not allocate ram pages.\n");
+		return TCMU_STS_NO_RESOURCE;
+	}
+
+	return null_queue(dev, cmd, NULL_OP_WRITE, length, ret);
+}
+
+static int null_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	return null_queue(dev, cmd, NULL_OP_OTHER, 0, TCMU_STS_OK);
+}
+
+static int null_unmapv(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		       struct tcmur_unmap_extent *extents, size_t nr_extents)
+{
+	struct null_state *state = tcmu_get_dev_private(dev);
+	size_t i;
+
+	if (state->ram) {
+		pthread_rwlock_wrlock(&state->ram_lock);
+		for (i = 0; i < nr_extents; i++)
+			null_ram_discard(state, extents[i].off, extents[i].len);
+		pthread_rwlock_unlock(&state->ram_lock);
+	}
+
+	return null_queue(dev, cmd, NULL_OP_OTHER, 0, TCMU_STS_OK);
+}
+
+/* Zeroing a ram range frees its pages, other patterns are left to the runner */
+static int null_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  uint64_t off, uint64_t len, struct iovec *iov,
+			  size_t iov_cnt)
+{
+	struct null_state *state = tcmu_get_dev_private(dev);
+
+	if (state->ram) {
+		if (!tcmu_iovec_zeroed(iov, iov_cnt))
+			return TCMU_STS_NOT_HANDLED;
+
+		pthread_rwlock_wrlock(&state->ram_lock);
+		null_ram_discard(state, off, len);
+		pthread_rwlock_unlock(&state->ram_lock);
+	}
+
+	return null_queue(dev, cmd, NULL_OP_OTHER, 0, TCMU_STS_OK);
+}
+
+static int null_get_lba_status(struct tcmu_device *dev,
+			       struct tcmulib_cmd *cmd, uint64_t off,
+			       uint64_t len, struct tcmur_lba_status *status,
+			       size_t *nr_status)
+{
+	struct null_state *state = tcmu_get_dev_private(dev);
+	uint64_t pos = off, end = off + len, next;
+	size_t i = 0;
+	bool mapped;
+
+	if (!state->ram) {
+		status[0].off = off;
+		status[0].len = len;
+		status[0].mapped = false;
+		*nr_status = 1;
+		goto done;
+	}
+
+	pthread_rwlock_rdlock(&state->ram_lock);
+	while (pos < end && i < *nr_status) {
+		if (!state->tables[pos >> NULL_TABLE_BYTES_SHIFT]) {
+			next = pos + null_to_next_table(pos, end);
+			mapped = false;
+		} else {
+			next = min((pos | (NULL_PAGE_SIZE - 1)) + 1, end);
+			mapped = null_ram_page(state, pos >> NULL_PAGE_SHIFT,
+					       false) != NULL;
+		}
+
+		if (i && status[i - 1].mapped == mapped) {
+			status[i - 1].len += next - pos;
+		} else {
+			status[i].off = pos;
+			status[i].len = next - pos;
+			status[i].mapped = mapped;
+			i++;
+		}
+		pos = next;
+	}
+	pthread_rwlock_unlock(&state->ram_lock);
+	*nr_status = i;
+done:
+	return null_queue(dev, cmd, NULL_OP_OTHER, 0, TCMU_STS_OK);
+}
+
+static size_t null_nr_tables(uint64_t size)
+{
+	return (size + NULL_TABLE_BYTES - 1) >> NULL_TABLE_BYTES_SHIFT;
+}
+
+/* Frees tables from to nr_tables and returns the number of pages freed */
+static uint64_t null_free_tables(char ***tables, size_t from, size_t nr_tables)
+{
+	uint64_t nr_pages = 0;
+	size_t i, j;
+
+	for (i = from; i < nr_tables; i++) {
+		if (!tables[i])
+			continue;
+		for (j = 0; j < NULL_TABLE_SIZE; j++) {
+			if (tables[i][j]) {
+				free(tables[i][j]);
+				nr_pages++;
+			}
+		}
+		free(tables[i]);
+		tables[i] = NULL;
+	}
+	return nr_pages;
+}
+
+/* Called with ram_lock held for writing */
+static void null_ram_free_tables(struct null_state *state, size_t from)
+{
+	state->nr_pages -= null_free_tables(state->tables, from,
+					    state->nr_tables);
+}
+
+static int null_ram_resize(struct tcmu_device *dev, uint64_t size)
+{
+	struct null_state *state = tcmu_get_dev_private(dev);
+	size_t nr_tables = null_nr_tables(size);
+	uint64_t old_size;
+	char ***tables;
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&state->ram_lock);
+	old_size = (uint64_t)state->nr_tables << NULL_TABLE_BYTES_SHIFT;
+	if (size < old_size)
+		null_ram_discard(state, size, old_size - size);
+	null_ram_free_tables(state, nr_tables);
+
+	tables = realloc(state->tables, max(nr_tables, (size_t)1) *
+			 sizeof(*tables));
+	if (!tables) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+	if (nr_tables > state->nr_tables)
+		memset(tables + state->nr_tables, 0,
+		       (nr_tables - state->nr_tables) * sizeof(*tables));
+	state->tables = tables;
+	state->nr_tables = nr_tables;
+unlock:
+	pthread_rwlock_unlock(&state->ram_lock);
+	return ret;
+}
+
+/*
+ * Keeps the page directory of a device closed by a reopen, for the open
+ * that follows. Returns false if it has to be freed with the device.
+ */
+static bool null_ram_park(struct null_state *state)
+{
+	struct null_parked *parked;
+
+	if (!state->ram || !tcmu_dev_in_recovery(state->dev))
+		return false;
+
+	parked = malloc(sizeof(*parked));
+	if (!parked) {
+		tcmu_dev_err(state->dev, "Could not keep the ram pages for the reopen.\n");
+		return false;
+	}
+	parked->dev = state->dev;
+	parked->tables = state->tables;
+	parked->nr_tables = state->nr_tables;
+	parked->nr_pages = state->nr_pages;
+
+	pthread_mutex_lock(&null_parked_lock);
+	list_add_tail(&null_parked, &parked->entry);
+	pthread_mutex_unlock(&null_parked_lock);
+	return true;
+}
+
+static struct null_parked *null_ram_unpark(struct tcmu_device *dev)
+{
+	struct null_parked *parked, *found = NULL;
+
+	pthread_mutex_lock(&null_parked_lock);
+	list_for_each(&null_parked, parked, entry) {
+		if (parked->dev == dev) {
+			list_del(&parked->entry);
+			found = parked;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&null_parked_lock);
+	return found;
+}
+
+static void null_ram_free_parked(struct null_parked *parked)
+{
+	null_free_tables(parked->tables, 0, parked->nr_tables);
+	free(parked->tables);
+	free(parked);
+}
+
+static int null_opt_to_u64(struct tcmu_device *dev, const char *opt,
+			   const char *val, uint64_t *res)
+{
+	char *end;
+
+	errno = 0;
+	*res = strtoull(val, &end, 10);
+	if (errno || end == val || *end || *val == '-') {
+		tcmu_dev_err(dev, "Invalid value for %s\n", opt);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+#define NULL_LAT_UNSET	UINT64_MAX
+
+static int null_parse_opt(struct tcmu_device *dev, struct null_state *state,
+			  char *opt)
+{
+	uint64_t val;
+	char *eq;
+	int ret;
+
+	eq = strchr(opt, '=');
+	if (!eq)
+		goto unknown;
+	*eq++ = '\0';
+
+	if (!strcmp(opt, "lat_dist")) {
+		if (!strcmp(eq, "fixed"))
+			state->lat_dist = NULL_LAT_FIXED;
+		else if (!strcmp(eq, "uniform"))
+			state->lat_dist = NULL_LAT_UNIFORM;
+		else if (!strcmp(eq, "exp"))
+			state->lat_dist = NULL_LAT_EXP;
+		else
+			goto invalid;
+		return 0;
+	}
+
+	ret = null_opt_to_u64(dev, opt, eq, &val);
+	if (ret)
+		return ret;
+
+	if (!strcmp(opt, "lat_us")) {
+		state->lat_ns[NULL_OP_OTHER] = val * 1000;
+	} else if (!strcmp(opt, "read_lat_us")) {
+		state->lat_ns[NULL_OP_READ] = val * 1000;
+	} else if (!strcmp(opt, "write_lat_us")) {
+		state->lat_ns[NULL_OP_WRITE] = val * 1000;
+	} else if (!strcmp(opt, "read_mbps")) {
+		state->bps[NULL_OP_READ] = val * 1024 * 1024;
+	} else if (!strcmp(opt, "write_mbps")) {
+		state->bps[NULL_OP_WRITE] = val * 1024 * 1024;
+	} else if (!strcmp(opt, "qd")) {
+		if (val > UINT32_MAX)
+			goto invalid;
+		state->qd = val;
+	} else if (!strcmp(opt, "err_ppm")) {
+		if (val > 1000000)
+			goto invalid;
+		state->err_ppm = val;
+	} else {
+		goto unknown;
+	}
+	return 0;
+
+invalid:
+	tcmu_dev_err(dev, "Invalid value %s for %s\n", eq, opt);
+	return -EINVAL;
+unknown:
+	tcmu_dev_err(dev, "Unknown option %s\n", opt);
+	return -EINVAL;
+}
+
+static int null_parse_opts(struct tcmu_device *dev, struct null_state *state,
+			   char *opts)
+{
+	char *opt, *next;
+	int ret;
+
+	state->lat_ns[NULL_OP_READ] = NULL_LAT_UNSET;
+	state->lat_ns[NULL_OP_WRITE] = NULL_LAT_UNSET;
+
+	for (opt = opts; opt; opt = next) {
+		next = strchr(opt, ';');
+		if (next)
+			*next++ = '\0';
+		if (!*opt)
+			continue;
+
+		ret = null_parse_opt(dev, state, opt);
+		if (ret)
+			return ret;
+	}
+
+	/* lat_us is for the ops that do not have their own */
+	if (state->lat_ns[NULL_OP_READ] == NULL_LAT_UNSET)
+		state->lat_ns[NULL_OP_READ] = state->lat_ns[NULL_OP_OTHER];
+	if (state->lat_ns[NULL_OP_WRITE] == NULL_LAT_UNSET)
+		state->lat_ns[NULL_OP_WRITE] = state->lat_ns[NULL_OP_OTHER];
+	return 0;
+}
+
+static int null_open(struct tcmu_device *dev, bool reopen)
+{
+	struct null_state *state;
+	struct null_parked *parked;
+	char *cfgstring, *config, *opts;
+	int ret = -EINVAL;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+
+	state->dev = dev;
+	list_head_init(&state->waiting);
+	tcmu_set_dev_private(dev, state);
+
+	cfgstring = strdup(tcmu_get_dev_cfgstring(dev));
+	if (!cfgstring) {
+		ret = -ENOMEM;
+		goto free_state;
+	}
+
+	config = strchr(cfgstring, '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		goto free_config;
+	}
+	config += 1; /* get past '/' */
+
+	opts = strchr(config, ';');
+	if (opts)
+		*opts++ = '\0';
+
+	if (!strcmp(config, "ram")) {
+		state->ram = true;
+	} else if (*config && strcmp(config, "null")) {
+		tcmu_dev_err(dev, "Unknown mode %s\n", config);
+		goto free_config;
+	}
+
+	ret = null_parse_opts(dev, state, opts);
+	if (ret)
+		goto free_config;
+
+	state->rand = null_now_ns() ^ (uintptr_t)state;
+	if (!state->rand)
+		state->rand = 1;
+
+	ret = pthread_rwlock_init(&state->ram_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto free_config;
+	}
+
+	/* a stale directory is of a device that went away during a reopen */
+	parked = null_ram_unpark(dev);
+	if (parked && (!reopen || !state->ram)) {
+		null_ram_free_parked(parked);
+		parked = NULL;
+	}
+
+	if (state->ram) {
+		if (parked) {
+			state->tables = parked->tables;
+			state->nr_tables = parked->nr_tables;
+			state->nr_pages = parked->nr_pages;
+			free(parked);
+			tcmu_dev_dbg(dev, "kept %"PRIu64" MiB of ram\n",
+				     (state->nr_pages * NULL_PAGE_SIZE) >> 20);
+		}
+		/* the size could have changed while it was closed */
+		ret = null_ram_resize(dev, tcmu_get_dev_num_lbas(dev) *
+					   tcmu_get_dev_block_size(dev));
+		if (ret)
+			goto free_tables;
+	}
+
+	ret = pthread_mutex_init(&state->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto free_tables;
+	}
+
+	ret = pthread_cond_init(&state->cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	ret = pthread_create(&state->thread, NULL, null_completer, state);
+	if (ret) {
+		ret = -ret;
+		tcmu_dev_err(dev, "could not start completion thread\n");
+		goto destroy_cond;
+	}
+
+	tcmu_dev_dbg(dev, "%s, latency us read %"PRIu64" write %"PRIu64" other %"PRIu64" dist %d, MiB/s read %"PRIu64" write %"PRIu64", qd %u, err_ppm %u\n",
+		     state->ram ? "ram" : "null",
+		     state->lat_ns[NULL_OP_READ] / 1000,
+		     state->lat_ns[NULL_OP_WRITE] / 1000,
+		     state->lat_ns[NULL_OP_OTHER] / 1000, state->lat_dist,
+		     state->bps[NULL_OP_READ] >> 20,
+		     state->bps[NULL_OP_WRITE] >> 20, state->qd,
+		     state->err_ppm);
+	free(cfgstring);
+	return 0;
+
+destroy_cond:
+	pthread_cond_destroy(&state->cond);
+destroy_lock:
+	pthread_mutex_destroy(&state->lock);
+free_tables:
+	/* a reopen that failed is tried again */
+	if (!null_ram_park(state)) {
+		null_ram_free_tables(state, 0);
+		free(state->tables);
+	}
+	pthread_rwlock_destroy(&state->ram_lock);
+free_config:
+	free(cfgstring);
+free_state:
+	free(state);
+	return ret;
+}
+
+static void null_close(struct tcmu_device *dev)
+{
+	struct null_state *state = tcmu_get_dev_private(dev);
+
+	/* the runner has waited for all cmds, so nothing is queued */
+	pthread_mutex_lock(&state->lock);
+	state->stopping = true;
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+	pthread_join(state->thread, NULL);
+
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->lock);
+	if (!null_ram_park(state)) {
+		if (state->ram)
+			tcmu_dev_dbg(dev, "freeing %"PRIu64" MiB of ram\n",
+				     (state->nr_pages * NULL_PAGE_SIZE) >> 20);
+		null_ram_free_tables(state, 0);
+		free(state->tables);
+	}
+	pthread_rwlock_destroy(&state->ram_lock);
+	free(state->heap);
+	free(state);
+}
+
+static void null_removed(struct tcmu_device *dev)
+{
+	struct null_parked *parked = null_ram_unpark(dev);
+
+	if (parked)
+		null_ram_free_parked(parked);
+}
+
+static int null_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
+{
+	struct null_state *state = tcmu_get_dev_private(dev);
+
+	switch (cfg->type) {
+	case TCMULIB_CFG_DEV_SIZE:
+		if (!state->ram)
+			return 0;
+		return null_ram_resize(dev, cfg->data.dev_size);
+	case TCMULIB_CFG_DEV_CFGSTR:
+	case TCMULIB_CFG_WRITE_CACHE:
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static const char null_cfg_desc[] =
+	"null config string is of the form:\n"
+	"[ram][;option1;option2;...]\n"
+	"where:\n"
+	"ram:		Keep the data in memory, allocated as it is written.\n"
+	"		It is kept across a reopen and lost when the device\n"
+	"		is removed. Without it writes are discarded and\n"
+	"		reads return zeros.\n"
+	"optionN:	\"lat_us=N\" mean latency added to each cmd\n"
+	"		\"read_lat_us=N\", \"write_lat_us=N\" the same for\n"
+	"		reads or writes only\n"
+	"		\"lat_dist=fixed|uniform|exp\" latency distribution,\n"
+	"		uniform is from 0 to twice the mean\n"
+	"		\"read_mbps=N\", \"write_mbps=N\" bandwidth caps in MiB/s\n"
+	"		\"qd=N\" cmds in flight, the rest wait in the handler\n"
+	"		\"err_ppm=N\" reads and writes per million that fail\n";
+
+static struct tcmur_handler null_handler = {
+	.cfg_desc = null_cfg_desc,
+
+	.reconfig = null_reconfig,
+
+	.open = null_open,
+	.close = null_close,
+	.removed = null_removed,
+	.read = null_read,
+	.write = null_write,
+	.flush = null_flush,
+	.unmapv = null_unmapv,
+	.writesame = null_writesame,
+	.get_lba_status = null_get_lba_status,
+	.name = "Null and ramdisk Handler",
+	.subtype = "null",
+	/* cmds are done right away or completed by the completion thread */
+	.nr_threads = 0,
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&null_handler);
+}
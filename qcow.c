@@ -55,6 +55,7 @@
 #include <scsi/scsi.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <zlib.h>
 #if defined(HAVE_LINUX_FALLOC)
@@ -81,8 +82,17 @@ struct bdev {
 	/* from TCMU configfs configuration */
 	int64_t size;
 	uint32_t block_size;
+	uint32_t cluster_size;	/* 0 for raw images */
 
 	int fd;		/* image file descriptor */
+	int data_fd;	/* fd for guest data, O_DIRECT if asked for */
+	uint32_t dio_align;
+
+	/* metadata cache sizes in bytes, 0 for the defaults */
+	uint64_t l2_cache_size;
+	uint64_t rc_cache_size;
+	uint64_t zcache_size;
+	unsigned int cor_threshold;
 };
 
 struct bdev_ops {
@@ -91,6 +101,7 @@ struct bdev_ops {
 	void (*close) (struct bdev *dev);
 	ssize_t (*preadv) (struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset);
 	ssize_t (*pwritev) (struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset);
+	int (*flush) (struct bdev *bdev);	/* optional */
 };
 
 static int bdev_open(struct bdev *bdev, int dirfd, const char *pathname, int flags)
@@ -118,6 +129,39 @@ err:
 	return -1;
 }
 
+/*
+ * With O_DIRECT only guest data bypasses the page cache. The image's
+ * metadata is read and written in small, unaligned pieces, so it goes
+ * through bdev->fd, which is always opened without it.
+ */
+static int bdev_open_data_fd(struct bdev *bdev, int dirfd,
+			     const char *pathname, int flags)
+{
+	bdev->data_fd = bdev->fd;
+	bdev->dio_align = 0;
+	if (!(flags & O_DIRECT))
+		return 0;
+
+	bdev->data_fd = openat(dirfd, pathname, flags);
+	if (bdev->data_fd == -1) {
+		tcmu_err("Failed to open %s with O_DIRECT: %m\n", pathname);
+		return -1;
+	}
+
+	if (tcmu_get_dio_align(NULL, bdev->data_fd, bdev->block_size,
+			       &bdev->dio_align)) {
+		close(bdev->data_fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void bdev_close_data_fd(struct bdev *bdev)
+{
+	if (bdev->data_fd != bdev->fd)
+		close(bdev->data_fd);
+}
+
 static int get_dirfd(int fd)
 {
 	char proc_path[64];
@@ -190,9 +234,40 @@ static void qcow2_header_bswap(struct qcow2_header *be, struct qcow2_header *dst
 
 #define RC_CACHE_SIZE L2_CACHE_SIZE
 
+struct qcow_state;
+
+/*
+ * Cache of L2 tables or refcount blocks, indexed by their offset in the
+ * image. Entries are looked up through a hash table and evicted with
+ * CLOCK. Modified tables are marked dirty and written back when they are
+ * evicted or the image is flushed.
+ */
+struct qcow_cache {
+	unsigned int nr;	/* number of tables */
+	unsigned int table_bits;
+	void *tables;
+	uint64_t *offsets;	/* 0 if the slot is unused */
+	int *next;		/* hash chain, -1 terminated */
+	uint8_t *referenced;
+	uint8_t *dirty;
+	unsigned int nr_dirty;
+	bool unsynced;		/* tables written since the last fdatasync */
+	int *buckets;
+	unsigned int hash_mask;
+	unsigned int hand;
+
+	/* makes what the tables depend on durable before one is written */
+	int (*barrier)(struct qcow_state *s);
+
+	uint64_t hits;
+	uint64_t misses;
+};
+
 struct qcow_state
 {
 	int fd;
+	int data_fd;
+	uint32_t dio_align;
 	uint64_t size;
 	unsigned int cluster_bits;
 	unsigned int cluster_size;
@@ -205,16 +280,29 @@ struct qcow_state
 	unsigned int l1_size;
 	uint64_t l1_table_offset;
 	uint64_t *l1_table;
+	bool l1_dirty;
 
 	/* L2 cache */
-	uint64_t *l2_cache;
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-	int l2_cache_counts[L2_CACHE_SIZE];
+	struct qcow_cache l2_cache;
 
-	/* cluster decompression cache */
-	uint8_t *cluster_cache;
-	uint8_t *cluster_data;
-	uint64_t cluster_cache_offset;
+	/* tags this image's clusters in the per-thread decompression buffers */
+	uint64_t id;
+
+	/*
+	 * meta_lock protects the L1 table and the L2 cache. alloc_lock
+	 * protects the refcount table and cache and cluster allocation. It
+	 * is taken either alone or nested inside meta_lock.
+	 */
+	pthread_mutex_t meta_lock;
+	pthread_mutex_t alloc_lock;
+
+	/* inflated compressed clusters, keyed by their offset in the file */
+	pthread_mutex_t zcache_lock;
+	struct qcow_cache zcache;
+
+	/* copy-on-read, per cluster hashed read counters */
+	unsigned int cor_threshold;
+	uint8_t *cor_reads;
 
 	struct bdev *backing_image;
 	uint64_t cluster_compressed;
@@ -225,12 +313,11 @@ struct qcow_state
 	uint64_t refcount_table_offset;
 	uint32_t refcount_table_size;
 	uint64_t *refcount_table;
+	bool rc_table_dirty;
 
 	/* refcount block cache */
 	unsigned int refcount_order;
-	void *rc_cache;
-	uint64_t rc_cache_offsets[RC_CACHE_SIZE];
-	int rc_cache_counts[RC_CACHE_SIZE];
+	struct qcow_cache rc_cache;
 
 	uint64_t (*block_alloc) (struct qcow_state *s, size_t size);
 	int (*set_refcount) (struct qcow_state *s, uint64_t cluster_offset, uint64_t value);
@@ -238,6 +325,289 @@ struct qcow_state
 	uint64_t first_free_cluster;
 };
 
+/*
+ * Compressed clusters are inflated into per-thread buffers, so io
+ * threads can read them concurrently. The last cluster inflated by a
+ * thread is kept, and images are told apart by their id.
+ */
+struct qcow_scratch {
+	size_t size;
+	uint8_t *cluster;
+	uint8_t *data;
+	uint64_t image_id;
+	uint64_t offset;
+};
+
+static pthread_key_t qcow_scratch_key;
+static uint64_t qcow_next_image_id = 1;
+
+static void qcow_scratch_free(void *arg)
+{
+	struct qcow_scratch *sc = arg;
+
+	free(sc->cluster);
+	free(sc->data);
+	free(sc);
+}
+
+static struct qcow_scratch *qcow_get_scratch(struct qcow_state *s)
+{
+	struct qcow_scratch *sc = pthread_getspecific(qcow_scratch_key);
+
+	if (!sc) {
+		sc = calloc(1, sizeof(*sc));
+		if (!sc)
+			return NULL;
+		if (pthread_setspecific(qcow_scratch_key, sc)) {
+			free(sc);
+			return NULL;
+		}
+	}
+
+	if (sc->size < s->cluster_size) {
+		free(sc->cluster);
+		free(sc->data);
+		sc->image_id = 0;
+		sc->cluster = malloc(s->cluster_size);
+		sc->data = malloc(s->cluster_size);
+		if (!sc->cluster || !sc->data) {
+			free(sc->cluster);
+			free(sc->data);
+			sc->cluster = sc->data = NULL;
+			sc->size = 0;
+			return NULL;
+		}
+		sc->size = s->cluster_size;
+	}
+	return sc;
+}
+
+static void qcow_state_init(struct qcow_state *s)
+{
+	s->id = __atomic_fetch_add(&qcow_next_image_id, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&s->meta_lock, NULL);
+	pthread_mutex_init(&s->alloc_lock, NULL);
+	pthread_mutex_init(&s->zcache_lock, NULL);
+}
+
+static void qcow_state_free(struct qcow_state *s)
+{
+	pthread_mutex_destroy(&s->meta_lock);
+	pthread_mutex_destroy(&s->alloc_lock);
+	pthread_mutex_destroy(&s->zcache_lock);
+	free(s->cor_reads);
+	free(s);
+}
+
+/*
+ * Size a cache from the requested bytes, or from def tables. There is
+ * no point in caching more tables than the image can have.
+ */
+static int qcow_cache_init(struct qcow_cache *c, uint64_t bytes,
+			   unsigned int def, unsigned int min,
+			   uint64_t max, unsigned int table_bits)
+{
+	uint64_t nr = bytes ? bytes >> table_bits : def;
+	unsigned int nr_buckets = 1;
+	unsigned int i;
+
+	if (nr > max)
+		nr = max;
+	if (nr < min)
+		nr = min;
+	if (nr > INT_MAX)
+		nr = INT_MAX;
+
+	while (nr_buckets < nr)
+		nr_buckets <<= 1;
+
+	memset(c, 0, sizeof(*c));
+	c->nr = nr;
+	c->table_bits = table_bits;
+	c->hash_mask = nr_buckets - 1;
+
+	c->tables = calloc(c->nr, 1 << table_bits);
+	c->offsets = calloc(c->nr, sizeof(*c->offsets));
+	c->next = calloc(c->nr, sizeof(*c->next));
+	c->referenced = calloc(c->nr, sizeof(*c->referenced));
+	c->dirty = calloc(c->nr, sizeof(*c->dirty));
+	c->buckets = malloc(nr_buckets * sizeof(*c->buckets));
+	if (!c->tables || !c->offsets || !c->next || !c->referenced ||
+	    !c->dirty || !c->buckets)
+		return -1;
+
+	for (i = 0; i < nr_buckets; i++)
+		c->buckets[i] = -1;
+
+	tcmu_dbg("%u entry cache for %u byte tables\n", c->nr, 1 << table_bits);
+	return 0;
+}
+
+static void qcow_cache_free(struct qcow_cache *c, const char *name)
+{
+	if (c->tables)
+		tcmu_dbg("%s cache: %"PRIu64" hits %"PRIu64" misses\n",
+			 name, c->hits, c->misses);
+
+	free(c->tables);
+	free(c->offsets);
+	free(c->next);
+	free(c->referenced);
+	free(c->dirty);
+	free(c->buckets);
+	memset(c, 0, sizeof(*c));
+}
+
+static unsigned int qcow_cache_hash(struct qcow_cache *c, uint64_t offset)
+{
+	return ((offset >> c->table_bits) * 0x9E3779B97F4A7C15ULL >> 32) &
+		c->hash_mask;
+}
+
+static void qcow_cache_unhash(struct qcow_cache *c, int i)
+{
+	int *p = &c->buckets[qcow_cache_hash(c, c->offsets[i])];
+
+	while (*p != i)
+		p = &c->next[*p];
+	*p = c->next[i];
+	c->offsets[i] = 0;
+}
+
+static int qcow_cache_write(struct qcow_cache *c, int fd, int i)
+{
+	size_t len = 1 << c->table_bits;
+
+	if (pwrite(fd, c->tables + ((size_t)i << c->table_bits), len,
+		   c->offsets[i]) != len) {
+		tcmu_err("metadata writeback at %"PRIx64" failed: %m\n",
+			 c->offsets[i]);
+		return -1;
+	}
+	c->dirty[i] = 0;
+	c->nr_dirty--;
+	c->unsynced = true;
+	return 0;
+}
+
+static int qcow_cache_writeback(struct qcow_cache *c, int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->nr && c->nr_dirty; i++) {
+		if (c->dirty[i] && qcow_cache_write(c, fd, i))
+			return -1;
+	}
+	return 0;
+}
+
+static void qcow_cache_mark_dirty(struct qcow_cache *c, void *table)
+{
+	size_t i = (table - c->tables) >> c->table_bits;
+
+	if (!c->dirty[i]) {
+		c->dirty[i] = 1;
+		c->nr_dirty++;
+	}
+}
+
+static void *qcow_cache_find(struct qcow_cache *c, uint64_t offset)
+{
+	int i;
+
+	for (i = c->buckets[qcow_cache_hash(c, offset)]; i != -1; i = c->next[i]) {
+		if (c->offsets[i] == offset) {
+			c->referenced[i] = 1;
+			return c->tables + ((size_t)i << c->table_bits);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Evict an entry, writing it back first if it is dirty, and reuse its
+ * slot for offset. The caller fills the returned table.
+ */
+static void *qcow_cache_claim(struct qcow_state *s, struct qcow_cache *c,
+			      int fd, uint64_t offset)
+{
+	unsigned int bucket = qcow_cache_hash(c, offset);
+	int i;
+
+	/* CLOCK, skip entries referenced since the hand last passed them */
+	while (c->referenced[c->hand]) {
+		c->referenced[c->hand] = 0;
+		c->hand = (c->hand + 1) % c->nr;
+	}
+	i = c->hand;
+	c->hand = (c->hand + 1) % c->nr;
+
+	if (c->dirty[i]) {
+		if (c->barrier && c->barrier(s))
+			return NULL;
+		if (qcow_cache_write(c, fd, i))
+			return NULL;
+	}
+
+	if (c->offsets[i])
+		qcow_cache_unhash(c, i);
+
+	c->offsets[i] = offset;
+	c->referenced[i] = 1;
+	c->next[i] = c->buckets[bucket];
+	c->buckets[bucket] = i;
+	return c->tables + ((size_t)i << c->table_bits);
+}
+
+/* returns the cached copy of the table at offset, reading it on a miss */
+static void *qcow_cache_lookup(struct qcow_state *s, struct qcow_cache *c,
+			       int fd, uint64_t offset)
+{
+	size_t len = 1 << c->table_bits;
+	void *table;
+
+	table = qcow_cache_find(c, offset);
+	if (table) {
+		c->hits++;
+		return table;
+	}
+	c->misses++;
+
+	table = qcow_cache_claim(s, c, fd, offset);
+	if (!table)
+		return NULL;
+
+	if (pread(fd, table, len, offset) != len) {
+		qcow_cache_unhash(c, (table - c->tables) >> c->table_bits);
+		return NULL;
+	}
+	return table;
+}
+
+/* default inflated cluster cache size, in clusters */
+#define QCOW_ZCACHE_CLUSTERS	16
+
+/* copy-on-read counters, collisions only make promotion happen early */
+#define QCOW_COR_SLOTS		65536
+
+static int qcow_setup_read_caches(struct bdev *bdev, struct qcow_state *s)
+{
+	if (qcow_cache_init(&s->zcache, bdev->zcache_size,
+			    QCOW_ZCACHE_CLUSTERS, 1, UINT_MAX,
+			    s->cluster_bits)) {
+		tcmu_err("Failed to allocate compressed cluster cache\n");
+		return -1;
+	}
+
+	s->cor_threshold = bdev->cor_threshold;
+	if (s->cor_threshold) {
+		s->cor_reads = calloc(QCOW_COR_SLOTS, sizeof(*s->cor_reads));
+		if (!s->cor_reads)
+			return -1;
+	}
+	return 0;
+}
+
 static uint64_t qcow_block_alloc(struct qcow_state *s, size_t size);
 static uint64_t qcow2_block_alloc(struct qcow_state *s, size_t size);
 static int qcow_no_refcount(struct qcow_state *s, uint64_t cluster_offset, uint64_t value)
@@ -245,6 +615,8 @@ static int qcow_no_refcount(struct qcow_state *s, uint64_t cluster_offset, uint6
 	return 0;
 }
 static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uint64_t value);
+static int qcow_sync_refcounts(struct qcow_state *s);
+static int qcow_image_flush(struct bdev *bdev);
 
 static int qcow_probe(struct bdev *bdev, int dirfd, const char *pathname)
 {
@@ -444,9 +816,10 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 	s = calloc(1, sizeof(struct qcow_state));
 	if (!s)
 		return -1;
+	qcow_state_init(s);
 	bdev->private = s;
 
-	bdev->fd = openat(dirfd, pathname, flags);
+	bdev->fd = openat(dirfd, pathname, flags & ~O_DIRECT);
 	s->fd = bdev->fd;
 	if (bdev->fd == -1) {
 		tcmu_err("Failed to open file: %s\n", pathname);
@@ -478,6 +851,7 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 
 	s->cluster_bits = header.cluster_bits;
 	s->cluster_size = 1 << s->cluster_bits;
+	bdev->cluster_size = s->cluster_size;
 	s->cluster_sectors = 1 << (s->cluster_bits - 9);
 	s->l2_bits = header.l2_bits;
 	s->l2_size = 1 << s->l2_bits;
@@ -512,39 +886,41 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	if (qcow_cache_init(&s->l2_cache, bdev->l2_cache_size,
+			    L2_CACHE_SIZE, MIN_L2_CACHE_SIZE, s->l1_size,
+			    s->l2_bits + 3)) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
 
-	/* cluster decompression cache */
-	s->cluster_cache = calloc(1, s->cluster_size);
-	s->cluster_data = calloc(1, s->cluster_size);
-	s->cluster_cache_offset = -1;
-	if (!s->cluster_cache || !s->cluster_data) {
-		tcmu_err("Failed to allocate cluster decompression space\n");
+	if (qcow_setup_read_caches(bdev, s))
 		goto fail;
-	}
 
-	if (qcow_setup_backing_file(bdev, &header) == -1)
+	if (bdev_open_data_fd(bdev, dirfd, pathname, flags) == -1)
 		goto fail;
+	s->data_fd = bdev->data_fd;
+	s->dio_align = bdev->dio_align;
+
+	if (qcow_setup_backing_file(bdev, &header) == -1)
+		goto fail_data_fd;
 
 	s->cluster_compressed = QCOW_OFLAG_COMPRESSED;
 	s->cluster_mask = ~QCOW_OFLAG_COMPRESSED;
 
 	s->block_alloc = qcow_block_alloc;
 	s->set_refcount = qcow_no_refcount;
+
 	tcmu_dbg("%d: %s\n", bdev->fd, pathname);
 	return 0;
+fail_data_fd:
+	bdev_close_data_fd(bdev);
 fail:
 	close(bdev->fd);
-	free(s->cluster_cache);
-	free(s->cluster_data);
-	free(s->l2_cache);
+	qcow_cache_free(&s->l2_cache, "L2");
+	qcow_cache_free(&s->zcache, "compressed cluster");
 	free(s->l1_table);
 fail_nofd:
-	free(s);
+	qcow_state_free(s);
 	return -1;
 }
 
@@ -560,9 +936,10 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 	s = calloc(1, sizeof(struct qcow_state));
 	if (!s)
 		return -1;
+	qcow_state_init(s);
 	bdev->private = s;
 
-	bdev->fd = openat(dirfd, pathname, flags);
+	bdev->fd = openat(dirfd, pathname, flags & ~O_DIRECT);
 	s->fd = bdev->fd;
 	if (bdev->fd == -1) {
 		tcmu_err("Failed to open file: %s\n", pathname);
@@ -594,6 +971,7 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 
 	s->cluster_bits = header.cluster_bits;
 	s->cluster_size = 1 << s->cluster_bits;
+	bdev->cluster_size = s->cluster_size;
 	s->cluster_sectors = 1 << (s->cluster_bits - 9);
 	s->l2_bits = s->cluster_bits - 3;	// L2 table is always 1 cluster in size (8 (2^3) byte entries)
 	s->l2_size = 1 << s->l2_bits;
@@ -633,22 +1011,15 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	if (qcow_cache_init(&s->l2_cache, bdev->l2_cache_size,
+			    L2_CACHE_SIZE, MIN_L2_CACHE_SIZE, s->l1_size,
+			    s->l2_bits + 3)) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
-	tcmu_dbg("s->l2_cache = %p\n", s->l2_cache);
 
-	/* cluster decompression cache */
-	s->cluster_cache = calloc(1, s->cluster_size);
-	s->cluster_data = calloc(1, s->cluster_size);
-	s->cluster_cache_offset = -1;
-	if (!s->cluster_cache || !s->cluster_data) {
-		tcmu_err("Failed to allocate cluster decompression space\n");
+	if (qcow_setup_read_caches(bdev, s))
 		goto fail;
-	}
-	tcmu_dbg("s->cluster_cache = %p\n", s->cluster_cache);
 
 	/* refcount table */
 	s->refcount_table_offset = header.refcount_table_offset;
@@ -666,15 +1037,20 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 	}
 
 	s->refcount_order = header.refcount_order;
-	s->rc_cache = calloc(RC_CACHE_SIZE, s->cluster_size);
-	if (s->rc_cache == NULL) {
+	if (qcow_cache_init(&s->rc_cache, bdev->rc_cache_size,
+			    RC_CACHE_SIZE, MIN_REFCOUNT_CACHE_SIZE,
+			    s->refcount_table_size, s->cluster_bits)) {
 		tcmu_err("Failed to allocate refcount cache\n");
 		goto fail;
 	}
-	tcmu_dbg("s->rc_cache = %p\n", s->rc_cache);
 
-	if (qcow2_setup_backing_file(bdev, &header) == -1)
+	if (bdev_open_data_fd(bdev, dirfd, pathname, flags) == -1)
 		goto fail;
+	s->data_fd = bdev->data_fd;
+	s->dio_align = bdev->dio_align;
+
+	if (qcow2_setup_backing_file(bdev, &header) == -1)
+		goto fail_data_fd;
 
 	s->cluster_compressed = QCOW2_OFLAG_COMPRESSED;
 	s->cluster_copied =  QCOW2_OFLAG_COPIED;
@@ -682,18 +1058,21 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 
 	s->block_alloc = qcow2_block_alloc;
 	s->set_refcount = qcow2_set_refcount;
+	s->l2_cache.barrier = qcow_sync_refcounts;
+
 	tcmu_dbg("%d: %s\n", bdev->fd, pathname);
 	return 0;
+fail_data_fd:
+	bdev_close_data_fd(bdev);
 fail:
 	close(bdev->fd);
-	free(s->cluster_cache);
-	free(s->cluster_data);
-	free(s->rc_cache);
+	qcow_cache_free(&s->rc_cache, "refcount");
 	free(s->refcount_table);
-	free(s->l2_cache);
+	qcow_cache_free(&s->l2_cache, "L2");
+	qcow_cache_free(&s->zcache, "compressed cluster");
 	free(s->l1_table);
 fail_nofd:
-	free(s);
+	qcow_state_free(s);
 	return -1;
 }
 
@@ -701,56 +1080,26 @@ static void qcow_image_close(struct bdev *bdev)
 {
 	struct qcow_state *s = bdev->private;
 
+	if (qcow_image_flush(bdev))
+		tcmu_err("metadata writeback failed on close\n");
+
 	if (s->backing_image) {
 		s->backing_image->ops->close(s->backing_image);
 		free(s->backing_image);
 	}
+	bdev_close_data_fd(bdev);
 	close(bdev->fd);
-	free(s->cluster_cache);
-	free(s->cluster_data);
 	free(s->l1_table);
-	free(s->l2_cache);
+	qcow_cache_free(&s->l2_cache, "L2");
+	qcow_cache_free(&s->zcache, "compressed cluster");
 	free(s->refcount_table);
-	free(s->rc_cache);
-	free(s);
+	qcow_cache_free(&s->rc_cache, "refcount");
+	qcow_state_free(s);
 }
 
 static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
 {
-	int i, j;
-	int min_index = 0;
-	int min_count = INT_MAX;
-	uint64_t *l2_table;
-	ssize_t read;
-
-	/* l2 cache lookup */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			if (++s->l2_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			tcmu_dbg("%s: l2 hit %"PRIx64" at index %d\n", __func__, *l2_table, i);
-			return l2_table;
-		}
-	}
-	/* not found, evict least used entry */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
-	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
-	read = pread(s->fd, l2_table, s->l2_size * sizeof(uint64_t), l2_offset);
-	if (read != s->l2_size * sizeof(uint64_t))
-		return NULL;
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
-
-	return l2_table;
+	return qcow_cache_lookup(s, &s->l2_cache, s->fd, l2_offset);
 }
 
 static uint64_t qcow_cluster_alloc(struct qcow_state *s)
@@ -774,29 +1123,46 @@ static uint64_t qcow_block_alloc(struct qcow_state *s, size_t size)
 	return offset;
 }
 
+/*
+ * Allocate a block and take its first reference under alloc_lock. The
+ * refcount is written before the block is mapped, so a crash in between
+ * leaks the block instead of leaving it mapped but free.
+ */
+static uint64_t qcow_alloc_ref(struct qcow_state *s, size_t size)
+{
+	uint64_t offset;
+
+	pthread_mutex_lock(&s->alloc_lock);
+	offset = s->block_alloc(s, size);
+	if (offset)
+		s->set_refcount(s, offset, 1);
+	pthread_mutex_unlock(&s->alloc_lock);
+	return offset;
+}
+
+/* drop an allocated cluster that lost the race to be mapped */
+static void qcow_free_cluster(struct qcow_state *s, uint64_t offset)
+{
+	pthread_mutex_lock(&s->alloc_lock);
+	s->set_refcount(s, offset, 0);
+	if (offset < s->first_free_cluster)
+		s->first_free_cluster = offset;
+	pthread_mutex_unlock(&s->alloc_lock);
+}
+
 static uint64_t l2_table_alloc(struct qcow_state *s)
 {
 	tcmu_dbg("%s\n", __func__);
-	return s->block_alloc(s, s->l2_size * sizeof(uint64_t));
+	return qcow_alloc_ref(s, s->l2_size * sizeof(uint64_t));
 }
 
+/* written back by qcow_image_flush */
 static int l1_table_update(struct qcow_state *s, unsigned int l1_index, uint64_t l2_offset)
 {
-	ssize_t ret;
-
 	tcmu_dbg("%s: setting L1[%u] to %"PRIx64"\n", __func__, l1_index, l2_offset);
 	s->l1_table[l1_index] = htobe64(l2_offset);
-
-	ret = pwrite(s->fd,
-		&s->l1_table[l1_index],
-		sizeof(uint64_t),
-		s->l1_table_offset + (l1_index * sizeof(uint64_t)));
-
-	if (ret != sizeof(uint64_t))
-		tcmu_err("%s: error, L1 writeback failed (%zd)\n", __func__, ret);
-
-	fdatasync(s->fd);
-	return ret;
+	s->l1_dirty = true;
+	return 0;
 }
 
 /* refcount table */
@@ -861,39 +1227,7 @@ static void set_refcount(unsigned int order, void *rcblock, size_t index, uint64
 
 static void *rc_cache_lookup(struct qcow_state *s, uint64_t rc_offset)
 {
-	int i, j;
-	int min_index = 0;
-	int min_count = INT_MAX;
-	void *rc_table;
-	ssize_t read;
-
-	/* rc cache lookup */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
-		if (rc_offset == s->rc_cache_offsets[i]) {
-			if (++s->rc_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < RC_CACHE_SIZE; j++) {
-					s->rc_cache_counts[j] >>= 1;
-				}
-			}
-			rc_table = s->rc_cache + (i << s->cluster_bits);
-			return rc_table;
-		}
-	}
-	/* not found, evict least used entry */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
-		if (s->rc_cache_counts[i] < min_count) {
-			min_count = s->rc_cache_counts[i];
-			min_index = i;
-		}
-	}
-	rc_table = s->rc_cache + (min_index << s->cluster_bits);
-	read = pread(s->fd, rc_table, 1 << s->cluster_bits, rc_offset);
-	if (read != 1 << s->cluster_bits)
-		return NULL;
-	s->rc_cache_offsets[min_index] = rc_offset;
-	s->rc_cache_counts[min_index] = 1;
-
-	return rc_table;
+	return qcow_cache_lookup(s, &s->rc_cache, s->fd, rc_offset);
 }
 
 static uint64_t qcow2_get_refcount(struct qcow_state *s, int64_t cluster_offset)
@@ -920,23 +1254,13 @@ static uint64_t qcow2_get_refcount(struct qcow_state *s, int64_t cluster_offset)
 	return rc;
 }
 
+/* written back by qcow_sync_refcounts */
 static int rc_table_update(struct qcow_state *s, unsigned int rc_index, uint64_t refblock_offset)
 {
-	ssize_t ret;
-
 	tcmu_dbg("%s: setting RC[%u] to %"PRIx64"\n", __func__, rc_index, refblock_offset);
 	s->refcount_table[rc_index] = htobe64(refblock_offset);
-
-	ret = pwrite(s->fd,
-		&s->refcount_table[rc_index],
-		sizeof(uint64_t),
-		s->refcount_table_offset + (rc_index * sizeof(uint64_t)));
-
-	if (ret != sizeof(uint64_t))
-		tcmu_err("%s: error, RC writeback failed (%zd)\n", __func__, ret);
-
-	fdatasync(s->fd);
-	return ret;
+	s->rc_table_dirty = true;
+	return 0;
 }
 
 static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uint64_t value)
@@ -946,7 +1270,6 @@ static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uin
 	uint64_t refblock_offset;
 	uint64_t refblock_index;
 	void *refblock;
-	ssize_t ret;
 
 	refcount_bits = s->cluster_bits - s->refcount_order + 3;
 	rc_index = cluster_offset >> (s->cluster_bits + refcount_bits);
@@ -972,12 +1295,44 @@ static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uin
 	}
 
 	set_refcount(s->refcount_order, refblock, refblock_index, value);
+	qcow_cache_mark_dirty(&s->rc_cache, refblock);
+	return 0;
+}
 
-	/* for now this writes back the entire block */
-	ret = pwrite(s->fd, refblock, s->cluster_size, refblock_offset);
-	if (ret != s->cluster_size)
-		tcmu_err("%s: error, refblock writeback failed (%zd)\n", __func__, ret);
-	fdatasync(s->fd);
+/*
+ * Write back the refcount blocks, then the refcount table pointing to
+ * them, and make both durable. Called before L2 tables are written, so
+ * a cluster is never mapped on disk while its refcount still says free.
+ */
+static int qcow_sync_refcounts(struct qcow_state *s)
+{
+	size_t len = s->refcount_table_size * sizeof(uint64_t);
+	int ret = -1;
+
+	pthread_mutex_lock(&s->alloc_lock);
+	if (qcow_cache_writeback(&s->rc_cache, s->fd))
+		goto unlock;
+
+	if (s->rc_table_dirty) {
+		if (s->rc_cache.unsynced && fdatasync(s->fd))
+			goto unlock;
+		s->rc_cache.unsynced = false;
+
+		if (pwrite(s->fd, s->refcount_table, len,
+			   s->refcount_table_offset) != len) {
+			tcmu_err("refcount table writeback failed: %m\n");
+			goto unlock;
+		}
+		s->rc_table_dirty = false;
+		s->rc_cache.unsynced = true;
+	}
+
+	if (s->rc_cache.unsynced && fdatasync(s->fd))
+		goto unlock;
+	s->rc_cache.unsynced = false;
+	ret = 0;
+unlock:
+	pthread_mutex_unlock(&s->alloc_lock);
 	return ret;
 }
 
@@ -1013,21 +1368,50 @@ static int l2_table_update(struct qcow_state *s,
 			   uint64_t *l2_table, uint64_t l2_table_offset,
 			   unsigned int l2_index, uint64_t cluster_offset)
 {
-	ssize_t ret;
-
 	tcmu_dbg("%s: setting %"PRIx64"[%u] to %"PRIx64"\n",
 		__func__, l2_table_offset, l2_index, cluster_offset);
 	l2_table[l2_index] = htobe64(cluster_offset);
+	qcow_cache_mark_dirty(&s->l2_cache, l2_table);
+	return 0;
+}
+
+/*
+ * Write back the dirty metadata in dependency order: refcounts, then L2
+ * tables, then the L1 table, with an fdatasync after each level that
+ * had anything to write.
+ */
+static int qcow_image_flush(struct bdev *bdev)
+{
+	struct qcow_state *s = bdev->private;
+	size_t len = s->l1_size * sizeof(uint64_t);
+	int ret = -1;
+
+	pthread_mutex_lock(&s->meta_lock);
+	if (qcow_sync_refcounts(s))
+		goto unlock;
 
-	ret = pwrite(s->fd,
-		&(l2_table[l2_index]),
-		sizeof(uint64_t),
-		l2_table_offset + (l2_index * sizeof(uint64_t)));
+	if (qcow_cache_writeback(&s->l2_cache, s->fd))
+		goto unlock;
 
-	if (ret != sizeof(uint64_t))
-		tcmu_err("%s: error, L2 writeback failed (%zd)\n", __func__, ret);
+	if (s->l1_dirty) {
+		if (s->l2_cache.unsynced && fdatasync(s->fd))
+			goto unlock;
+		s->l2_cache.unsynced = false;
 
-	fdatasync(s->fd);
+		if (pwrite(s->fd, s->l1_table, len, s->l1_table_offset) != len) {
+			tcmu_err("L1 table writeback failed: %m\n");
+			goto unlock;
+		}
+		s->l1_dirty = false;
+		s->l2_cache.unsynced = true;
+	}
+
+	if (s->l2_cache.unsynced && fdatasync(s->fd))
+		goto unlock;
+	s->l2_cache.unsynced = false;
+	ret = 0;
+unlock:
+	pthread_mutex_unlock(&s->meta_lock);
 	return ret;
 }
 
@@ -1056,25 +1440,94 @@ static int decompress_buffer(uint8_t *dst, size_t dst_size, const uint8_t *src,
 	return 0;
 }
 
-static int decompress_cluster(struct qcow_state *s, uint64_t cluster_offset)
+/*
+ * Returns the inflated cluster in this thread's scratch buffer. Besides
+ * the last cluster each thread inflated, the image keeps a cache of
+ * them shared by the io threads.
+ */
+static uint8_t *decompress_cluster(struct qcow_state *s, uint64_t cluster_offset)
 {
+	struct qcow_scratch *sc;
 	uint64_t coffset;
 	size_t csize;
 	ssize_t ret;
+	void *cached;
+
+	sc = qcow_get_scratch(s);
+	if (!sc)
+		return NULL;
 
 	coffset = cluster_offset & s->cluster_offset_mask;
-	if (s->cluster_cache_offset != coffset) {
+	if (sc->image_id == s->id && sc->offset == coffset)
+		return sc->cluster;
+	sc->image_id = 0;
+
+	pthread_mutex_lock(&s->zcache_lock);
+	cached = qcow_cache_find(&s->zcache, coffset);
+	if (cached) {
+		s->zcache.hits++;
+		memcpy(sc->cluster, cached, s->cluster_size);
+	} else {
+		s->zcache.misses++;
+	}
+	pthread_mutex_unlock(&s->zcache_lock);
+
+	if (!cached) {
 		csize = cluster_offset >> (63 - s->cluster_bits);
 		csize &= (s->cluster_size -1);
-		ret = pread(s->fd, s->cluster_data, csize, coffset);
+		ret = tcmu_pread_aligned(s->data_fd, sc->data, csize,
+					 coffset, s->dio_align);
 		if (ret != csize)
-			return -1;
-		ret = decompress_buffer(s->cluster_cache, s->cluster_size, s->cluster_data, csize);
+			return NULL;
+		ret = decompress_buffer(sc->cluster, s->cluster_size, sc->data, csize);
 		if (ret < 0)
-			return -1;
-		s->cluster_cache_offset = coffset;
+			return NULL;
+
+		/* another thread may have inflated it meanwhile */
+		pthread_mutex_lock(&s->zcache_lock);
+		if (!qcow_cache_find(&s->zcache, coffset)) {
+			cached = qcow_cache_claim(s, &s->zcache, -1, coffset);
+			if (cached)
+				memcpy(cached, sc->cluster, s->cluster_size);
+		}
+		pthread_mutex_unlock(&s->zcache_lock);
 	}
-	return 0;
+
+	sc->image_id = s->id;
+	sc->offset = coffset;
+	return sc->cluster;
+}
+
+/*
+ * Fill a newly allocated cluster with the backing file's data for it,
+ * before it gets mapped in place of the backing file.
+ */
+static int qcow_copy_backing(struct qcow_state *s, uint64_t offset,
+			     uint64_t cluster_offset)
+{
+	uint64_t start = offset & ~((uint64_t)s->cluster_size - 1);
+	size_t len = min((uint64_t)s->cluster_size, s->size - start);
+	struct iovec iov;
+	int ret = -1;
+
+	iov.iov_base = malloc(len);
+	iov.iov_len = len;
+	if (!iov.iov_base)
+		return -1;
+
+	if (s->backing_image->ops->preadv(s->backing_image, &iov, 1, start) != len) {
+		tcmu_err("backing file read at %"PRIx64" failed\n", start);
+		goto out;
+	}
+	if (tcmu_pwrite_aligned(s->data_fd, iov.iov_base, len, cluster_offset,
+				s->dio_align) != len) {
+		tcmu_err("backing file copy to %"PRIx64" failed\n", cluster_offset);
+		goto out;
+	}
+	ret = 0;
+out:
+	free(iov.iov_base);
+	return ret;
 }
 
 /**
@@ -1086,13 +1539,16 @@ static int decompress_cluster(struct qcow_state *s, uint64_t cluster_offset)
  * offset: virtual image sector offset
  * allocate: true if new cluster and L2 table allocations should happen (writes)
  */
-static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset, bool allocate)
+static uint64_t __get_cluster_offset(struct qcow_state *s, const uint64_t offset,
+				     bool allocate, uint64_t *new_cluster,
+				     bool *need_cluster)
 {
 	unsigned int l1_index;
 	unsigned int l2_index;
 	uint64_t l2_offset;
 	uint64_t *l2_table;
 	uint64_t cluster_offset;
+	uint8_t *data;
 
 	tcmu_dbg("%s: %"PRIx64" %s\n", __func__, offset, allocate ? "write" : "read");
 
@@ -1108,7 +1564,6 @@ static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset,
 		if (!allocate || !(l2_offset = l2_table_alloc(s)))
 			return 0;
 		l1_table_update(s, l1_index, l2_offset | s->cluster_copied);
-		s->set_refcount(s, l2_offset, 1);
 	}
 
 	l2_table = l2_cache_lookup(s, l2_offset);
@@ -1121,21 +1576,27 @@ static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset,
 
 	if (!cluster_offset) {
 		/* sector not allocated in image file */
-		if (!allocate || !(cluster_offset = qcow_cluster_alloc(s)))
+		if (!allocate)
+			return 0;
+		if (!*new_cluster) {
+			/* let the caller allocate it without meta_lock */
+			*need_cluster = true;
 			return 0;
+		}
+		cluster_offset = *new_cluster;
+		*new_cluster = 0;
 		l2_table_update(s, l2_table, l2_offset, l2_index, cluster_offset | s->cluster_copied);
-		s->set_refcount(s, cluster_offset, 1);
 	} else if ((cluster_offset & s->cluster_compressed) && allocate) {
 		tcmu_err("re-allocating compressed cluster for writing\n");
 		/* reallocate a compressed cluster for writing */
-		if (decompress_cluster(s, cluster_offset) < 0)
+		if (!(data = decompress_cluster(s, cluster_offset)))
 			return 0;
-		if (!(cluster_offset = qcow_cluster_alloc(s)))
+		if (!(cluster_offset = qcow_alloc_ref(s, s->cluster_size)))
 			return 0;
-		if (pwrite(s->fd, s->cluster_cache, s->cluster_size, cluster_offset) != s->cluster_size)
+		if (tcmu_pwrite_aligned(s->data_fd, data, s->cluster_size,
+					cluster_offset, s->dio_align) != s->cluster_size)
 			return 0;
 		l2_table_update(s, l2_table, l2_offset, l2_index, cluster_offset | s->cluster_copied);
-		s->set_refcount(s, cluster_offset, 1);
 	} else if (!(cluster_offset & s->cluster_copied) && allocate) {
 		uint64_t old_offset = cluster_offset & s->cluster_mask;
 		// TODO what if this is compressed?
@@ -1146,15 +1607,16 @@ static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset,
 		 * need to make a new copy if this is for a write */
 		if (!(cow_buffer = malloc(s->cluster_size)))
 			goto fail;
-		if (!(cluster_offset = qcow_cluster_alloc(s)))
+		if (!(cluster_offset = qcow_alloc_ref(s, s->cluster_size)))
 			goto fail;
-		if (pread(s->fd, cow_buffer, s->cluster_size, old_offset) != s->cluster_size)
+		if (tcmu_pread_aligned(s->data_fd, cow_buffer, s->cluster_size,
+				       old_offset, s->dio_align) != s->cluster_size)
 			goto fail;
-		if (pwrite(s->fd, cow_buffer, s->cluster_size, cluster_offset) != s->cluster_size)
+		if (tcmu_pwrite_aligned(s->data_fd, cow_buffer, s->cluster_size,
+					cluster_offset, s->dio_align) != s->cluster_size)
 			goto fail;
 		free(cow_buffer);
 		l2_table_update(s, l2_table, l2_offset, l2_index, cluster_offset | s->cluster_copied);
-		s->set_refcount(s, cluster_offset, 1);
 		// TODO drop refcount on old cluster
 		goto out;
 	fail:
@@ -1166,6 +1628,93 @@ out:
 	return cluster_offset & ~(s->cluster_copied);
 }
 
+static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset, bool allocate)
+{
+	uint64_t cluster_offset, new_cluster = 0;
+	bool need_cluster;
+
+	for (;;) {
+		need_cluster = false;
+		pthread_mutex_lock(&s->meta_lock);
+		cluster_offset = __get_cluster_offset(s, offset, allocate,
+						      &new_cluster, &need_cluster);
+		pthread_mutex_unlock(&s->meta_lock);
+		if (!need_cluster)
+			break;
+
+		/* lookups by other threads go on while we allocate */
+		new_cluster = qcow_alloc_ref(s, s->cluster_size);
+		if (!new_cluster)
+			return 0;
+
+		/* the parts of the cluster not written must keep reading the same */
+		if (s->backing_image &&
+		    qcow_copy_backing(s, offset, new_cluster)) {
+			qcow_free_cluster(s, new_cluster);
+			return 0;
+		}
+	}
+
+	/* someone else mapped the cluster while we were allocating */
+	if (new_cluster)
+		qcow_free_cluster(s, new_cluster);
+
+	return cluster_offset;
+}
+
+/*
+ * Look up the clusters from sector_num on and return the offset of the
+ * first one. *n is set to how many of the sector_count sectors can be
+ * handled together with it: following clusters that are contiguous in
+ * the image file, or that are all unallocated or all zero.
+ */
+static uint64_t get_cluster_run(struct qcow_state *s, uint64_t sector_num,
+				uint64_t sector_count, bool allocate, uint64_t *n)
+{
+	uint64_t sector_index = sector_num & (s->cluster_sectors - 1);
+	uint64_t len = min(sector_count, s->cluster_sectors - sector_index);
+	uint64_t first, next, expect;
+
+	first = expect = get_cluster_offset(s, sector_num << 9, allocate);
+
+	while (len < sector_count && !(first & s->cluster_compressed)) {
+		next = get_cluster_offset(s, (sector_num + len) << 9, allocate);
+		if (first && first != QCOW2_OFLAG_ZERO)
+			expect += s->cluster_size;
+		if (next != expect)
+			break;
+		len += min(sector_count - len, (uint64_t)s->cluster_sectors);
+	}
+
+	*n = len;
+	return first;
+}
+
+/*
+ * Count reads of the clusters in [sector_num, sector_num + n) that were
+ * served by the backing file or inflated, and copy the ones read
+ * cor_threshold times into the image.
+ */
+static void qcow_cor_note(struct qcow_state *s, uint64_t sector_num, uint64_t n)
+{
+	uint64_t cluster = sector_num >> (s->cluster_bits - 9);
+	uint64_t last = (sector_num + n - 1) >> (s->cluster_bits - 9);
+	uint8_t *reads;
+
+	for (; cluster <= last; cluster++) {
+		reads = &s->cor_reads[(cluster * 0x9E3779B97F4A7C15ULL >> 32) &
+				      (QCOW_COR_SLOTS - 1)];
+		if (__atomic_add_fetch(reads, 1, __ATOMIC_RELAXED) < s->cor_threshold)
+			continue;
+		__atomic_store_n(reads, 0, __ATOMIC_RELAXED);
+
+		/* allocating it copies the backing or inflated data */
+		if (!get_cluster_offset(s, cluster << s->cluster_bits, true))
+			tcmu_dbg("copy-on-read of cluster %"PRIu64" failed\n",
+				 cluster);
+	}
+}
+
 /* returns number of iovs initialized in seg */
 static size_t iovec_segment(struct iovec *iov, struct iovec *seg, size_t off, size_t len)
 {
@@ -1228,11 +1777,11 @@ static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off
 
 	while (sector_count) {
 		sector_index = sector_num & (s->cluster_sectors - 1);
-		n = min(sector_count, (s->cluster_sectors - sector_index));
+		cluster_offset = get_cluster_run(s, sector_num, sector_count,
+						 false, &n);
 
 		_cnt = iovec_segment(iov, _iov, _off, n * 512);
 
-		cluster_offset = get_cluster_offset(s, sector_num << 9, false);
 		if (!cluster_offset) {
 			if (!s->backing_image) {
 				/* read unallocated sectors as 0s */
@@ -1244,18 +1793,26 @@ static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off
 								    (off_t) sector_num * 512);
 				if (read != n * 512)
 					break;
+				if (s->cor_reads)
+					qcow_cor_note(s, sector_num, n);
 			}
 		} else if (cluster_offset == QCOW2_OFLAG_ZERO) {
 			/* cluster discarded, read as 0s */
 			iovec_memset(_iov, _cnt, 0, 512 * n);
 		} else if (cluster_offset & s->cluster_compressed) {
-			if (decompress_cluster(s, cluster_offset) < 0) {
+			uint8_t *data = decompress_cluster(s, cluster_offset);
+
+			if (!data) {
 				tcmu_err("decompression failure\n");
 				return -1;
 			}
-			tcmu_memcpy_into_iovec(_iov, _cnt, s->cluster_cache + sector_index * 512, 512 * n);
+			tcmu_memcpy_into_iovec(_iov, _cnt, data + sector_index * 512, 512 * n);
+			if (s->cor_reads)
+				qcow_cor_note(s, sector_num, n);
 		} else {
-			read = preadv(bdev->fd, _iov, _cnt, cluster_offset + (sector_index * 512));
+			read = tcmu_preadv_aligned(bdev->data_fd, _iov, _cnt,
+						   cluster_offset + (sector_index * 512),
+						   bdev->dio_align);
 			if (read != n * 512)
 				break;
 		}
@@ -1293,11 +1850,11 @@ static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, of
 
 	while (sector_count) {
 		sector_index = sector_num & (s->cluster_sectors - 1);
-		n = min(sector_count, (s->cluster_sectors - sector_index));
+		cluster_offset = get_cluster_run(s, sector_num, sector_count,
+						 true, &n);
 
 		_cnt = iovec_segment(iov, _iov, _off, n * 512);
 
-		cluster_offset = get_cluster_offset(s, sector_num << 9, true);
 		if (!cluster_offset) {
 			tcmu_err("cluster not allocated for writes\n");
 			return -1;
@@ -1307,7 +1864,9 @@ static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, of
 			tcmu_err("cluster decompression CoW failure\n");
 			return -1;
 		} else {
-			written = pwritev(bdev->fd, _iov, _cnt, cluster_offset + (sector_index * 512));
+			written = tcmu_pwritev_aligned(bdev->data_fd, _iov, _cnt,
+						       cluster_offset + (sector_index * 512),
+						       bdev->dio_align);
 			if (written < 0)
 				break;
 		}
@@ -1324,6 +1883,7 @@ static struct bdev_ops qcow_ops = {
 	.close = qcow_image_close,
 	.preadv = qcow_preadv,
 	.pwritev = qcow_pwritev,
+	.flush = qcow_image_flush,
 };
 
 static struct bdev_ops qcow2_ops = {
@@ -1332,6 +1892,7 @@ static struct bdev_ops qcow2_ops = {
 	.close = qcow_image_close,
 	.preadv = qcow_preadv,
 	.pwritev = qcow_pwritev,
+	.flush = qcow_image_flush,
 };
 
 /* raw image support for backing files */
@@ -1354,24 +1915,34 @@ static int raw_probe(struct bdev *bdev, int dirfd, const char *pathname)
 
 static int raw_image_open(struct bdev *bdev, int dirfd, const char *pathname, int flags)
 {
-	bdev->fd = openat(dirfd, pathname, flags);
+	bdev->fd = openat(dirfd, pathname, flags & ~O_DIRECT);
 	tcmu_dbg("%d: %s\n", bdev->fd, pathname);
+	if (bdev->fd == -1)
+		return -1;
+
+	if (bdev_open_data_fd(bdev, dirfd, pathname, flags) == -1) {
+		close(bdev->fd);
+		return -1;
+	}
 	return bdev->fd;
 }
 
 static void raw_image_close(struct bdev *bdev)
 {
+	bdev_close_data_fd(bdev);
 	close(bdev->fd);
 }
 
 static ssize_t raw_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset)
 {
-	return preadv(bdev->fd, iov, iovcnt, offset);
+	return tcmu_preadv_aligned(bdev->data_fd, iov, iovcnt, offset,
+				   bdev->dio_align);
 }
 
 static ssize_t raw_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset)
 {
-	return pwritev(bdev->fd, iov, iovcnt, offset);
+	return tcmu_pwritev_aligned(bdev->data_fd, iov, iovcnt, offset,
+				    bdev->dio_align);
 }
 
 static struct bdev_ops raw_ops = {
@@ -1384,10 +1955,42 @@ static struct bdev_ops raw_ops = {
 
 /* TCMU QCOW Handler */
 
+/* byte count with an optional K, M or G suffix */
+static int qcow_parse_size(const char *str, uint64_t *size)
+{
+	unsigned long long val;
+	char *end;
+
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G': case 'g':
+		val <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		val <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		val <<= 10;
+		end++;
+		break;
+	}
+	if (*end)
+		return -1;
+
+	*size = val;
+	return 0;
+}
+
 static int qcow_open(struct tcmu_device *dev, bool reopen)
 {
 	struct bdev *bdev;
-	char *config;
+	char *cfgstring = NULL, *config, *opt, *next;
+	int flags = O_RDWR;
+	uint64_t cor;
 
 	bdev = calloc(1, sizeof(*bdev));
 	if (!bdev)
@@ -1402,13 +2005,51 @@ static int qcow_open(struct tcmu_device *dev, bool reopen)
 		goto err;
 	}
 
-	config = strchr(tcmu_get_dev_cfgstring(dev), '/');
+	cfgstring = strdup(tcmu_get_dev_cfgstring(dev));
+	if (!cfgstring)
+		goto err;
+
+	config = strchr(cfgstring, '/');
 	if (!config) {
 		tcmu_err("no configuration found in cfgstring\n");
 		goto err;
 	}
 	config += 1; /* get past '/' */
 
+	opt = strchr(config, ';');
+	if (opt)
+		*opt++ = '\0';
+
+	for (; opt; opt = next) {
+		next = strchr(opt, ';');
+		if (next)
+			*next++ = '\0';
+
+		if (!strcmp(opt, "direct=1")) {
+			/* only for the image's data, backing files stay cached */
+			flags |= O_DIRECT;
+		} else if (!strncmp(opt, QCOW2_OPT_L2_CACHE_SIZE "=",
+				    strlen(QCOW2_OPT_L2_CACHE_SIZE) + 1)) {
+			if (qcow_parse_size(opt + strlen(QCOW2_OPT_L2_CACHE_SIZE) + 1,
+					    &bdev->l2_cache_size))
+				goto bad_opt;
+		} else if (!strncmp(opt, QCOW2_OPT_REFCOUNT_CACHE_SIZE "=",
+				    strlen(QCOW2_OPT_REFCOUNT_CACHE_SIZE) + 1)) {
+			if (qcow_parse_size(opt + strlen(QCOW2_OPT_REFCOUNT_CACHE_SIZE) + 1,
+					    &bdev->rc_cache_size))
+				goto bad_opt;
+		} else if (!strncmp(opt, "compressed-cache-size=", 22)) {
+			if (qcow_parse_size(opt + 22, &bdev->zcache_size))
+				goto bad_opt;
+		} else if (!strncmp(opt, "copy-on-read=", 13)) {
+			if (qcow_parse_size(opt + 13, &cor) || !cor || cor > UINT8_MAX)
+				goto bad_opt;
+			bdev->cor_threshold = cor;
+		} else {
+			goto bad_opt;
+		}
+	}
+
 	tcmu_dbg("%s\n", tcmu_get_dev_cfgstring(dev));
 	tcmu_dbg("%s\n", config);
 
@@ -1417,10 +2058,18 @@ static int qcow_open(struct tcmu_device *dev, bool reopen)
 	 */
 	tcmu_set_dev_write_cache_enabled(dev, 1);
 
-	if (bdev_open(bdev, AT_FDCWD, config, O_RDWR) == -1)
+	if (bdev_open(bdev, AT_FDCWD, config, flags) == -1)
 		goto err;
+	/* split RWs map whole runs of clusters */
+	if (bdev->cluster_size > bdev->block_size)
+		tcmu_set_dev_opt_split_len(dev, bdev->cluster_size /
+					   bdev->block_size);
+	free(cfgstring);
 	return 0;
+bad_opt:
+	tcmu_err("unknown or invalid option %s\n", opt);
 err:
+	free(cfgstring);
 	free(bdev);
 	return -1;
 }
@@ -1488,6 +2137,12 @@ static int qcow_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct bdev *bdev = tcmu_get_dev_private(dev);
 	int ret;
 
+	if (bdev->ops->flush && bdev->ops->flush(bdev)) {
+		tcmu_dev_err(dev, "metadata writeback failed\n");
+		ret = TCMU_STS_WR_ERR;
+		goto done;
+	}
+
 	if (fsync(bdev->fd)) {
 		tcmu_dev_err(dev, "sync failed\n");
 		ret = TCMU_STS_WR_ERR;
@@ -1499,7 +2154,112 @@ done:
 	return TCMU_STS_OK;
 }
 
-static const char qcow_cfg_desc[] = "The path to the QEMU QCOW image file.";
+/*
+ * Clusters that are not allocated read back as zeros when there is no
+ * backing file, so zeroing them needs no writes at all and they stay
+ * unallocated. Allocated clusters are zeroed in place.
+ */
+static int qcow_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  uint64_t off, uint64_t len, struct iovec *iov,
+			  size_t iov_cnt)
+{
+	struct bdev *bdev = tcmu_get_dev_private(dev);
+	struct qcow_state *s = bdev->private;
+	struct iovec zero_iov = { NULL, 0 };
+	uint64_t cluster_offset, n;
+	ssize_t written;
+	int ret = TCMU_STS_OK;
+
+	if (s->backing_image || !tcmu_iovec_zeroed(iov, iov_cnt))
+		return TCMU_STS_NOT_HANDLED;
+
+	while (len) {
+		n = s->cluster_size - (off & (s->cluster_size - 1));
+		n = min(n, len);
+
+		cluster_offset = get_cluster_offset(s, off, false);
+		if (cluster_offset && cluster_offset != QCOW2_OFLAG_ZERO) {
+			if (!zero_iov.iov_base) {
+				zero_iov.iov_base = calloc(1, s->cluster_size);
+				if (!zero_iov.iov_base) {
+					ret = TCMU_STS_NO_RESOURCE;
+					goto done;
+				}
+			}
+			zero_iov.iov_len = n;
+
+			written = bdev->ops->pwritev(bdev, &zero_iov, 1, off);
+			if (written != n) {
+				tcmu_dev_err(dev, "write same failed: %m\n");
+				ret = TCMU_STS_WR_ERR;
+				goto done;
+			}
+		}
+		off += n;
+		len -= n;
+	}
+done:
+	free(zero_iov.iov_base);
+	cmd->done(dev, cmd, ret);
+	return TCMU_STS_OK;
+}
+
+/* Clusters looked up per GET LBA STATUS, so huge images are not walked whole */
+#define QCOW_LBA_STATUS_MAX_CLUSTERS	(1 << 20)
+
+/*
+ * Walk the L1/L2 tables: unallocated and zero clusters are deallocated,
+ * unless a backing file provides their data.
+ */
+static int qcow_get_lba_status(struct tcmu_device *dev,
+			       struct tcmulib_cmd *cmd, uint64_t off,
+			       uint64_t len, struct tcmur_lba_status *status,
+			       size_t *nr_status)
+{
+	struct bdev *bdev = tcmu_get_dev_private(dev);
+	struct qcow_state *s = bdev->private;
+	struct tcmur_lba_status *cur = NULL;
+	uint64_t cluster_offset, n, end = min(off + len, s->size);
+	unsigned int nr_clusters = 0;
+	size_t i = 0;
+	bool mapped;
+
+	while (off < end && nr_clusters++ < QCOW_LBA_STATUS_MAX_CLUSTERS) {
+		n = s->cluster_size - (off & (s->cluster_size - 1));
+		n = min(n, end - off);
+
+		cluster_offset = get_cluster_offset(s, off, false);
+		if (!cluster_offset)
+			mapped = s->backing_image != NULL;
+		else
+			mapped = cluster_offset != QCOW2_OFLAG_ZERO;
+
+		if (cur && cur->mapped == mapped) {
+			cur->len += n;
+		} else {
+			if (i == *nr_status)
+				break;
+			cur = &status[i++];
+			cur->off = off;
+			cur->len = n;
+			cur->mapped = mapped;
+		}
+		off += n;
+	}
+
+	*nr_status = i;
+	cmd->done(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static const char qcow_cfg_desc[] =
+	"The path to the QEMU QCOW image file, optionally followed by\n"
+	";direct=1 to bypass the page cache for the image data,\n"
+	";l2-cache-size=BYTES and ;refcount-cache-size=BYTES (K, M or G\n"
+	"suffixes allowed) to size the metadata caches,\n"
+	";compressed-cache-size=BYTES to size the inflated cluster cache and\n"
+	";copy-on-read=N (1-255) to copy backing file and compressed\n"
+	"clusters into the image once they have been read N times.";
 
 static struct tcmur_handler qcow_handler = {
 	.name = "QEMU Copy-On-Write image file",
@@ -1511,11 +2271,20 @@ static struct tcmur_handler qcow_handler = {
 	.write = qcow_write,
 	.flush = qcow_flush,
 	.read = qcow_read,
-	.nr_threads = 1,
+	.writesame = qcow_writesame,
+	.get_lba_status = qcow_get_lba_status,
+	.nr_threads = 2,
+	.max_threads = TCMUR_MAX_IO_THREADS,
 };
 
 /* Entry point must be named "handler_init". */
 int handler_init(void)
 {
+	int ret;
+
+	ret = pthread_key_create(&qcow_scratch_key, qcow_scratch_free);
+	if (ret)
+		return -ret;
+
 	return tcmur_register_handler(&qcow_handler);
 }
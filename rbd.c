@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <endian.h>
@@ -29,6 +30,7 @@
 #include "tcmur_cmd_handler.h"
 #include "libtcmu.h"
 #include "tcmur_device.h"
+#include "darray.h"
 
 #include <rbd/librbd.h>
 #include <rados/librados.h>
@@ -52,6 +54,21 @@
 #define RBD_WRITE_SAME_SUPPORT
 #endif
 
+/* rbd_diff_iterate2 added in 0.1.9 */
+#if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(0, 1, 9)
+#define RBD_DIFF_ITERATE2_SUPPORT
+#endif
+
+/*
+ * The object map is only trusted while we hold the exclusive lock, and
+ * fast-diff is needed for diff_iterate2 to read it rather than list
+ * the objects.
+ */
+#if defined(RBD_LOCK_ACQUIRE_SUPPORT) && defined(RBD_DIFF_ITERATE2_SUPPORT) && \
+    defined(RBD_FEATURE_FAST_DIFF)
+#define RBD_OBJECT_MAP_SUPPORT
+#endif
+
 /* defined in librbd.h if supported */
 #ifdef LIBRBD_SUPPORTS_IOVEC
 #if LIBRBD_SUPPORTS_IOVEC
@@ -70,7 +87,77 @@
 #define TCMU_RBD_LOCKER_TAG_FMT "tcmu_tag=%hu,rbd_client=%s"
 #define TCMU_RBD_LOCKER_BUF_LEN 256
 
+/*
+ * Bounce buffers for the librbd calls that take a flat buffer are
+ * kept on per size class free lists, so big cmds do not pay for a
+ * fresh allocation and its page faults every time.
+ */
+#define RBD_BOUNCE_MIN_SHIFT	16	/* 64K */
+#define RBD_BOUNCE_MAX_SHIFT	24	/* 16M */
+#define RBD_BOUNCE_NR_CLASSES	(RBD_BOUNCE_MAX_SHIFT - RBD_BOUNCE_MIN_SHIFT + 1)
+#define RBD_BOUNCE_MAX_CACHED	(32 * 1024 * 1024)
+#define RBD_BOUNCE_HUGE_SIZE	(2 * 1024 * 1024)
+
+struct rbd_bounce_buf {
+	struct rbd_bounce_buf *next;
+	int class;		/* -1 if too big to be cached */
+	size_t size;
+	char *data;
+};
+
+struct rbd_bounce_pool {
+	pthread_mutex_t lock;
+	struct rbd_bounce_buf *free[RBD_BOUNCE_NR_CLASSES];
+	size_t cached;
+	bool hugepages;
+};
+
+/*
+ * A rados cluster handle, possibly shared by the images of all devices
+ * that connect with the same conf, id and osd op timeout.
+ */
+struct tcmu_rbd_conn {
+	rados_t cluster;
+
+	char *conf_path;
+	char *id;
+	char *osd_op_timeout;
+
+	unsigned int users;
+	bool shared;
+	/* rados_connect is still running, wait for it on rbd_conns_cond */
+	bool connecting;
+	/* the client was blacklisted, so new images must not use it */
+	bool fenced;
+};
+
+static darray(struct tcmu_rbd_conn *) rbd_conns = darray_new();
+static pthread_mutex_t rbd_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rbd_conns_cond = PTHREAD_COND_INITIALIZER;
+
+#ifdef RBD_OBJECT_MAP_SUPPORT
+#define RBD_OBJMAP_WORD_BITS	(8 * sizeof(unsigned long))
+
+/*
+ * A copy of the image's object map. A bit is set if the object may
+ * exist: bits are set before we write to an object and are never
+ * cleared, so a clear bit always means the object is a hole.
+ */
+struct tcmu_rbd_objmap {
+	pthread_rwlock_t lock;
+	unsigned long *bits;
+	uint64_t nr_objs;
+	int order;
+	bool enabled;
+	/* built since we took the lock, so no one else wrote since */
+	bool valid;
+};
+#endif
+
 struct tcmu_rbd_state {
+	struct tcmu_rbd_conn *conn;
+	/* max handles shared by images of this cluster, 0 for a private one */
+	unsigned int rados_conns;
 	rados_t cluster;
 	rados_ioctx_t io_ctx;
 	rbd_image_t image;
@@ -80,6 +167,11 @@ struct tcmu_rbd_state {
 	char *osd_op_timeout;
 	char *conf_path;
 	char *id;
+
+	struct rbd_bounce_pool bounce_pool;
+#ifdef RBD_OBJECT_MAP_SUPPORT
+	struct tcmu_rbd_objmap objmap;
+#endif
 };
 
 enum rbd_aio_type {
@@ -101,12 +193,132 @@ struct rbd_aio_cb {
 			uint64_t offset;
 			uint64_t miscompare_offset;
 		} caw;
+		struct {
+			size_t pending;
+			int64_t ret;
+		} unmap;
 	};
-	char *bounce_buffer;
+	struct rbd_bounce_buf *bounce;
 	struct iovec *iov;
 	size_t iov_cnt;
 };
 
+static void *rbd_bounce_map(struct rbd_bounce_pool *pool, size_t size)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+	void *data;
+
+	if (pool->hugepages && !(size % RBD_BOUNCE_HUGE_SIZE)) {
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    flags | MAP_HUGETLB, -1, 0);
+		if (data != MAP_FAILED)
+			return data;
+	}
+
+	/* fall back to transparent hugepages when none are reserved */
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    pool->hugepages ? flags & ~MAP_POPULATE : flags, -1, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	if (pool->hugepages) {
+		madvise(data, size, MADV_HUGEPAGE);
+		/* fault it in now that it can use hugepages */
+		memset(data, 0, size);
+	}
+	return data;
+}
+
+static struct rbd_bounce_buf *rbd_bounce_get(struct tcmu_device *dev,
+					     size_t len)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct rbd_bounce_pool *pool = &state->bounce_pool;
+	struct rbd_bounce_buf *buf;
+	int class = 0;
+
+	while (class < RBD_BOUNCE_NR_CLASSES &&
+	       len > 1UL << (RBD_BOUNCE_MIN_SHIFT + class))
+		class++;
+
+	if (class < RBD_BOUNCE_NR_CLASSES) {
+		pthread_mutex_lock(&pool->lock);
+		buf = pool->free[class];
+		if (buf) {
+			pool->free[class] = buf->next;
+			pool->cached -= buf->size;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (buf)
+			return buf;
+	}
+
+	buf = malloc(sizeof(*buf));
+	if (!buf)
+		goto err;
+
+	if (class < RBD_BOUNCE_NR_CLASSES) {
+		buf->class = class;
+		buf->size = 1UL << (RBD_BOUNCE_MIN_SHIFT + class);
+	} else {
+		buf->class = -1;
+		buf->size = len;
+	}
+
+	buf->data = rbd_bounce_map(pool, buf->size);
+	if (!buf->data) {
+		free(buf);
+		goto err;
+	}
+	return buf;
+
+err:
+	tcmu_dev_err(dev, "Could not allocate bounce buffer.\n");
+	return NULL;
+}
+
+static void rbd_bounce_put(struct tcmu_device *dev, struct rbd_bounce_buf *buf)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct rbd_bounce_pool *pool = &state->bounce_pool;
+
+	if (buf->class >= 0) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->cached + buf->size <= RBD_BOUNCE_MAX_CACHED) {
+			buf->next = pool->free[buf->class];
+			pool->free[buf->class] = buf;
+			pool->cached += buf->size;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (!buf)
+			return;
+	}
+
+	munmap(buf->data, buf->size);
+	free(buf);
+}
+
+static void rbd_bounce_pool_init(struct rbd_bounce_pool *pool)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+}
+
+static void rbd_bounce_pool_destroy(struct rbd_bounce_pool *pool)
+{
+	struct rbd_bounce_buf *buf;
+	int i;
+
+	for (i = 0; i < RBD_BOUNCE_NR_CLASSES; i++) {
+		while ((buf = pool->free[i])) {
+			pool->free[i] = buf->next;
+			munmap(buf->data, buf->size);
+			free(buf);
+		}
+	}
+	pthread_mutex_destroy(&pool->lock);
+}
+
 #ifdef LIBRADOS_SUPPORTS_SERVICES
 
 #ifdef RBD_LOCK_ACQUIRE_SUPPORT
@@ -117,6 +329,10 @@ static void tcmu_rbd_service_status_update(struct tcmu_device *dev,
 	char *status_buf = NULL;
 	int ret;
 
+	/* only images with their own handle are registered */
+	if (state->conn->shared)
+		return;
+
 	ret = asprintf(&status_buf, "%s%c%s%c", "lock_owner", '\0',
 		       has_lock ? "true" : "false", '\0');
 	if (ret < 0) {
@@ -143,6 +359,15 @@ static int tcmu_rbd_service_register(struct tcmu_device *dev)
 	char *image_id_buf = NULL;
 	int ret;
 
+	/*
+	 * A daemon can only be registered once per handle, and it is
+	 * named after and reports the lock state of a single image.
+	 */
+	if (state->conn->shared) {
+		tcmu_dev_dbg(dev, "Not registering service for shared cluster handle.\n");
+		return 0;
+	}
+
 	ret = uname(&u);
 	if (ret < 0) {
 		ret = -errno;
@@ -343,18 +568,6 @@ static void tcmu_rbd_detect_device_class(struct tcmu_device *dev)
 	free(crush_rule);
 }
 
-static void tcmu_rbd_image_close(struct tcmu_device *dev)
-{
-	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
-
-	rbd_close(state->image);
-	rados_ioctx_destroy(state->io_ctx);
-	rados_shutdown(state->cluster);
-
-	state->cluster = NULL;
-	state->io_ctx = NULL;
-	state->image = NULL;
-}
 
 static int timer_check_and_set_def(struct tcmu_device *dev)
 {
@@ -427,26 +640,56 @@ set:
 			      state->osd_op_timeout);
 }
 
-static int tcmu_rbd_image_open(struct tcmu_device *dev)
+static bool tcmu_rbd_str_eq(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+static void tcmu_rbd_conn_free(struct tcmu_rbd_conn *conn)
+{
+	free(conn->conf_path);
+	free(conn->id);
+	free(conn->osd_op_timeout);
+	free(conn);
+}
+
+/* Must be called with rbd_conns_lock held */
+static void tcmu_rbd_conn_unlink(struct tcmu_rbd_conn *conn)
+{
+	size_t i;
+
+	for (i = 0; i < darray_size(rbd_conns); i++) {
+		if (darray_item(rbd_conns, i) == conn) {
+			darray_remove(rbd_conns, i);
+			break;
+		}
+	}
+}
+
+static int tcmu_rbd_conn_connect(struct tcmu_device *dev,
+				 struct tcmu_rbd_conn *conn)
 {
 	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
 	int ret;
 
-	ret = rados_create(&state->cluster, state->id);
+	ret = rados_create(&conn->cluster, conn->id);
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not create cluster. (Err %d)\n", ret);
 		return ret;
 	}
+	state->cluster = conn->cluster;
 
 	/* Try default location when conf_path=NULL, but ignore failure */
-	ret = rados_conf_read_file(state->cluster, state->conf_path);
-	if (state->conf_path && ret < 0) {
+	ret = rados_conf_read_file(conn->cluster, conn->conf_path);
+	if (conn->conf_path && ret < 0) {
 		tcmu_dev_err(dev, "Could not read config %s (Err %d)",
-			     state->conf_path, ret);
+			     conn->conf_path, ret);
 		goto rados_shutdown;
 	}
 
-	rados_conf_set(state->cluster, "rbd_cache", "false");
+	rados_conf_set(conn->cluster, "rbd_cache", "false");
 
 	ret = timer_check_and_set_def(dev);
 	if (ret)
@@ -454,12 +697,158 @@ static int tcmu_rbd_image_open(struct tcmu_device *dev)
 			      "Could not set rados osd op timeout to %s (Err %d. Failover may be delayed.)\n",
 			      state->osd_op_timeout, ret);
 
-	ret = rados_connect(state->cluster);
+	ret = rados_connect(conn->cluster);
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not connect to cluster. (Err %d)\n",
 			     ret);
 		goto rados_shutdown;
 	}
+	return 0;
+
+rados_shutdown:
+	rados_shutdown(conn->cluster);
+	state->cluster = NULL;
+	return ret;
+}
+
+/*
+ * Get a cluster handle for the device. With rados_conns set, images with
+ * the same conf, id and osd op timeout are spread over up to rados_conns
+ * shared handles, otherwise the device gets a private one.
+ */
+static int tcmu_rbd_conn_get(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct tcmu_rbd_conn **entry, *conn;
+	unsigned int nr;
+	int ret;
+
+	pthread_mutex_lock(&rbd_conns_lock);
+retry:
+	conn = NULL;
+	nr = 0;
+	if (state->rados_conns) {
+		darray_foreach(entry, rbd_conns) {
+			if (__atomic_load_n(&(*entry)->fenced, __ATOMIC_RELAXED) ||
+			    !tcmu_rbd_str_eq((*entry)->conf_path, state->conf_path) ||
+			    !tcmu_rbd_str_eq((*entry)->id, state->id) ||
+			    !tcmu_rbd_str_eq((*entry)->osd_op_timeout,
+					     state->osd_op_timeout))
+				continue;
+
+			nr++;
+			if (!conn || (*entry)->users < conn->users)
+				conn = *entry;
+		}
+	}
+
+	if (conn && nr >= state->rados_conns) {
+		if (conn->connecting) {
+			pthread_cond_wait(&rbd_conns_cond, &rbd_conns_lock);
+			goto retry;
+		}
+
+		conn->users++;
+		pthread_mutex_unlock(&rbd_conns_lock);
+
+		state->conn = conn;
+		state->cluster = conn->cluster;
+		tcmu_dev_dbg(dev, "Sharing cluster handle with %u images.\n",
+			     conn->users - 1);
+		return 0;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		goto oom;
+	if ((state->conf_path && !(conn->conf_path = strdup(state->conf_path))) ||
+	    (state->id && !(conn->id = strdup(state->id))) ||
+	    (state->osd_op_timeout &&
+	     !(conn->osd_op_timeout = strdup(state->osd_op_timeout)))) {
+		tcmu_rbd_conn_free(conn);
+		goto oom;
+	}
+	conn->users = 1;
+	conn->shared = state->rados_conns > 0;
+	conn->connecting = true;
+	if (conn->shared)
+		darray_append(rbd_conns, conn);
+	pthread_mutex_unlock(&rbd_conns_lock);
+
+	ret = tcmu_rbd_conn_connect(dev, conn);
+
+	pthread_mutex_lock(&rbd_conns_lock);
+	conn->connecting = false;
+	if (ret < 0 && conn->shared)
+		tcmu_rbd_conn_unlink(conn);
+	pthread_cond_broadcast(&rbd_conns_cond);
+	pthread_mutex_unlock(&rbd_conns_lock);
+
+	if (ret < 0) {
+		tcmu_rbd_conn_free(conn);
+		return ret;
+	}
+	state->conn = conn;
+	return 0;
+
+oom:
+	pthread_mutex_unlock(&rbd_conns_lock);
+	tcmu_dev_err(dev, "Could not allocate cluster handle.\n");
+	return -ENOMEM;
+}
+
+static void tcmu_rbd_conn_put(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct tcmu_rbd_conn *conn = state->conn;
+	bool last;
+
+	pthread_mutex_lock(&rbd_conns_lock);
+	last = !--conn->users;
+	if (last && conn->shared)
+		tcmu_rbd_conn_unlink(conn);
+	pthread_mutex_unlock(&rbd_conns_lock);
+
+	if (last) {
+		rados_shutdown(conn->cluster);
+		tcmu_rbd_conn_free(conn);
+	}
+	state->conn = NULL;
+	state->cluster = NULL;
+}
+
+/*
+ * Blacklisting fences the whole client, so every image using the handle
+ * is affected. They get a new one when they are reopened.
+ */
+static void tcmu_rbd_conn_fenced(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+
+	if (state->conn)
+		__atomic_store_n(&state->conn->fenced, true, __ATOMIC_RELAXED);
+}
+
+static void tcmu_rbd_image_close(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+
+	rbd_close(state->image);
+	rados_ioctx_destroy(state->io_ctx);
+	tcmu_rbd_conn_put(dev);
+
+	state->io_ctx = NULL;
+	state->image = NULL;
+}
+
+static int tcmu_rbd_image_open(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	int ret;
+
+	ret = tcmu_rbd_conn_get(dev);
+	if (ret < 0)
+		return ret;
 
 	tcmu_rbd_detect_device_class(dev);
 	ret = rados_ioctx_create(state->cluster, state->pool_name,
@@ -467,7 +856,7 @@ static int tcmu_rbd_image_open(struct tcmu_device *dev)
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not create ioctx for pool %s. (Err %d)\n",
 			     state->pool_name, ret);
-		goto rados_shutdown;
+		goto conn_put;
 	}
 
 	ret = rbd_open(state->io_ctx, state->image_name, &state->image, NULL);
@@ -489,12 +878,229 @@ rbd_close:
 rados_destroy:
 	rados_ioctx_destroy(state->io_ctx);
 	state->io_ctx = NULL;
-rados_shutdown:
-	rados_shutdown(state->cluster);
-	state->cluster = NULL;
+conn_put:
+	tcmu_rbd_conn_put(dev);
 	return ret;
 }
 
+#ifdef RBD_OBJECT_MAP_SUPPORT
+
+static size_t rbd_objmap_words(uint64_t nr_objs)
+{
+	return (nr_objs + RBD_OBJMAP_WORD_BITS - 1) / RBD_OBJMAP_WORD_BITS;
+}
+
+static bool rbd_objmap_test(unsigned long *bits, uint64_t obj)
+{
+	return __atomic_load_n(&bits[obj / RBD_OBJMAP_WORD_BITS],
+			       __ATOMIC_RELAXED) &
+		(1UL << (obj % RBD_OBJMAP_WORD_BITS));
+}
+
+static void rbd_objmap_set(unsigned long *bits, uint64_t obj)
+{
+	__atomic_or_fetch(&bits[obj / RBD_OBJMAP_WORD_BITS],
+			  1UL << (obj % RBD_OBJMAP_WORD_BITS), __ATOMIC_RELAXED);
+}
+
+static void tcmu_rbd_objmap_init(struct tcmu_rbd_objmap *map)
+{
+	pthread_rwlock_init(&map->lock, NULL);
+}
+
+static void tcmu_rbd_objmap_destroy(struct tcmu_rbd_objmap *map)
+{
+	free(map->bits);
+	pthread_rwlock_destroy(&map->lock);
+}
+
+/* Enable the fast paths if the image has a usable object map */
+static void tcmu_rbd_objmap_enable(struct tcmu_device *dev,
+				   rbd_image_info_t *info)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct tcmu_rbd_objmap *map = &state->objmap;
+	uint64_t features, need = RBD_FEATURE_OBJECT_MAP | RBD_FEATURE_FAST_DIFF;
+
+	if (rbd_get_features(state->image, &features) < 0 ||
+	    (features & need) != need)
+		return;
+
+	/* holes in a clone are read from its parent */
+	if (info->parent_pool != -1) {
+		tcmu_dev_dbg(dev, "Not using the object map of a clone.\n");
+		return;
+	}
+
+	map->nr_objs = (info->size + info->obj_size - 1) / info->obj_size;
+	map->order = info->order;
+	map->bits = calloc(rbd_objmap_words(map->nr_objs),
+			   sizeof(unsigned long));
+	if (!map->bits)
+		return;
+	map->enabled = true;
+}
+
+static int tcmu_rbd_objmap_cb(uint64_t off, size_t len, int exists, void *arg)
+{
+	struct tcmu_rbd_objmap *map = arg;
+	uint64_t obj;
+
+	if (!exists)
+		return 0;
+
+	for (obj = off >> map->order;
+	     obj < map->nr_objs && obj << map->order < off + len; obj++)
+		rbd_objmap_set(map->bits, obj);
+	return 0;
+}
+
+/*
+ * Reload the object map after taking the lock, as another node may have
+ * written to the image. Our own writes since the last load may not have
+ * reached it yet, so the old bits are kept too.
+ */
+static void tcmu_rbd_objmap_load(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct tcmu_rbd_objmap *map = &state->objmap;
+	struct tcmu_rbd_objmap new = { .order = map->order };
+	uint64_t flags, size;
+	size_t i;
+	int ret;
+
+	if (!map->enabled)
+		return;
+	__atomic_store_n(&map->valid, false, __ATOMIC_RELEASE);
+
+	ret = rbd_get_flags(state->image, &flags);
+	if (ret < 0 ||
+	    flags & (RBD_FLAG_OBJECT_MAP_INVALID | RBD_FLAG_FAST_DIFF_INVALID)) {
+		tcmu_dev_warn(dev, "Object map is invalid, not using it.\n");
+		return;
+	}
+
+	ret = rbd_get_size(state->image, &size);
+	if (ret < 0)
+		goto err;
+
+	new.nr_objs = (size + (1ULL << map->order) - 1) >> map->order;
+	new.bits = calloc(rbd_objmap_words(new.nr_objs), sizeof(unsigned long));
+	if (!new.bits) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ret = rbd_diff_iterate2(state->image, NULL, 0, size, 0, 1,
+				tcmu_rbd_objmap_cb, &new);
+	if (ret < 0) {
+		free(new.bits);
+		goto err;
+	}
+
+	pthread_rwlock_wrlock(&map->lock);
+	for (i = 0; i < rbd_objmap_words(min(new.nr_objs, map->nr_objs)); i++)
+		new.bits[i] |= map->bits[i];
+	free(map->bits);
+	map->bits = new.bits;
+	map->nr_objs = new.nr_objs;
+	__atomic_store_n(&map->valid, true, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&map->lock);
+
+	tcmu_dev_dbg(dev, "Loaded object map of %" PRIu64 " objects.\n",
+		     new.nr_objs);
+	return;
+
+err:
+	tcmu_dev_warn(dev, "Could not load object map. (Err %d)\n", ret);
+}
+
+static void tcmu_rbd_objmap_invalidate(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+
+	__atomic_store_n(&state->objmap.valid, false, __ATOMIC_RELEASE);
+}
+
+/* Must be called before writing to the range */
+static void tcmu_rbd_objmap_mark(struct tcmu_device *dev, uint64_t off,
+				 uint64_t len)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct tcmu_rbd_objmap *map = &state->objmap;
+	uint64_t obj;
+
+	if (!map->enabled || !len)
+		return;
+
+	pthread_rwlock_rdlock(&map->lock);
+	for (obj = off >> map->order;
+	     obj < map->nr_objs && obj <= (off + len - 1) >> map->order; obj++)
+		rbd_objmap_set(map->bits, obj);
+	pthread_rwlock_unlock(&map->lock);
+}
+
+/* Called with the map's lock held, after tcmu_rbd_objmap_usable */
+static bool __tcmu_rbd_objmap_is_hole(struct tcmu_rbd_objmap *map,
+				      uint64_t off, uint64_t len)
+{
+	uint64_t obj, last = (off + len - 1) >> map->order;
+
+	if (last >= map->nr_objs)
+		return false;
+
+	for (obj = off >> map->order; obj <= last; obj++) {
+		if (rbd_objmap_test(map->bits, obj))
+			return false;
+	}
+	return true;
+}
+
+static bool tcmu_rbd_objmap_usable(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	int is_owner;
+
+	if (!__atomic_load_n(&state->objmap.valid, __ATOMIC_ACQUIRE))
+		return false;
+
+	/* this is answered by librbd without a round trip */
+	return !rbd_is_exclusive_lock_owner(state->image, &is_owner) &&
+		is_owner;
+}
+
+/* Returns true if no object in the range has been written to */
+static bool tcmu_rbd_objmap_is_hole(struct tcmu_device *dev, uint64_t off,
+				    uint64_t len)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct tcmu_rbd_objmap *map = &state->objmap;
+	bool hole;
+
+	if (!len || !tcmu_rbd_objmap_usable(dev))
+		return false;
+
+	pthread_rwlock_rdlock(&map->lock);
+	hole = __tcmu_rbd_objmap_is_hole(map, off, len);
+	pthread_rwlock_unlock(&map->lock);
+	return hole;
+}
+
+#else /* RBD_OBJECT_MAP_SUPPORT */
+
+static void tcmu_rbd_objmap_mark(struct tcmu_device *dev, uint64_t off,
+				 uint64_t len)
+{
+}
+
+static bool tcmu_rbd_objmap_is_hole(struct tcmu_device *dev, uint64_t off,
+				    uint64_t len)
+{
+	return false;
+}
+
+#endif /* RBD_OBJECT_MAP_SUPPORT */
+
 #ifdef RBD_LOCK_ACQUIRE_SUPPORT
 
 /*
@@ -511,7 +1117,10 @@ static int tcmu_rbd_has_lock(struct tcmu_device *dev)
 	int ret, is_owner;
 
 	ret = rbd_is_exclusive_lock_owner(state->image, &is_owner);
-	if (ret == -ESHUTDOWN || ret == -ETIMEDOUT) {
+	if (ret == -ESHUTDOWN) {
+		tcmu_rbd_conn_fenced(dev);
+		return ret;
+	} else if (ret == -ETIMEDOUT) {
 		return ret;
 	} else if (ret < 0) {
 		/* let initiator figure things out */
@@ -522,6 +1131,9 @@ static int tcmu_rbd_has_lock(struct tcmu_device *dev)
 		return 1;
 	}
 	tcmu_dev_dbg(dev, "Not owner\n");
+#ifdef RBD_OBJECT_MAP_SUPPORT
+	tcmu_rbd_objmap_invalidate(dev);
+#endif
 
 	return 0;
 }
@@ -721,6 +1333,9 @@ static int tcmu_rbd_unlock(struct tcmu_device *dev)
 	if (tcmu_rbd_has_lock(dev) != 1)
 		return TCMU_STS_OK;
 
+#ifdef RBD_OBJECT_MAP_SUPPORT
+	tcmu_rbd_objmap_invalidate(dev);
+#endif
 	ret = rbd_lock_release(state->image);
 	if (!ret)
 		return TCMU_STS_OK;
@@ -757,8 +1372,14 @@ set_lock_tag:
 	tcmu_dev_warn(dev, "Acquired exclusive lock.\n");
 	if (tag != TCMU_INVALID_LOCK_TAG)
 		ret = tcmu_rbd_set_lock_tag(dev, tag);
+#ifdef RBD_OBJECT_MAP_SUPPORT
+	if (!ret)
+		tcmu_rbd_objmap_load(dev);
+#endif
 
 done:
+	if (ret == -ESHUTDOWN)
+		tcmu_rbd_conn_fenced(dev);
 	tcmu_rbd_service_status_update(dev, ret == 0 ? true : false);
 	return tcmu_rbd_to_sts(ret);
 }
@@ -791,6 +1412,10 @@ static void tcmu_rbd_check_excl_lock_enabled(struct tcmu_device *dev)
 
 static void tcmu_rbd_state_free(struct tcmu_rbd_state *state)
 {
+	rbd_bounce_pool_destroy(&state->bounce_pool);
+#ifdef RBD_OBJECT_MAP_SUPPORT
+	tcmu_rbd_objmap_destroy(&state->objmap);
+#endif
 	if (state->conf_path)
 		free(state->conf_path);
 	if (state->osd_op_timeout)
@@ -829,7 +1454,7 @@ static int tcmu_rbd_check_image_size(struct tcmu_device *dev, uint64_t new_size)
 static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 {
 	rbd_image_info_t image_info;
-	char *pool, *name, *next_opt;
+	char *pool, *name, *next_opt, *end;
 	char *config, *dev_cfg_dup;
 	struct tcmu_rbd_state *state;
 	uint32_t max_blocks;
@@ -838,6 +1463,10 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 	state = calloc(1, sizeof(*state));
 	if (!state)
 		return -ENOMEM;
+	rbd_bounce_pool_init(&state->bounce_pool);
+#ifdef RBD_OBJECT_MAP_SUPPORT
+	tcmu_rbd_objmap_init(&state->objmap);
+#endif
 	tcmu_set_dev_private(dev, state);
 
 	dev_cfg_dup = strdup(tcmu_get_dev_cfgstring(dev));
@@ -911,6 +1540,16 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 				tcmu_dev_err(dev, "Could not copy id.\n");
 				goto free_config;
 			}
+		} else if (!strcmp(next_opt, "bounce_hugepages=1")) {
+			state->bounce_pool.hugepages = true;
+		} else if (!strncmp(next_opt, "rados_conns=", 12)) {
+			state->rados_conns = strtoul(next_opt + 12, &end, 10);
+			if (end == next_opt + 12 || *end) {
+				ret = -EINVAL;
+				tcmu_dev_err(dev, "Invalid rados_conns %s.\n",
+					     next_opt + 12);
+				goto free_config;
+			}
 		}
 		next_opt = strtok(NULL, ";");
 	}
@@ -933,6 +1572,9 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 		tcmu_dev_err(dev, "Could not stat image.\n");
 		goto stop_image;
 	}
+#ifdef RBD_OBJECT_MAP_SUPPORT
+	tcmu_rbd_objmap_enable(dev, &image_info);
+#endif
 
 	/*
 	 * librbd/ceph can better split and align unmaps and internal RWs, so
@@ -945,6 +1587,9 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 	tcmu_set_dev_max_unmap_len(dev, max_blocks);
 	tcmu_set_dev_opt_unmap_gran(dev, image_info.obj_size /
 				    tcmu_get_dev_block_size(dev), false);
+	/* split RWs go to one object each */
+	tcmu_set_dev_opt_split_len(dev, image_info.obj_size /
+				   tcmu_get_dev_block_size(dev));
 	tcmu_set_dev_write_cache_enabled(dev, 0);
 
 	free(dev_cfg_dup);
@@ -989,7 +1634,7 @@ static int tcmu_rbd_handle_blacklisted_cmd(struct tcmu_device *dev,
 static int tcmu_rbd_handle_timedout_cmd(struct tcmu_device *dev,
 					struct tcmulib_cmd *cmd)
 {
-	tcmu_dev_err(dev, "Timing out cmd.\n");
+	tcmu_dev_err_ratelimited(dev, "Timing out cmd.\n");
 	tcmu_notify_conn_lost(dev);
 
 	/*
@@ -1028,16 +1673,21 @@ static int tcmu_rbd_aio_read(struct tcmu_device *dev, struct rbd_aio_cb *aio_cb,
 	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
 	int ret;
 
-	aio_cb->bounce_buffer = malloc(length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Could not allocate bounce buffer.\n");
+	/* a single iovec can be read into directly */
+	if (iov_cnt == 1)
+		return rbd_aio_read(state->image, offset, length,
+				    iov->iov_base, completion);
+
+	aio_cb->bounce = rbd_bounce_get(dev, length);
+	if (!aio_cb->bounce)
 		return -ENOMEM;
-	}
 
-	ret = rbd_aio_read(state->image, offset, length, aio_cb->bounce_buffer,
+	ret = rbd_aio_read(state->image, offset, length, aio_cb->bounce->data,
 			   completion);
-	if (ret < 0)
-		free(aio_cb->bounce_buffer);
+	if (ret < 0) {
+		rbd_bounce_put(dev, aio_cb->bounce);
+		aio_cb->bounce = NULL;
+	}
 	return ret;
 }
 
@@ -1048,18 +1698,22 @@ static int tcmu_rbd_aio_write(struct tcmu_device *dev, struct rbd_aio_cb *aio_cb
 	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
 	int ret;
 
-	aio_cb->bounce_buffer = malloc(length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Failed to allocate bounce buffer.\n");
-		return -ENOMEM;;
-	}
+	if (iov_cnt == 1)
+		return rbd_aio_write(state->image, offset, length,
+				     iov->iov_base, completion);
 
-	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, length, iov, iov_cnt);
+	aio_cb->bounce = rbd_bounce_get(dev, length);
+	if (!aio_cb->bounce)
+		return -ENOMEM;
 
-	ret = rbd_aio_write(state->image, offset, length, aio_cb->bounce_buffer,
+	tcmu_memcpy_from_iovec(aio_cb->bounce->data, length, iov, iov_cnt);
+
+	ret = rbd_aio_write(state->image, offset, length, aio_cb->bounce->data,
 			    completion);
-	if (ret < 0)
-		free(aio_cb->bounce_buffer);
+	if (ret < 0) {
+		rbd_bounce_put(dev, aio_cb->bounce);
+		aio_cb->bounce = NULL;
+	}
 	return ret;
 }
 
@@ -1071,23 +1725,23 @@ static int tcmu_rbd_aio_write(struct tcmu_device *dev, struct rbd_aio_cb *aio_cb
  * the only errno we've to bother about as of now are memory
  * allocation errors.
  */
-static void rbd_finish_aio_generic(rbd_completion_t completion,
-				   struct rbd_aio_cb *aio_cb)
+static void rbd_finish_aio_ret(struct rbd_aio_cb *aio_cb, int64_t ret)
 {
 	struct tcmu_device *dev = aio_cb->dev;
 	struct tcmulib_cmd *tcmulib_cmd = aio_cb->tcmulib_cmd;
 	struct iovec *iov = aio_cb->iov;
 	size_t iov_cnt = aio_cb->iov_cnt;
 	uint32_t cmp_offset;
-	int64_t ret;
 	int tcmu_r;
 
-	ret = rbd_aio_get_return_value(completion);
-	rbd_aio_release(completion);
-
 	if (ret == -ETIMEDOUT) {
 		tcmu_r = tcmu_rbd_handle_timedout_cmd(dev, tcmulib_cmd);
 	} else if (ret == -ESHUTDOWN || ret == -EROFS) {
+		if (ret == -ESHUTDOWN)
+			tcmu_rbd_conn_fenced(dev);
+#ifdef RBD_OBJECT_MAP_SUPPORT
+		tcmu_rbd_objmap_invalidate(dev);
+#endif
 		tcmu_r = tcmu_rbd_handle_blacklisted_cmd(dev, tcmulib_cmd);
 	} else if (ret == -EILSEQ && aio_cb->type == RBD_AIO_TYPE_CAW) {
 		cmp_offset = aio_cb->caw.miscompare_offset - aio_cb->caw.offset;
@@ -1099,7 +1753,7 @@ static void rbd_finish_aio_generic(rbd_completion_t completion,
 		tcmu_dev_err(dev, "Invalid IO request.\n");
 		tcmu_r = TCMU_STS_INVALID_CDB;
 	} else if (ret < 0) {
-		tcmu_dev_err(dev, "Got fatal IO error %"PRId64".\n", ret);
+		tcmu_dev_err_ratelimited(dev, "Got fatal IO error %"PRId64".\n", ret);
 
 		if (aio_cb->type == RBD_AIO_TYPE_READ)
 			tcmu_r = TCMU_STS_RD_ERR;
@@ -1107,21 +1761,31 @@ static void rbd_finish_aio_generic(rbd_completion_t completion,
 			tcmu_r = TCMU_STS_WR_ERR;
 	} else {
 		tcmu_r = TCMU_STS_OK;
-		if (aio_cb->type == RBD_AIO_TYPE_READ &&
-		    aio_cb->bounce_buffer) {
+		if (aio_cb->type == RBD_AIO_TYPE_READ && aio_cb->bounce) {
 			tcmu_memcpy_into_iovec(iov, iov_cnt,
-					       aio_cb->bounce_buffer,
+					       aio_cb->bounce->data,
 					       aio_cb->read.length);
 		}
 	}
 
 	tcmulib_cmd->done(dev, tcmulib_cmd, tcmu_r);
 
-	if (aio_cb->bounce_buffer)
-		free(aio_cb->bounce_buffer);
+	if (aio_cb->bounce)
+		rbd_bounce_put(dev, aio_cb->bounce);
 	free(aio_cb);
 }
 
+static void rbd_finish_aio_generic(rbd_completion_t completion,
+				   struct rbd_aio_cb *aio_cb)
+{
+	int64_t ret;
+
+	ret = rbd_aio_get_return_value(completion);
+	rbd_aio_release(completion);
+
+	rbd_finish_aio_ret(aio_cb, ret);
+}
+
 static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 			     struct iovec *iov, size_t iov_cnt, size_t length,
 			     off_t offset)
@@ -1130,6 +1794,13 @@ static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	rbd_completion_t completion;
 	ssize_t ret;
 
+	/* never written, so there is nothing to read from the OSDs */
+	if (tcmu_rbd_objmap_is_hole(dev, offset, length)) {
+		tcmu_zero_iovec(iov, iov_cnt);
+		cmd->done(dev, cmd, TCMU_STS_OK);
+		return TCMU_STS_OK;
+	}
+
 	aio_cb = calloc(1, sizeof(*aio_cb));
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
@@ -1188,6 +1859,7 @@ static int tcmu_rbd_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 		goto out_free_aio_cb;
 	}
 
+	tcmu_rbd_objmap_mark(dev, offset, length);
 	ret = tcmu_rbd_aio_write(dev, aio_cb, completion, iov, iov_cnt,
 				 length, offset);
 	if (ret < 0) {
@@ -1205,45 +1877,231 @@ out:
 }
 
 #ifdef RBD_DISCARD_SUPPORT
-static int tcmu_rbd_unmap(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
-			  uint64_t off, uint64_t len)
+static void rbd_unmap_set_ret(struct rbd_aio_cb *aio_cb, int64_t ret)
+{
+	int64_t ok = 0;
+
+	/* only the first error is returned */
+	__atomic_compare_exchange_n(&aio_cb->unmap.ret, &ok, ret, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void rbd_unmap_put(struct rbd_aio_cb *aio_cb, size_t count)
+{
+	if (!__atomic_sub_fetch(&aio_cb->unmap.pending, count,
+				__ATOMIC_ACQ_REL))
+		rbd_finish_aio_ret(aio_cb, aio_cb->unmap.ret);
+}
+
+static void rbd_finish_aio_unmap(rbd_completion_t completion,
+				 struct rbd_aio_cb *aio_cb)
+{
+	int64_t ret;
+
+	ret = rbd_aio_get_return_value(completion);
+	rbd_aio_release(completion);
+
+	if (ret < 0)
+		rbd_unmap_set_ret(aio_cb, ret);
+	rbd_unmap_put(aio_cb, 1);
+}
+
+/*
+ * librbd has no vectored discard, but the extents are already merged, so
+ * all of them are queued at once and the cmd is completed by the last.
+ */
+static int tcmu_rbd_unmapv(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   struct tcmur_unmap_extent *extents,
+			   size_t nr_extents)
 {
 	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
 	struct rbd_aio_cb *aio_cb;
 	rbd_completion_t completion;
-	ssize_t ret;
+	ssize_t ret = 0;
+	size_t i, skipped = 0;
 
 	aio_cb = calloc(1, sizeof(*aio_cb));
 	if (!aio_cb) {
 		tcmu_dev_err(dev, "Could not allocate aio_cb.\n");
-		goto out;
+		return TCMU_STS_NO_RESOURCE;
 	}
 
 	aio_cb->dev = dev;
 	aio_cb->tcmulib_cmd = cmd;
 	aio_cb->type = RBD_AIO_TYPE_WRITE;
-	aio_cb->bounce_buffer = NULL;
+	aio_cb->bounce = NULL;
+	/* the extra count keeps the cmd from completing while queueing */
+	aio_cb->unmap.pending = nr_extents + 1;
+
+	for (i = 0; i < nr_extents; i++) {
+		/* there is nothing to discard in a hole */
+		if (tcmu_rbd_objmap_is_hole(dev, extents[i].off,
+					    extents[i].len)) {
+			skipped++;
+			continue;
+		}
 
-	ret = rbd_aio_create_completion
-		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
-	if (ret < 0)
-		goto out_free_aio_cb;
+		ret = rbd_aio_create_completion
+			(aio_cb, (rbd_callback_t) rbd_finish_aio_unmap,
+			 &completion);
+		if (ret < 0)
+			break;
 
-	ret = rbd_aio_discard(state->image, off, len, completion);
-	if (ret < 0)
-		goto out_remove_tracked_aio;
+		ret = rbd_aio_discard(state->image, extents[i].off,
+				      extents[i].len, completion);
+		if (ret < 0) {
+			rbd_aio_release(completion);
+			break;
+		}
+	}
 
-	return TCMU_STS_OK;
+	if (i < nr_extents) {
+		tcmu_dev_err(dev, "Could not queue discard %zu of %zu: %zd\n",
+			     i, nr_extents, ret);
+		if (i == skipped) {
+			free(aio_cb);
+			return TCMU_STS_NO_RESOURCE;
+		}
+		rbd_unmap_set_ret(aio_cb, ret);
+	}
 
-out_remove_tracked_aio:
-	rbd_aio_release(completion);
-out_free_aio_cb:
-	free(aio_cb);
-out:
-	return TCMU_STS_NO_RESOURCE;
+	rbd_unmap_put(aio_cb, skipped + nr_extents - i + 1);
+	return TCMU_STS_OK;
 }
 #endif /* RBD_DISCARD_SUPPORT */
 
+#ifdef RBD_DIFF_ITERATE2_SUPPORT
+struct rbd_lba_status {
+	struct tcmur_lba_status *status;
+	size_t nr_status;
+	size_t max_status;
+	uint64_t cur;	/* where the last range ended */
+};
+
+static int rbd_lba_status_add(struct rbd_lba_status *ls, uint64_t end,
+			      bool mapped)
+{
+	struct tcmur_lba_status *last = NULL;
+
+	if (ls->nr_status)
+		last = &ls->status[ls->nr_status - 1];
+
+	if (last && last->mapped == mapped) {
+		last->len = end - last->off;
+	} else {
+		if (ls->nr_status == ls->max_status)
+			return -ENOSPC;
+		last = &ls->status[ls->nr_status++];
+		last->off = ls->cur;
+		last->len = end - ls->cur;
+		last->mapped = mapped;
+	}
+	ls->cur = end;
+	return 0;
+}
+
+/* Called for each allocated extent, the gaps between them are holes */
+static int rbd_lba_status_cb(uint64_t off, size_t len, int exists, void *arg)
+{
+	struct rbd_lba_status *ls = arg;
+	int ret;
+
+	if (!exists)
+		return 0;
+
+	if (off > ls->cur) {
+		ret = rbd_lba_status_add(ls, off, false);
+		if (ret)
+			return ret;
+	}
+	return rbd_lba_status_add(ls, off + len, true);
+}
+
+#ifdef RBD_OBJECT_MAP_SUPPORT
+/*
+ * Answer from the cached object map, one object at a time. Objects that
+ * may exist are reported as mapped. Returns false if it can not be used.
+ */
+static bool tcmu_rbd_objmap_lba_status(struct tcmu_device *dev,
+				       struct rbd_lba_status *ls,
+				       uint64_t off, uint64_t len)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct tcmu_rbd_objmap *map = &state->objmap;
+	uint64_t end = off + len, obj_end;
+	bool usable = false;
+
+	if (!tcmu_rbd_objmap_usable(dev))
+		return false;
+
+	pthread_rwlock_rdlock(&map->lock);
+	if (((end - 1) >> map->order) >= map->nr_objs)
+		goto unlock;
+
+	usable = true;
+	while (ls->cur < end) {
+		obj_end = ((ls->cur >> map->order) + 1) << map->order;
+		if (rbd_lba_status_add(ls, min(obj_end, end),
+				       rbd_objmap_test(map->bits,
+						       ls->cur >> map->order)))
+			break;
+	}
+unlock:
+	pthread_rwlock_unlock(&map->lock);
+	return usable;
+}
+#endif
+
+/*
+ * Extents that were never written to, or were discarded, in the image
+ * and its parents are deallocated. This blocks while librbd walks the
+ * object map, or lists the objects without one, which is fine as the
+ * runner does not call it from the cmdproc thread.
+ */
+static int tcmu_rbd_get_lba_status(struct tcmu_device *dev,
+				   struct tcmulib_cmd *cmd, uint64_t off,
+				   uint64_t len, struct tcmur_lba_status *status,
+				   size_t *nr_status)
+{
+	struct tcmu_rbd_state *state = tcmu_get_dev_private(dev);
+	struct rbd_lba_status ls = {
+		.status = status,
+		.max_status = *nr_status,
+		.cur = off,
+	};
+	int ret;
+
+#ifdef RBD_OBJECT_MAP_SUPPORT
+	if (tcmu_rbd_objmap_lba_status(dev, &ls, off, len)) {
+		*nr_status = ls.nr_status;
+		cmd->done(dev, cmd, TCMU_STS_OK);
+		return TCMU_STS_OK;
+	}
+#endif
+
+	ret = rbd_diff_iterate2(state->image, NULL, off, len, 1, 0,
+				rbd_lba_status_cb, &ls);
+	if (ret == -ENOSPC) {
+		/* the ranges filled in so far are complete */
+		ret = 0;
+	} else if (!ret && ls.cur < off + len) {
+		/* the tail after the last extent is a hole */
+		rbd_lba_status_add(&ls, off + len, false);
+	}
+
+	if (ret < 0) {
+		tcmu_dev_err(dev, "Could not get allocated extents: %d\n", ret);
+		ret = TCMU_STS_RD_ERR;
+	} else {
+		*nr_status = ls.nr_status;
+		ret = TCMU_STS_OK;
+	}
+
+	cmd->done(dev, cmd, ret);
+	return TCMU_STS_OK;
+}
+#endif /* RBD_DIFF_ITERATE2_SUPPORT */
+
 #ifdef LIBRBD_SUPPORTS_AIO_FLUSH
 
 static int tcmu_rbd_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
@@ -1262,7 +2120,7 @@ static int tcmu_rbd_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	aio_cb->dev = dev;
 	aio_cb->tcmulib_cmd = cmd;
 	aio_cb->type = RBD_AIO_TYPE_WRITE;
-	aio_cb->bounce_buffer = NULL;
+	aio_cb->bounce = NULL;
 
 	ret = rbd_aio_create_completion
 		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
@@ -1297,6 +2155,7 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 	struct rbd_aio_cb *aio_cb;
 	rbd_completion_t completion;
 	size_t length = tcmu_iovec_length(iov, iov_cnt);
+	char *buf;
 	ssize_t ret;
 
 	aio_cb = calloc(1, sizeof(*aio_cb));
@@ -1309,23 +2168,26 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 	aio_cb->tcmulib_cmd = cmd;
 	aio_cb->type = RBD_AIO_TYPE_WRITE;
 
-	aio_cb->bounce_buffer = malloc(length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Failed to allocate bounce buffer.\n");
-		goto out_free_aio_cb;
+	if (iov_cnt == 1) {
+		buf = iov->iov_base;
+	} else {
+		aio_cb->bounce = rbd_bounce_get(dev, length);
+		if (!aio_cb->bounce)
+			goto out_free_aio_cb;
+		buf = aio_cb->bounce->data;
+		tcmu_memcpy_from_iovec(buf, length, iov, iov_cnt);
 	}
 
-	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, length, iov, iov_cnt);
-
 	ret = rbd_aio_create_completion
 		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
 	if (ret < 0)
 		goto out_free_bounce_buffer;
 
 	tcmu_dev_dbg(dev, "Start write same off:%"PRIu64", len:%"PRIu64"\n", off, len);
+	tcmu_rbd_objmap_mark(dev, off, len);
 
-	ret = rbd_aio_writesame(state->image, off, len, aio_cb->bounce_buffer,
-				length, completion, 0);
+	ret = rbd_aio_writesame(state->image, off, len, buf, length,
+				completion, 0);
 	if (ret < 0)
 		goto out_remove_tracked_aio;
 
@@ -1334,7 +2196,8 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 out_remove_tracked_aio:
 	rbd_aio_release(completion);
 out_free_bounce_buffer:
-	free(aio_cb->bounce_buffer);
+	if (aio_cb->bounce)
+		rbd_bounce_put(dev, aio_cb->bounce);
 out_free_aio_cb:
 	free(aio_cb);
 out:
@@ -1351,6 +2214,7 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	struct rbd_aio_cb *aio_cb;
 	rbd_completion_t completion;
 	uint64_t buffer_length = 2 * len;
+	char *buf;
 	ssize_t ret;
 
 	aio_cb = calloc(1, sizeof(*aio_cb));
@@ -1364,15 +2228,16 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	aio_cb->type = RBD_AIO_TYPE_CAW;
 	aio_cb->caw.offset = off;
 
-	aio_cb->bounce_buffer = malloc(buffer_length);
-	if (!aio_cb->bounce_buffer) {
-		tcmu_dev_err(dev, "Failed to allocate bounce buffer.\n");
-		goto out_free_aio_cb;
-	}
-
 	/* compare followed by write buffer are combined */
-	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, buffer_length, iov,
-			       iov_cnt);
+	if (iov_cnt == 1) {
+		buf = iov->iov_base;
+	} else {
+		aio_cb->bounce = rbd_bounce_get(dev, buffer_length);
+		if (!aio_cb->bounce)
+			goto out_free_aio_cb;
+		buf = aio_cb->bounce->data;
+		tcmu_memcpy_from_iovec(buf, buffer_length, iov, iov_cnt);
+	}
 
 	ret = rbd_aio_create_completion(
 		aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
@@ -1382,9 +2247,9 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 
 	tcmu_dev_dbg(dev, "Start CAW off: %"PRIu64", len: %"PRIu64"\n",
 		     off, len);
-	ret = rbd_aio_compare_and_write(state->image, off, len,
-					aio_cb->bounce_buffer,
-					aio_cb->bounce_buffer + len, completion,
+	tcmu_rbd_objmap_mark(dev, off, len);
+	ret = rbd_aio_compare_and_write(state->image, off, len, buf, buf + len,
+					completion,
 					&aio_cb->caw.miscompare_offset, 0);
 	if (ret < 0)
 		goto out_remove_tracked_aio;
@@ -1394,7 +2259,8 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 out_remove_tracked_aio:
 	rbd_aio_release(completion);
 out_free_bounce_buffer:
-	free(aio_cb->bounce_buffer);
+	if (aio_cb->bounce)
+		rbd_bounce_put(dev, aio_cb->bounce);
 out_free_aio_cb:
 	free(aio_cb);
 out:
@@ -1466,7 +2332,10 @@ static const char tcmu_rbd_cfg_desc[] =
 	"devicename:	Name of the RBD image\n"
 	"optionN:	Like: \"osd_op_timeout=30\" in secs\n"
 	"                     \"conf=/etc/ceph/cluster.conf\"\n"
-	"                     \"id=user\"\n";
+	"                     \"id=user\"\n"
+	"                     \"bounce_hugepages=1\"\n"
+	"                     \"rados_conns=N\" to share up to N cluster\n"
+	"                     handles with other images\n";
 
 struct tcmur_handler tcmu_rbd_handler = {
 	.name	       = "Ceph RBD handler",
@@ -1481,7 +2350,10 @@ struct tcmur_handler tcmu_rbd_handler = {
 	.flush	       = tcmu_rbd_flush,
 #endif
 #ifdef RBD_DISCARD_SUPPORT
-	.unmap         = tcmu_rbd_unmap,
+	.unmapv        = tcmu_rbd_unmapv,
+#endif
+#ifdef RBD_DIFF_ITERATE2_SUPPORT
+	.get_lba_status = tcmu_rbd_get_lba_status,
 #endif
 	.handle_cmd    = tcmu_rbd_handle_cmd,
 #ifdef RBD_LOCK_ACQUIRE_SUPPORT
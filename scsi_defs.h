@@ -66,6 +66,7 @@
  * Service action opcodes
  */
 #define READ_CAPACITY_16		0x10
+#define GET_LBA_STATUS			0x12
 
 /* SCSI protocols; these are taken from SPC-3 section 7.5 */
 enum scsi_protocol {
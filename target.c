@@ -43,6 +43,11 @@ struct tgt_port_grp {
 	/* list of devs to recover */
 	struct list_head devs;
 	pthread_t recovery_thread;
+
+	/* devs reopening on the recovery pool, under tpg_recovery_lock */
+	unsigned int nr_reopening;
+	bool reopen_failed;
+	pthread_cond_t reopen_cond;
 };
 
 static int tcmu_set_tpg_int(struct tgt_port_grp *tpg, const char *name,
@@ -171,6 +176,7 @@ static struct tgt_port_grp *port_is_on_recovery_list(struct tgt_port *port)
 
 static void free_tgt_port_grp(struct tgt_port_grp *tpg)
 {
+	pthread_cond_destroy(&tpg->reopen_cond);
 	free(tpg->fabric);
 	free(tpg->wwn);
 	free(tpg);
@@ -184,6 +190,9 @@ static struct tgt_port_grp *setup_tgt_port_grp(struct tgt_port *port)
 	if (!tpg)
 		goto fail;
 
+	if (pthread_cond_init(&tpg->reopen_cond, NULL))
+		goto free_tpg;
+
 	list_head_init(&tpg->devs);
 	list_node_init(&tpg->recovery_entry);
 	tpg->tpgt = port->tpgt;
@@ -200,12 +209,70 @@ static struct tgt_port_grp *setup_tgt_port_grp(struct tgt_port *port)
 
 free_wwn:
 	free(tpg->wwn);
+	pthread_cond_destroy(&tpg->reopen_cond);
 free_tpg:
 	free(tpg);
 fail:
 	return NULL;
 }
 
+static void tgt_dev_reopen_done(struct tcmur_device *rdev, int ret)
+{
+	struct tgt_port_grp *tpg = rdev->recovery_tpg;
+
+	if (ret)
+		tcmu_dev_err(rdev->dev, "Could not reinitialize device. (err %d).\n",
+			     ret);
+
+	pthread_mutex_lock(&tpg_recovery_lock);
+	/* assume fatal error so do not enable tpg */
+	if (ret && !(tcmur_dev_get_flags(rdev) & TCMUR_DEV_FLAG_STOPPING))
+		tpg->reopen_failed = true;
+	if (!--tpg->nr_reopening)
+		pthread_cond_signal(&tpg->reopen_cond);
+	pthread_mutex_unlock(&tpg_recovery_lock);
+}
+
+/*
+ * Reopen a dev of a disabled tpg. Failed opens are retried after a
+ * backoff on the pool instead of in a loop, so a backend that is still
+ * down does not hold a thread other devs could use.
+ */
+static void tgt_dev_reopen_work_fn(struct tcmur_recovery_work *work)
+{
+	struct tcmur_device *rdev = container_of(work, struct tcmur_device,
+						 recovery_work);
+	struct tcmu_device *dev = rdev->dev;
+	unsigned int delay_ms;
+	int ret;
+
+	if (!rdev->recovery_attempts) {
+		ret = tcmu_reopen_dev_close(dev, false);
+		if (ret) {
+			if (ret > 0)
+				ret = 0;
+			goto done;
+		}
+	}
+
+	ret = tcmu_reopen_dev_open(dev);
+	if (ret && ret != -ESHUTDOWN) {
+		delay_ms = tcmur_recovery_backoff_ms(rdev->recovery_attempts++);
+		tcmu_dev_dbg(dev, "Open attempt %u failed (err %d), retrying in %u ms.\n",
+			     rdev->recovery_attempts, ret, delay_ms);
+		/* we are running on the pool, so there is a thread for it */
+		if (!tcmur_recovery_queue(work, tcmur_pending_nr_held(dev) > 0,
+					  delay_ms))
+			return;
+	}
+	if (ret == -ESHUTDOWN)
+		ret = -EIO;
+
+done:
+	tcmu_reopen_dev_done(dev);
+	tgt_dev_reopen_done(rdev, ret);
+}
+
 /*
  * Disable the target tpg to avoid flip flopping between paths
  * (transport path is ok so multipath layer switches to it, but
@@ -228,6 +295,7 @@ static void *tgt_port_grp_recovery_thread_fn(void *arg)
 	 * the list reopen list when setting enable=0 returns..
 	 */
 	ret = tcmu_set_tpg_int(tpg, "enable", 0);
+	tcmu_invalidate_all_alua_grps();
 
 	pthread_mutex_lock(&tpg_recovery_lock);
 	list_del(&tpg->recovery_entry);
@@ -246,23 +314,43 @@ static void *tgt_port_grp_recovery_thread_fn(void *arg)
 
 done:
 	/*
-	 * TODO - the transport is stopped, so we should use the
-	 * cmdproc thread to reopen all these in parallel.
+	 * The transport is stopped, so reopen all the devs in parallel on
+	 * the recovery pool, the ones initiators have cmds waiting on
+	 * first. No devs are added once the tpg is off tpg_recovery_list.
 	 */
+	pthread_mutex_lock(&tpg_recovery_lock);
 	list_for_each_safe(&tpg->devs, rdev, tmp_rdev, recovery_entry) {
 		list_del(&rdev->recovery_entry);
-		ret = __tcmu_reopen_dev(rdev->dev, false, -1);
+
+		rdev->recovery_tpg = tpg;
+		rdev->recovery_attempts = 0;
+		tcmur_recovery_work_init(&rdev->recovery_work,
+					 tgt_dev_reopen_work_fn);
+		tpg->nr_reopening++;
+		pthread_mutex_unlock(&tpg_recovery_lock);
+
+		ret = tcmur_recovery_queue(&rdev->recovery_work,
+					   tcmur_pending_nr_held(rdev->dev) > 0,
+					   0);
 		if (ret) {
-			tcmu_dev_err(rdev->dev, "Could not reinitialize device. (err %d).\n",
-				     ret);
-			if (!(rdev->flags & TCMUR_DEV_FLAG_STOPPING))
-				/* assume fatal error so do not enable tpg */
-				enable_tpg = false;
+			tcmu_dev_warn(rdev->dev, "Could not queue reopen (err %d), reopening it here.\n",
+				      ret);
+			ret = __tcmu_reopen_dev(rdev->dev, false, -1);
+			tgt_dev_reopen_done(rdev, ret);
 		}
+
+		pthread_mutex_lock(&tpg_recovery_lock);
 	}
 
+	while (tpg->nr_reopening)
+		pthread_cond_wait(&tpg->reopen_cond, &tpg_recovery_lock);
+	if (tpg->reopen_failed)
+		enable_tpg = false;
+	pthread_mutex_unlock(&tpg_recovery_lock);
+
 	if (enable_tpg) {
 		ret = tcmu_set_tpg_int(tpg, "enable", 1);
+		tcmu_invalidate_all_alua_grps();
 		if (ret) {
 			tcmu_err("Could not enable %s/%s/tpgt_%hu (err %d).\n",
 				 tpg->fabric, tpg->wwn, tpg->tpgt, ret);
@@ -0,0 +1,861 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Measure the per cmd cost of the runner and its handlers without LIO.
+ *
+ * tcmu-bench builds a tcmu_device around an in-memory mailbox and cmd
+ * ring, and plays the kernel's part itself: it queues generated cdbs
+ * on the ring, runs them through tcmulib_get_next_command and
+ * tcmur_generic_handle_cmd like the cmdproc thread does, and reaps
+ * the responses. Handlers run on the runner's io workers as usual.
+ *
+ * The built-in "bench" handler completes everything immediately, so
+ * it shows the runner's own overhead. Real handlers can be loaded
+ * with -H, e.g.:
+ *
+ *   tcmu-bench -r -w read -q 32 bench/
+ *   tcmu-bench -H ./handler_file.so -w write -t 4 file//tmp/bench.img
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <scsi/scsi.h>
+
+#include "darray.h"
+#include "target_core_user_local.h"
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_priv.h"
+#include "libtcmu_config.h"
+#include "tcmu-runner.h"
+#include "tcmur_aio.h"
+#include "tcmur_device.h"
+#include "tcmur_cmd_handler.h"
+#include "version.h"
+
+enum {
+	BENCH_READ,
+	BENCH_WRITE,
+	BENCH_MIX,
+	BENCH_UNMAP,
+	BENCH_CAW,
+	BENCH_WRITE_SAME,
+	BENCH_XCOPY,
+	BENCH_MAX,
+};
+
+static const char *bench_workloads[BENCH_MAX] = {
+	[BENCH_READ]		= "read",
+	[BENCH_WRITE]		= "write",
+	[BENCH_MIX]		= "mix",
+	[BENCH_UNMAP]		= "unmap",
+	[BENCH_CAW]		= "caw",
+	[BENCH_WRITE_SAME]	= "writesame",
+	[BENCH_XCOPY]		= "xcopy",
+};
+
+/* Percentage of reads in the mix workload */
+#define BENCH_MIX_READS 70
+
+#define BENCH_UNMAP_PARAM_LEN 24
+
+/* header, a target descriptor for src and dst, one segment descriptor */
+#define BENCH_XCOPY_PARAM_LEN 108
+
+/*
+ * XCOPYs are copied in chunks of the kernel's default hw_max_sectors,
+ * whatever the -l length of the segments is.
+ */
+#define BENCH_XCOPY_RW_LEN 128
+
+/* The device's vpd_unit_serial and the NAA designator made from it */
+#define BENCH_WWN "0123456789abcdef0123456789abcdef"
+static const uint8_t bench_naa[16] = {
+	0x60, 0x01, 0x40, 0x50, 0x12, 0x34, 0x56, 0x78,
+	0x9a, 0xbc, 0xde, 0xf0, 0x12, 0x34, 0x56, 0x78,
+};
+
+struct bench_cmd {
+	uint64_t submit_ns;
+	size_t data_off;	/* from the start of the mailbox */
+};
+
+struct bench {
+	int workload;
+	bool random;
+	int qd;
+	int threads;
+	uint32_t block_size;
+	uint32_t blocks;
+	uint64_t size;
+	uint64_t nr_cmds;
+
+	struct tcmu_device *dev;
+	struct tcmulib_handler lib_handler;
+	struct tcmu_mailbox *mb;
+	size_t ent_size;
+	uint32_t ktail;		/* responses reaped up to here */
+
+	struct bench_cmd *cmds;	/* indexed by cmd_id */
+	uint16_t *free_ids;
+	int nr_free;
+
+	uint64_t *lat;		/* ns, one per completed cmd */
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t next_lba;
+	unsigned int seed;
+};
+
+static struct bench bench = {
+	.workload	= BENCH_READ,
+	.qd		= 32,
+	.threads	= -1,
+	.block_size	= 512,
+	.blocks		= 8,
+	.size		= 1024 * 1024 * 1024,
+	.nr_cmds	= 1000000,
+	.seed		= 1,
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Count the allocations done while cmds are running, by the runner,
+ * libtcmu and the handlers alike.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static bool bench_count_allocs;
+static uint64_t bench_allocs;
+
+static inline void bench_count_alloc(void)
+{
+	if (__atomic_load_n(&bench_count_allocs, __ATOMIC_RELAXED))
+		__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	bench_count_alloc();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	bench_count_alloc();
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	bench_count_alloc();
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *p;
+
+	bench_count_alloc();
+	p = __libc_memalign(alignment, size);
+	if (!p)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+/*
+ * There is no configfs entry behind the synthetic device, so answer
+ * the lookups libtcmu and the handlers do from the bench parameters.
+ */
+long long tcmu_get_dev_size(struct tcmu_device *dev)
+{
+	return bench.size;
+}
+
+char *tcmu_get_wwn(struct tcmu_device *dev)
+{
+	return strdup(BENCH_WWN);
+}
+
+int tcmu_get_attribute(struct tcmu_device *dev, const char *name)
+{
+	if (!strcmp(name, "hw_block_size"))
+		return bench.block_size;
+	if (!strcmp(name, "hw_max_sectors"))
+		return bench.blocks;
+	return -ENOENT;
+}
+
+static darray(struct tcmur_handler *) bench_handlers = darray_new();
+
+int tcmur_register_handler(struct tcmur_handler *handler)
+{
+	darray_append(bench_handlers, handler);
+	return 0;
+}
+
+bool tcmur_unregister_handler(struct tcmur_handler *handler)
+{
+	int i;
+
+	for (i = 0; i < darray_size(bench_handlers); i++) {
+		if (darray_item(bench_handlers, i) == handler) {
+			darray_remove(bench_handlers, i);
+			return true;
+		}
+	}
+	return false;
+}
+
+static int bench_null_open(struct tcmu_device *dev, bool reopen)
+{
+	tcmu_set_dev_write_cache_enabled(dev, 1);
+	return 0;
+}
+
+static void bench_null_close(struct tcmu_device *dev)
+{
+}
+
+static int bench_null_rw(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			 struct iovec *iov, size_t iov_cnt, size_t length,
+			 off_t offset)
+{
+	cmd->done(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static int bench_null_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	cmd->done(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static int bench_null_unmap(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			    uint64_t off, uint64_t len)
+{
+	cmd->done(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static struct tcmur_handler bench_null_handler = {
+	.name		= "Benchmark null handler",
+	.subtype	= "bench",
+	.cfg_desc	= "no options",
+	.open		= bench_null_open,
+	.close		= bench_null_close,
+	.read		= bench_null_rw,
+	.write		= bench_null_rw,
+	.flush		= bench_null_flush,
+	.unmap		= bench_null_unmap,
+	.nr_threads	= 1,
+	.max_threads	= TCMUR_MAX_IO_THREADS,
+};
+
+static int bench_load_handler(const char *path)
+{
+	int (*handler_init)(void);
+	void *handle;
+
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		tcmu_err("Could not open handler at %s: %s\n", path, dlerror());
+		return -EINVAL;
+	}
+
+	handler_init = dlsym(handle, "handler_init");
+	if (!handler_init) {
+		tcmu_err("dlsym failure on %s: (%s)\n", path, dlerror());
+		return -EINVAL;
+	}
+
+	return handler_init() ? -EINVAL : 0;
+}
+
+static struct tcmur_handler *bench_find_handler(const char *cfgstring)
+{
+	struct tcmur_handler **handler;
+	size_t len;
+
+	darray_foreach(handler, bench_handlers) {
+		len = strlen((*handler)->subtype);
+		if (!strncmp(cfgstring, (*handler)->subtype, len) &&
+		    cfgstring[len] == '/')
+			return *handler;
+	}
+	return NULL;
+}
+
+/*
+ * Every ring entry has one iovec and a 16 byte cdb, so all entries have
+ * the same size and the ring never needs padding. One slot is left free
+ * so a full ring can be told from an empty one.
+ */
+static int bench_setup_ring(struct bench *b)
+{
+	struct tcmu_device *dev = b->dev;
+	size_t cmdr_off, cmdr_size, data_len, map_len;
+	void *map;
+	int i, ret;
+
+	b->ent_size = round_up(sizeof(struct tcmu_cmd_entry) +
+			       sizeof(struct iovec) + 16, TCMU_OP_ALIGN_SIZE);
+
+	data_len = max((size_t)b->blocks * b->block_size,
+		       (size_t)2 * b->block_size);
+	data_len = max(data_len, (size_t)BENCH_UNMAP_PARAM_LEN);
+	data_len = round_up(max(data_len, (size_t)BENCH_XCOPY_PARAM_LEN),
+			    (size_t)4096);
+
+	cmdr_off = round_up(sizeof(struct tcmu_mailbox), (size_t)ALIGN_SIZE);
+	cmdr_size = b->ent_size * (b->qd + 1);
+	map_len = round_up(cmdr_off + cmdr_size, (size_t)4096) +
+		  data_len * b->qd;
+
+	ret = posix_memalign(&map, 4096, map_len);
+	if (ret)
+		return -ret;
+	memset(map, 0, map_len);
+
+	b->mb = map;
+	b->mb->version = 2;
+	b->mb->cmdr_off = cmdr_off;
+	b->mb->cmdr_size = cmdr_size;
+	dev->map = map;
+	dev->map_len = map_len;
+
+	b->cmds = calloc(b->qd, sizeof(*b->cmds));
+	b->free_ids = calloc(b->qd, sizeof(*b->free_ids));
+	b->lat = calloc(b->nr_cmds, sizeof(*b->lat));
+	if (!b->cmds || !b->free_ids || !b->lat)
+		return -ENOMEM;
+
+	for (i = 0; i < b->qd; i++) {
+		b->cmds[i].data_off = round_up(cmdr_off + cmdr_size,
+					       (size_t)4096) + i * data_len;
+		b->free_ids[b->nr_free++] = b->qd - 1 - i;
+	}
+	return 0;
+}
+
+/*
+ * -t is passed on as the runner's thread options, except for the built-in
+ * handler which can also complete cmds without io workers.
+ */
+static int bench_set_io_threads(struct bench *b, struct tcmur_handler *rhandler)
+{
+	char *cfgstring = tcmu_get_dev_cfgstring(b->dev);
+	size_t len = strlen(cfgstring);
+	int n;
+
+	if (b->threads < 0)
+		return 0;
+
+	if (rhandler == &bench_null_handler) {
+		rhandler->nr_threads = b->threads;
+		return 0;
+	}
+
+	n = snprintf(cfgstring + len, sizeof(b->dev->cfgstring) - len,
+		     ";%snr_threads=%d;%smax_threads=%d", TCMUR_DEV_OPT_PREFIX,
+		     b->threads, TCMUR_DEV_OPT_PREFIX, b->threads);
+	if ((size_t)n >= sizeof(b->dev->cfgstring) - len)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+/*
+ * The parts of the runner's dev_added that do not need configfs. There
+ * is no tcmu.conf, so the runner's defaults are used like they are
+ * without one.
+ */
+static int bench_add_dev(struct bench *b, const char *cfgstring)
+{
+	struct tcmur_handler *rhandler;
+	struct tcmur_device *rdev;
+	struct tcmu_device *dev;
+	char *reason = NULL;
+	int ret;
+
+	rhandler = bench_find_handler(cfgstring);
+	if (!rhandler) {
+		tcmu_err("No handler for %s\n", cfgstring);
+		return -ENOENT;
+	}
+
+	if (rhandler->check_config &&
+	    !rhandler->check_config(cfgstring, &reason)) {
+		tcmu_err("check_config failed for %s: %s\n", cfgstring,
+			 reason ? : "unknown");
+		free(reason);
+		return -EINVAL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
+	b->dev = dev;
+
+	pthread_mutex_init(&dev->cfgfs_lock, NULL);
+	snprintf(dev->dev_name, sizeof(dev->dev_name), "bench");
+	snprintf(dev->tcm_hba_name, sizeof(dev->tcm_hba_name), "user_0");
+	snprintf(dev->tcm_dev_name, sizeof(dev->tcm_dev_name), "bench0");
+	snprintf(dev->cfgstring, sizeof(dev->cfgstring), "%s", cfgstring);
+
+	b->lib_handler.name = rhandler->name;
+	b->lib_handler.subtype = rhandler->subtype;
+	b->lib_handler.cfg_desc = rhandler->cfg_desc;
+	b->lib_handler.check_config = rhandler->check_config;
+	b->lib_handler.hm_private = rhandler;
+	dev->handler = &b->lib_handler;
+
+	/* Reads of it never block, and writes always succeed */
+	dev->fd = open("/dev/null", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (dev->fd == -1)
+		return -errno;
+
+	ret = bench_setup_ring(b);
+	if (ret)
+		return ret;
+
+	tcmu_set_dev_block_size(dev, b->block_size);
+	tcmu_set_dev_num_lbas(dev, b->size / b->block_size);
+	tcmu_set_dev_max_xfer_len(dev, b->blocks);
+	tcmu_set_dev_max_unmap_len(dev, VPD_MAX_UNMAP_LBA_COUNT);
+	tcmu_set_dev_opt_unmap_gran(dev, b->blocks, true);
+	tcmu_set_dev_unmap_gran_align(dev, 0);
+	tcmu_set_dev_opt_xcopy_rw_len(dev, min(b->blocks,
+					       (uint32_t)BENCH_XCOPY_RW_LEN));
+
+	tcmulib_set_cmd_private_size(sizeof(struct tcmur_cmd));
+	ret = tcmulib_setup_cmd_pool(dev, b->qd, 1);
+	if (ret)
+		tcmu_warn("Could not setup cmd pool %d. Using malloc.\n", ret);
+
+	ret = bench_set_io_threads(b, rhandler);
+	if (ret)
+		return ret;
+
+	ret = tcmur_dev_setup(dev, NULL);
+	if (ret) {
+		tcmu_err("Could not open %s %d\n", cfgstring, ret);
+		return ret;
+	}
+	rdev = tcmu_get_daemon_dev_private(dev);
+	b->threads = rdev->nr_threads;
+
+	/* We are the cmdproc thread */
+	rdev->cmdproc_thread = pthread_self();
+	return 0;
+}
+
+static void bench_remove_dev(struct bench *b)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(b->dev);
+
+	tcmur_dev_stop_io(b->dev);
+	/*
+	 * The last cmds are reaped as soon as a worker queues them, so let
+	 * it finish with them before the workers are cancelled.
+	 */
+	aio_wait_for_empty_queue(rdev);
+	cleanup_io_work_queue_threads(b->dev);
+	tcmur_stop_device(b->dev);
+	tcmur_dev_cleanup(b->dev);
+}
+
+static uint64_t bench_next_lba(struct bench *b)
+{
+	uint64_t nr_slots = tcmu_get_dev_num_lbas(b->dev) / b->blocks;
+	uint64_t lba;
+
+	if (b->random)
+		return ((uint64_t)rand_r(&b->seed) % nr_slots) * b->blocks;
+
+	lba = b->next_lba;
+	b->next_lba += b->blocks;
+	if (b->next_lba + b->blocks > nr_slots * b->blocks)
+		b->next_lba = 0;
+	return lba;
+}
+
+/* Returns the length of the data out/in buffer */
+static size_t bench_fill_cdb(struct bench *b, int op, uint8_t *cdb,
+			     uint8_t *data)
+{
+	uint64_t lba = bench_next_lba(b);
+	uint64_t half;
+	uint8_t *desc;
+	int i;
+
+	switch (op) {
+	case BENCH_READ:
+	case BENCH_WRITE:
+		cdb[0] = op == BENCH_READ ? READ_16 : WRITE_16;
+		*(uint64_t *)&cdb[2] = htobe64(lba);
+		*(uint32_t *)&cdb[10] = htobe32(b->blocks);
+		b->bytes += (uint64_t)b->blocks * b->block_size;
+		return b->blocks * b->block_size;
+	case BENCH_WRITE_SAME:
+		cdb[0] = WRITE_SAME_16;
+		*(uint64_t *)&cdb[2] = htobe64(lba);
+		*(uint32_t *)&cdb[10] = htobe32(b->blocks);
+		b->bytes += (uint64_t)b->blocks * b->block_size;
+		return b->block_size;
+	case BENCH_CAW:
+		/* zeros compared with and written, so it keeps matching */
+		cdb[0] = COMPARE_AND_WRITE;
+		*(uint64_t *)&cdb[2] = htobe64(lba);
+		cdb[13] = 1;
+		memset(data, 0, 2 * b->block_size);
+		b->bytes += b->block_size;
+		return 2 * b->block_size;
+	case BENCH_UNMAP:
+		cdb[0] = UNMAP;
+		*(uint16_t *)&cdb[7] = htobe16(BENCH_UNMAP_PARAM_LEN);
+		memset(data, 0, BENCH_UNMAP_PARAM_LEN);
+		*(uint16_t *)&data[0] = htobe16(BENCH_UNMAP_PARAM_LEN - 2);
+		*(uint16_t *)&data[2] = htobe16(16);
+		*(uint64_t *)&data[8] = htobe64(lba);
+		*(uint32_t *)&data[16] = htobe32(b->blocks);
+		b->bytes += (uint64_t)b->blocks * b->block_size;
+		return BENCH_UNMAP_PARAM_LEN;
+	case BENCH_XCOPY:
+		/* copy to the other half of the device */
+		half = tcmu_get_dev_num_lbas(b->dev) / b->blocks / 2 * b->blocks;
+		cdb[0] = EXTENDED_COPY;
+		*(uint32_t *)&cdb[10] = htobe32(BENCH_XCOPY_PARAM_LEN);
+		memset(data, 0, BENCH_XCOPY_PARAM_LEN);
+		data[1] = 0x18;
+		*(uint16_t *)&data[2] = htobe16(64);
+		*(uint32_t *)&data[8] = htobe32(28);
+		for (i = 0; i < 2; i++) {
+			desc = &data[16 + i * 32];
+			desc[0] = XCOPY_TARGET_DESC_TYPE_CODE_ID;
+			desc[4] = 0x01;
+			desc[5] = 0x03;
+			desc[7] = sizeof(bench_naa);
+			memcpy(&desc[8], bench_naa, sizeof(bench_naa));
+		}
+		desc = &data[80];
+		desc[0] = XCOPY_SEG_DESC_TYPE_CODE_B2B;
+		*(uint16_t *)&desc[2] = htobe16(0x18);
+		*(uint16_t *)&desc[6] = htobe16(1);
+		*(uint16_t *)&desc[10] = htobe16(b->blocks);
+		*(uint64_t *)&desc[12] = htobe64(lba);
+		*(uint64_t *)&desc[20] = htobe64(lba < half ? lba + half :
+							     lba - half);
+		b->bytes += (uint64_t)b->blocks * b->block_size;
+		return BENCH_XCOPY_PARAM_LEN;
+	}
+	return 0;
+}
+
+/* What the kernel does when LIO hands it a cmd */
+static void bench_submit(struct bench *b)
+{
+	struct tcmu_mailbox *mb = b->mb;
+	struct tcmu_cmd_entry *ent;
+	struct bench_cmd *bc;
+	uint32_t len_op = 0;
+	uint16_t cmd_id;
+	uint8_t *cdb;
+	int op = b->workload;
+
+	if (op == BENCH_MIX)
+		op = rand_r(&b->seed) % 100 < BENCH_MIX_READS ?
+					BENCH_READ : BENCH_WRITE;
+
+	cmd_id = b->free_ids[--b->nr_free];
+	bc = &b->cmds[cmd_id];
+
+	ent = (void *)mb + mb->cmdr_off + mb->cmd_head;
+	memset(ent, 0, b->ent_size);
+	tcmu_hdr_set_op(&len_op, TCMU_OP_CMD);
+	tcmu_hdr_set_len(&len_op, b->ent_size);
+	ent->hdr.len_op = len_op;
+	ent->hdr.cmd_id = cmd_id;
+	ent->req.iov_cnt = 1;
+
+	cdb = (uint8_t *)&ent->req.iov[1];
+	ent->req.cdb_off = (void *)cdb - (void *)mb;
+	ent->req.iov[0].iov_base = (void *)bc->data_off;
+	ent->req.iov[0].iov_len = bench_fill_cdb(b, op, cdb,
+						 (void *)mb + bc->data_off);
+
+	bc->submit_ns = bench_now();
+	__atomic_store_n(&mb->cmd_head,
+			 (mb->cmd_head + b->ent_size) % mb->cmdr_size,
+			 __ATOMIC_RELEASE);
+	b->submitted++;
+}
+
+/* What the kernel does when the runner writes to the uio fd */
+static void bench_reap(struct bench *b)
+{
+	struct tcmu_mailbox *mb = b->mb;
+	struct tcmu_cmd_entry *ent;
+	uint32_t tail;
+	uint64_t now;
+
+	tail = __atomic_load_n(&mb->cmd_tail, __ATOMIC_ACQUIRE);
+	if (tail == b->ktail)
+		return;
+
+	now = bench_now();
+	while (b->ktail != tail) {
+		ent = (void *)mb + mb->cmdr_off + b->ktail;
+
+		if (ent->rsp.scsi_status)
+			b->errors++;
+		b->lat[b->completed++] = now - b->cmds[ent->hdr.cmd_id].submit_ns;
+		b->free_ids[b->nr_free++] = ent->hdr.cmd_id;
+
+		b->ktail = (b->ktail + b->ent_size) % mb->cmdr_size;
+	}
+}
+
+static int bench_run(struct bench *b)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(b->dev);
+	struct pollfd pfd;
+	eventfd_t kicks;
+	int ret;
+
+	__atomic_store_n(&bench_count_allocs, true, __ATOMIC_RELAXED);
+
+	while (b->completed < b->nr_cmds) {
+		while (b->nr_free && b->submitted < b->nr_cmds)
+			bench_submit(b);
+
+		tcmur_process_ring(b->dev, false);
+		bench_reap(b);
+
+		if (b->completed == b->nr_cmds ||
+		    (b->nr_free && b->submitted < b->nr_cmds) ||
+		    tcmulib_has_queued_completions(b->dev))
+			continue;
+
+		/* Wait for the io workers to complete something */
+		pfd.fd = rdev->cmpl_efd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		ret = poll(&pfd, 1, 10000);
+		if (ret == -1 && errno != EINTR) {
+			tcmu_err("poll error %d\n", errno);
+			return -errno;
+		}
+		if (!ret) {
+			tcmu_err("No cmd completed in 10 seconds, %" PRIu64 " outstanding\n",
+				 b->submitted - b->completed);
+			return -ETIMEDOUT;
+		}
+		eventfd_read(rdev->cmpl_efd, &kicks);
+	}
+
+	__atomic_store_n(&bench_count_allocs, false, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int bench_cmp_lat(const void *a, const void *b)
+{
+	uint64_t la = *(const uint64_t *)a, lb = *(const uint64_t *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static double bench_pct_usecs(struct bench *b, double pct)
+{
+	return b->lat[(uint64_t)((b->completed - 1) * pct / 100)] / 1000.0;
+}
+
+static void bench_report(struct bench *b, uint64_t elapsed_ns)
+{
+	double secs = elapsed_ns / 1000000000.0;
+	uint64_t i, sum = 0;
+
+	for (i = 0; i < b->completed; i++)
+		sum += b->lat[i];
+	qsort(b->lat, b->completed, sizeof(*b->lat), bench_cmp_lat);
+
+	printf("%s%s: qd %d, %d io threads, %u x %u byte blocks, %" PRIu64 " cmds\n",
+	       b->random ? "random " : "", bench_workloads[b->workload],
+	       b->qd, b->threads, b->blocks, b->block_size, b->completed);
+	printf("iops %.0f, %.2f MiB/s, %" PRIu64 " errors\n",
+	       b->completed / secs, b->bytes / secs / (1024 * 1024), b->errors);
+	printf("latency usecs: avg %.2f, p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+	       sum / 1000.0 / b->completed, bench_pct_usecs(b, 50),
+	       bench_pct_usecs(b, 90), bench_pct_usecs(b, 99),
+	       bench_pct_usecs(b, 99.9), bench_pct_usecs(b, 100));
+	printf("allocations per cmd %.2f\n",
+	       (double)bench_allocs / b->completed);
+}
+
+static void usage(void) {
+	printf("\nusage:\n");
+	printf("\ttcmu-bench [options] [cfgstring]\n");
+	printf("\nThe cfgstring defaults to \"bench/\", the built-in null handler.\n");
+	printf("\noptions:\n");
+	printf("\t-h, --help: print this message and exit\n");
+	printf("\t-V, --version: print version and exit\n");
+	printf("\t-d, --debug: enable debug messages\n");
+	printf("\t-H, --handler=PATH: load the handler module at PATH, can be repeated\n");
+	printf("\t-w, --workload=read|write|mix|unmap|caw|writesame|xcopy: default read\n");
+	printf("\t-r, --random: use random instead of sequential LBAs\n");
+	printf("\t-q, --queue-depth=N: cmds kept outstanding, default 32\n");
+	printf("\t-t, --threads=N: io worker threads, default the handler's\n");
+	printf("\t-b, --block-size=N: default 512\n");
+	printf("\t-l, --blocks=N: blocks per cmd, default 8\n");
+	printf("\t-s, --size=N: device size in MiB, default 1024\n");
+	printf("\t-n, --cmds=N: cmds to run, default 1000000\n");
+	printf("\n");
+}
+
+static struct option long_options[] = {
+	{"debug", no_argument, 0, 'd'},
+	{"help", no_argument, 0, 'h'},
+	{"version", no_argument, 0, 'V'},
+	{"handler", required_argument, 0, 'H'},
+	{"workload", required_argument, 0, 'w'},
+	{"random", no_argument, 0, 'r'},
+	{"queue-depth", required_argument, 0, 'q'},
+	{"threads", required_argument, 0, 't'},
+	{"block-size", required_argument, 0, 'b'},
+	{"blocks", required_argument, 0, 'l'},
+	{"size", required_argument, 0, 's'},
+	{"cmds", required_argument, 0, 'n'},
+	{0, 0, 0, 0},
+};
+
+int main(int argc, char **argv)
+{
+	const char *cfgstring = "bench/";
+	uint64_t start;
+	int i, ret;
+
+	tcmur_register_handler(&bench_null_handler);
+
+	while (1) {
+		int c;
+		int option_index = 0;
+
+		c = getopt_long(argc, argv, "dhVH:w:rq:t:b:l:s:n:",
+				long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			tcmu_set_log_level(TCMU_CONF_LOG_DEBUG);
+			break;
+		case 'H':
+			if (bench_load_handler(optarg))
+				exit(1);
+			break;
+		case 'w':
+			for (i = 0; i < BENCH_MAX; i++) {
+				if (!strcmp(optarg, bench_workloads[i]))
+					break;
+			}
+			if (i == BENCH_MAX) {
+				usage();
+				exit(1);
+			}
+			bench.workload = i;
+			break;
+		case 'r':
+			bench.random = true;
+			break;
+		case 'q':
+			bench.qd = atoi(optarg);
+			break;
+		case 't':
+			bench.threads = atoi(optarg);
+			break;
+		case 'b':
+			bench.block_size = atoi(optarg);
+			break;
+		case 'l':
+			bench.blocks = atoi(optarg);
+			break;
+		case 's':
+			bench.size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'n':
+			bench.nr_cmds = strtoull(optarg, NULL, 10);
+			break;
+		case 'V':
+			printf("tcmu-bench %s\n", TCMUR_VERSION);
+			exit(1);
+		default:
+		case 'h':
+			usage();
+			exit(1);
+		}
+	}
+
+	if (optind < argc)
+		cfgstring = argv[optind];
+
+	/*
+	 * cmd_ids are 16 bits, CAW only does one block and XCOPY segments
+	 * have a 16 bit block count.
+	 */
+	if (bench.qd <= 0 || bench.qd > UINT16_MAX || !bench.nr_cmds ||
+	    bench.block_size < 512 || !bench.blocks ||
+	    bench.size < (uint64_t)bench.block_size * bench.blocks ||
+	    (bench.workload == BENCH_CAW && bench.blocks != MAX_CAW_LENGTH) ||
+	    (bench.workload == BENCH_XCOPY &&
+	     (bench.blocks > UINT16_MAX ||
+	      bench.size < (uint64_t)bench.block_size * bench.blocks * 2))) {
+		usage();
+		exit(1);
+	}
+
+	ret = bench_add_dev(&bench, cfgstring);
+	if (ret) {
+		tcmu_err("Could not setup the bench device %d\n", ret);
+		exit(1);
+	}
+
+	start = bench_now();
+	ret = bench_run(&bench);
+	if (!ret)
+		bench_report(&bench, bench_now() - start);
+
+	bench_remove_dev(&bench);
+	return ret ? 1 : 0;
+}
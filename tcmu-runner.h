@@ -33,6 +33,37 @@ typedef int (*handle_cmd_fn_t)(struct tcmu_device *, struct tcmulib_cmd *);
 typedef int (*unmap_fn_t)(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 			  uint64_t off, uint64_t len);
 
+/* A byte range passed to tcmur_handler->unmapv */
+struct tcmur_unmap_extent {
+	uint64_t off;
+	uint64_t len;
+};
+
+typedef int (*unmapv_fn_t)(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   struct tcmur_unmap_extent *extents,
+			   size_t nr_extents);
+typedef int (*writesame_fn_t)(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			      uint64_t off, uint64_t len, struct iovec *iov,
+			      size_t iov_cnt);
+
+/* A byte range filled in by tcmur_handler->get_lba_status */
+struct tcmur_lba_status {
+	uint64_t off;
+	uint64_t len;
+	bool mapped;
+};
+
+typedef int (*get_lba_status_fn_t)(struct tcmu_device *dev,
+				   struct tcmulib_cmd *cmd, uint64_t off,
+				   uint64_t len, struct tcmur_lba_status *status,
+				   size_t *nr_status);
+typedef int (*copy_fn_t)(struct tcmu_device *dst_dev, struct tcmulib_cmd *cmd,
+			 uint64_t dst_off, struct tcmu_device *src_dev,
+			 uint64_t src_off, uint64_t len);
+
+/* Limit for tcmur_handler->max_threads */
+#define TCMUR_MAX_IO_THREADS 64
+
 struct tcmulib_cfg_info;
 
 struct tcmur_handler {
@@ -62,6 +93,11 @@ struct tcmur_handler {
 	/* Per-device added/removed callbacks */
 	int (*open)(struct tcmu_device *dev, bool reopen);
 	void (*close)(struct tcmu_device *dev);
+	/*
+	 * Optional, called once the device is removed and closed, to free
+	 * what the handler keeps across a reopen.
+	 */
+	void (*removed)(struct tcmu_device *dev);
 
 	/*
 	 * If > 0, runner will execute up to nr_threads IO callouts from
@@ -71,6 +107,14 @@ struct tcmur_handler {
 	 */
 	int nr_threads;
 
+	/*
+	 * Upper bound for the io thread count users can set with the
+	 * tcmur_nr_threads and tcmur_max_threads cfgstring options or in
+	 * tcmu.conf. If 0, the IO callouts are not safe to run from more
+	 * than nr_threads threads, and the count is not configurable.
+	 */
+	int max_threads;
+
 	/*
 	 * Async handle_cmd only handlers return:
 	 *
@@ -109,6 +153,64 @@ struct tcmur_handler {
 	flush_fn_t flush;
 	unmap_fn_t unmap;
 
+	/*
+	 * Optional. Unmaps all the extents of an UNMAP, or the range of a
+	 * WRITE SAME with the UNMAP bit, in one call. The extents are sorted,
+	 * do not overlap or touch, and are not split to the optimal unmap
+	 * granularity, so one can be longer than the max unmap len. If set,
+	 * it is used instead of ->unmap.
+	 */
+	unmapv_fn_t unmapv;
+
+	/*
+	 * Optional. Writes the one block in iov over len bytes from off for
+	 * WRITE SAME, so a handler can zero a range without writing it,
+	 * like fallocate(FALLOC_FL_ZERO_RANGE) does. For a WRITE of zeros
+	 * with zero_detect set, iov is all the WRITE's zeroed data instead.
+	 * Return or complete the cmd with TCMU_STS_NOT_HANDLED, before
+	 * anything has been written, for the patterns or ranges it can not
+	 * do, and the runner writes the data out with ->write.
+	 */
+	writesame_fn_t writesame;
+
+	/*
+	 * Optional. Copies len bytes from src_dev to dst_dev for EXTENDED
+	 * COPY without the data going through the runner. It is only
+	 * called when both devices use this handler, and is run like the
+	 * IO callouts above for dst_dev.
+	 *
+	 * Return or complete the cmd with TCMU_STS_NOT_HANDLED, before any
+	 * of dst_dev has been written, if the two devices can not be copied
+	 * between natively, and the runner will read and write the data
+	 * itself.
+	 */
+	copy_fn_t copy;
+
+	/*
+	 * Optional. Reports which parts of the len bytes from off are
+	 * allocated for GET LBA STATUS. Fill in up to *nr_status ranges in
+	 * order, the first starting at off and each starting where the one
+	 * before it ended, and set *nr_status to the number filled in. The
+	 * ranges may stop short of off + len. Ranges that read back as
+	 * zeros without using backend space are not mapped. Without this
+	 * callout the runner reports all LBAs as mapped. It may block:
+	 * with nr_threads == 0 it is called from a thread of its own.
+	 */
+	get_lba_status_fn_t get_lba_status;
+
+	/*
+	 * Optional, and only used by handlers with nr_threads == 0. The
+	 * cmdproc thread calls submit_batch before it dispatches the cmds
+	 * it pulled off the ring, and unplug once it has dispatched all of
+	 * them. In between the handler may queue the io of its read and
+	 * write callouts instead of sending it to the backend, and must
+	 * send all of it from unplug. Both are called from the same thread
+	 * as the IO callouts, but completions and compound commands can
+	 * still call the IO callouts from other threads meanwhile.
+	 */
+	void (*submit_batch)(struct tcmu_device *dev);
+	void (*unplug)(struct tcmu_device *dev);
+
 	/*
 	 * If the lock is acquired and the tag is not TCMU_INVALID_LOCK_TAG,
 	 * it must be associated with the lock and returned by get_lock_tag on
@@ -146,6 +248,11 @@ struct tcmur_handler {
  * following. It usually just calls tcmur_register_handler.
  *
  * int handler_init(void);
+ *
+ * For plugins listed in the handler directory's handlers.manifest it is
+ * only called when the first device or check_config needs the plugin,
+ * possibly from a device open thread, and it must register exactly the
+ * subtype the manifest lists.
  */
 
 /*
@@ -13,9 +13,9 @@ ExclusiveOS:   Linux
 
 BuildRequires: cmake make gcc
 BuildRequires: libnl3-devel glib2-devel zlib-devel kmod-devel
-BuildRequires: glusterfs-api-devel librados2-devel librbd1-devel
+BuildRequires: glusterfs-api-devel librados2-devel librbd1-devel liburing-devel
 
-Requires(pre): librados2, librbd1, kmod, zlib, libnl3, glib2, glusterfs-api, logrotate
+Requires(pre): librados2, librbd1, kmod, zlib, libnl3, glib2, glusterfs-api, liburing, logrotate
 
 %description
 A daemon that handles the userspace side of the LIO TCM-User backstore.
@@ -9,8 +9,12 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "ccan/list/list.h"
 
@@ -19,72 +23,59 @@
 #include "tcmur_device.h"
 #include "tcmur_aio.h"
 #include "tcmu-runner.h"
+#include "libtcmu_trace.h"
 
-struct tcmu_work {
-	struct tcmu_device *dev;
-	struct tcmulib_cmd *cmd;
-	tcmu_work_fn_t fn;
-	struct list_node entry;
-};
+TCMU_TRACE_SEMAPHORE(cmd_enqueue);
+TCMU_TRACE_SEMAPHORE(cmd_pickup);
+TCMU_TRACE_SEMAPHORE(cmd_submit);
 
 static void _cleanup_mutex_lock(void *arg)
 {
 	pthread_mutex_unlock(arg);
 }
 
+/*
+ * tracked_aio_ops is only updated with atomics, track_lock is only
+ * taken when the count drops to zero while someone is waiting in
+ * aio_wait_for_empty_queue. The waiter publishes is_empty_cond before
+ * it checks the count and the finisher drops the count before it
+ * checks is_empty_cond, so with seq_cst ordering at least one of them
+ * sees the other.
+ *
+ * The same goes for a cmd starting while a reopen sets IN_RECOVERY: the
+ * cmd bumps the count before it checks the flags, and the reopen sets
+ * the flag before aio_wait_for_empty_queue checks the count, so the
+ * increment must be seq_cst too.
+ */
 void track_aio_request_start(struct tcmur_device *rdev)
 {
 	struct tcmu_track_aio *aio_track = &rdev->track_queue;
 
-	pthread_cleanup_push(_cleanup_mutex_lock, (void *)&aio_track->track_lock);
-	pthread_mutex_lock(&aio_track->track_lock);
-
-	++aio_track->tracked_aio_ops;
-
-	pthread_mutex_unlock(&aio_track->track_lock);
-	pthread_cleanup_pop(0);
+	__atomic_add_fetch(&aio_track->tracked_aio_ops, 1, __ATOMIC_SEQ_CST);
 }
 
-void track_aio_request_finish(struct tcmur_device *rdev, int *wake_up)
+void track_aio_request_finish(struct tcmur_device *rdev)
 {
 	struct tcmu_track_aio *aio_track = &rdev->track_queue;
 	pthread_cond_t *cond;
+	unsigned int left;
 
-	pthread_cleanup_push(_cleanup_mutex_lock, (void *)&aio_track->track_lock);
-	pthread_mutex_lock(&aio_track->track_lock);
-
-	assert(aio_track->tracked_aio_ops > 0);
-	--aio_track->tracked_aio_ops;
-
-	if (wake_up) {
-		++aio_track->pending_wakeups;
-		*wake_up = (aio_track->pending_wakeups == 1) ? 1 : 0;
-	}
-
-	if (!aio_track->tracked_aio_ops && aio_track->is_empty_cond) {
-		cond = aio_track->is_empty_cond;
-		aio_track->is_empty_cond = NULL;
-		pthread_cond_signal(cond);
-	}
-
-	pthread_mutex_unlock(&aio_track->track_lock);
-	pthread_cleanup_pop(0);
-}
-
-void track_aio_wakeup_finish(struct tcmur_device *rdev, int *wake_up)
-{
-	struct tcmu_track_aio *aio_track = &rdev->track_queue;
+	left = __atomic_sub_fetch(&aio_track->tracked_aio_ops, 1,
+				  __ATOMIC_SEQ_CST);
+	assert(left != UINT_MAX);
+	if (left || !__atomic_load_n(&aio_track->is_empty_cond,
+				     __ATOMIC_SEQ_CST))
+		return;
 
 	pthread_cleanup_push(_cleanup_mutex_lock, (void *)&aio_track->track_lock);
 	pthread_mutex_lock(&aio_track->track_lock);
 
-	if (aio_track->pending_wakeups > 1) {
-		aio_track->pending_wakeups = 1;
-		*wake_up = 1;
-	} else {
-		assert(aio_track->pending_wakeups > 0);
-		aio_track->pending_wakeups = 0;
-		*wake_up = 0;
+	cond = aio_track->is_empty_cond;
+	if (cond && !__atomic_load_n(&aio_track->tracked_aio_ops,
+				     __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&aio_track->is_empty_cond, NULL,
+				 __ATOMIC_SEQ_CST);
+		pthread_cond_signal(cond);
 	}
 
 	pthread_mutex_unlock(&aio_track->track_lock);
@@ -96,7 +87,7 @@ static void cleanup_empty_queue_wait(void *arg)
 	struct tcmu_track_aio *aio_track = arg;
 
 	pthread_cond_destroy(aio_track->is_empty_cond);
-	aio_track->is_empty_cond = NULL;
+	__atomic_store_n(&aio_track->is_empty_cond, NULL, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&aio_track->track_lock);
 }
 
@@ -113,17 +104,18 @@ int aio_wait_for_empty_queue(struct tcmur_device *rdev)
 	pthread_cleanup_push(cleanup_empty_queue_wait, aio_track);
 	pthread_mutex_lock(&aio_track->track_lock);
 
-	if (!aio_track->tracked_aio_ops)
-		goto unlock;
-
-	tcmu_dev_dbg(rdev->dev, "waiting for %d commands\n",
-		     rdev->track_queue.tracked_aio_ops);
+	__atomic_store_n(&aio_track->is_empty_cond, &cond, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&aio_track->tracked_aio_ops, __ATOMIC_SEQ_CST)) {
+		tcmu_dev_dbg(rdev->dev, "waiting for %u commands\n",
+			     __atomic_load_n(&aio_track->tracked_aio_ops,
+					     __ATOMIC_RELAXED));
 
-	aio_track->is_empty_cond = &cond;
-	ret = pthread_cond_wait(&cond, &aio_track->track_lock);
-	aio_track->is_empty_cond = NULL;
+		/* the finisher clears is_empty_cond when it signals */
+		while (!ret && aio_track->is_empty_cond == &cond)
+			ret = pthread_cond_wait(&cond, &aio_track->track_lock);
+	}
+	__atomic_store_n(&aio_track->is_empty_cond, NULL, __ATOMIC_SEQ_CST);
 
-unlock:
 	pthread_mutex_unlock(&aio_track->track_lock);
 	pthread_cleanup_pop(0);
 
@@ -131,46 +123,310 @@ unlock:
 	return ret;
 }
 
-static void _cleanup_io_work(void *arg)
+/*
+ * Each io worker has a bounded MPMC queue based on Dmitry Vyukov's
+ * design. The seq of a cell tells producers and consumers whose turn it
+ * is, so both sides only need a compare and swap on their position and
+ * idle workers can steal from busy ones.
+ */
+static void io_ring_init(struct tcmu_io_worker *w)
+{
+	unsigned long i;
+
+	for (i = 0; i < TCMU_IO_RING_SIZE; i++)
+		w->cells[i].seq = i;
+	w->enq_pos = 0;
+	w->deq_pos = 0;
+}
+
+static bool io_ring_push(struct tcmu_io_worker *w, struct tcmulib_cmd *cmd)
+{
+	struct tcmu_io_cell *cell;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&w->enq_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &w->cells[pos & (TCMU_IO_RING_SIZE - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&w->enq_pos, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false; /* full */
+		} else {
+			pos = __atomic_load_n(&w->enq_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->cmd = cmd;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static struct tcmulib_cmd *io_ring_pop(struct tcmu_io_worker *w)
+{
+	struct tcmulib_cmd *cmd;
+	struct tcmu_io_cell *cell;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&w->deq_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &w->cells[pos & (TCMU_IO_RING_SIZE - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&w->deq_pos, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL; /* empty */
+		} else {
+			pos = __atomic_load_n(&w->deq_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	cmd = cell->cmd;
+	__atomic_store_n(&cell->seq, pos + TCMU_IO_RING_SIZE, __ATOMIC_RELEASE);
+	return cmd;
+}
+
+static struct tcmulib_cmd *io_overflow_pop(struct tcmu_io_queue *io_wq)
+{
+	struct tcmulib_cmd *cmd;
+
+	if (!__atomic_load_n(&io_wq->nr_overflow, __ATOMIC_RELAXED))
+		return NULL;
+
+	pthread_mutex_lock(&io_wq->overflow_lock);
+	cmd = io_wq->overflow_head;
+	if (cmd) {
+		io_wq->overflow_head = tcmur_cmd_priv(cmd)->work_next;
+		if (!io_wq->overflow_head)
+			io_wq->overflow_tail = NULL;
+		__atomic_sub_fetch(&io_wq->nr_overflow, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&io_wq->overflow_lock);
+
+	return cmd;
+}
+
+static void io_overflow_push(struct tcmu_io_queue *io_wq,
+			     struct tcmulib_cmd *cmd)
+{
+	tcmur_cmd_priv(cmd)->work_next = NULL;
+
+	pthread_mutex_lock(&io_wq->overflow_lock);
+	if (io_wq->overflow_tail)
+		tcmur_cmd_priv(io_wq->overflow_tail)->work_next = cmd;
+	else
+		io_wq->overflow_head = cmd;
+	io_wq->overflow_tail = cmd;
+	__atomic_add_fetch(&io_wq->nr_overflow, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&io_wq->overflow_lock);
+}
+
+/* Take from our own queue first, then steal from the others */
+static struct tcmulib_cmd *io_work_dequeue(struct tcmu_io_queue *io_wq,
+					   int self)
+{
+	struct tcmulib_cmd *cmd;
+	int i, nr_rings;
+
+	/*
+	 * Retired workers can still have cmds queued by producers that
+	 * raced with them, so look at every ring that has ever been used.
+	 */
+	nr_rings = __atomic_load_n(&io_wq->nr_rings, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nr_rings; i++) {
+		cmd = io_ring_pop(&io_wq->workers[(self + i) % nr_rings]);
+		if (cmd)
+			goto found;
+	}
+
+	cmd = io_overflow_pop(io_wq);
+	if (!cmd)
+		return NULL;
+found:
+	__atomic_sub_fetch(&io_wq->nr_queued, 1, __ATOMIC_RELAXED);
+	return cmd;
+}
+
+/*
+ * Wake up the worker we queued to if it is parked. If it is busy, wake
+ * any parked worker, so it can steal the cmd.
+ *
+ * A worker sets parked before it checks the queues one last time and we
+ * check parked after queueing, so one of the two sides always sees the
+ * other.
+ *
+ * Returns false if all workers are busy.
+ */
+static bool io_work_wake(struct tcmu_io_queue *io_wq,
+			 struct tcmu_io_worker *target, int nr_workers)
+{
+	struct tcmu_io_worker *w = NULL;
+	int i;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&target->parked, __ATOMIC_RELAXED)) {
+		w = target;
+	} else {
+		for (i = 0; i < nr_workers; i++) {
+			if (__atomic_load_n(&io_wq->workers[i].parked,
+					    __ATOMIC_RELAXED)) {
+				w = &io_wq->workers[i];
+				break;
+			}
+		}
+	}
+
+	if (!w)
+		return false;
+
+	pthread_mutex_lock(&w->park_lock);
+	pthread_cond_signal(&w->park_cond);
+	pthread_mutex_unlock(&w->park_lock);
+	return true;
+}
+
+static void *io_work_queue(void *arg);
+
+/*
+ * Autoscaling
+ *
+ * When a cmd is queued while every worker is busy and there is more
+ * than one cmd per worker waiting, the producer adds a worker, up to
+ * max_workers. Workers that stay parked for TCMU_IO_WORKER_IDLE_SECS
+ * retire themselves, highest index first, down to min_workers.
+ */
+#define TCMU_IO_WORKER_IDLE_SECS 10
+
+static void io_work_grow(struct tcmu_device *dev, struct tcmu_io_queue *io_wq)
 {
-	free(arg);
+	struct tcmu_io_worker *w;
+	int nr, ret;
+
+	/* someone else is already resizing */
+	if (pthread_mutex_trylock(&io_wq->resize_lock))
+		return;
+
+	nr = io_wq->nr_workers;
+	if (io_wq->stopping || nr >= io_wq->max_workers)
+		goto unlock;
+
+	w = &io_wq->workers[nr];
+	ret = pthread_create(&w->thread, NULL, io_work_queue, w);
+	if (ret) {
+		w->thread = 0;
+		tcmu_dev_warn(dev, "Could not add io worker %d.\n", ret);
+		goto unlock;
+	}
+
+	if (nr == io_wq->nr_rings)
+		__atomic_store_n(&io_wq->nr_rings, nr + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&io_wq->nr_workers, nr + 1, __ATOMIC_RELEASE);
+
+	tcmu_dev_dbg(dev, "Added io worker, %d running\n", nr + 1);
+unlock:
+	pthread_mutex_unlock(&io_wq->resize_lock);
+}
+
+static bool io_work_retire(struct tcmu_io_queue *io_wq,
+			   struct tcmu_io_worker *w)
+{
+	bool retired = false;
+	int nr;
+
+	pthread_mutex_lock(&io_wq->resize_lock);
+	nr = io_wq->nr_workers;
+	if (!io_wq->stopping && nr > io_wq->min_workers &&
+	    w == &io_wq->workers[nr - 1]) {
+		__atomic_store_n(&io_wq->nr_workers, nr - 1, __ATOMIC_RELEASE);
+		pthread_detach(w->thread);
+		w->thread = 0;
+		retired = true;
+
+		tcmu_dev_dbg(w->dev, "Retired idle io worker, %d running\n",
+			     nr - 1);
+	}
+	pthread_mutex_unlock(&io_wq->resize_lock);
+
+	return retired;
+}
+
+/* Returns NULL if we were idle for too long */
+static struct tcmulib_cmd *io_work_park(struct tcmu_io_queue *io_wq,
+					struct tcmu_io_worker *w, int self)
+{
+	struct tcmulib_cmd *cmd;
+	struct timespec idle_end;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &idle_end);
+	idle_end.tv_sec += TCMU_IO_WORKER_IDLE_SECS;
+
+	pthread_cleanup_push(_cleanup_mutex_lock, &w->park_lock);
+	pthread_mutex_lock(&w->park_lock);
+
+	__atomic_store_n(&w->parked, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	while (!(cmd = io_work_dequeue(io_wq, self)) && ret != ETIMEDOUT) {
+		if (io_wq->max_workers > io_wq->min_workers)
+			ret = pthread_cond_timedwait(&w->park_cond,
+						     &w->park_lock, &idle_end);
+		else
+			pthread_cond_wait(&w->park_cond, &w->park_lock);
+	}
+
+	__atomic_store_n(&w->parked, 0, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&w->park_lock);
+	pthread_cleanup_pop(0);
+
+	return cmd;
 }
 
 static void *io_work_queue(void *arg)
 {
-	struct tcmu_device *dev = arg;
+	struct tcmu_io_worker *w = arg;
+	struct tcmu_device *dev = w->dev;
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
+	int self = w - io_wq->workers;
 	int ret;
 
+	tcmur_dev_set_thread_affinity(dev);
+
 	while (1) {
-		struct tcmu_work *work;
 		struct tcmulib_cmd *cmd;
 
-		pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
-		pthread_mutex_lock(&io_wq->io_lock);
-
-		while (list_empty(&io_wq->io_queue)) {
-			pthread_cond_wait(&io_wq->io_cond,
-					  &io_wq->io_lock);
+		cmd = io_work_dequeue(io_wq, self);
+		if (!cmd) {
+			cmd = io_work_park(io_wq, w, self);
+			if (!cmd) {
+				if (io_work_retire(io_wq, w))
+					break;
+				continue;
+			}
 		}
-
-		work = list_first_entry(&io_wq->io_queue, struct tcmu_work,
-					entry);
-		list_del(&work->entry);
-
-		pthread_mutex_unlock(&io_wq->io_lock);
-		pthread_cleanup_pop(0);
+		TCMU_TRACE_CMD(cmd_pickup, tcmu_get_dev_name(dev), cmd);
 
 		/* kick start I/O request */
-		cmd = work->cmd;
-		pthread_cleanup_push(_cleanup_io_work, work);
-
-		ret = work->fn(work->dev, cmd);
+		tcmur_stats_cmd_work(cmd);
+		TCMU_TRACE_CMD(cmd_submit, tcmu_get_dev_name(dev), cmd);
+		ret = tcmur_cmd_priv(cmd)->work_fn(dev, cmd);
 		if (ret)
 			cmd->done(dev, cmd, ret);
-
-		pthread_cleanup_pop(1); /* cleanup work */
 	}
 
 	return NULL;
@@ -179,28 +435,35 @@ static void *io_work_queue(void *arg)
 static int aio_schedule(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 			tcmu_work_fn_t fn)
 {
-	struct tcmu_work *work;
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
+	struct tcmu_io_worker *w;
+	unsigned int start, queued;
+	int i, nr_workers;
 
-	work = malloc(sizeof(*work));
-	if (!work)
-		return TCMU_STS_NO_RESOURCE;
+	TCMU_TRACE_CMD(cmd_enqueue, tcmu_get_dev_name(dev), cmd);
 
-	work->fn = fn;
-	work->dev = dev;
-	work->cmd = cmd;
-	list_node_init(&work->entry);
+	tcmur_cmd_priv(cmd)->work_fn = fn;
+	queued = __atomic_add_fetch(&io_wq->nr_queued, 1, __ATOMIC_RELAXED);
 
-	/* cleanup push/pop not _really_ required here atm */
-	pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
-	pthread_mutex_lock(&io_wq->io_lock);
-
-	list_add_tail(&io_wq->io_queue, &work->entry);
-	pthread_cond_signal(&io_wq->io_cond); // TODO: conditional
+	nr_workers = __atomic_load_n(&io_wq->nr_workers, __ATOMIC_ACQUIRE);
+	start = __atomic_fetch_add(&io_wq->next_worker, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < nr_workers; i++) {
+		w = &io_wq->workers[(start + i) % nr_workers];
+		if (io_ring_push(w, cmd))
+			goto wake;
+	}
 
-	pthread_mutex_unlock(&io_wq->io_lock);
-	pthread_cleanup_pop(0);
+	/*
+	 * Compound cmds like UNMAP can queue far more sub cmds than the
+	 * rings hold, so park the rest on the slow list.
+	 */
+	w = &io_wq->workers[start % nr_workers];
+	io_overflow_push(io_wq, cmd);
+wake:
+	if (!io_work_wake(io_wq, w, nr_workers) && queued > nr_workers &&
+	    nr_workers < io_wq->max_workers)
+		io_work_grow(dev, io_wq);
 
 	return TCMU_STS_ASYNC_HANDLED;
 }
@@ -212,6 +475,7 @@ int async_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	int ret;
 
 	if (!rhandler->nr_threads) {
+		TCMU_TRACE_CMD(cmd_submit, tcmu_get_dev_name(dev), cmd);
 		ret = work_fn(dev, cmd);
 		if (!ret)
 			ret = TCMU_STS_ASYNC_HANDLED;
@@ -227,7 +491,6 @@ int setup_aio_tracking(struct tcmur_device *rdev)
 	int ret;
 	struct tcmu_track_aio *aio_track = &rdev->track_queue;
 
-	aio_track->pending_wakeups = 0;
 	aio_track->tracked_aio_ops = 0;
 	ret = pthread_mutex_init(&aio_track->track_lock, NULL);
 	if (ret != 0) {
@@ -252,65 +515,128 @@ void cleanup_aio_tracking(struct tcmur_device *rdev)
 
 void cleanup_io_work_queue_threads(struct tcmu_device *dev)
 {
-	struct tcmur_handler *r_handler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
-	int i, nr_threads = r_handler->nr_threads;
+	int i;
 
-	if (!io_wq->io_wq_threads) {
+	if (!io_wq->workers) {
 		return;
 	}
 
-	for (i = 0; i < nr_threads; i++) {
-		if (io_wq->io_wq_threads[i]) {
-			tcmu_cancel_thread(io_wq->io_wq_threads[i]);
+	/* Stop the autoscaler, so the thread ids below stay stable */
+	pthread_mutex_lock(&io_wq->resize_lock);
+	io_wq->stopping = true;
+	pthread_mutex_unlock(&io_wq->resize_lock);
+
+	for (i = 0; i < io_wq->max_workers; i++) {
+		if (io_wq->workers[i].thread) {
+			tcmu_cancel_thread(io_wq->workers[i].thread);
+			io_wq->workers[i].thread = 0;
 		}
 	}
 }
 
+static void cleanup_io_workers(struct tcmu_io_queue *io_wq, int nr_inited)
+{
+	int i;
+
+	for (i = 0; i < nr_inited; i++) {
+		pthread_cond_destroy(&io_wq->workers[i].park_cond);
+		pthread_mutex_destroy(&io_wq->workers[i].park_lock);
+	}
+
+	free(io_wq->workers);
+	io_wq->workers = NULL;
+	io_wq->nr_workers = 0;
+	io_wq->nr_rings = 0;
+}
+
+/*
+ * Start rdev->nr_threads io workers. If rdev->max_threads is larger, the
+ * workers are scaled between the two based on load.
+ */
 int setup_io_work_queue(struct tcmu_device *dev)
 {
-	struct tcmur_handler *r_handler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
-	int ret, i, nr_threads = r_handler->nr_threads;
+	int ret, i, nr_threads = rdev->nr_threads;
+	int max_threads = max(rdev->max_threads, nr_threads);
+	struct tcmu_io_worker *w;
+	void *workers;
 
 	if (!nr_threads)
 		return 0;
 
-	list_head_init(&io_wq->io_queue);
-
-	ret = pthread_mutex_init(&io_wq->io_lock, NULL);
+	ret = pthread_mutex_init(&io_wq->overflow_lock, NULL);
 	if (ret != 0) {
 		goto out;
 	}
-	ret = pthread_cond_init(&io_wq->io_cond, NULL);
+
+	ret = pthread_mutex_init(&io_wq->resize_lock, NULL);
+	if (ret != 0) {
+		goto cleanup_overflow_lock;
+	}
+
+	io_wq->overflow_head = NULL;
+	io_wq->overflow_tail = NULL;
+	io_wq->nr_overflow = 0;
+	io_wq->nr_queued = 0;
+	io_wq->next_worker = 0;
+	io_wq->min_workers = nr_threads;
+	io_wq->max_workers = max_threads;
+	io_wq->stopping = false;
+
+	ret = posix_memalign(&workers, 64, max_threads * sizeof(*w));
 	if (ret != 0) {
-		goto cleanup_lock;
+		ret = -ret;
+		goto cleanup_resize_lock;
 	}
+	memset(workers, 0, max_threads * sizeof(*w));
+	io_wq->workers = workers;
 
-	/* TODO: Allow user to override device defaults */
-	io_wq->io_wq_threads = calloc(nr_threads, sizeof(pthread_t));
-	if (!io_wq->io_wq_threads)
-		goto cleanup_cond;
+	for (i = 0; i < max_threads; i++) {
+		w = &io_wq->workers[i];
+		w->dev = dev;
+		io_ring_init(w);
 
+		ret = pthread_mutex_init(&w->park_lock, NULL);
+		if (ret != 0) {
+			goto cleanup_workers;
+		}
+
+		ret = pthread_cond_init(&w->park_cond, NULL);
+		if (ret != 0) {
+			pthread_mutex_destroy(&w->park_lock);
+			goto cleanup_workers;
+		}
+	}
+
+	/* Only start them once every ring can be stolen from */
+	io_wq->nr_workers = nr_threads;
+	io_wq->nr_rings = nr_threads;
 	for (i = 0; i < nr_threads; i++) {
-		ret = pthread_create(&io_wq->io_wq_threads[i], NULL,
-				      io_work_queue, dev);
+		ret = pthread_create(&io_wq->workers[i].thread, NULL,
+				     io_work_queue, &io_wq->workers[i]);
 		if (ret != 0) {
+			io_wq->workers[i].thread = 0;
 			goto cleanup_threads;
 		}
 	}
 
+	if (max_threads > nr_threads)
+		tcmu_dev_dbg(dev, "Scaling io workers between %d and %d\n",
+			     nr_threads, max_threads);
 	return 0;
 
 cleanup_threads:
 	cleanup_io_work_queue_threads(dev);
-	free(io_wq->io_wq_threads);
-cleanup_cond:
-	pthread_cond_destroy(&io_wq->io_cond);
-cleanup_lock:
-	pthread_mutex_destroy(&io_wq->io_lock);
+	i = max_threads;
+cleanup_workers:
+	cleanup_io_workers(io_wq, i);
+cleanup_resize_lock:
+	pthread_mutex_destroy(&io_wq->resize_lock);
+cleanup_overflow_lock:
+	pthread_mutex_destroy(&io_wq->overflow_lock);
 out:
 	return ret;
 }
@@ -321,7 +647,7 @@ void cleanup_io_work_queue(struct tcmu_device *dev, bool cancel)
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
 	int ret;
 
-	if (!io_wq->io_wq_threads) {
+	if (!io_wq->workers) {
 		return;
 	}
 
@@ -330,23 +656,26 @@ void cleanup_io_work_queue(struct tcmu_device *dev, bool cancel)
 	}
 
 	/*
-	 * Note that there's no need to drain ->io_queue at this point
-	 * as it _should_ be empty (target layer would call this path
-	 * when no commands are running - thanks Mike).
+	 * Note that there's no need to drain the worker queues at this
+	 * point as they _should_ be empty (target layer would call this
+	 * path when no commands are running - thanks Mike).
 	 *
 	 * Out of tree handlers which do not use the aio code are not
 	 * supported in this path.
 	 */
 
-	ret = pthread_mutex_destroy(&io_wq->io_lock);
+	cleanup_io_workers(io_wq, io_wq->max_workers);
+
+	/* Wait for a retiring worker to drop the lock */
+	pthread_mutex_lock(&io_wq->resize_lock);
+	pthread_mutex_unlock(&io_wq->resize_lock);
+	ret = pthread_mutex_destroy(&io_wq->resize_lock);
 	if (ret != 0) {
-		tcmu_err("failed to destroy io workqueue lock\n");
+		tcmu_err("failed to destroy io workqueue resize lock\n");
 	}
 
-	ret = pthread_cond_destroy(&io_wq->io_cond);
+	ret = pthread_mutex_destroy(&io_wq->overflow_lock);
 	if (ret != 0) {
-		tcmu_err("failed to destroy io workqueue cond\n");
+		tcmu_err("failed to destroy io workqueue overflow lock\n");
 	}
-
-	free(io_wq->io_wq_threads);
 }
@@ -10,6 +10,7 @@
 #define __TCMUR_AIO_H
 
 #include <pthread.h>
+#include <stdbool.h>
 
 #include "ccan/list/list.h"
 
@@ -18,18 +19,52 @@ struct tcmu_device;
 struct tcmulib_cmd;
 
 struct tcmu_track_aio {
-	unsigned int pending_wakeups;
-	unsigned int tracked_aio_ops;
+	unsigned int tracked_aio_ops;	/* atomic, see track_aio_request_start */
 	pthread_mutex_t track_lock;
 	pthread_cond_t *is_empty_cond;
 };
 
+/* Must be a power of 2 */
+#define TCMU_IO_RING_SIZE 256
+
+struct tcmu_io_cell {
+	unsigned long seq;
+	struct tcmulib_cmd *cmd;
+};
+
+struct tcmu_io_worker {
+	struct tcmu_device *dev;
+	pthread_t thread;
+
+	/* set while the worker sleeps on park_cond */
+	int parked;
+	pthread_mutex_t park_lock;
+	pthread_cond_t park_cond;
+
+	/* lock-free bounded queue other workers can steal from */
+	struct tcmu_io_cell cells[TCMU_IO_RING_SIZE];
+	unsigned long enq_pos __attribute__((aligned(64)));
+	unsigned long deq_pos __attribute__((aligned(64)));
+};
+
 struct tcmu_io_queue {
-	pthread_mutex_t io_lock;
-	pthread_cond_t io_cond;
+	struct tcmu_io_worker *workers;
+	int nr_workers;		/* running workers */
+	int nr_rings;		/* rings that may hold cmds */
+	unsigned int next_worker;
+	unsigned int nr_queued;
+
+	/* autoscaling bounds and state */
+	pthread_mutex_t resize_lock;
+	int min_workers;
+	int max_workers;
+	bool stopping;
 
-	pthread_t *io_wq_threads;
-	struct list_head io_queue;
+	/* cmds that did not fit in any of the worker rings */
+	pthread_mutex_t overflow_lock;
+	struct tcmulib_cmd *overflow_head;
+	struct tcmulib_cmd *overflow_tail;
+	unsigned int nr_overflow;
 };
 
 int setup_io_work_queue(struct tcmu_device *);
@@ -47,8 +82,7 @@ int async_handle_cmd(struct tcmu_device *, struct tcmulib_cmd *,
 
 /* aio request tracking */
 void track_aio_request_start(struct tcmur_device *);
-void track_aio_request_finish(struct tcmur_device *, int *);
-void track_aio_wakeup_finish(struct tcmur_device *, int *);
+void track_aio_request_finish(struct tcmur_device *);
 int aio_wait_for_empty_queue(struct tcmur_device *rdev);
 
 #endif /* __TCMUR_AIO_H */
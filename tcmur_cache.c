@@ -0,0 +1,837 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Optional per device read cache.
+ *
+ * Data returned by the handler's read callout is kept in a fixed pool of
+ * pages, so repeated reads can be completed from the cmdproc thread
+ * without calling into the handler. Sequential read streams are detected
+ * and the data after them is read in ahead of time.
+ *
+ * Write type cmds drop the cached pages they overlap when they start.
+ * Data read while any of them is running might be stale, so it is not
+ * inserted: a generation count that is bumped when a write starts and
+ * completes is sampled before a read is issued and checked before its
+ * data is inserted.
+ *
+ * The same hooks keep the flash tier below it (tcmur_tier.c) coherent.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <scsi/scsi.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_aio.h"
+#include "tcmur_cache.h"
+#include "tcmur_tier.h"
+
+/* Sequential read streams tracked per device */
+#define TCMUR_CACHE_NR_STREAMS		8
+/* Reads in sequence before readahead starts */
+#define TCMUR_CACHE_SEQ_THRESH		2
+/* Largest readahead IO */
+#define TCMUR_CACHE_RA_MAX_PAGES	32
+
+struct tcmur_cache_page {
+	struct list_node hash_entry;
+	/* on the lru list when valid, or on the free list when unused */
+	struct list_node lru_entry;
+	uint64_t idx;
+	bool valid;	/* false while readahead is reading it in */
+};
+
+struct tcmur_cache_stream {
+	uint64_t next;		/* offset the next read in sequence starts at */
+	uint64_t ra_end;	/* readahead has been issued up to here */
+	unsigned int nr_seq;
+	unsigned int last_used;
+};
+
+struct tcmur_cache {
+	pthread_mutex_t lock;
+
+	struct tcmur_cache_page *pages;
+	char *data;
+	unsigned int nr_pages;
+
+	struct list_head *hash;
+	unsigned int hash_mask;
+	struct list_head lru;	/* valid pages, least recently used first */
+	struct list_head free;
+
+	unsigned int ra_pages;
+	struct tcmur_cache_stream streams[TCMUR_CACHE_NR_STREAMS];
+	unsigned int stream_clock;
+
+	uint64_t gen;
+	unsigned int nr_writes;	/* write type cmds running */
+
+	unsigned int nr_ra;	/* readahead IOs running */
+	struct tcmur_cache_ra *ras;	/* preallocated readahead IOs */
+	struct list_head free_ra;
+	pthread_cond_t ra_cond;
+	bool stopping;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t ra_pages_read;
+};
+
+struct tcmur_cache_ra {
+	struct tcmulib_cmd cmd;
+	struct tcmur_cmd rcmd;
+	uint8_t cdb[16];
+	uint64_t gen;
+	struct list_node entry;
+
+	unsigned int nr_pages;
+	struct tcmur_cache_page *pages[TCMUR_CACHE_RA_MAX_PAGES];
+	struct iovec iov[TCMUR_CACHE_RA_MAX_PAGES];
+};
+
+/* Walks an iovec array without consuming it like tcmu_memcpy_*_iovec */
+struct tcmur_cache_iter {
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t i;
+	size_t off;
+};
+
+static void cache_iter_copy(struct tcmur_cache_iter *iter, char *buf,
+			    size_t len, bool to_iov)
+{
+	size_t n;
+	char *p;
+
+	while (len && iter->i < iter->iov_cnt) {
+		n = min(len, iter->iov[iter->i].iov_len - iter->off);
+		p = (char *)iter->iov[iter->i].iov_base + iter->off;
+
+		if (buf) {
+			if (to_iov)
+				memcpy(p, buf, n);
+			else
+				memcpy(buf, p, n);
+			buf += n;
+		}
+		len -= n;
+
+		iter->off += n;
+		if (iter->off == iter->iov[iter->i].iov_len) {
+			iter->i++;
+			iter->off = 0;
+		}
+	}
+}
+
+static inline char *cache_page_data(struct tcmur_cache *cache,
+				    struct tcmur_cache_page *page)
+{
+	return cache->data +
+		((size_t)(page - cache->pages) << TCMUR_CACHE_PAGE_SHIFT);
+}
+
+static inline struct list_head *cache_bucket(struct tcmur_cache *cache,
+					     uint64_t idx)
+{
+	return &cache->hash[(unsigned int)((idx * 0x9E3779B97F4A7C15ULL) >> 32) &
+			    cache->hash_mask];
+}
+
+static struct tcmur_cache_page *cache_lookup(struct tcmur_cache *cache,
+					     uint64_t idx)
+{
+	struct tcmur_cache_page *page;
+
+	list_for_each(cache_bucket(cache, idx), page, hash_entry) {
+		if (page->idx == idx)
+			return page;
+	}
+	return NULL;
+}
+
+/* Get an unused page, evicting the least recently used one if needed */
+static struct tcmur_cache_page *cache_get_page(struct tcmur_cache *cache,
+					       uint64_t idx)
+{
+	struct tcmur_cache_page *page;
+
+	page = list_pop(&cache->free, struct tcmur_cache_page, lru_entry);
+	if (!page) {
+		page = list_pop(&cache->lru, struct tcmur_cache_page,
+				lru_entry);
+		if (!page)
+			return NULL;
+		list_del(&page->hash_entry);
+	}
+
+	page->idx = idx;
+	page->valid = false;
+	list_add_tail(cache_bucket(cache, idx), &page->hash_entry);
+	return page;
+}
+
+static void cache_put_page(struct tcmur_cache *cache,
+			   struct tcmur_cache_page *page)
+{
+	list_del(&page->hash_entry);
+	if (page->valid)
+		list_del(&page->lru_entry);
+	page->valid = false;
+	list_add(&cache->free, &page->lru_entry);
+}
+
+static void cache_mark_valid(struct tcmur_cache *cache,
+			     struct tcmur_cache_page *page)
+{
+	page->valid = true;
+	list_add_tail(&cache->lru, &page->lru_entry);
+}
+
+static bool cache_copy_hit(struct tcmur_cache *cache, struct tcmulib_cmd *cmd,
+			   uint64_t off, size_t len)
+{
+	struct tcmur_cache_iter iter = { cmd->iovec, cmd->iov_cnt, 0, 0 };
+	uint64_t first = off >> TCMUR_CACHE_PAGE_SHIFT;
+	uint64_t last = (off + len - 1) >> TCMUR_CACHE_PAGE_SHIFT;
+	struct tcmur_cache_page *page;
+	size_t page_off, n;
+	uint64_t idx;
+
+	for (idx = first; idx <= last; idx++) {
+		page = cache_lookup(cache, idx);
+		if (!page || !page->valid)
+			return false;
+	}
+
+	page_off = off & (TCMUR_CACHE_PAGE_SIZE - 1);
+	for (idx = first; idx <= last; idx++) {
+		page = cache_lookup(cache, idx);
+
+		n = min(len, TCMUR_CACHE_PAGE_SIZE - page_off);
+		cache_iter_copy(&iter, cache_page_data(cache, page) + page_off,
+				n, true);
+		len -= n;
+		page_off = 0;
+
+		list_del(&page->lru_entry);
+		list_add_tail(&cache->lru, &page->lru_entry);
+	}
+	return true;
+}
+
+static struct tcmur_cache_ra *cache_ra_alloc(struct tcmu_device *dev,
+					     struct tcmur_cache *cache,
+					     uint64_t idx)
+{
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	struct tcmur_cache_ra *ra;
+	uint64_t lba;
+
+	ra = list_pop(&cache->free_ra, struct tcmur_cache_ra, entry);
+	if (!ra)
+		return NULL;
+	memset(ra, 0, sizeof(*ra));
+	tcmur_cmd_init(&ra->cmd, &ra->rcmd);
+
+	/* a real cdb so the io tracing and debug output make sense */
+	lba = htobe64((idx << TCMUR_CACHE_PAGE_SHIFT) / block_size);
+	ra->cdb[0] = READ_16;
+	memcpy(&ra->cdb[2], &lba, 8);
+
+	ra->cmd.cdb = ra->cdb;
+	ra->cmd.iovec = ra->iov;
+	ra->gen = cache->gen;
+	return ra;
+}
+
+static void cache_ra_add_page(struct tcmu_device *dev, struct tcmur_cache *cache,
+			      struct tcmur_cache_ra *ra,
+			      struct tcmur_cache_page *page)
+{
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	uint32_t nr_lbas;
+
+	ra->pages[ra->nr_pages] = page;
+	ra->iov[ra->nr_pages].iov_base = cache_page_data(cache, page);
+	ra->iov[ra->nr_pages].iov_len = TCMUR_CACHE_PAGE_SIZE;
+	ra->nr_pages++;
+	ra->cmd.iov_cnt = ra->nr_pages;
+
+	nr_lbas = htobe32(ra->nr_pages * (TCMUR_CACHE_PAGE_SIZE / block_size));
+	memcpy(&ra->cdb[10], &nr_lbas, 4);
+}
+
+/*
+ * Track the read and, once it is part of a sequential stream, allocate
+ * the pages after it and queue the reads to fill them on ra_list.
+ */
+static void cache_readahead(struct tcmu_device *dev, struct tcmur_cache *cache,
+			    uint64_t off, size_t len, struct list_head *ra_list)
+{
+	uint64_t dev_end = tcmu_get_dev_num_lbas(dev) *
+					tcmu_get_dev_block_size(dev);
+	uint64_t ra_len = (uint64_t)cache->ra_pages << TCMUR_CACHE_PAGE_SHIFT;
+	struct tcmur_cache_stream *stream = NULL, *s;
+	struct tcmur_cache_page *page;
+	struct tcmur_cache_ra *ra = NULL;
+	uint64_t idx, end;
+	int i;
+
+	if (!cache->ra_pages || cache->stopping)
+		return;
+
+	for (i = 0; i < TCMUR_CACHE_NR_STREAMS; i++) {
+		s = &cache->streams[i];
+		if (s->nr_seq && s->next == off) {
+			stream = s;
+			break;
+		}
+		if (!stream || s->last_used < stream->last_used)
+			stream = s;
+	}
+	if (stream->next != off || !stream->nr_seq) {
+		/* new stream, reuse the least recently used slot */
+		stream->nr_seq = 0;
+		stream->ra_end = 0;
+	}
+	stream->nr_seq++;
+	stream->next = off + len;
+	stream->last_used = ++cache->stream_clock;
+
+	if (stream->nr_seq < TCMUR_CACHE_SEQ_THRESH || cache->nr_writes)
+		return;
+
+	/* top up the window once half of it has been consumed */
+	if (stream->ra_end >= stream->next + ra_len / 2)
+		return;
+
+	/* only whole pages are read ahead */
+	idx = max(stream->ra_end, stream->next) >> TCMUR_CACHE_PAGE_SHIFT;
+	end = min(stream->next + ra_len, dev_end) >> TCMUR_CACHE_PAGE_SHIFT;
+
+	for (; idx < end; idx++) {
+		if (cache_lookup(cache, idx)) {
+			ra = NULL;
+			continue;
+		}
+
+		page = cache_get_page(cache, idx);
+		if (!page)
+			break;
+
+		if (!ra || ra->nr_pages == TCMUR_CACHE_RA_MAX_PAGES) {
+			ra = cache_ra_alloc(dev, cache, idx);
+			if (!ra) {
+				cache_put_page(cache, page);
+				break;
+			}
+			list_add_tail(ra_list, &ra->entry);
+			cache->nr_ra++;
+		}
+		cache_ra_add_page(dev, cache, ra, page);
+	}
+	stream->ra_end = idx << TCMUR_CACHE_PAGE_SHIFT;
+}
+
+static void cache_ra_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  int ret)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache_ra *ra = container_of(cmd, struct tcmur_cache_ra,
+						 cmd);
+	struct tcmur_cache *cache = rdev->read_cache;
+	unsigned int i;
+
+	pthread_mutex_lock(&cache->lock);
+	if (ret == TCMU_STS_OK && ra->gen == cache->gen) {
+		for (i = 0; i < ra->nr_pages; i++)
+			cache_mark_valid(cache, ra->pages[i]);
+		cache->ra_pages_read += ra->nr_pages;
+	} else {
+		for (i = 0; i < ra->nr_pages; i++)
+			cache_put_page(cache, ra->pages[i]);
+	}
+	if (!--cache->nr_ra && cache->stopping)
+		pthread_cond_signal(&cache->ra_cond);
+	list_add(&cache->free_ra, &ra->entry);
+	pthread_mutex_unlock(&cache->lock);
+
+	track_aio_request_finish(rdev);
+}
+
+static int cache_ra_work_fn(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cache_ra *ra = container_of(cmd, struct tcmur_cache_ra,
+						 cmd);
+
+	return rhandler->read(dev, cmd, cmd->iovec, cmd->iov_cnt,
+			      ra->nr_pages * TCMUR_CACHE_PAGE_SIZE,
+			      ra->pages[0]->idx << TCMUR_CACHE_PAGE_SHIFT);
+}
+
+static void cache_submit_ra(struct tcmu_device *dev, struct list_head *ra_list)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache_ra *ra;
+	int ret;
+
+	while ((ra = list_pop(ra_list, struct tcmur_cache_ra, entry))) {
+		ra->cmd.done = cache_ra_done;
+
+		track_aio_request_start(rdev);
+		ret = async_handle_cmd(dev, &ra->cmd, cache_ra_work_fn);
+		if (ret != TCMU_STS_ASYNC_HANDLED)
+			cache_ra_done(dev, &ra->cmd, ret);
+	}
+}
+
+/**
+ * tcmur_cache_read - try to complete a READ from the read cache
+ * @dev: device the cmd was sent to
+ * @cmd: READ cmd that passed the lba and length checks
+ *
+ * Returns true if the data was copied to the cmd's iovec. Otherwise the
+ * caller must issue the read to the handler and call tcmur_cache_fill
+ * when it completes successfully. Either way readahead may be started.
+ */
+bool tcmur_cache_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache *cache = rdev->read_cache;
+	uint64_t off = tcmu_get_lba(cmd->cdb) * tcmu_get_dev_block_size(dev);
+	size_t len = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	LIST_HEAD(ra_list);
+	bool hit;
+
+	if (!cache || !len)
+		return false;
+
+	pthread_mutex_lock(&cache->lock);
+	hit = cache_copy_hit(cache, cmd, off, len);
+	if (hit) {
+		cache->hits++;
+	} else {
+		cache->misses++;
+		tcmur_cmd_priv(cmd)->cache_gen = cache->nr_writes ? 0 : cache->gen;
+	}
+	cache_readahead(dev, cache, off, len, &ra_list);
+	pthread_mutex_unlock(&cache->lock);
+
+	cache_submit_ra(dev, &ra_list);
+	return hit;
+}
+
+/* Insert the whole pages a successful READ from the handler returned */
+void tcmur_cache_fill(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache *cache = rdev->read_cache;
+	struct tcmur_cache_iter iter = { cmd->iovec, cmd->iov_cnt, 0, 0 };
+	uint64_t off = tcmu_get_lba(cmd->cdb) * tcmu_get_dev_block_size(dev);
+	size_t len = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	struct tcmur_cache_page *page;
+	uint64_t idx, end;
+
+	if (!cache || !tcmur_cmd_priv(cmd)->cache_gen)
+		return;
+
+	idx = (off + TCMUR_CACHE_PAGE_SIZE - 1) >> TCMUR_CACHE_PAGE_SHIFT;
+	end = (off + len) >> TCMUR_CACHE_PAGE_SHIFT;
+	if (idx >= end)
+		return;
+	/* do not let one large read flush everything else */
+	end = min(end, idx + cache->nr_pages / 2);
+
+	cache_iter_copy(&iter, NULL, (idx << TCMUR_CACHE_PAGE_SHIFT) - off,
+			false);
+
+	pthread_mutex_lock(&cache->lock);
+	if (tcmur_cmd_priv(cmd)->cache_gen != cache->gen)
+		goto unlock;
+
+	for (; idx < end; idx++) {
+		page = cache_lookup(cache, idx);
+		if (page) {
+			cache_iter_copy(&iter, NULL, TCMUR_CACHE_PAGE_SIZE, false);
+			continue;
+		}
+
+		page = cache_get_page(cache, idx);
+		if (!page)
+			break;
+		cache_iter_copy(&iter, cache_page_data(cache, page),
+				TCMUR_CACHE_PAGE_SIZE, false);
+		cache_mark_valid(cache, page);
+	}
+unlock:
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static void cache_invalidate(struct tcmu_device *dev, struct tcmur_cache *cache,
+			     uint64_t lba, uint64_t nr_lbas)
+{
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	uint64_t num_lbas = tcmu_get_dev_num_lbas(dev);
+	struct tcmur_cache_page *page, *next;
+	uint64_t idx, last;
+
+	if (lba >= num_lbas || !nr_lbas)
+		return;
+	nr_lbas = min(nr_lbas, num_lbas - lba);
+
+	idx = (lba * block_size) >> TCMUR_CACHE_PAGE_SHIFT;
+	last = ((lba + nr_lbas) * block_size - 1) >> TCMUR_CACHE_PAGE_SHIFT;
+
+	/*
+	 * Pages that are still being read in are not touched, the
+	 * generation check drops them when their read completes.
+	 */
+	if (last - idx >= cache->nr_pages) {
+		list_for_each_safe(&cache->lru, page, next, lru_entry) {
+			if (page->idx >= idx && page->idx <= last)
+				cache_put_page(cache, page);
+		}
+		return;
+	}
+
+	for (; idx <= last; idx++) {
+		page = cache_lookup(cache, idx);
+		if (page && page->valid)
+			cache_put_page(cache, page);
+	}
+}
+
+/**
+ * tcmur_cache_write_start - notify the read cache a write is starting
+ * @dev: device that is going to be written to
+ * @lba: first lba written
+ * @nr_lbas: number of lbas written. 0 if the caller will invalidate
+ *	     the ranges itself with tcmur_cache_invalidate.
+ *
+ * Must be paired with a tcmur_cache_write_done call when the write has
+ * completed, successfully or not.
+ */
+void tcmur_cache_write_start(struct tcmu_device *dev, uint64_t lba,
+			     uint64_t nr_lbas)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache *cache = rdev->read_cache;
+
+	tcmur_tier_write_start(dev, lba, nr_lbas);
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->gen++;
+	cache->nr_writes++;
+	cache_invalidate(dev, cache, lba, nr_lbas);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void tcmur_cache_write_done(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache *cache = rdev->read_cache;
+
+	tcmur_tier_write_done(dev);
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->gen++;
+	cache->nr_writes--;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Drop the cached pages in a range while a write to it is running */
+void tcmur_cache_invalidate(struct tcmu_device *dev, uint64_t lba,
+			    uint64_t nr_lbas)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache *cache = rdev->read_cache;
+
+	tcmur_tier_invalidate(dev, lba, nr_lbas);
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	cache_invalidate(dev, cache, lba, nr_lbas);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Drop everything, for when the data may have changed behind our back
+ * like after a reopen or when another node could have held the lock.
+ */
+void tcmur_cache_invalidate_all(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache *cache = rdev->read_cache;
+	struct tcmur_cache_page *page;
+
+	tcmur_tier_invalidate_all(dev);
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->gen++;
+	while ((page = list_top(&cache->lru, struct tcmur_cache_page,
+				lru_entry)))
+		cache_put_page(cache, page);
+	memset(cache->streams, 0, sizeof(cache->streams));
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Returns true with the range written if cmd may modify the device */
+static bool cache_cmd_writes(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			     uint64_t *lba, uint64_t *nr_lbas)
+{
+	uint8_t *cdb = cmd->cdb;
+
+	switch (cdb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+		*lba = tcmu_get_lba(cdb);
+		*nr_lbas = tcmu_get_xfer_length(cdb);
+		return true;
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		*lba = tcmu_get_lba(cdb);
+		*nr_lbas = tcmu_get_xfer_length(cdb);
+		if (!*nr_lbas)
+			*nr_lbas = UINT64_MAX;
+		return true;
+	case COMPARE_AND_WRITE:
+		*lba = tcmu_get_lba(cdb);
+		*nr_lbas = cdb[13];
+		return true;
+	case UNMAP:
+		/* the descriptors are invalidated as they are parsed */
+		*lba = 0;
+		*nr_lbas = 0;
+		return true;
+	case FORMAT_UNIT:
+		*lba = 0;
+		*nr_lbas = UINT64_MAX;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Called for every cmd runner handles before it is executed and after
+ * it completes, so writes to the device can be tracked.
+ */
+void tcmur_cache_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint64_t lba, nr_lbas;
+
+	if ((rdev->read_cache || rdev->tier) &&
+	    cache_cmd_writes(dev, cmd, &lba, &nr_lbas))
+		tcmur_cache_write_start(dev, lba, nr_lbas);
+	tcmur_tier_cmd_start(dev, cmd);
+}
+
+void tcmur_cache_cmd_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  int rc)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint64_t lba, nr_lbas;
+
+	tcmur_tier_cmd_done(dev, cmd, rc);
+	if ((rdev->read_cache || rdev->tier) &&
+	    cache_cmd_writes(dev, cmd, &lba, &nr_lbas))
+		tcmur_cache_write_done(dev);
+}
+
+/**
+ * tcmur_cache_setup - create the device's read cache
+ * @dev: device to create the cache for
+ * @size_mb: cache size in MiB, 0 disables the cache
+ * @read_ahead_kb: readahead window in KiB, -1 for the default
+ *
+ * Must be called after the handler's open so the block size is final,
+ * and before the cmdproc thread is started.
+ */
+int tcmur_cache_setup(struct tcmu_device *dev, int size_mb, int read_ahead_kb)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	struct tcmur_cache *cache;
+	unsigned int i, nr_buckets, nr_ras;
+	uint64_t nr_pages;
+	int ret = -ENOMEM;
+
+	if (size_mb <= 0)
+		return 0;
+
+	if (!rhandler->read) {
+		tcmu_dev_warn(dev, "Handler does not support the read cache.\n");
+		return 0;
+	}
+
+	if (block_size > TCMUR_CACHE_PAGE_SIZE ||
+	    TCMUR_CACHE_PAGE_SIZE % block_size) {
+		tcmu_dev_warn(dev, "Read cache does not support block size %u.\n",
+			      block_size);
+		return 0;
+	}
+
+	nr_pages = ((uint64_t)size_mb << 20) >> TCMUR_CACHE_PAGE_SHIFT;
+	if (nr_pages > (1U << 30)) {
+		tcmu_dev_err(dev, "Read cache size %d MiB is too large.\n",
+			     size_mb);
+		return -EINVAL;
+	}
+
+	if (read_ahead_kb < 0)
+		read_ahead_kb = TCMUR_CACHE_DEF_READ_AHEAD_KB;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return -ENOMEM;
+
+	cache->nr_pages = nr_pages;
+	/* keep room for data that is not part of a stream */
+	cache->ra_pages = min((uint64_t)read_ahead_kb >>
+				(TCMUR_CACHE_PAGE_SHIFT - 10), nr_pages / 4);
+	cache->gen = 1;
+	list_head_init(&cache->lru);
+	list_head_init(&cache->free);
+	list_head_init(&cache->free_ra);
+
+	for (nr_buckets = 1; nr_buckets < nr_pages; nr_buckets <<= 1)
+		;
+	cache->hash_mask = nr_buckets - 1;
+
+	cache->hash = malloc(nr_buckets * sizeof(*cache->hash));
+	if (!cache->hash)
+		goto free_cache;
+	for (i = 0; i < nr_buckets; i++)
+		list_head_init(&cache->hash[i]);
+
+	cache->pages = calloc(nr_pages, sizeof(*cache->pages));
+	if (!cache->pages)
+		goto free_hash;
+	for (i = 0; i < nr_pages; i++)
+		list_add_tail(&cache->free, &cache->pages[i].lru_entry);
+
+	if (posix_memalign((void **)&cache->data, TCMUR_CACHE_PAGE_SIZE,
+			   nr_pages << TCMUR_CACHE_PAGE_SHIFT))
+		goto free_pages;
+
+	/*
+	 * Each stream tops its window up once half of it was consumed, so
+	 * it has at most two windows of readahead IOs running.
+	 */
+	nr_ras = TCMUR_CACHE_NR_STREAMS * 2 *
+		((cache->ra_pages + TCMUR_CACHE_RA_MAX_PAGES - 1) /
+						TCMUR_CACHE_RA_MAX_PAGES);
+	if (nr_ras) {
+		cache->ras = calloc(nr_ras, sizeof(*cache->ras));
+		if (!cache->ras)
+			goto free_data;
+		for (i = 0; i < nr_ras; i++)
+			list_add_tail(&cache->free_ra, &cache->ras[i].entry);
+	}
+
+	ret = pthread_mutex_init(&cache->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto free_ras;
+	}
+
+	ret = pthread_cond_init(&cache->ra_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	tcmu_dev_dbg(dev, "read cache %d MiB, readahead %u KiB\n", size_mb,
+		     cache->ra_pages << (TCMUR_CACHE_PAGE_SHIFT - 10));
+	rdev->read_cache = cache;
+	return 0;
+
+destroy_lock:
+	pthread_mutex_destroy(&cache->lock);
+free_ras:
+	free(cache->ras);
+free_data:
+	free(cache->data);
+free_pages:
+	free(cache->pages);
+free_hash:
+	free(cache->hash);
+free_cache:
+	free(cache);
+	return ret;
+}
+
+/*
+ * Stop starting readahead and wait for the running readahead IOs. Must
+ * be called before the io workers are stopped.
+ */
+void tcmur_cache_stop(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache *cache = rdev->read_cache;
+
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->stopping = true;
+	while (cache->nr_ra)
+		pthread_cond_wait(&cache->ra_cond, &cache->lock);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Must be called once all cmds have completed */
+void tcmur_cache_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cache *cache = rdev->read_cache;
+
+	if (!cache)
+		return;
+
+	tcmu_dev_info(dev, "read cache hits %"PRIu64" misses %"PRIu64" readahead pages %"PRIu64"\n",
+		      cache->hits, cache->misses, cache->ra_pages_read);
+
+	rdev->read_cache = NULL;
+	pthread_cond_destroy(&cache->ra_cond);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->ras);
+	free(cache->data);
+	free(cache->pages);
+	free(cache->hash);
+	free(cache);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_CACHE_H
+#define __TCMUR_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct tcmu_device;
+struct tcmulib_cmd;
+
+/* Cached data is tracked in pages of this size */
+#define TCMUR_CACHE_PAGE_SHIFT		12
+#define TCMUR_CACHE_PAGE_SIZE		(1 << TCMUR_CACHE_PAGE_SHIFT)
+
+/* Readahead window used when neither tcmu.conf nor the device set one */
+#define TCMUR_CACHE_DEF_READ_AHEAD_KB	512
+
+struct tcmur_cache;
+
+int tcmur_cache_setup(struct tcmu_device *dev, int size_mb, int read_ahead_kb);
+void tcmur_cache_stop(struct tcmu_device *dev);
+void tcmur_cache_cleanup(struct tcmu_device *dev);
+
+bool tcmur_cache_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+void tcmur_cache_fill(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+
+void tcmur_cache_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+void tcmur_cache_cmd_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  int rc);
+void tcmur_cache_write_start(struct tcmu_device *dev, uint64_t lba,
+			     uint64_t nr_lbas);
+void tcmur_cache_write_done(struct tcmu_device *dev);
+void tcmur_cache_invalidate(struct tcmu_device *dev, uint64_t lba,
+			    uint64_t nr_lbas);
+void tcmur_cache_invalidate_all(struct tcmu_device *dev);
+
+#endif /* __TCMUR_CACHE_H */
@@ -13,6 +13,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "ccan/list/list.h"
 
@@ -26,50 +28,101 @@
 #include "tcmur_cmd_handler.h"
 #include "tcmu-runner.h"
 #include "alua.h"
+#include "libtcmu_trace.h"
 
-static void _cleanup_spin_lock(void *arg)
-{
-	pthread_spin_unlock(arg);
-}
+TCMU_TRACE_SEMAPHORE(cmd_dispatch);
+TCMU_TRACE_SEMAPHORE(cmd_done);
 
+/*
+ * Only called by the cmdproc thread, which is the only writer of the
+ * ring, so no locking is needed.
+ */
 void tcmur_command_complete(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 			    int rc)
 {
-	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	TCMU_TRACE_CMD_RESULT(cmd_done, tcmu_get_dev_name(dev), cmd, rc);
+	tcmur_stats_cmd_done(dev, cmd, rc);
+	tcmur_cache_cmd_done(dev, cmd, rc);
+	tcmur_pending_cmd_done(dev);
+	tcmulib_command_complete(dev, cmd, rc);
+}
+
+/* Same for count cmds, with one ring tail update */
+void tcmur_command_complete_batch(struct tcmu_device *dev,
+				  struct tcmulib_cmd **cmds, int *rcs,
+				  int count)
+{
+	int i;
 
-	pthread_cleanup_push(_cleanup_spin_lock, (void *)&rdev->lock);
-	pthread_spin_lock(&rdev->lock);
+	for (i = 0; i < count; i++) {
+		TCMU_TRACE_CMD_RESULT(cmd_done, tcmu_get_dev_name(dev),
+				      cmds[i], rcs[i]);
+		tcmur_stats_cmd_done(dev, cmds[i], rcs[i]);
+		tcmur_cache_cmd_done(dev, cmds[i], rcs[i]);
+		tcmur_pending_cmd_done(dev);
+	}
+	tcmulib_command_complete_batch(dev, cmds, rcs, count);
+}
 
-	tcmulib_command_complete(dev, cmd, rc);
+/*
+ * Async completions are queued for the cmdproc thread, which writes them
+ * to the ring and notifies the kernel once per batch. It only needs a
+ * kick when the queue goes from empty to non empty and it is not the
+ * one completing the command.
+ */
+static void __aio_command_finish(struct tcmu_device *dev,
+				 struct tcmulib_cmd *cmd, int rc)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 
-	pthread_spin_unlock(&rdev->lock);
-	pthread_cleanup_pop(0);
+	TCMU_TRACE_CMD_RESULT(cmd_done, tcmu_get_dev_name(dev), cmd, rc);
+	tcmur_stats_cmd_done(dev, cmd, rc);
+	tcmur_cache_cmd_done(dev, cmd, rc);
+	tcmur_pending_cmd_done(dev);
+	if (tcmulib_queue_command_complete(dev, cmd, rc) &&
+	    !pthread_equal(pthread_self(), rdev->cmdproc_thread))
+		eventfd_write(rdev->cmpl_efd, 1);
 }
 
 static void aio_command_finish(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 			       int rc)
 {
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
-	int wake_up;
 
-	tcmur_command_complete(dev, cmd, rc);
-	track_aio_request_finish(rdev, &wake_up);
-	while (wake_up) {
-		tcmulib_processing_complete(dev);
-		track_aio_wakeup_finish(rdev, &wake_up);
-	}
+	__aio_command_finish(dev, cmd, rc);
+	track_aio_request_finish(rdev);
+}
+
+/* A compound cmd's sub-cmd, with the runner's part of it */
+struct tcmur_sub_cmd {
+	struct tcmulib_cmd cmd;
+	struct tcmur_cmd rcmd;
+};
+
+/* Comes from the device's scratch pool, freed with tcmur_scratch_free */
+static struct tcmulib_cmd *alloc_sub_cmd(struct tcmu_device *dev)
+{
+	struct tcmur_sub_cmd *sub;
+
+	sub = tcmur_scratch_alloc(dev, sizeof(*sub));
+	if (!sub)
+		return NULL;
+	tcmur_cmd_init(&sub->cmd, &sub->rcmd);
+	return &sub->cmd;
 }
 
-static int alloc_iovec(struct tcmulib_cmd *cmd, size_t length)
+/* The iovec of a compound cmd's sub-cmd comes from the device's scratch pool */
+static int alloc_iovec(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		       size_t length)
 {
 	struct iovec *iov;
 
 	assert(!cmd->iovec);
 
-	iov = calloc(1, sizeof(*iov));
+	iov = tcmur_scratch_alloc(dev, sizeof(*iov));
 	if (!iov)
 		goto out;
-	iov->iov_base = calloc(1, length);
+	iov->iov_base = tcmur_scratch_alloc(dev, length);
 	if (!iov->iov_base)
 		goto free_iov;
 	iov->iov_len = length;
@@ -79,7 +132,7 @@ static int alloc_iovec(struct tcmulib_cmd *cmd, size_t length)
 	return 0;
 
 free_iov:
-	free(iov);
+	tcmur_scratch_free(iov);
 out:
 	return -ENOMEM;
 }
@@ -89,13 +142,16 @@ static void free_iovec(struct tcmulib_cmd *cmd)
 	assert(cmd->iovec);
 	assert(cmd->iovec->iov_base);
 
-	free(cmd->iovec->iov_base);
-	free(cmd->iovec);
+	tcmur_scratch_free(cmd->iovec->iov_base);
+	tcmur_scratch_free(cmd->iovec);
 
 	cmd->iov_cnt = 0;
 	cmd->iovec = NULL;
 }
 
+static void handle_scratch_cbk(struct tcmu_device *dev,
+			       struct tcmulib_cmd *cmd, int ret);
+
 static inline int check_iovec_length(struct tcmu_device *dev,
 				     struct tcmulib_cmd *cmd, uint32_t sectors)
 {
@@ -147,6 +203,14 @@ static void handle_generic_cbk(struct tcmu_device *dev,
 	aio_command_finish(dev, cmd, ret);
 }
 
+static void handle_cached_read_cbk(struct tcmu_device *dev,
+				   struct tcmulib_cmd *cmd, int ret)
+{
+	if (ret == TCMU_STS_OK)
+		tcmur_cache_fill(dev, cmd);
+	aio_command_finish(dev, cmd, ret);
+}
+
 static int read_work_fn(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
@@ -168,11 +232,180 @@ static int write_work_fn(struct tcmu_device *dev,
 				block_size * tcmu_get_lba(cmd->cdb));
 }
 
+/*
+ * A READ or WRITE larger than rdev->split_lbas, cut at multiples of it
+ * into pieces the handler runs in parallel.
+ */
+struct rw_split {
+	struct tcmulib_cmd *origcmd;
+	bool write;
+	unsigned int refcount;	/* atomic */
+	int status;		/* atomic, first error of a piece */
+};
+
+struct rw_split_piece {
+	struct tcmulib_cmd cmd;
+	struct tcmur_cmd rcmd;
+	struct rw_split *split;
+	uint64_t offset;
+	size_t length;
+};
+
+static void rw_split_put(struct tcmu_device *dev, struct rw_split *split,
+			 unsigned int refs)
+{
+	struct tcmulib_cmd *origcmd = split->origcmd;
+	int ret;
+
+	if (__atomic_sub_fetch(&split->refcount, refs, __ATOMIC_ACQ_REL))
+		return;
+
+	ret = __atomic_load_n(&split->status, __ATOMIC_RELAXED);
+	tcmur_scratch_free(split);
+	origcmd->done(dev, origcmd, ret);
+}
+
+/* Only the first error is returned */
+static void rw_split_set_error(struct rw_split *split, int ret)
+{
+	int ok = TCMU_STS_OK;
+
+	__atomic_compare_exchange_n(&split->status, &ok, ret, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void handle_split_cbk(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			     int ret)
+{
+	struct rw_split_piece *piece = cmd->cmdstate;
+
+	if (ret != TCMU_STS_OK)
+		rw_split_set_error(piece->split, ret);
+	rw_split_put(dev, piece->split, 1);
+}
+
+static int split_work_fn(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct rw_split_piece *piece = cmd->cmdstate;
+
+	if (piece->split->write)
+		return rhandler->write(dev, cmd, cmd->iovec, cmd->iov_cnt,
+				       piece->length, piece->offset);
+	return rhandler->read(dev, cmd, cmd->iovec, cmd->iov_cnt,
+			      piece->length, piece->offset);
+}
+
+/*
+ * Fill out with the next len bytes of the iovec at *iov, skipping *off
+ * bytes of its first entry, and advance both past them. Returns the
+ * number of entries used.
+ */
+static size_t rw_split_iovec(struct iovec **iov, size_t *off, size_t len,
+			     struct iovec *out)
+{
+	size_t cnt = 0, part;
+
+	while (len) {
+		part = min((*iov)->iov_len - *off, len);
+		out[cnt].iov_base = (char *)(*iov)->iov_base + *off;
+		out[cnt].iov_len = part;
+		cnt++;
+
+		len -= part;
+		*off += part;
+		if (*off == (*iov)->iov_len) {
+			(*iov)++;
+			*off = 0;
+		}
+	}
+	return cnt;
+}
+
+static int handle_split_rw(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   bool write)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	uint64_t split_lbas = rdev->split_lbas;
+	uint64_t lba = tcmu_get_lba(cmd->cdb);
+	uint64_t nlbas = tcmu_get_xfer_length(cmd->cdb);
+	struct iovec *iov = cmd->iovec, *piece_iov;
+	struct rw_split_piece *pieces;
+	struct rw_split *split;
+	unsigned int nr, i;
+	uint64_t lbas;
+	size_t off = 0;
+	int ret;
+
+	nr = (lba + nlbas - 1) / split_lbas - lba / split_lbas + 1;
+
+	/* every piece boundary can cut one entry in two */
+	split = tcmur_scratch_alloc(dev, sizeof(*split) +
+				    nr * sizeof(*pieces) +
+				    (cmd->iov_cnt + nr) * sizeof(*piece_iov));
+	if (!split)
+		return async_handle_cmd(dev, cmd,
+					write ? write_work_fn : read_work_fn);
+	pieces = (struct rw_split_piece *)(split + 1);
+	piece_iov = (struct iovec *)(pieces + nr);
+
+	split->origcmd = cmd;
+	split->write = write;
+	/* one for us, so the last piece can not finish cmd while we loop */
+	split->refcount = nr + 1;
+
+	for (i = 0; i < nr; i++) {
+		struct rw_split_piece *piece = &pieces[i];
+
+		lbas = min(split_lbas - lba % split_lbas, nlbas);
+
+		piece->split = split;
+		piece->offset = lba * block_size;
+		piece->length = lbas * block_size;
+		tcmur_cmd_init(&piece->cmd, &piece->rcmd);
+		piece->cmd.cmd_id = cmd->cmd_id;
+		piece->cmd.cdb = cmd->cdb;
+		piece->cmd.iovec = piece_iov;
+		piece->cmd.iov_cnt = rw_split_iovec(&iov, &off, piece->length,
+						    piece_iov);
+		piece->cmd.cmdstate = piece;
+		piece->cmd.done = handle_split_cbk;
+		piece_iov += piece->cmd.iov_cnt;
+
+		ret = async_handle_cmd(dev, &piece->cmd, split_work_fn);
+		if (ret != TCMU_STS_ASYNC_HANDLED) {
+			/* the rest are not sent, so put their refs too */
+			rw_split_set_error(split, ret);
+			rw_split_put(dev, split, nr - i);
+			break;
+		}
+
+		lba += lbas;
+		nlbas -= lbas;
+	}
+
+	rw_split_put(dev, split, 1);
+	return TCMU_STS_ASYNC_HANDLED;
+}
+
+static int async_handle_rw(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   bool write)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (rdev->split_lbas &&
+	    tcmu_get_xfer_length(cmd->cdb) > rdev->split_lbas)
+		return handle_split_rw(dev, cmd, write);
+	return async_handle_cmd(dev, cmd, write ? write_work_fn : read_work_fn);
+}
+
 struct unmap_state {
 	pthread_mutex_t lock;
 	unsigned int refcount;
 	bool error;
 	int status;
+	cmd_done_t done;	/* completes the original cmd */
 };
 
 struct unmap_descriptor {
@@ -191,7 +424,7 @@ static struct unmap_state *unmap_state_alloc(struct tcmu_device *dev,
 
 	*return_err = 0;
 
-	state = calloc(1, sizeof(*state));
+	state = tcmur_scratch_alloc(dev, sizeof(*state));
 	if (!state) {
 		tcmu_dev_err(dev, "Failed to calloc memory for unmap_state!\n");
 		*return_err = TCMU_STS_NO_RESOURCE;
@@ -207,18 +440,20 @@ static struct unmap_state *unmap_state_alloc(struct tcmu_device *dev,
 
 	state->refcount = 0;
 	state->error = false;
+	state->status = TCMU_STS_OK;
+	state->done = aio_command_finish;
 	cmd->cmdstate = state;
 	return state;
 
 out_free_state:
-	free(state);
+	tcmur_scratch_free(state);
 	return NULL;
 }
 
 static void unmap_state_free(struct unmap_state *state)
 {
 	pthread_mutex_destroy(&state->lock);
-	free(state);
+	tcmur_scratch_free(state);
 }
 
 static void handle_unmap_cbk(struct tcmu_device *dev, struct tcmulib_cmd *ucmd,
@@ -227,10 +462,11 @@ static void handle_unmap_cbk(struct tcmu_device *dev, struct tcmulib_cmd *ucmd,
 	struct unmap_descriptor *desc = ucmd->cmdstate;
 	struct tcmulib_cmd *origcmd = desc->origcmd;
 	struct unmap_state *state = origcmd->cmdstate;
+	cmd_done_t done = state->done;
 	bool error;
 	int status;
 
-	free(desc);
+	tcmur_scratch_free(desc);
 
 	pthread_mutex_lock(&state->lock);
 	error = state->error;
@@ -242,7 +478,7 @@ static void handle_unmap_cbk(struct tcmu_device *dev, struct tcmulib_cmd *ucmd,
 		state->status = ret;
 	}
 
-	free(ucmd);
+	tcmur_scratch_free(ucmd);
 
 	if (--state->refcount > 0) {
 		pthread_mutex_unlock(&state->lock);
@@ -254,7 +490,7 @@ static void handle_unmap_cbk(struct tcmu_device *dev, struct tcmulib_cmd *ucmd,
 
 	unmap_state_free(state);
 
-	aio_command_finish(dev, origcmd, error ? status : ret);
+	done(dev, origcmd, error ? status : ret);
 }
 
 static int unmap_work_fn(struct tcmu_device *dev, struct tcmulib_cmd *ucmd)
@@ -316,13 +552,13 @@ static int align_and_split_unmap(struct tcmu_device *dev,
 		     opt_unmap_gran, mask, lbas);
 
 	while (nlbas) {
-		desc = calloc(1, sizeof(*desc));
+		desc = tcmur_scratch_alloc(dev, sizeof(*desc));
 		if (!desc) {
 			tcmu_dev_err(dev, "Failed to calloc desc!\n");
 			return TCMU_STS_NO_RESOURCE;
 		}
 
-		ucmd = calloc(1, sizeof(*ucmd));
+		ucmd = alloc_sub_cmd(dev);
 		if (!ucmd) {
 			tcmu_dev_err(dev, "Failed to calloc unmapcmd!\n");
 			ret = TCMU_STS_NO_RESOURCE;
@@ -361,9 +597,9 @@ static int align_and_split_unmap(struct tcmu_device *dev,
 	return ret;
 
 free_ucmd:
-	free(ucmd);
+	tcmur_scratch_free(ucmd);
 free_desc:
-	free(desc);
+	tcmur_scratch_free(desc);
 	return ret;
 }
 
@@ -400,6 +636,7 @@ static int handle_unmap_internal(struct tcmu_device *dev, struct tcmulib_cmd *or
 			goto state_unlock;
 
 		if (nlbas) {
+			tcmur_cache_invalidate(dev, lba, nlbas);
 			ret = align_and_split_unmap(dev, origcmd, lba, nlbas);
 			if (ret != TCMU_STS_ASYNC_HANDLED)
 				goto state_unlock;
@@ -440,8 +677,151 @@ state_unlock:
 	return ret;
 }
 
+struct unmapv_state {
+	cmd_done_t done;	/* completes the cmd */
+	size_t nr_extents;
+	struct tcmur_unmap_extent extents[];
+};
+
+static struct unmapv_state *unmapv_state_alloc(struct tcmu_device *dev,
+					       size_t nr_extents)
+{
+	struct unmapv_state *state;
+
+	state = tcmur_scratch_alloc(dev, sizeof(*state) +
+				    nr_extents * sizeof(state->extents[0]));
+	if (!state) {
+		tcmu_dev_err(dev, "Failed to alloc memory for unmapv_state!\n");
+		return NULL;
+	}
+	state->done = aio_command_finish;
+	state->nr_extents = 0;
+	return state;
+}
+
+static int unmap_extent_cmp(const void *a, const void *b)
+{
+	const struct tcmur_unmap_extent *x = a, *y = b;
+
+	if (x->off < y->off)
+		return -1;
+	return x->off > y->off;
+}
+
+static void handle_unmapv_cbk(struct tcmu_device *dev,
+			      struct tcmulib_cmd *cmd, int ret)
+{
+	struct unmapv_state *state = cmd->cmdstate;
+	cmd_done_t done = state->done;
+
+	tcmur_scratch_free(state);
+	done(dev, cmd, ret);
+}
+
+static int unmapv_work_fn(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct unmapv_state *state = cmd->cmdstate;
+
+	return rhandler->unmapv(dev, cmd, state->extents, state->nr_extents);
+}
+
+/*
+ * Sort and merge the extents in lbas, then pass them, in bytes, to the
+ * handler's ->unmapv in one call. The state is freed on failure.
+ */
+static int unmapv_submit(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			 struct unmapv_state *state)
+{
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	struct tcmur_unmap_extent *ext = state->extents, *next;
+	size_t i, nr_descs = state->nr_extents;
+	int ret;
+
+	qsort(state->extents, nr_descs, sizeof(*ext), unmap_extent_cmp);
+	for (i = 1; i < nr_descs; i++) {
+		next = &state->extents[i];
+		if (next->off <= ext->off + ext->len)
+			ext->len = max(ext->len, next->off + next->len - ext->off);
+		else
+			*++ext = *next;
+	}
+	state->nr_extents = ext - state->extents + 1;
+
+	tcmu_dev_dbg(dev, "%zu unmap block descriptors merged into %zu extents\n",
+		     nr_descs, state->nr_extents);
+
+	for (i = 0; i < state->nr_extents; i++) {
+		ext = &state->extents[i];
+		tcmur_cache_invalidate(dev, ext->off, ext->len);
+		ext->off *= block_size;
+		ext->len *= block_size;
+	}
+
+	cmd->cmdstate = state;
+	cmd->done = handle_unmapv_cbk;
+	ret = async_handle_cmd(dev, cmd, unmapv_work_fn);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		tcmur_scratch_free(state);
+	return ret;
+}
+
+static int handle_unmapv(struct tcmu_device *dev, struct tcmulib_cmd *origcmd,
+			 uint16_t bddl, uint8_t *par)
+{
+	struct unmapv_state *state;
+	uint64_t lba, nlbas;
+	int ret, i;
+
+	state = unmapv_state_alloc(dev, bddl / 16);
+	if (!state)
+		return TCMU_STS_NO_RESOURCE;
+
+	/* The first descriptor list offset is 8 in Data-Out buffer */
+	par += 8;
+
+	/* The unmap block descriptor data length is 16 */
+	for (i = 0; i < bddl / 16; i++, par += 16) {
+		lba = be64toh(*((uint64_t *)&par[0]));
+		nlbas = be32toh(*((uint32_t *)&par[8]));
+
+		tcmu_dev_dbg(dev, "Parameter list %d, start lba: %"PRIu64", end lba: %"PRIu64", nlbas: %"PRIu64"\n",
+			     i, lba, lba + nlbas - 1, nlbas);
+
+		if (nlbas > tcmu_get_dev_max_unmap_len(dev)) {
+			tcmu_dev_err(dev, "Illegal parameter list LBA count %"PRIu64" exceeds:%u\n",
+				     nlbas, tcmu_get_dev_max_unmap_len(dev));
+			ret = TCMU_STS_INVALID_PARAM_LIST;
+			goto free_state;
+		}
+
+		ret = check_lbas(dev, lba, nlbas);
+		if (ret)
+			goto free_state;
+
+		if (!nlbas)
+			continue;
+
+		state->extents[state->nr_extents].off = lba;
+		state->extents[state->nr_extents].len = nlbas;
+		state->nr_extents++;
+	}
+
+	if (!state->nr_extents) {
+		ret = TCMU_STS_OK;
+		goto free_state;
+	}
+
+	return unmapv_submit(dev, origcmd, state);
+
+free_state:
+	tcmur_scratch_free(state);
+	return ret;
+}
+
 static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *origcmd)
 {
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	uint8_t *cdb = origcmd->cdb;
 	size_t copied, data_length = tcmu_get_xfer_length(cdb);
 	struct unmap_state *state;
@@ -449,6 +829,11 @@ static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *origcmd)
 	uint16_t dl, bddl;
 	int ret;
 
+	if (!rhandler->unmap && !rhandler->unmapv) {
+		tcmu_dev_err(dev, "Handler does not support UNMAP\n");
+		return TCMU_STS_INVALID_CMD;
+	}
+
 	/*
 	 * ANCHOR bit check
 	 *
@@ -486,7 +871,7 @@ static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *origcmd)
 		return TCMU_STS_INVALID_PARAM_LIST_LEN;
 	}
 
-	par = calloc(1, data_length);
+	par = tcmur_scratch_alloc(dev, data_length);
 	if (!par) {
 		tcmu_dev_err(dev, "The state parameter is NULL!\n");
 		return TCMU_STS_NO_RESOURCE;
@@ -536,28 +921,40 @@ static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *origcmd)
 		goto out_free_par;
 	}
 
+	if (rhandler->unmapv) {
+		ret = handle_unmapv(dev, origcmd, bddl, par);
+		goto out_free_par;
+	}
+
 	state = unmap_state_alloc(dev, origcmd, &ret);
 	if (!state)
 		goto out_free_par;
 
 	ret = handle_unmap_internal(dev, origcmd, bddl, par);
 
-	free(par);
+	tcmur_scratch_free(par);
 	return ret;
 
 out_free_par:
-	free(par);
+	tcmur_scratch_free(par);
 	return ret;
 }
 
+/*
+ * Each write of an emulated WRITE SAME points up to this many iovecs at
+ * the buffer the block is replicated into.
+ */
+#define WRITE_SAME_MAX_IOVS	8
+
 struct write_same {
 	uint64_t cur_lba;
 	uint64_t lba_cnt;
 
-	struct iovec iovec;
+	struct iovec iovec[WRITE_SAME_MAX_IOVS];
 	size_t iov_cnt;
 	void *iov_base;
 	size_t iov_len;
+	size_t write_len;
 };
 
 static int writesame_work_fn(struct tcmu_device *dev,
@@ -567,16 +964,24 @@ static int writesame_work_fn(struct tcmu_device *dev,
 	uint32_t block_size = tcmu_get_dev_block_size(dev);
 	struct write_same *write_same = cmd->cmdstate;
 	uint64_t cur_lba = write_same->cur_lba;
+	size_t left = write_same->lba_cnt * block_size;
+	size_t i;
 
-	write_same->iovec.iov_base = write_same->iov_base;
-	write_same->iovec.iov_len = write_same->iov_len;
+	write_same->write_len = min(left,
+				    write_same->iov_len * WRITE_SAME_MAX_IOVS);
+	for (i = 0, left = write_same->write_len; left; i++) {
+		write_same->iovec[i].iov_base = write_same->iov_base;
+		write_same->iovec[i].iov_len = min(left, write_same->iov_len);
+		left -= write_same->iovec[i].iov_len;
+	}
+	write_same->iov_cnt = i;
 
 	/*
 	 * Write contents of the logical block data(from the Data-Out Buffer)
 	 * to each LBA in the specified LBA range.
 	 */
-	return rhandler->write(dev, cmd, &write_same->iovec,
-			       write_same->iov_cnt, write_same->iov_len,
+	return rhandler->write(dev, cmd, write_same->iovec,
+			       write_same->iov_cnt, write_same->write_len,
 			       block_size * cur_lba);
 }
 
@@ -586,8 +991,7 @@ static void handle_writesame_cbk(struct tcmu_device *dev,
 {
 	struct write_same *write_same = cmd->cmdstate;
 	uint32_t block_size = tcmu_get_dev_block_size(dev);
-	uint64_t write_lbas = write_same->iov_len / block_size;
-	uint64_t left_lbas;
+	uint64_t write_lbas = write_same->write_len / block_size;
 	int rc;
 
 	/* write failed - bail out */
@@ -596,20 +1000,12 @@ static void handle_writesame_cbk(struct tcmu_device *dev,
 
 	write_same->cur_lba += write_lbas;
 	write_same->lba_cnt -= write_lbas;
-	left_lbas = write_same->lba_cnt;
 
-	if (!left_lbas)
+	if (!write_same->lba_cnt)
 		goto finish_err;
 
-	if (left_lbas <= write_lbas) {
-		tcmu_dev_dbg(dev, "Last lba: %"PRIu64", write lbas: %"PRIu64"\n",
-			     write_same->cur_lba, left_lbas);
-
-		write_same->iov_len = left_lbas * block_size;
-	} else {
-		tcmu_dev_dbg(dev, "Next lba: %"PRIu64", write lbas: %"PRIu64"\n",
-			     write_same->cur_lba, write_lbas);
-	}
+	tcmu_dev_dbg(dev, "Next lba: %"PRIu64", lbas left: %"PRIu64"\n",
+		     write_same->cur_lba, write_same->lba_cnt);
 
 	rc = async_handle_cmd(dev, cmd, writesame_work_fn);
 	if (rc != TCMU_STS_ASYNC_HANDLED) {
@@ -621,8 +1017,8 @@ static void handle_writesame_cbk(struct tcmu_device *dev,
 	return;
 
 finish_err:
-	free(write_same->iov_base);
-	free(write_same);
+	tcmur_scratch_free(write_same->iov_base);
+	tcmur_scratch_free(write_same);
 	aio_command_finish(dev, cmd, ret);
 }
 
@@ -675,40 +1071,61 @@ static int handle_writesame_check(struct tcmu_device *dev, struct tcmulib_cmd *c
 	return TCMU_STS_OK;
 }
 
-static int handle_unmap_in_writesame(struct tcmu_device *dev,
-				     struct tcmulib_cmd *cmd)
+/*
+ * Unmap the lbas a WRITE SAME with the UNMAP bit, or a zeroed WRITE is
+ * for. done completes the cmd if this returns TCMU_STS_ASYNC_HANDLED.
+ */
+static int handle_unmap_cdb_lbas(struct tcmu_device *dev,
+				 struct tcmulib_cmd *cmd, cmd_done_t done)
 {
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	uint8_t *cdb = cmd->cdb;
 	uint64_t lba = tcmu_get_lba(cdb);
 	uint64_t nlbas = tcmu_get_xfer_length(cdb);
+	struct unmapv_state *vstate;
 	struct unmap_state *state;
 	unsigned int refcount;
 	int ret;
 
-	tcmu_dev_dbg(dev, "Do UNMAP in WRITE_SAME cmd!\n");
+	tcmu_dev_dbg(dev, "Do UNMAP in 0x%x cmd!\n", cdb[0]);
+
+	if (rhandler->unmapv) {
+		vstate = unmapv_state_alloc(dev, 1);
+		if (!vstate)
+			return TCMU_STS_NO_RESOURCE;
+		vstate->extents[0].off = lba;
+		vstate->extents[0].len = nlbas;
+		vstate->nr_extents = 1;
+		vstate->done = done;
+		return unmapv_submit(dev, cmd, vstate);
+	}
 
 	state = unmap_state_alloc(dev, cmd, &ret);
 	if (!state)
 		return ret;
+	state->done = done;
 
 	pthread_mutex_lock(&state->lock);
 	ret = align_and_split_unmap(dev, cmd, lba, nlbas);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
 		state->error = true;
+		state->status = ret;
+	}
 
 	refcount = state->refcount;
 	pthread_mutex_unlock(&state->lock);
 
-	/* Or will let the cbk to do the release */
-	if (!refcount)
-		unmap_state_free(state);
+	/* the cbk of the unmaps already sent completes the cmd */
+	if (refcount)
+		return TCMU_STS_ASYNC_HANDLED;
 
+	unmap_state_free(state);
 	return ret;
 }
 
-static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+/* Writes the block over the range through the handler's ->write */
+static int writesame_emulate(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	uint8_t *cdb = cmd->cdb;
 	uint32_t lba_cnt = tcmu_get_xfer_length(cdb);
 	uint32_t block_size = tcmu_get_dev_block_size(dev);
@@ -718,28 +1135,25 @@ static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct write_same *write_same;
 	int i, ret;
 
-	ret = handle_writesame_check(dev, cmd);
-	if (ret)
-		return ret;
+	max_xfer_length = tcmu_get_dev_max_xfer_len(dev) * block_size;
+	length = round_up(length, max_xfer_length);
+	length = min(length, (size_t)lba_cnt * block_size);
 
-	if (rhandler->unmap && (cmd->cdb[1] & 0x08))
-		return handle_unmap_in_writesame(dev, cmd);
+	ret = tcmur_scratch_throttle(dev, cmd, length, handle_scratch_cbk);
+	if (ret != TCMU_STS_OK)
+		return ret;
 
-	write_same = calloc(1, sizeof(struct write_same));
+	write_same = tcmur_scratch_alloc(dev, sizeof(struct write_same));
 	if (!write_same) {
 		tcmu_dev_err(dev, "Failed to calloc write_same data!\n");
 		return TCMU_STS_NO_RESOURCE;
 	}
 
-	max_xfer_length = tcmu_get_dev_max_xfer_len(dev) * block_size;
-	length = round_up(length, max_xfer_length);
-	length = min(length, (size_t)lba_cnt * block_size);
-
 	write_same->iov_len = length;
-	write_same->iov_base = calloc(1, length);
+	write_same->iov_base = tcmur_scratch_alloc(dev, length);
 	if (!write_same->iov_base) {
 		tcmu_dev_err(dev, "Failed to calloc iov_base data!\n");
-		free(write_same);
+		tcmur_scratch_free(write_same);
 		return TCMU_STS_NO_RESOURCE;
 	}
 
@@ -750,15 +1164,67 @@ static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	write_same->cur_lba = start_lba;
 	write_same->lba_cnt = lba_cnt;
-	write_same->iov_cnt = 1;
 	cmd->cmdstate = write_same;
 
 	cmd->done = handle_writesame_cbk;
 
-	tcmu_dev_dbg(dev, "First lba: %"PRIu64", write lbas: %"PRIu64"\n",
+	tcmu_dev_dbg(dev, "First lba: %"PRIu64", buffer lbas: %"PRIu64"\n",
 		     start_lba, write_lbas);
 
-	return async_handle_cmd(dev, cmd, writesame_work_fn);
+	ret = async_handle_cmd(dev, cmd, writesame_work_fn);
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
+		tcmur_scratch_free(write_same->iov_base);
+		tcmur_scratch_free(write_same);
+	}
+	return ret;
+}
+
+static void handle_native_writesame_cbk(struct tcmu_device *dev,
+					struct tcmulib_cmd *cmd, int ret)
+{
+	/* The handler only does some patterns or ranges natively */
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		ret = writesame_emulate(dev, cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+
+	aio_command_finish(dev, cmd, ret);
+}
+
+static int native_writesame_work_fn(struct tcmu_device *dev,
+				    struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	uint8_t *cdb = cmd->cdb;
+	uint64_t off = block_size * tcmu_get_lba(cdb);
+	uint64_t len = (uint64_t)block_size * tcmu_get_xfer_length(cdb);
+
+	cmd->done = handle_native_writesame_cbk;
+	return rhandler->writesame(dev, cmd, off, len, cmd->iovec,
+				   cmd->iov_cnt);
+}
+
+static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	int ret;
+
+	ret = handle_writesame_check(dev, cmd);
+	if (ret)
+		return ret;
+
+	if ((rhandler->unmap || rhandler->unmapv) && (cmd->cdb[1] & 0x08))
+		return handle_unmap_cdb_lbas(dev, cmd, aio_command_finish);
+
+	if (rhandler->writesame) {
+		ret = async_handle_cmd(dev, cmd, native_writesame_work_fn);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+	}
+
+	return writesame_emulate(dev, cmd);
 }
 
 static int tcmur_writesame_work_fn(struct tcmu_device *dev,
@@ -793,8 +1259,8 @@ int tcmur_handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	if (ret)
 		return ret;
 
-	if (rhandler->unmap && (cmd->cdb[1] & 0x08))
-		return handle_unmap_in_writesame(dev, cmd);
+	if ((rhandler->unmap || rhandler->unmapv) && (cmd->cdb[1] & 0x08))
+		return handle_unmap_cdb_lbas(dev, cmd, aio_command_finish);
 
 	cmd->cmdstate = write_same_fn;
 
@@ -811,22 +1277,23 @@ struct write_verify_state {
 	struct tcmulib_cmd *readcmd;
 };
 
-static int write_verify_init(struct tcmulib_cmd *origcmd, size_t length)
+static int write_verify_init(struct tcmu_device *dev,
+			     struct tcmulib_cmd *origcmd, size_t length)
 {
 	struct tcmulib_cmd *readcmd;
 	struct write_verify_state *state;
 	int i;
 
-	readcmd = calloc(1, sizeof(*readcmd));
+	readcmd = alloc_sub_cmd(dev);
 	if (!readcmd)
 		goto out;
 	readcmd->cmdstate = origcmd;
 	readcmd->cdb = origcmd->cdb;
 
-	if (alloc_iovec(readcmd, length))
+	if (alloc_iovec(dev, readcmd, length))
 		goto free_cmd;
 
-	state = calloc(1, sizeof(*state));
+	state = tcmur_scratch_alloc(dev, sizeof(*state));
 	if (!state)
 		goto free_iov;
 
@@ -835,7 +1302,8 @@ static int write_verify_init(struct tcmulib_cmd *origcmd, size_t length)
 	state->requested = length;
 	state->readcmd = readcmd;
 
-	state->w_iovec = calloc(origcmd->iov_cnt, sizeof(struct iovec));
+	state->w_iovec = tcmur_scratch_alloc(dev, origcmd->iov_cnt *
+					     sizeof(struct iovec));
 	if (!state->w_iovec)
 		goto free_state;
 
@@ -849,11 +1317,11 @@ static int write_verify_init(struct tcmulib_cmd *origcmd, size_t length)
 	return 0;
 
 free_state:
-	free(state);
+	tcmur_scratch_free(state);
 free_iov:
 	free_iovec(readcmd);
 free_cmd:
-	free(readcmd);
+	tcmur_scratch_free(readcmd);
 out:
 	return -ENOMEM;
 }
@@ -866,9 +1334,9 @@ static void write_verify_free(struct tcmulib_cmd *origcmd)
 	/* some handlers update iov_base */
 	readcmd->iovec->iov_base = state->read_buf;
 	free_iovec(readcmd);
-	free(readcmd);
-	free(state->w_iovec);
-	free(state);
+	tcmur_scratch_free(readcmd);
+	tcmur_scratch_free(state->w_iovec);
+	tcmur_scratch_free(state);
 }
 
 static void handle_write_verify_read_cbk(struct tcmu_device *dev,
@@ -928,7 +1396,11 @@ static int handle_write_verify(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
-	if (write_verify_init(cmd, length)) {
+	ret = tcmur_scratch_throttle(dev, cmd, length, handle_scratch_cbk);
+	if (ret != TCMU_STS_OK)
+		return ret;
+
+	if (write_verify_init(dev, cmd, length)) {
 		ret = TCMU_STS_NO_RESOURCE;
 		goto out;
 	}
@@ -966,18 +1438,45 @@ struct xcopy {
 	uint32_t lba_cnt;
 	uint32_t copy_lbas;
 
-	void *iov_base;
-	size_t iov_len;
-	struct iovec iovec;
-	size_t iov_cnt;
-};
-
-/* For now only supports block -> block type */
-static int xcopy_parse_segment_descs(uint8_t *seg_descs, struct xcopy *xcopy,
-				     uint8_t sdll)
-{
-	uint8_t *seg_desc = seg_descs;
-	uint8_t desc_len;
+	/* src and dst ranges checked for dirty data in a write-back cache */
+	unsigned int nr_wcache_waits;
+
+	/*
+	 * Data path copy: src_lba, dst_lba and lba_cnt are the part of the
+	 * segment no chunk has picked up yet.
+	 */
+	pthread_mutex_t lock;
+	struct tcmulib_cmd *origcmd;
+	struct xcopy_chunk *chunks;
+	unsigned int nr_chunks;
+	unsigned int nr_active;
+	int ret;
+};
+
+/* Max chunks of a segment being read or written at once */
+#define XCOPY_MAX_CHUNKS		8U
+
+/*
+ * Each chunk has its own buffer and cmd, and reads then writes up to
+ * copy_lbas blocks at a time until the segment has been copied.
+ */
+struct xcopy_chunk {
+	struct tcmulib_cmd cmd;
+	struct tcmur_cmd rcmd;
+	struct xcopy *xcopy;
+	uint64_t src_lba;
+	uint64_t dst_lba;
+	uint32_t nr_lbas;
+	void *buf;
+	struct iovec iovec;
+};
+
+/* For now only supports block -> block type */
+static int xcopy_parse_segment_descs(uint8_t *seg_descs, struct xcopy *xcopy,
+				     uint8_t sdll)
+{
+	uint8_t *seg_desc = seg_descs;
+	uint8_t desc_len;
 
 	/*
 	 * From spc4r31, section 6.3.7.5 Block device to block device
@@ -1097,13 +1596,15 @@ static int xcopy_locate_udev(struct tcmulib_context *ctx,
 	struct tcmu_device **dev_ptr;
 	struct tcmu_device *dev;
 	uint8_t wwn[XCOPY_NAA_IEEE_REGEX_LEN];
+	int ret = -1;
 
+	pthread_mutex_lock(&ctx->devices_lock);
 	darray_foreach(dev_ptr, ctx->devices) {
 		dev = *dev_ptr;
 
 		memset(wwn, 0, XCOPY_NAA_IEEE_REGEX_LEN);
 		if (xcopy_gen_naa_ieee(dev, wwn))
-			return -1;
+			break;
 
 		if (memcmp(wwn, dev_wwn, XCOPY_NAA_IEEE_REGEX_LEN))
 			continue;
@@ -1112,10 +1613,12 @@ static int xcopy_locate_udev(struct tcmulib_context *ctx,
 		tcmu_dev_dbg(dev, "Located tcmu devivce: %s\n",
 			     dev->tcm_dev_name);
 
-		return 0;
+		ret = 0;
+		break;
 	}
+	pthread_mutex_unlock(&ctx->devices_lock);
 
-	return -1;
+	return ret;
 }
 
 /* Identification descriptor target */
@@ -1242,12 +1745,16 @@ static int xcopy_parse_target_descs(struct tcmu_device *udev,
 		}
 	}
 
-	if (xcopy->src_dev)
+	if (xcopy->src_dev && xcopy->dst_dev)
+		ret = 0;
+	else if (xcopy->src_dev)
 		ret = xcopy_locate_udev(udev->ctx, xcopy->dst_tid_wwn,
 					&xcopy->dst_dev);
 	else if (xcopy->dst_dev)
 		ret = xcopy_locate_udev(udev->ctx, xcopy->src_tid_wwn,
 					&xcopy->src_dev);
+	else
+		ret = -1;
 
 	if (ret) {
 		tcmu_err("Target device not found, the index are %hu and %hu\n",
@@ -1282,7 +1789,7 @@ static int xcopy_parse_parameter_list(struct tcmu_device *dev,
 	 * of the parameter data that shall be contained in the Data-Out
 	 * Buffer.
 	*/
-	par = calloc(1, data_length);
+	par = tcmur_scratch_alloc(dev, data_length);
 	if (!par) {
 		tcmu_dev_err(dev, "calloc parameter list buffer error\n");
 		return TCMU_STS_NO_RESOURCE;
@@ -1414,7 +1921,8 @@ static int xcopy_parse_parameter_list(struct tcmu_device *dev,
 		tcmu_dev_err(xcopy->src_dev,
 			     "src target exceeds last lba %"PRIu64" (lba %"PRIu64", copy len %u\n",
 			     num_lbas, xcopy->src_lba, xcopy->lba_cnt);
-		return TCMU_STS_RANGE;
+		ret = TCMU_STS_RANGE;
+		goto err;
 	}
 
 	num_lbas = tcmu_get_dev_num_lbas(xcopy->dst_dev);
@@ -1422,77 +1930,135 @@ static int xcopy_parse_parameter_list(struct tcmu_device *dev,
 		tcmu_dev_err(xcopy->dst_dev,
 			     "dst target exceeds last lba %"PRIu64" (lba %"PRIu64", copy len %u)\n",
 			     num_lbas, xcopy->dst_lba, xcopy->lba_cnt);
-		return TCMU_STS_RANGE;
+		ret = TCMU_STS_RANGE;
+		goto err;
 	}
 
-	return TCMU_STS_OK;
-
+	ret = TCMU_STS_OK;
 err:
-	free(par);
+	tcmur_scratch_free(par);
 
 	return ret;
 }
 
-static int xcopy_read_work_fn(struct tcmu_device *src_dev, struct tcmulib_cmd *cmd);
+static void xcopy_free(struct xcopy *xcopy)
+{
+	unsigned int i;
+
+	if (xcopy->chunks) {
+		for (i = 0; i < xcopy->nr_chunks; i++)
+			tcmur_scratch_free(xcopy->chunks[i].buf);
+		tcmur_scratch_free(xcopy->chunks);
+		pthread_mutex_destroy(&xcopy->lock);
+	}
+	tcmur_scratch_free(xcopy);
+}
+
+static void xcopy_finish(struct xcopy *xcopy, int ret)
+{
+	aio_command_finish(xcopy->origdev, xcopy->origcmd, ret);
+	xcopy_free(xcopy);
+}
+
+/* Drops a chunk, or the ref of the thread starting them, and may finish */
+static void xcopy_put(struct xcopy *xcopy)
+{
+	bool last;
+
+	pthread_mutex_lock(&xcopy->lock);
+	last = !--xcopy->nr_active;
+	pthread_mutex_unlock(&xcopy->lock);
+
+	if (last)
+		xcopy_finish(xcopy, xcopy->ret);
+}
+
+/*
+ * Hands the chunk the next part of the segment. Returns false once it
+ * has all been picked up or a chunk failed.
+ */
+static bool xcopy_chunk_get(struct xcopy_chunk *chunk, int ret)
+{
+	struct xcopy *xcopy = chunk->xcopy;
+	bool got = false;
+
+	pthread_mutex_lock(&xcopy->lock);
+	if (ret != TCMU_STS_OK && xcopy->ret == TCMU_STS_OK)
+		xcopy->ret = ret;
+
+	if (xcopy->ret == TCMU_STS_OK && xcopy->lba_cnt) {
+		chunk->nr_lbas = min(xcopy->lba_cnt, xcopy->copy_lbas);
+		chunk->src_lba = xcopy->src_lba;
+		chunk->dst_lba = xcopy->dst_lba;
+
+		xcopy->src_lba += chunk->nr_lbas;
+		xcopy->dst_lba += chunk->nr_lbas;
+		xcopy->lba_cnt -= chunk->nr_lbas;
+		got = true;
+	}
+	pthread_mutex_unlock(&xcopy->lock);
+
+	return got;
+}
+
+static int xcopy_read_work_fn(struct tcmu_device *src_dev,
+			      struct tcmulib_cmd *cmd);
 static void handle_xcopy_read_cbk(struct tcmu_device *src_dev,
 				  struct tcmulib_cmd *cmd,
 				  int ret);
 
-static void handle_xcopy_write_cbk(struct tcmu_device *dst_dev,
-				  struct tcmulib_cmd *cmd,
-				  int ret)
+/* Starts the chunk's next read, or drops it if there is nothing left */
+static void xcopy_chunk_run(struct xcopy_chunk *chunk, int ret)
 {
-	struct xcopy *xcopy = cmd->cmdstate;
-	struct tcmu_device *src_dev = xcopy->src_dev;
+	struct xcopy *xcopy = chunk->xcopy;
 
-	/* write failed - bail out */
-	if (ret != TCMU_STS_OK) {
-		tcmu_dev_err(src_dev, "Failed to write to dst device!\n");
-		goto out;
+	while (xcopy_chunk_get(chunk, ret)) {
+		chunk->cmd.done = handle_xcopy_read_cbk;
+		ret = async_handle_cmd(xcopy->src_dev, &chunk->cmd,
+				       xcopy_read_work_fn);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
 	}
 
-	xcopy->lba_cnt -= xcopy->copy_lbas;
-	if (!xcopy->lba_cnt)
-		goto out;
+	xcopy_put(xcopy);
+}
 
-	xcopy->src_lba += xcopy->copy_lbas;
-	xcopy->dst_lba += xcopy->copy_lbas;
-	xcopy->copy_lbas = min(xcopy->lba_cnt, xcopy->copy_lbas);
+static void handle_xcopy_write_cbk(struct tcmu_device *dst_dev,
+				  struct tcmulib_cmd *cmd,
+				  int ret)
+{
+	struct xcopy_chunk *chunk = cmd->cmdstate;
 
-	cmd->done = handle_xcopy_read_cbk;
-	ret = async_handle_cmd(xcopy->src_dev, cmd, xcopy_read_work_fn);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
-		goto out;
+	tcmur_cache_write_done(dst_dev);
 
-	return;
+	/* write failed - bail out */
+	if (ret != TCMU_STS_OK)
+		tcmu_dev_err(dst_dev, "Failed to write to dst device!\n");
 
-out:
-	aio_command_finish(xcopy->origdev, cmd, ret);
-	free(xcopy->iov_base);
-	free(xcopy);
+	xcopy_chunk_run(chunk, ret);
 }
 
 static int xcopy_write_work_fn(struct tcmu_device *dst_dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dst_dev);
 	uint32_t block_size = tcmu_get_dev_block_size(dst_dev);
-	struct xcopy *xcopy = cmd->cmdstate;
-	struct iovec *iovec = &xcopy->iovec;
-	size_t iov_cnt = xcopy->iov_cnt;
+	struct xcopy_chunk *chunk = cmd->cmdstate;
+	size_t length = block_size * chunk->nr_lbas;
 
-	iovec->iov_base = xcopy->iov_base;
-	iovec->iov_len = xcopy->iov_len;
+	chunk->iovec.iov_base = chunk->buf;
+	chunk->iovec.iov_len = length;
 
 	cmd->done = handle_xcopy_write_cbk;
-	return rhandler->write(dst_dev, cmd, iovec, iov_cnt, xcopy->iov_len,
-			       block_size * xcopy->dst_lba);
+	return rhandler->write(dst_dev, cmd, &chunk->iovec, 1, length,
+			       block_size * chunk->dst_lba);
 }
 
 static void handle_xcopy_read_cbk(struct tcmu_device *src_dev,
 				  struct tcmulib_cmd *cmd,
 				  int ret)
 {
-	struct xcopy *xcopy = cmd->cmdstate;
+	struct xcopy_chunk *chunk = cmd->cmdstate;
+	struct xcopy *xcopy = chunk->xcopy;
 
 	/* read failed - bail out */
 	if (ret != TCMU_STS_OK) {
@@ -1502,36 +2068,237 @@ static void handle_xcopy_read_cbk(struct tcmu_device *src_dev,
 
 	cmd->done = handle_xcopy_write_cbk;
 
+	tcmur_cache_write_start(xcopy->dst_dev, chunk->dst_lba,
+				chunk->nr_lbas);
 	ret = async_handle_cmd(xcopy->dst_dev, cmd, xcopy_write_work_fn);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
+		tcmur_cache_write_done(xcopy->dst_dev);
 		goto err;
+	}
 
 	return;
 
 err:
-	aio_command_finish(xcopy->origdev, cmd, ret);
-	free(xcopy->iov_base);
-	free(xcopy);
+	xcopy_chunk_run(chunk, ret);
 }
 
 static int xcopy_read_work_fn(struct tcmu_device *src_dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(src_dev);
 	uint32_t block_size = tcmu_get_dev_block_size(src_dev);
-	struct xcopy *xcopy = cmd->cmdstate;
-	struct iovec *iovec = &xcopy->iovec;
-	size_t iov_cnt = xcopy->iov_cnt;
+	struct xcopy_chunk *chunk = cmd->cmdstate;
+	size_t length = block_size * chunk->nr_lbas;
 
 	tcmu_dev_dbg(src_dev,
 		     "Copying %u sectors from src (lba:%"PRIu64") to dst (lba:%"PRIu64")\n",
-		     xcopy->copy_lbas, xcopy->src_lba, xcopy->dst_lba);
+		     chunk->nr_lbas, chunk->src_lba, chunk->dst_lba);
 
-	iovec->iov_base = xcopy->iov_base;
-	iovec->iov_len = xcopy->iov_len;
+	chunk->iovec.iov_base = chunk->buf;
+	chunk->iovec.iov_len = length;
 
 	cmd->done = handle_xcopy_read_cbk;
-	return rhandler->read(src_dev, cmd, iovec, iov_cnt, xcopy->iov_len,
-			      block_size * xcopy->src_lba);
+	return rhandler->read(src_dev, cmd, &chunk->iovec, 1, length,
+			      block_size * chunk->src_lba);
+}
+
+/*
+ * Copies the segment through the runner with up to XCOPY_MAX_CHUNKS
+ * reads and writes in flight. Returns TCMU_STS_ASYNC_HANDLED once the
+ * chunks are running; the last one to finish completes the cmd.
+ */
+static void handle_xcopy_scratch_cbk(struct tcmu_device *dev,
+				     struct tcmulib_cmd *cmd, int ret);
+
+static int xcopy_start_chunks(struct xcopy *xcopy)
+{
+	uint32_t block_size = tcmu_get_dev_block_size(xcopy->src_dev);
+	struct xcopy_chunk *chunk;
+	unsigned int i, nr_chunks;
+	int ret;
+
+	nr_chunks = (xcopy->lba_cnt + xcopy->copy_lbas - 1) / xcopy->copy_lbas;
+	nr_chunks = min(nr_chunks, XCOPY_MAX_CHUNKS);
+
+	/*
+	 * Chunks can complete out of order, so an overlapping copy within
+	 * a device is done one chunk at a time like a plain forward copy.
+	 */
+	if (xcopy->src_dev == xcopy->dst_dev &&
+	    xcopy->src_lba < xcopy->dst_lba + xcopy->lba_cnt &&
+	    xcopy->dst_lba < xcopy->src_lba + xcopy->lba_cnt)
+		nr_chunks = 1;
+
+	ret = tcmur_scratch_throttle(xcopy->origdev, xcopy->origcmd,
+				     (size_t)nr_chunks * xcopy->copy_lbas * block_size,
+				     handle_xcopy_scratch_cbk);
+	if (ret != TCMU_STS_OK)
+		return ret;
+
+	xcopy->chunks = tcmur_scratch_alloc(xcopy->origdev,
+					    nr_chunks * sizeof(*xcopy->chunks));
+	if (!xcopy->chunks) {
+		tcmu_dev_err(xcopy->origdev, "calloc xcopy chunks error\n");
+		return TCMU_STS_NO_RESOURCE;
+	}
+
+	if (pthread_mutex_init(&xcopy->lock, NULL)) {
+		tcmur_scratch_free(xcopy->chunks);
+		xcopy->chunks = NULL;
+		return TCMU_STS_NO_RESOURCE;
+	}
+
+	/* Fewer chunks only make the copy slower, one is enough to go on */
+	for (i = 0; i < nr_chunks; i++) {
+		chunk = &xcopy->chunks[i];
+		chunk->buf = tcmur_scratch_alloc(xcopy->origdev,
+						 xcopy->copy_lbas * block_size);
+		if (!chunk->buf)
+			break;
+	}
+	xcopy->nr_chunks = i;
+	if (!xcopy->nr_chunks) {
+		tcmu_dev_err(xcopy->origdev, "calloc iovec data error\n");
+		return TCMU_STS_NO_RESOURCE;
+	}
+
+	/* One ref per chunk, plus ours so no chunk finishes the cmd early */
+	xcopy->nr_active = xcopy->nr_chunks + 1;
+	xcopy->ret = TCMU_STS_OK;
+
+	for (i = 0; i < xcopy->nr_chunks; i++) {
+		chunk = &xcopy->chunks[i];
+		chunk->xcopy = xcopy;
+		tcmur_cmd_init(&chunk->cmd, &chunk->rcmd);
+		chunk->cmd.cdb = xcopy->origcmd->cdb;
+		chunk->cmd.cmdstate = chunk;
+		xcopy_chunk_run(chunk, TCMU_STS_OK);
+	}
+
+	xcopy_put(xcopy);
+	return TCMU_STS_ASYNC_HANDLED;
+}
+
+/* Enough of the device's scratch memory was freed for the chunks */
+static void handle_xcopy_scratch_cbk(struct tcmu_device *dev,
+				     struct tcmulib_cmd *cmd, int ret)
+{
+	struct xcopy *xcopy = cmd->cmdstate;
+
+	if (ret == TCMU_STS_OK) {
+		ret = xcopy_start_chunks(xcopy);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+
+	xcopy_finish(xcopy, ret);
+}
+
+static void handle_xcopy_native_cbk(struct tcmu_device *dst_dev,
+				    struct tcmulib_cmd *cmd, int ret)
+{
+	struct xcopy *xcopy = cmd->cmdstate;
+
+	tcmur_cache_write_done(dst_dev);
+
+	/* The handler can not copy between these two, move the data here */
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		ret = xcopy_start_chunks(xcopy);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	} else if (ret != TCMU_STS_OK) {
+		tcmu_dev_err(dst_dev, "Failed to copy to dst device!\n");
+	}
+
+	xcopy_finish(xcopy, ret);
+}
+
+static int xcopy_native_work_fn(struct tcmu_device *dst_dev,
+				struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dst_dev);
+	uint32_t block_size = tcmu_get_dev_block_size(dst_dev);
+	struct xcopy *xcopy = cmd->cmdstate;
+
+	tcmu_dev_dbg(dst_dev,
+		     "Offloading copy of %u sectors from src (lba:%"PRIu64") to dst (lba:%"PRIu64")\n",
+		     xcopy->lba_cnt, xcopy->src_lba, xcopy->dst_lba);
+
+	cmd->done = handle_xcopy_native_cbk;
+	return rhandler->copy(dst_dev, cmd, block_size * xcopy->dst_lba,
+			      xcopy->src_dev, block_size * xcopy->src_lba,
+			      block_size * xcopy->lba_cnt);
+}
+
+/*
+ * Devices on the same handler may be able to copy without the data
+ * coming through the runner, so give the handler the whole segment
+ * first.
+ */
+static int xcopy_copy(struct tcmulib_cmd *cmd)
+{
+	struct xcopy *xcopy = cmd->cmdstate;
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(xcopy->dst_dev);
+	int ret;
+
+	if (!rhandler->copy ||
+	    tcmu_get_runner_handler(xcopy->src_dev) != rhandler)
+		return xcopy_start_chunks(xcopy);
+
+	tcmur_cache_write_start(xcopy->dst_dev, xcopy->dst_lba, xcopy->lba_cnt);
+	ret = async_handle_cmd(xcopy->dst_dev, cmd, xcopy_native_work_fn);
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return ret;
+	tcmur_cache_write_done(xcopy->dst_dev);
+
+	if (ret == TCMU_STS_NOT_HANDLED)
+		return xcopy_start_chunks(xcopy);
+	return ret;
+}
+
+static void handle_xcopy_wcache_cbk(struct tcmu_device *dev,
+				    struct tcmulib_cmd *cmd, int ret);
+
+/*
+ * Data buffered by a write-back cache is written back before it is read
+ * from src, or before it could be written back over the copy on dst.
+ */
+static int xcopy_start(struct tcmulib_cmd *cmd)
+{
+	struct xcopy *xcopy = cmd->cmdstate;
+	struct tcmu_device *wait_dev;
+	uint64_t wait_lba;
+	int ret;
+
+	while (xcopy->nr_wcache_waits < 2) {
+		if (xcopy->nr_wcache_waits++) {
+			wait_dev = xcopy->dst_dev;
+			wait_lba = xcopy->dst_lba;
+		} else {
+			wait_dev = xcopy->src_dev;
+			wait_lba = xcopy->src_lba;
+		}
+
+		cmd->done = handle_xcopy_wcache_cbk;
+		ret = tcmur_wcache_wait(wait_dev, cmd, wait_lba, xcopy->lba_cnt);
+		if (ret != TCMU_STS_OK)
+			return ret;
+	}
+
+	return xcopy_copy(cmd);
+}
+
+static void handle_xcopy_wcache_cbk(struct tcmu_device *dev,
+				    struct tcmulib_cmd *cmd, int ret)
+{
+	struct xcopy *xcopy = cmd->cmdstate;
+
+	if (ret == TCMU_STS_OK) {
+		ret = xcopy_start(cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+
+	xcopy_finish(xcopy, ret);
 }
 
 /* async xcopy */
@@ -1539,8 +2306,7 @@ static int handle_xcopy(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	uint8_t *cdb = cmd->cdb;
 	size_t data_length = tcmu_get_xfer_length(cdb);
-	uint32_t block_size = tcmu_get_dev_block_size(dev);
-	uint32_t max_sectors, src_max_sectors, copy_lbas, dst_max_sectors;
+	uint32_t max_sectors, src_max_sectors, dst_max_sectors;
 	struct xcopy *xcopy;
 	int ret;
 
@@ -1569,7 +2335,7 @@ static int handle_xcopy(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		return TCMU_STS_INVALID_PARAM_LIST_LEN;
 	}
 
-	xcopy = calloc(1, sizeof(struct xcopy));
+	xcopy = tcmur_scratch_alloc(dev, sizeof(struct xcopy));
 	if (!xcopy) {
 		tcmu_dev_err(dev, "calloc xcopy data error\n");
 		return TCMU_STS_NO_RESOURCE;
@@ -1590,28 +2356,18 @@ static int handle_xcopy(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	dst_max_sectors = tcmu_get_dev_opt_xcopy_rw_len(xcopy->dst_dev);
 
 	max_sectors = min(src_max_sectors, dst_max_sectors);
-	copy_lbas = min(max_sectors, xcopy->lba_cnt);
-	xcopy->copy_lbas = copy_lbas;
+	xcopy->copy_lbas = min(max_sectors, xcopy->lba_cnt);
 
-	xcopy->iov_len = xcopy->copy_lbas * block_size;
-	xcopy->iov_base = calloc(1, xcopy->iov_len);
-	if (!xcopy->iov_base) {
-		tcmu_dev_err(dev, "calloc iovec data error\n");
-		ret = TCMU_STS_NO_RESOURCE;
-		goto finish_err;
-	}
-
-	xcopy->iov_cnt = 1;
 	xcopy->origdev = dev;
+	xcopy->origcmd = cmd;
 	cmd->cmdstate = xcopy;
 
-	ret = async_handle_cmd(xcopy->src_dev, cmd, xcopy_read_work_fn);
+	ret = xcopy_start(cmd);
 	if (ret == TCMU_STS_ASYNC_HANDLED)
 		return ret;
 
-	free(xcopy->iov_base);
 finish_err:
-	free(xcopy);
+	xcopy_free(xcopy);
 	return ret;
 }
 
@@ -1621,23 +2377,25 @@ struct caw_state {
 	size_t requested;
 	void *read_buf;
 	struct tcmulib_cmd *origcmd;
+	struct tcmur_range range;
 };
 
 static struct tcmulib_cmd *
-caw_init_readcmd(struct tcmulib_cmd *origcmd, size_t length)
+caw_init_readcmd(struct tcmu_device *dev, struct tcmulib_cmd *origcmd,
+		 size_t length)
 {
 	struct tcmulib_cmd *readcmd;
 	struct caw_state *state;
 
-	state = calloc(1, sizeof(*state));
+	state = tcmur_scratch_alloc(dev, sizeof(*state));
 	if (!state)
 		goto out;
-	readcmd = calloc(1, sizeof(*readcmd));
+	readcmd = alloc_sub_cmd(dev);
 	if (!readcmd)
 		goto free_state;
 	readcmd->cdb = origcmd->cdb;
 
-	if (alloc_iovec(readcmd, length))
+	if (alloc_iovec(dev, readcmd, length))
 		goto free_cmd;
 
 	/* multi-op state maintainance */
@@ -1649,9 +2407,9 @@ caw_init_readcmd(struct tcmulib_cmd *origcmd, size_t length)
 	return readcmd;
 
 free_cmd:
-	free(readcmd);
+	tcmur_scratch_free(readcmd);
 free_state:
-	free(state);
+	tcmur_scratch_free(state);
 out:
 	return NULL;
 }
@@ -1663,17 +2421,20 @@ static void caw_free_readcmd(struct tcmulib_cmd *readcmd)
 	/* some handlers update iov_base */
 	readcmd->iovec->iov_base = state->read_buf;
 	free_iovec(readcmd);
-	free(state);
-	free(readcmd);
+	tcmur_scratch_free(state);
+	tcmur_scratch_free(readcmd);
 }
 
 static void handle_caw_write_cbk(struct tcmu_device *dev,
 				 struct tcmulib_cmd *cmd, int ret)
 {
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmulib_cmd *readcmd = cmd->cmdstate;
+	struct caw_state *state = readcmd->cmdstate;
 
-	pthread_mutex_unlock(&rdev->caw_lock);
+	tcmur_range_unlock(dev, &rdev->caw_lock, &state->range);
 	aio_command_finish(dev, cmd, ret);
+	caw_free_readcmd(readcmd);
 }
 
 static void handle_caw_read_cbk(struct tcmu_device *dev,
@@ -1698,23 +2459,50 @@ static void handle_caw_read_cbk(struct tcmu_device *dev,
 		goto finish_err;
 	}
 
-	/* perform write */
+	/* perform write, the range stays locked until it completes */
 	tcmu_seek_in_cmd_iovec(origcmd, state->requested);
+	origcmd->cmdstate = readcmd;
 	origcmd->done = handle_caw_write_cbk;
 
 	ret = async_handle_cmd(dev, origcmd, write_work_fn);
 	if (ret != TCMU_STS_ASYNC_HANDLED)
 		goto finish_err;
 
-	caw_free_readcmd(readcmd);
 	return;
 
 finish_err:
-	pthread_mutex_unlock(&rdev->caw_lock);
+	tcmur_range_unlock(dev, &rdev->caw_lock, &state->range);
 	aio_command_finish(dev, origcmd, ret);
 	caw_free_readcmd(readcmd);
 }
 
+static int caw_start_read(struct tcmu_device *dev, struct tcmulib_cmd *readcmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct caw_state *state = readcmd->cmdstate;
+	int ret;
+
+	readcmd->done = handle_caw_read_cbk;
+	ret = async_handle_cmd(dev, readcmd, read_work_fn);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		tcmur_range_unlock(dev, &rdev->caw_lock, &state->range);
+	return ret;
+}
+
+/* An overlapping CAW completed and the range is ours now */
+static void handle_caw_locked_cbk(struct tcmu_device *dev,
+				  struct tcmulib_cmd *readcmd, int ret)
+{
+	struct caw_state *state = readcmd->cmdstate;
+
+	ret = caw_start_read(dev, readcmd);
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return;
+
+	aio_command_finish(dev, state->origcmd, ret);
+	caw_free_readcmd(readcmd);
+}
+
 static int handle_caw_check(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	int ret;
@@ -1752,6 +2540,7 @@ static int handle_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	size_t half = (tcmu_iovec_length(cmd->iovec, cmd->iov_cnt)) / 2;
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	uint8_t sectors = cmd->cdb[13];
+	struct caw_state *state;
 
 	/* From sbc4r12a section 5.3 COMPARE AND WRITE command
 	 * A NUMBER OF LOGICAL BLOCKS field set to zero specifies that no
@@ -1769,26 +2558,58 @@ static int handle_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (ret)
 		return ret;
 
-	readcmd = caw_init_readcmd(cmd, half);
+	ret = tcmur_scratch_throttle(dev, cmd, half, handle_scratch_cbk);
+	if (ret != TCMU_STS_OK)
+		return ret;
+
+	readcmd = caw_init_readcmd(dev, cmd, half);
 	if (!readcmd) {
 		ret = TCMU_STS_NO_RESOURCE;
 		goto out;
 	}
 
-	readcmd->done = handle_caw_read_cbk;
-
-	pthread_mutex_lock(&rdev->caw_lock);
+	/* only CAWs to overlapping lbas are serialized */
+	state = readcmd->cmdstate;
+	state->range.cmd = readcmd;
+	state->range.lba = tcmu_get_lba(cmd->cdb);
+	state->range.nr_lbas = sectors;
+	readcmd->done = handle_caw_locked_cbk;
 
-	ret = async_handle_cmd(dev, readcmd, read_work_fn);
+	ret = tcmur_range_lock(dev, &rdev->caw_lock, &state->range);
+	if (ret == TCMU_STS_OK)
+		ret = caw_start_read(dev, readcmd);
 	if (ret == TCMU_STS_ASYNC_HANDLED)
 		return TCMU_STS_ASYNC_HANDLED;
 
-	pthread_mutex_unlock(&rdev->caw_lock);
 	caw_free_readcmd(readcmd);
 out:
 	return ret;
 }
 
+/* Enough of the device's scratch memory was freed to start the cmd */
+static void handle_scratch_cbk(struct tcmu_device *dev,
+			       struct tcmulib_cmd *cmd, int ret)
+{
+	if (ret == TCMU_STS_OK) {
+		switch (cmd->cdb[0]) {
+		case COMPARE_AND_WRITE:
+			ret = handle_caw(dev, cmd);
+			break;
+		case WRITE_VERIFY:
+		case WRITE_VERIFY_16:
+			ret = handle_write_verify(dev, cmd);
+			break;
+		default:
+			ret = writesame_emulate(dev, cmd);
+			break;
+		}
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+
+	aio_command_finish(dev, cmd, ret);
+}
+
 static int tcmur_caw_fn(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	tcmur_caw_fn_t caw_fn = cmd->cmdstate;
@@ -1832,31 +2653,230 @@ int tcmur_handle_caw(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	return async_handle_cmd(dev, cmd, tcmur_caw_fn);
 }
 
-/* async flush */
-static int flush_work_fn(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+/* Descriptors returned per GET LBA STATUS, at most */
+#define GET_LBA_STATUS_MAX_DESCS	64
+
+struct lba_status_state {
+	struct tcmu_device *dev;
+	uint64_t lba;
+	uint32_t alloc_len;
+	size_t max_descs;
+	size_t nr_status;
+	struct tcmur_lba_status status[GET_LBA_STATUS_MAX_DESCS];
+};
+
+/*
+ * Turn the handler's byte ranges into LBA status descriptors, merging
+ * ranges that ended up with the same status. A block is only reported
+ * as deallocated if all of it is. If the handler did not report
+ * anything, all the LBAs are reported as mapped.
+ */
+static int lba_status_complete(struct tcmu_device *dev,
+			       struct tcmulib_cmd *cmd,
+			       struct lba_status_state *state)
 {
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	uint64_t num_lbas = tcmu_get_dev_num_lbas(dev);
+	uint8_t buf[8 + GET_LBA_STATUS_MAX_DESCS * 16];
+	struct tcmur_lba_status *desc = NULL;
+	uint64_t lba = state->lba, end, end_lba, left;
+	size_t i, n, nr_descs = 0;
+	uint32_t count;
+	bool mapped;
+
+	/* descriptors are built in place, never past the range read */
+	for (i = 0; i < state->nr_status && lba < num_lbas; i++) {
+		end = state->status[i].off + state->status[i].len;
+		mapped = state->status[i].mapped;
+
+		if (mapped)
+			end_lba = round_up(end, block_size) / block_size;
+		else
+			end_lba = end / block_size;
+		end_lba = min(end_lba, num_lbas);
+		if (end_lba <= lba)
+			continue;
 
-	return rhandler->flush(dev, cmd);
+		if (desc && desc->mapped == mapped) {
+			desc->len = end_lba - desc->off;
+		} else {
+			if (nr_descs == state->max_descs)
+				break;
+			desc = &state->status[nr_descs++];
+			desc->off = lba;
+			desc->len = end_lba - lba;
+			desc->mapped = mapped;
+		}
+		lba = end_lba;
+	}
+
+	if (!nr_descs) {
+		desc = &state->status[nr_descs++];
+		desc->off = state->lba;
+		desc->len = num_lbas - state->lba;
+		desc->mapped = true;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	for (i = 0, n = 0; i < nr_descs && n < state->max_descs; i++) {
+		lba = state->status[i].off;
+		left = state->status[i].len;
+
+		/* the NUMBER OF LOGICAL BLOCKS field is 32 bits */
+		for (; left && n < state->max_descs; n++) {
+			count = min(left, (uint64_t)UINT32_MAX);
+			*((uint64_t *)&buf[8 + n * 16]) = htobe64(lba);
+			*((uint32_t *)&buf[8 + n * 16 + 8]) = htobe32(count);
+			/* PROVISIONING STATUS: 0 mapped, 1 deallocated */
+			buf[8 + n * 16 + 12] = state->status[i].mapped ? 0 : 1;
+			lba += count;
+			left -= count;
+		}
+	}
+
+	/* PARAMETER DATA LENGTH does not count its own 4 bytes */
+	*((uint32_t *)&buf[0]) = htobe32(4 + n * 16);
+
+	tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt, buf,
+			       min((size_t)state->alloc_len, 8 + n * 16));
+	return TCMU_STS_OK;
 }
 
-static int handle_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+static void handle_lba_status_cbk(struct tcmu_device *dev,
+				  struct tcmulib_cmd *cmd, int ret)
 {
-	cmd->done = handle_generic_cbk;
-	return async_handle_cmd(dev, cmd, flush_work_fn);
+	struct lba_status_state *state = cmd->cmdstate;
+
+	if (ret == TCMU_STS_OK)
+		ret = lba_status_complete(dev, cmd, state);
+	free(state);
+	aio_command_finish(dev, cmd, ret);
 }
 
-static int handle_recv_copy_result(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+static int lba_status_work_fn(struct tcmu_device *dev,
+			      struct tcmulib_cmd *cmd)
 {
-	struct iovec *iovec = cmd->iovec;
-	size_t iov_cnt = cmd->iov_cnt;
-	uint8_t buf[128];
-	uint16_t val16;
-	uint32_t val32;
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct lba_status_state *state = cmd->cmdstate;
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	uint64_t nr_lbas = tcmu_get_dev_num_lbas(dev) - state->lba;
 
-	memset(buf, 0, sizeof(buf));
+	/* do not scan past what the descriptors can report */
+	nr_lbas = min(nr_lbas, (uint64_t)state->max_descs * UINT32_MAX);
 
-	/*
+	state->nr_status = state->max_descs;
+	return rhandler->get_lba_status(dev, cmd, state->lba * block_size,
+					nr_lbas * block_size,
+					state->status, &state->nr_status);
+}
+
+static void *lba_status_thread(void *arg)
+{
+	struct tcmulib_cmd *cmd = arg;
+	struct lba_status_state *state = cmd->cmdstate;
+	struct tcmu_device *dev = state->dev;
+	int ret;
+
+	ret = lba_status_work_fn(dev, cmd);
+	if (ret)
+		cmd->done(dev, cmd, ret);
+	return NULL;
+}
+
+/*
+ * Handlers without io threads run their callouts on the cmdproc thread,
+ * but get_lba_status may walk a large part of the backend, so it gets a
+ * thread of its own. GET LBA STATUS is rare enough for that.
+ */
+static int lba_status_spawn(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, lba_status_thread, cmd);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		tcmu_dev_warn(dev, "Could not start GET LBA STATUS thread: %d\n",
+			      ret);
+		return async_handle_cmd(dev, cmd, lba_status_work_fn);
+	}
+	return TCMU_STS_ASYNC_HANDLED;
+}
+
+static int handle_get_lba_status(struct tcmu_device *dev,
+				 struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct lba_status_state *state;
+	uint64_t lba = tcmu_get_lba(cmd->cdb);
+	uint32_t alloc_len = tcmu_get_xfer_length(cmd->cdb);
+	int ret;
+
+	if (lba >= tcmu_get_dev_num_lbas(dev)) {
+		tcmu_dev_err(dev, "GET LBA STATUS lba %"PRIu64" exceeds last lba %"PRIu64"\n",
+			     lba, tcmu_get_dev_num_lbas(dev) - 1);
+		return TCMU_STS_RANGE;
+	}
+
+	if (!alloc_len)
+		return TCMU_STS_OK;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return TCMU_STS_NO_RESOURCE;
+	state->dev = dev;
+	state->lba = lba;
+	state->alloc_len = alloc_len;
+	/* a short allocation length still gets the first descriptor */
+	state->max_descs = alloc_len >= 24 ? (alloc_len - 8) / 16 : 1;
+	state->max_descs = min(state->max_descs,
+			       (size_t)GET_LBA_STATUS_MAX_DESCS);
+
+	if (!rhandler->get_lba_status) {
+		ret = lba_status_complete(dev, cmd, state);
+		free(state);
+		return ret;
+	}
+
+	cmd->cmdstate = state;
+	cmd->done = handle_lba_status_cbk;
+	if (!rhandler->nr_threads)
+		ret = lba_status_spawn(dev, cmd);
+	else
+		ret = async_handle_cmd(dev, cmd, lba_status_work_fn);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		free(state);
+	return ret;
+}
+
+/* async flush */
+static int flush_work_fn(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+
+	return rhandler->flush(dev, cmd);
+}
+
+static int handle_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	cmd->done = handle_generic_cbk;
+	return async_handle_cmd(dev, cmd, flush_work_fn);
+}
+
+static int handle_recv_copy_result(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct iovec *iovec = cmd->iovec;
+	size_t iov_cnt = cmd->iov_cnt;
+	uint8_t buf[128];
+	uint16_t val16;
+	uint32_t val32;
+
+	memset(buf, 0, sizeof(buf));
+
+	/*
 	 * From spc4r31, section 6.18.4 OPERATING PARAMETERS service
 	 * action
 	 */
@@ -1961,30 +2981,208 @@ static int handle_recv_copy_result(struct tcmu_device *dev, struct tcmulib_cmd *
 	return TCMU_STS_OK;
 }
 
+static void handle_fua_write_cbk(struct tcmu_device *dev,
+				 struct tcmulib_cmd *cmd, int ret)
+{
+	if (ret == TCMU_STS_OK) {
+		cmd->done = handle_generic_cbk;
+		ret = async_handle_cmd(dev, cmd, flush_work_fn);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+	aio_command_finish(dev, cmd, ret);
+}
+
+/* If the zeros could not be unmapped or written same, write them out */
+static void handle_zero_write_cbk(struct tcmu_device *dev,
+				  struct tcmulib_cmd *cmd, int ret)
+{
+	if (ret != TCMU_STS_OK) {
+		cmd->done = handle_generic_cbk;
+		ret = async_handle_rw(dev, cmd, true);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+	aio_command_finish(dev, cmd, ret);
+}
+
+static int zero_write_work_fn(struct tcmu_device *dev,
+			      struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	uint8_t *cdb = cmd->cdb;
+
+	return rhandler->writesame(dev, cmd, block_size * tcmu_get_lba(cdb),
+				   block_size * tcmu_get_xfer_length(cdb),
+				   cmd->iovec, cmd->iov_cnt);
+}
+
+/*
+ * A WRITE of zeros is sent to the handler as an unmap, or as a WRITE SAME
+ * of zeros, so the zeros never reach the backend. If the handler fails
+ * that, the data is written out normally. Returns NOT_HANDLED if the
+ * data is not zeroed or has to be written out normally.
+ */
+static int handle_zero_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	int ret;
+
+	if (!tcmu_get_xfer_length(cmd->cdb) ||
+	    (!rhandler->unmap && !rhandler->unmapv && !rhandler->writesame) ||
+	    !tcmu_iovec_zeroed(cmd->iovec, cmd->iov_cnt))
+		return TCMU_STS_NOT_HANDLED;
+
+	if (rhandler->unmap || rhandler->unmapv) {
+		ret = handle_unmap_cdb_lbas(dev, cmd, handle_zero_write_cbk);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return ret;
+		/* nothing was sent, so try ->writesame or write it out */
+		if (!rhandler->writesame)
+			return TCMU_STS_NOT_HANDLED;
+	}
+
+	cmd->done = handle_zero_write_cbk;
+	return async_handle_cmd(dev, cmd, zero_write_work_fn);
+}
+
+/*
+ * A WRITE the write-back cache did not buffer. If it has FUA set and the
+ * handler has a cache of its own, that is flushed after it too.
+ */
+static int handle_write_through(struct tcmu_device *dev,
+				struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint8_t *cdb = cmd->cdb;
+	bool fua = cdb[0] != WRITE_6 && (cdb[1] & 0x08);
+	int ret;
+
+	if (!fua && rdev->zero_detect > 0) {
+		ret = handle_zero_write(dev, cmd);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+	}
+
+	cmd->done = handle_generic_cbk;
+	if (fua && rhandler->flush && tcmur_wcache_backend_wce(dev))
+		cmd->done = handle_fua_write_cbk;
+	return async_handle_rw(dev, cmd, true);
+}
+
+static void handle_wcache_write_cbk(struct tcmu_device *dev,
+				    struct tcmulib_cmd *cmd, int ret)
+{
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		ret = handle_write_through(dev, cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+	aio_command_finish(dev, cmd, ret);
+}
+
 /* async write */
 static int handle_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint8_t *cdb = cmd->cdb;
+	bool fua = cdb[0] != WRITE_6 && (cdb[1] & 0x08);
 	int ret;
 
 	ret = check_lba_and_length(dev, cmd, tcmu_get_xfer_length(cmd->cdb));
 	if (ret)
 		return ret;
 
+	if (rdev->wcache) {
+		cmd->done = handle_wcache_write_cbk;
+		ret = tcmur_wcache_write(dev, cmd);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+		return handle_write_through(dev, cmd);
+	}
+
+	/* FUA WRITEs are always written out */
+	if (!fua && rdev->zero_detect > 0) {
+		ret = handle_zero_write(dev, cmd);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+	}
+
+	cmd->done = handle_generic_cbk;
+	return async_handle_rw(dev, cmd, true);
+}
+
+/* A READ served by the flash tier, sent to the handler if that failed */
+static void handle_tier_read_cbk(struct tcmu_device *dev,
+				 struct tcmulib_cmd *cmd, int ret)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		cmd->done = rdev->read_cache ? handle_cached_read_cbk :
+					       handle_generic_cbk;
+		ret = async_handle_rw(dev, cmd, false);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+		aio_command_finish(dev, cmd, ret);
+		return;
+	}
+
+	handle_cached_read_cbk(dev, cmd, ret);
+}
+
+static int __handle_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
 	cmd->done = handle_generic_cbk;
-	return async_handle_cmd(dev, cmd, write_work_fn);
+	if (rdev->read_cache) {
+		if (tcmur_cache_read(dev, cmd))
+			return TCMU_STS_OK;
+		cmd->done = handle_cached_read_cbk;
+	}
+	if (rdev->tier) {
+		cmd_done_t done = cmd->done;
+
+		cmd->done = handle_tier_read_cbk;
+		if (tcmur_tier_read(dev, cmd) != TCMU_STS_NOT_HANDLED)
+			return TCMU_STS_ASYNC_HANDLED;
+		cmd->done = done;
+	}
+	return async_handle_rw(dev, cmd, false);
+}
+
+static void handle_wcache_read_cbk(struct tcmu_device *dev,
+				   struct tcmulib_cmd *cmd, int ret)
+{
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		ret = __handle_read(dev, cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+	aio_command_finish(dev, cmd, ret);
 }
 
 /* async read */
 static int handle_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	int ret;
 
 	ret = check_lba_and_length(dev, cmd, tcmu_get_xfer_length(cmd->cdb));
 	if (ret)
 		return ret;
 
-	cmd->done = handle_generic_cbk;
-	return async_handle_cmd(dev, cmd, read_work_fn);
+	/* dirty data in the write-back cache is newer than the read cache's */
+	if (rdev->wcache) {
+		cmd->done = handle_wcache_read_cbk;
+		ret = tcmur_wcache_read(dev, cmd);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
+	}
+	return __handle_read(dev, cmd);
 }
 
 /* FORMAT UNIT */
@@ -2035,7 +3233,7 @@ static void handle_format_unit_cbk(struct tcmu_device *dev,
 		free_iovec(writecmd);
 		if ((dev->num_lbas - state->done_blocks) * dev->block_size < state->length)
 		    state->length = (dev->num_lbas - state->done_blocks) * dev->block_size;
-		if (alloc_iovec(writecmd, state->length)) {
+		if (alloc_iovec(dev, writecmd, state->length)) {
 			ret = TCMU_STS_NO_RESOURCE;
 			goto free_cmd;
 		}
@@ -2062,10 +3260,10 @@ static void handle_format_unit_cbk(struct tcmu_device *dev,
 free_iovec:
 	free_iovec(writecmd);
 free_cmd:
-	free(writecmd);
-	free(state);
+	tcmur_scratch_free(writecmd);
+	tcmur_scratch_free(state);
 	pthread_mutex_lock(&rdev->format_lock);
-	rdev->flags &= ~TCMUR_DEV_FLAG_FORMATTING;
+	tcmur_dev_clear_flags(rdev, TCMUR_DEV_FLAG_FORMATTING);
 	pthread_mutex_unlock(&rdev->format_lock);
 	aio_command_finish(dev, origcmd, ret);
 }
@@ -2087,16 +3285,16 @@ static int handle_format_unit(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		return TCMU_STS_FRMT_IN_PROGRESS;
 	}
 	rdev->format_progress = 0;
-	rdev->flags |= TCMUR_DEV_FLAG_FORMATTING;
+	tcmur_dev_set_flags(rdev, TCMUR_DEV_FLAG_FORMATTING);
 	pthread_mutex_unlock(&rdev->format_lock);
 
-	writecmd = calloc(1, sizeof(*writecmd));
+	writecmd = alloc_sub_cmd(dev);
 	if (!writecmd)
 		goto clear_format;
 	writecmd->done = handle_format_unit_cbk;
 	writecmd->cmdstate = cmd;
 
-	state = calloc(1, sizeof(*state));
+	state = tcmur_scratch_alloc(dev, sizeof(*state));
 	if (!state)
 		goto free_cmd;
 
@@ -2111,7 +3309,7 @@ static int handle_format_unit(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if ((num_lbas - state->done_blocks) * block_size < length)
 		state->length = (num_lbas - state->done_blocks) * block_size;
 
-	if (alloc_iovec(writecmd, state->length)) {
+	if (alloc_iovec(dev, writecmd, state->length)) {
 		goto free_state;
 	}
 
@@ -2130,12 +3328,12 @@ static int handle_format_unit(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 free_iov:
 	free_iovec(writecmd);
 free_state:
-	free(state);
+	tcmur_scratch_free(state);
 free_cmd:
-	free(writecmd);
+	tcmur_scratch_free(writecmd);
 clear_format:
 	pthread_mutex_lock(&rdev->format_lock);
-	rdev->flags &= ~TCMUR_DEV_FLAG_FORMATTING;
+	tcmur_dev_clear_flags(rdev, TCMUR_DEV_FLAG_FORMATTING);
 	pthread_mutex_unlock(&rdev->format_lock);
 	return TCMU_STS_NO_RESOURCE;
 }
@@ -2194,6 +3392,29 @@ bool tcmur_handler_is_passthrough_only(struct tcmur_handler *rhandler)
 	return true;
 }
 
+/*
+ * Lets the handler batch the io of the cmds dispatched until
+ * tcmur_handler_unplug. Returns false if it does not batch.
+ */
+bool tcmur_handler_submit_batch(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+
+	if (!rhandler->submit_batch || !rhandler->unplug ||
+	    rhandler->nr_threads)
+		return false;
+
+	rhandler->submit_batch(dev);
+	return true;
+}
+
+void tcmur_handler_unplug(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+
+	rhandler->unplug(dev);
+}
+
 int tcmur_cmd_passthrough_handler(struct tcmu_device *dev,
 				  struct tcmulib_cmd *cmd)
 {
@@ -2220,22 +3441,86 @@ int tcmur_cmd_passthrough_handler(struct tcmu_device *dev,
 	track_aio_request_start(rdev);
 	ret = handle_passthrough(dev, cmd);
 	if (ret != TCMU_STS_ASYNC_HANDLED)
-		track_aio_request_finish(rdev, NULL);
+		track_aio_request_finish(rdev);
 
 	return ret;
 }
 
+static int __tcmur_cmd_handler(struct tcmu_device *dev,
+			       struct tcmulib_cmd *cmd);
+
+/* The cmd waited for the CAWs that overlap it to complete */
+static void handle_caw_conflict_cbk(struct tcmu_device *dev,
+				    struct tcmulib_cmd *cmd, int ret)
+{
+	ret = __tcmur_cmd_handler(dev, cmd);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		aio_command_finish(dev, cmd, ret);
+}
+
+/* Writes must not land between the read and write of a running CAW */
+static int handle_caw_conflict(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint64_t num_lbas = tcmu_get_dev_num_lbas(dev);
+	uint8_t *cdb = cmd->cdb;
+	uint64_t lba, nr_lbas;
+
+	switch (cdb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+		lba = tcmu_get_lba(cdb);
+		nr_lbas = tcmu_get_xfer_length(cdb);
+		break;
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		lba = tcmu_get_lba(cdb);
+		nr_lbas = tcmu_get_xfer_length(cdb);
+		if (!nr_lbas && lba < num_lbas)
+			nr_lbas = num_lbas - lba;
+		break;
+	default:
+		return TCMU_STS_OK;
+	}
+
+	cmd->done = handle_caw_conflict_cbk;
+	return tcmur_range_wait(dev, &rdev->caw_lock, cmd, lba, nr_lbas);
+}
+
+static int tcmur_cmd_handler(struct tcmu_device *dev,
+			     struct tcmulib_cmd *cmd);
+
+/* The cmd was held until the device's reopen or lock acquisition */
+static void handle_pending_cbk(struct tcmu_device *dev,
+			       struct tcmulib_cmd *cmd, int ret)
+{
+	if (ret == TCMU_STS_OK) {
+		ret = tcmur_cmd_handler(dev, cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+	/* it was not tracked while it was on hold */
+	__aio_command_finish(dev, cmd, ret);
+}
+
 static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	int ret = TCMU_STS_NOT_HANDLED;
-	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	uint8_t *cdb = cmd->cdb;
+	bool held = false;
 
+	TCMU_TRACE_CMD(cmd_dispatch, tcmu_get_dev_name(dev), cmd);
 	track_aio_request_start(rdev);
 
 	if (tcmu_dev_in_recovery(dev)) {
-		ret = TCMU_STS_BUSY;
+		ret = tcmur_pending_park(dev, cmd, false, TCMU_STS_BUSY,
+					 handle_pending_cbk);
+		held = ret == TCMU_STS_ASYNC_HANDLED;
 		goto untrack;
 	}
 
@@ -2260,6 +3545,12 @@ static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	case WRITE_SAME_16:
 	case FORMAT_UNIT:
 		ret = alua_check_state(dev, cmd);
+		if (ret == TCMU_STS_BUSY) {
+			/* an implicit failover is acquiring the lock */
+			ret = tcmur_pending_park(dev, cmd, true, ret,
+						 handle_pending_cbk);
+			held = ret == TCMU_STS_ASYNC_HANDLED;
+		}
 		if (ret)
 			goto untrack;
 		break;
@@ -2267,6 +3558,26 @@ static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		break;
 	}
 
+	ret = handle_caw_conflict(dev, cmd);
+	if (ret != TCMU_STS_OK)
+		goto untrack;
+
+	ret = __tcmur_cmd_handler(dev, cmd);
+
+untrack:
+	if (ret != TCMU_STS_ASYNC_HANDLED || held)
+		track_aio_request_finish(rdev);
+	return ret;
+}
+
+static int __tcmur_cmd_handler(struct tcmu_device *dev,
+			       struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	uint8_t *cdb = cmd->cdb;
+	int ret = TCMU_STS_NOT_HANDLED;
+
 	switch(cdb[0]) {
 	case READ_6:
 	case READ_10:
@@ -2285,12 +3596,23 @@ static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		break;
 	case SYNCHRONIZE_CACHE:
 	case SYNCHRONIZE_CACHE_16:
-		if (rhandler->flush)
+		if (tcmur_wcache_take_error(dev))
+			ret = TCMU_STS_WR_ERR;
+		else if (rhandler->flush)
 			ret = handle_flush(dev, cmd);
+		else if (rdev->wcache)
+			/* the wcache barrier has written the data back */
+			ret = TCMU_STS_OK;
 		break;
 	case EXTENDED_COPY:
 		ret = handle_xcopy(dev, cmd);
 		break;
+	case SERVICE_ACTION_IN_16:
+		if ((cdb[1] & 0x1f) == GET_LBA_STATUS)
+			ret = handle_get_lba_status(dev, cmd);
+		else
+			ret = TCMU_STS_NOT_HANDLED;
+		break;
 	case COMPARE_AND_WRITE:
 		ret = handle_caw(dev, cmd);
 		break;
@@ -2309,9 +3631,6 @@ static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		ret = TCMU_STS_NOT_HANDLED;
 	}
 
-untrack:
-	if (ret != TCMU_STS_ASYNC_HANDLED)
-		track_aio_request_finish(rdev, NULL);
 	return ret;
 }
 
@@ -2413,7 +3732,7 @@ static int handle_try_passthrough(struct tcmu_device *dev,
 	}
 
 	if (ret != TCMU_STS_ASYNC_HANDLED)
-		track_aio_request_finish(rdev, NULL);
+		track_aio_request_finish(rdev);
 
 	return ret;
 }
@@ -2433,6 +3752,8 @@ int tcmur_dev_update_size(struct tcmu_device *dev, unsigned long new_size)
 		else
 			tcmur_set_pending_ua(dev, TCMUR_UA_DEV_SIZE_CHANGED);
 	}
+	if (!ret)
+		tcmur_cache_invalidate_all(dev);
 
 	return ret;
 }
@@ -2441,9 +3762,7 @@ void tcmur_set_pending_ua(struct tcmu_device *dev, int ua)
 {
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 
-	pthread_mutex_lock(&rdev->state_lock);
-	rdev->pending_uas |= (1 << ua);
-	pthread_mutex_unlock(&rdev->state_lock);
+	__atomic_fetch_or(&rdev->pending_uas, 1 << ua, __ATOMIC_RELEASE);
 }
 
 /*
@@ -2452,7 +3771,7 @@ void tcmur_set_pending_ua(struct tcmu_device *dev, int ua)
 static int handle_pending_ua(struct tcmur_device *rdev, struct tcmulib_cmd *cmd)
 {
 	uint8_t *cdb = cmd->cdb;
-	int ret = TCMU_STS_NOT_HANDLED, ua;
+	int ret = TCMU_STS_NOT_HANDLED, ua, uas;
 
 	switch (cdb[0]) {
 	case INQUIRY:
@@ -2460,52 +3779,198 @@ static int handle_pending_ua(struct tcmur_device *rdev, struct tcmulib_cmd *cmd)
 		/* The kernel will handle REPORT_LUNS */
 		return TCMU_STS_NOT_HANDLED;
 	}
-	pthread_mutex_lock(&rdev->state_lock);
 
-	if (!rdev->pending_uas) {
-		ret = TCMU_STS_NOT_HANDLED;
-		goto unlock;
-	}
+	/*
+	 * Only the cmd that clears a UA's bit reports it, so racing cmds
+	 * never report the same UA twice.
+	 */
+	uas = __atomic_load_n(&rdev->pending_uas, __ATOMIC_ACQUIRE);
+	do {
+		if (!uas)
+			return TCMU_STS_NOT_HANDLED;
+		ua = ffs(uas) - 1;
+	} while (!__atomic_compare_exchange_n(&rdev->pending_uas, &uas,
+					      uas & ~(1 << ua), false,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
 
-	ua = ffs(rdev->pending_uas) - 1;
 	switch (ua) {
 	case TCMUR_UA_DEV_SIZE_CHANGED:
 		ret = TCMU_STS_CAPACITY_CHANGED;
 		break;
 	}
-	rdev->pending_uas &= ~(1 << ua);
 
-unlock:
-	pthread_mutex_unlock(&rdev->state_lock);
 	return ret;
 }
 
+static int __tcmur_generic_handle_cmd(struct tcmu_device *dev,
+				      struct tcmulib_cmd *cmd)
+{
+	int ret;
+
+	/*
+	 * The handler want to handle some commands by itself,
+	 * try to passthrough it first
+	 */
+	ret = handle_try_passthrough(dev, cmd);
+	if (ret != TCMU_STS_NOT_HANDLED)
+		return ret;
+
+	/* Falls back to the runner's generic handle callout */
+	ret = handle_sync_cmd(dev, cmd);
+	if (ret == TCMU_STS_NOT_HANDLED)
+		ret = tcmur_cmd_handler(dev, cmd);
+	return ret;
+}
+
+/* The cmd was put on hold until the data it needs was written back */
+static void handle_wcache_barrier_cbk(struct tcmu_device *dev,
+				      struct tcmulib_cmd *cmd, int ret)
+{
+	if (ret == TCMU_STS_OK) {
+		ret = __tcmur_generic_handle_cmd(dev, cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+	/* it was not tracked while it was on hold */
+	__aio_command_finish(dev, cmd, ret);
+}
+
+static int handle_cmd_after_qos(struct tcmu_device *dev,
+				struct tcmulib_cmd *cmd)
+{
+	int ret;
+
+	ret = tcmur_wcache_barrier(dev, cmd, handle_wcache_barrier_cbk);
+	if (ret != TCMU_STS_OK)
+		return ret;
+
+	return __tcmur_generic_handle_cmd(dev, cmd);
+}
+
+/* The cmd was held back until the device's QoS limits let it go */
+static void handle_qos_cbk(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   int ret)
+{
+	if (ret == TCMU_STS_OK) {
+		ret = handle_cmd_after_qos(dev, cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+	/* it was not tracked while it was on hold */
+	__aio_command_finish(dev, cmd, ret);
+}
+
 int tcmur_generic_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	int ret;
 
+	/* paired with tcmur_*_cmd_done when the cmd is completed */
+	tcmur_cache_cmd_start(dev, cmd);
+	tcmur_pending_cmd_start(dev);
+
 	ret = handle_pending_ua(rdev, cmd);
 	if (ret != TCMU_STS_NOT_HANDLED)
 		return ret;
 
-	if (rdev->flags & TCMUR_DEV_FLAG_FORMATTING && cmd->cdb[0] != INQUIRY) {
+	if (tcmur_dev_get_flags(rdev) & TCMUR_DEV_FLAG_FORMATTING &&
+	    cmd->cdb[0] != INQUIRY) {
 		tcmu_set_sense_key_specific_info(cmd->sense_buf,
 						 rdev->format_progress);
 		return TCMU_STS_FRMT_IN_PROGRESS;
 	}
 
-	/*
-	 * The handler want to handle some commands by itself,
-	 * try to passthrough it first
-	 */
-	ret = handle_try_passthrough(dev, cmd);
-	if (ret != TCMU_STS_NOT_HANDLED)
+	ret = tcmur_qos_start(dev, cmd, handle_qos_cbk);
+	if (ret != TCMU_STS_OK)
 		return ret;
 
-	/* Falls back to the runner's generic handle callout */
-	ret = handle_sync_cmd(dev, cmd);
+	return handle_cmd_after_qos(dev, cmd);
+}
+
+/* Commands taken off the ring and completed at once by cmdproc */
+#define TCMUR_CMDPROC_BATCH 32
+
+static int tcmur_cmdproc_handle_cmd(struct tcmu_device *dev,
+				    struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	int ret;
+
+	tcmur_stats_cmd_start(dev, cmd);
+
+	if (tcmu_get_log_level() == TCMU_LOG_DEBUG_SCSI_CMD)
+		tcmu_print_cdb_info(dev, cmd, NULL);
+
+	if (tcmur_handler_is_passthrough_only(rhandler))
+		ret = tcmur_cmd_passthrough_handler(dev, cmd);
+	else
+		ret = tcmur_generic_handle_cmd(dev, cmd);
+
 	if (ret == TCMU_STS_NOT_HANDLED)
-		ret = tcmur_cmd_handler(dev, cmd);
+		tcmu_print_cdb_info(dev, cmd, "is not supported");
+
 	return ret;
 }
+
+/**
+ * tcmur_process_ring - what the cmdproc thread does when it is woken up
+ * @dev: device to handle the ring of
+ * @dev_stopping: only write back completions, no new commands
+ *
+ * Handle the new commands on the ring and write back the completions
+ * queued by async commands. Only one thread at a time may do this for
+ * a device.
+ */
+void tcmur_process_ring(struct tcmu_device *dev, bool dev_stopping)
+{
+	struct tcmulib_cmd *cmds[TCMUR_CMDPROC_BATCH];
+	int rcs[TCMUR_CMDPROC_BATCH];
+	bool plugged = false;
+	int completed = 0;
+	int i, n, nr_done;
+	int ret;
+
+	tcmulib_processing_start(dev);
+
+	n = TCMUR_CMDPROC_BATCH;
+	while (!dev_stopping && n == TCMUR_CMDPROC_BATCH) {
+		n = tcmulib_get_next_commands(dev, cmds, TCMUR_CMDPROC_BATCH);
+		if (n && !plugged)
+			plugged = tcmur_handler_submit_batch(dev);
+
+		/*
+		 * command (processing) completion is called in the following
+		 * scenarios:
+		 *   - handle_cmd: synchronous handlers
+		 *   - generic_handle_cmd: non tcmur handler calls (see generic_cmd())
+		 *			   and on errors when calling tcmur handler.
+		 *
+		 * The synchronous completions of a batch are written back
+		 * together, compacted to the front of cmds.
+		 */
+		for (i = 0, nr_done = 0; i < n; i++) {
+			ret = tcmur_cmdproc_handle_cmd(dev, cmds[i]);
+			if (ret != TCMU_STS_ASYNC_HANDLED) {
+				cmds[nr_done] = cmds[i];
+				rcs[nr_done++] = ret;
+			}
+		}
+
+		if (nr_done) {
+			completed = 1;
+			tcmur_command_complete_batch(dev, cmds, rcs, nr_done);
+		}
+	}
+
+	/* Send the io the handler held back for the whole drain */
+	if (plugged)
+		tcmur_handler_unplug(dev);
+
+	/* Write back the async completions queued meanwhile */
+	if (tcmulib_reap_completions(dev))
+		completed = 1;
+
+	if (completed)
+		tcmulib_processing_complete(dev);
+}
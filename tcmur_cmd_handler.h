@@ -10,6 +10,7 @@
 #define __TCMUR_CMD_HANDLER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 struct tcmu_device;
 struct tcmulib_cmd;
@@ -19,8 +20,14 @@ void tcmur_set_pending_ua(struct tcmu_device *dev, int ua);
 int tcmur_generic_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
 int tcmur_cmd_passthrough_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
 bool tcmur_handler_is_passthrough_only(struct tcmur_handler *rhandler);
+bool tcmur_handler_submit_batch(struct tcmu_device *dev);
+void tcmur_handler_unplug(struct tcmu_device *dev);
 void tcmur_command_complete(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 			    int ret);
+void tcmur_command_complete_batch(struct tcmu_device *dev,
+				  struct tcmulib_cmd **cmds, int *rcs,
+				  int count);
+void tcmur_process_ring(struct tcmu_device *dev, bool dev_stopping);
 typedef int (*tcmur_writesame_fn_t)(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 			   uint64_t off, uint64_t len, struct iovec *iov, size_t iov_cnt);
 int tcmur_handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
@@ -13,49 +13,54 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/mempolicy.h>
 
 #include "libtcmu_log.h"
 #include "libtcmu_common.h"
+#include "libtcmu_config.h"
 #include "tcmu-runner.h"
 #include "tcmur_device.h"
 #include "tcmur_cmd_handler.h"
 #include "target.h"
+#include "alua.h"
 
 bool tcmu_dev_in_recovery(struct tcmu_device *dev)
 {
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
-	int in_recov = false;
 
-	pthread_mutex_lock(&rdev->state_lock);
-	if (rdev->flags & TCMUR_DEV_FLAG_IN_RECOVERY)
-		in_recov = true;
-	pthread_mutex_unlock(&rdev->state_lock);
-	return in_recov;
+	return !!(tcmur_dev_get_flags(rdev) & TCMUR_DEV_FLAG_IN_RECOVERY);
 }
 
-/*
- * TCMUR_DEV_FLAG_IN_RECOVERY must be set before calling
+/**
+ * tcmu_reopen_dev_close - first step of a reopen, close the device
+ * @dev: device being recovered
+ * @in_lock_thread: true if called from locking thread.
+ *
+ * TCMUR_DEV_FLAG_IN_RECOVERY must be set before calling. Returns 0 if
+ * the device was closed and should be opened with tcmu_reopen_dev_open,
+ * 1 if it is being removed, or a -errno. tcmu_reopen_dev_done must be
+ * called when the reopen is over, whatever this returned.
  */
-int __tcmu_reopen_dev(struct tcmu_device *dev, bool in_lock_thread, int retries)
+int tcmu_reopen_dev_close(struct tcmu_device *dev, bool in_lock_thread)
 {
 	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	int ret, attempt = 0;
 	bool needs_close = false;
+	int ret;
 
 	tcmu_dev_dbg(dev, "Waiting for outstanding commands to complete\n");
 	ret = aio_wait_for_empty_queue(rdev);
-
-	pthread_mutex_lock(&rdev->state_lock);
 	if (ret)
-		goto done;
+		return ret;
 
-	if (rdev->flags & TCMUR_DEV_FLAG_STOPPING) {
-		ret = 0;
-		goto done;
-	}
-	pthread_mutex_unlock(&rdev->state_lock);
+	if (tcmur_dev_get_flags(rdev) & TCMUR_DEV_FLAG_STOPPING)
+		return 1;
 
 	/*
 	 * There are no SCSI commands running but there may be
@@ -72,7 +77,7 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, bool in_lock_thread, int retries)
 	 */
 	pthread_mutex_lock(&rdev->state_lock);
 	if (rdev->lock_state != TCMUR_DEV_LOCK_LOCKING)
-		rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 
 	if (rdev->flags & TCMUR_DEV_FLAG_IS_OPEN)
 		needs_close = true;
@@ -82,33 +87,90 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, bool in_lock_thread, int retries)
 		tcmu_dev_dbg(dev, "Closing device.\n");
 		rhandler->close(dev);
 	}
+	/* the backend could have been changed by someone else meanwhile */
+	tcmur_cache_invalidate_all(dev);
 
 	pthread_mutex_lock(&rdev->state_lock);
-	rdev->flags &= ~TCMUR_DEV_FLAG_IS_OPEN;
-	ret = -EIO;
-	while (ret != 0 && !(rdev->flags & TCMUR_DEV_FLAG_STOPPING) &&
-	       (retries < 0 || attempt <= retries)) {
-		pthread_mutex_unlock(&rdev->state_lock);
+	tcmur_dev_clear_flags(rdev, TCMUR_DEV_FLAG_IS_OPEN);
+	pthread_mutex_unlock(&rdev->state_lock);
 
-		tcmu_dev_dbg(dev, "Opening device. Attempt %d\n", attempt);
-		ret = rhandler->open(dev, true);
-		if (ret) {
-			/* Avoid busy loop ? */
-			sleep(1);
-		}
+	return 0;
+}
 
-		pthread_mutex_lock(&rdev->state_lock);
-		if (!ret) {
-			rdev->flags |= TCMUR_DEV_FLAG_IS_OPEN;
-			rdev->lock_lost = false;
+/**
+ * tcmu_reopen_dev_open - try to open a device closed by a reopen once
+ * @dev: device being recovered
+ *
+ * Returns 0 if the device is open, -ESHUTDOWN if it is being removed,
+ * or the handler's error, in which case it can be tried again later.
+ */
+int tcmu_reopen_dev_open(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	int ret;
+
+	if (tcmur_dev_get_flags(rdev) & TCMUR_DEV_FLAG_STOPPING)
+		return -ESHUTDOWN;
+
+	tcmu_dev_dbg(dev, "Opening device.\n");
+	ret = rhandler->open(dev, true);
+	if (ret)
+		return ret;
+	tcmur_wcache_reopened(dev);
+
+	pthread_mutex_lock(&rdev->state_lock);
+	tcmur_dev_set_flags(rdev, TCMUR_DEV_FLAG_IS_OPEN);
+	rdev->lock_lost = false;
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	return 0;
+}
+
+/**
+ * tcmu_reopen_dev_done - end a reopen started by tcmu_reopen_dev_close
+ * @dev: device being recovered
+ */
+void tcmu_reopen_dev_done(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	pthread_mutex_lock(&rdev->state_lock);
+	tcmur_dev_clear_flags(rdev, TCMUR_DEV_FLAG_IN_RECOVERY);
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	tcmur_pending_wake(dev);
+}
+
+/*
+ * TCMUR_DEV_FLAG_IN_RECOVERY must be set before calling
+ */
+int __tcmu_reopen_dev(struct tcmu_device *dev, bool in_lock_thread, int retries)
+{
+	int ret, attempt;
+
+	ret = tcmu_reopen_dev_close(dev, in_lock_thread);
+	if (ret) {
+		if (ret > 0)
+			ret = 0;
+		goto done;
+	}
+
+	for (attempt = 0; retries < 0 || attempt <= retries; attempt++) {
+		tcmu_dev_dbg(dev, "Opening device. Attempt %d\n", attempt);
+		ret = tcmu_reopen_dev_open(dev);
+		if (!ret)
+			break;
+		if (ret == -ESHUTDOWN) {
+			ret = -EIO;
+			break;
 		}
-		attempt++;
+		/* Avoid busy loop ? */
+		sleep(1);
 	}
 
 done:
-	rdev->flags &= ~TCMUR_DEV_FLAG_IN_RECOVERY;
-	pthread_mutex_unlock(&rdev->state_lock);
-
+	tcmu_reopen_dev_done(dev);
 	return ret;
 }
 
@@ -127,7 +189,7 @@ int tcmu_reopen_dev(struct tcmu_device *dev, bool in_lock_thread, int retries)
 		pthread_mutex_unlock(&rdev->state_lock);
 		return -EBUSY;
 	}
-	rdev->flags |= TCMUR_DEV_FLAG_IN_RECOVERY;
+	tcmur_dev_set_flags(rdev, TCMUR_DEV_FLAG_IN_RECOVERY);
 	pthread_mutex_unlock(&rdev->state_lock);
 
 	return __tcmu_reopen_dev(dev, in_lock_thread, retries);
@@ -143,6 +205,9 @@ void tcmu_cancel_recovery(struct tcmu_device *dev)
 	 * handlers to fail/complete normally to avoid a segfault.
 	 */
 	tcmu_dev_dbg(dev, "Waiting on recovery thread\n");
+	/* do not wait out a retry backoff, it will see we are stopping */
+	tcmur_recovery_kick(&rdev->recovery_work);
+
 	pthread_mutex_lock(&rdev->state_lock);
 	while (rdev->flags & TCMUR_DEV_FLAG_IN_RECOVERY) {
 		pthread_mutex_unlock(&rdev->state_lock);
@@ -187,7 +252,7 @@ void tcmu_notify_conn_lost(struct tcmu_device *dev)
 		     rdev->lock_state);
 
 	if (!tcmu_add_dev_to_recovery_list(dev))
-		rdev->flags |= TCMUR_DEV_FLAG_IN_RECOVERY;
+		tcmur_dev_set_flags(rdev, TCMUR_DEV_FLAG_IN_RECOVERY);
 unlock:
 	pthread_mutex_unlock(&rdev->state_lock);
 }
@@ -212,9 +277,13 @@ void tcmu_notify_lock_lost(struct tcmu_device *dev)
 	 */
 	if (rdev->lock_state != TCMUR_DEV_LOCK_LOCKING) {
 		rdev->lock_lost = true;
-		rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 	}
 	pthread_mutex_unlock(&rdev->state_lock);
+
+	/* another node may write to the device now */
+	tcmur_cache_invalidate_all(dev);
+	tcmur_wcache_discard(dev);
 }
 
 int tcmu_cancel_lock_thread(struct tcmu_device *dev)
@@ -227,6 +296,21 @@ int tcmu_cancel_lock_thread(struct tcmu_device *dev)
 		pthread_mutex_unlock(&rdev->state_lock);
 		return 0;
 	}
+
+	/*
+	 * If it is still waiting for a recovery thread nothing was done
+	 * yet, and waiting for it could deadlock if we are running on the
+	 * last free one.
+	 */
+	if (tcmur_recovery_cancel(&rdev->lock_work)) {
+		tcmu_dev_dbg(rdev->dev, "canceled queued lock acquisition\n");
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
+		pthread_mutex_unlock(&rdev->state_lock);
+
+		tcmur_pending_wake(dev);
+		return 0;
+	}
+
 	/*
 	 * It looks like lock calls are not cancelable, so
 	 * we wait here to avoid crashes.
@@ -261,7 +345,7 @@ void tcmu_release_dev_lock(struct tcmu_device *dev)
 	 * is in a state where it cannot be fenced.
 	 */
 	pthread_mutex_lock(&rdev->state_lock);
-	rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+	tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 	pthread_mutex_unlock(&rdev->state_lock);
 }
 
@@ -354,7 +438,7 @@ int tcmu_acquire_dev_lock(struct tcmu_device *dev, bool is_sync,
 	 * the STPG.
 	 */
 	if (!is_sync)
-		tcmu_flush_device(dev);
+		tcmur_pending_flush_device(dev);
 
 	reopen = false;
 	pthread_mutex_lock(&rdev->state_lock);
@@ -403,14 +487,19 @@ done:
 	/* TODO: set UA based on bgly's patches */
 	pthread_mutex_lock(&rdev->state_lock);
 	if (ret == TCMU_STS_OK)
-		rdev->lock_state = TCMUR_DEV_LOCK_LOCKED;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_LOCKED);
 	else
-		rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 	tcmu_dev_dbg(dev, "lock call done. lock state %d\n", rdev->lock_state);
 	pthread_cond_signal(&rdev->lock_cond);
 	pthread_mutex_unlock(&rdev->state_lock);
 
+	/* another node may have written to the device while we did not own it */
+	if (ret == TCMU_STS_OK)
+		tcmur_cache_invalidate_all(dev);
+
 	tcmu_unblock_device(dev);
+	tcmur_pending_wake(dev);
 
 	return ret;
 }
@@ -429,8 +518,853 @@ void tcmu_update_dev_lock_state(struct tcmu_device *dev)
 	if (rdev->lock_state == TCMUR_DEV_LOCK_LOCKED &&
 	    state != TCMUR_DEV_LOCK_LOCKED) {
 		tcmu_dev_dbg(dev, "Updated out of sync lock state.\n");
-		rdev->lock_state = TCMUR_DEV_LOCK_UNLOCKED;
+		tcmur_dev_set_lock_state(rdev, TCMUR_DEV_LOCK_UNLOCKED);
 		rdev->lock_lost = true;
 	}
 	pthread_mutex_unlock(&rdev->state_lock);
 }
+
+static int tcmur_dev_opt_to_int(struct tcmu_device *dev, const char *key,
+				const char *val, int *res)
+{
+	char *end;
+	long num;
+
+	errno = 0;
+	num = strtol(val, &end, 0);
+	if (errno || end == val || *end != '\0' || num < 0 || num > INT_MAX) {
+		tcmu_dev_err(dev, "Invalid value %s for %s%s.\n", val,
+			     TCMUR_DEV_OPT_PREFIX, key);
+		return -EINVAL;
+	}
+
+	*res = num;
+	return 0;
+}
+
+static int tcmur_dev_set_qos_opt(struct tcmu_device *dev, const char *key,
+				 const char *val,
+				 struct tcmur_qos_limits *limits)
+{
+	if (!strcmp(key, "qos_read_iops"))
+		return tcmur_dev_opt_to_int(dev, key, val, &limits->read_iops);
+	if (!strcmp(key, "qos_write_iops"))
+		return tcmur_dev_opt_to_int(dev, key, val, &limits->write_iops);
+	if (!strcmp(key, "qos_read_kbps"))
+		return tcmur_dev_opt_to_int(dev, key, val, &limits->read_kbps);
+	if (!strcmp(key, "qos_write_kbps"))
+		return tcmur_dev_opt_to_int(dev, key, val, &limits->write_kbps);
+	if (!strcmp(key, "qos_burst_ms"))
+		return tcmur_dev_opt_to_int(dev, key, val, &limits->burst_ms);
+
+	tcmu_dev_err(dev, "Unknown option %s%s.\n", TCMUR_DEV_OPT_PREFIX, key);
+	return -EINVAL;
+}
+
+static int tcmur_dev_set_opt(struct tcmu_device *dev, const char *key,
+			     const char *val)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (!strncmp(key, "qos_", 4))
+		return tcmur_dev_set_qos_opt(dev, key, val, &rdev->qos_limits);
+	if (!strcmp(key, "busy_poll_usecs"))
+		return tcmur_dev_opt_to_int(dev, key, val,
+					    &rdev->busy_poll_usecs);
+	if (!strcmp(key, "nr_threads"))
+		return tcmur_dev_opt_to_int(dev, key, val, &rdev->nr_threads);
+	if (!strcmp(key, "max_threads"))
+		return tcmur_dev_opt_to_int(dev, key, val, &rdev->max_threads);
+	if (!strcmp(key, "read_cache_mb"))
+		return tcmur_dev_opt_to_int(dev, key, val, &rdev->read_cache_mb);
+	if (!strcmp(key, "read_ahead_kb"))
+		return tcmur_dev_opt_to_int(dev, key, val, &rdev->read_ahead_kb);
+	if (!strcmp(key, "write_back_mb"))
+		return tcmur_dev_opt_to_int(dev, key, val, &rdev->write_back_mb);
+	if (!strcmp(key, "write_back_delay_ms"))
+		return tcmur_dev_opt_to_int(dev, key, val,
+					    &rdev->write_back_delay_ms);
+	if (!strcmp(key, "write_back_max_io_kb"))
+		return tcmur_dev_opt_to_int(dev, key, val,
+					    &rdev->write_back_max_io_kb);
+	if (!strcmp(key, "zero_detect"))
+		return tcmur_dev_opt_to_int(dev, key, val, &rdev->zero_detect);
+	if (!strcmp(key, "failover_queue_depth"))
+		return tcmur_dev_opt_to_int(dev, key, val,
+					    &rdev->failover_queue_depth);
+	if (!strcmp(key, "failover_queue_timeout_ms"))
+		return tcmur_dev_opt_to_int(dev, key, val,
+					    &rdev->failover_queue_timeout_ms);
+	if (!strcmp(key, "scratch_cache_mb"))
+		return tcmur_dev_opt_to_int(dev, key, val,
+					    &rdev->scratch_cache_mb);
+	if (!strcmp(key, "scratch_limit_mb"))
+		return tcmur_dev_opt_to_int(dev, key, val,
+					    &rdev->scratch_limit_mb);
+	if (!strcmp(key, "tier_mb"))
+		return tcmur_dev_opt_to_int(dev, key, val, &rdev->tier_mb);
+	if (!strcmp(key, "tier_write_through"))
+		return tcmur_dev_opt_to_int(dev, key, val,
+					    &rdev->tier_write_through);
+	if (!strcmp(key, "tier_path")) {
+		free(rdev->tier_path);
+		rdev->tier_path = strdup(val);
+		if (!rdev->tier_path)
+			return -ENOMEM;
+		return 0;
+	}
+	if (!strcmp(key, "split_kb"))
+		return tcmur_dev_opt_to_int(dev, key, val, &rdev->split_kb);
+	if (!strcmp(key, "affinity_mem"))
+		return tcmur_dev_opt_to_int(dev, key, val, &rdev->affinity_mem);
+	if (!strcmp(key, "affinity")) {
+		if (tcmur_check_affinity(val)) {
+			tcmu_dev_err(dev, "Invalid value %s for %s%s.\n", val,
+				     TCMUR_DEV_OPT_PREFIX, key);
+			return -EINVAL;
+		}
+
+		free(rdev->affinity);
+		rdev->affinity = strdup(val);
+		if (!rdev->affinity)
+			return -ENOMEM;
+		return 0;
+	}
+
+	tcmu_dev_err(dev, "Unknown option %s%s.\n", TCMUR_DEV_OPT_PREFIX, key);
+	return -EINVAL;
+}
+
+static void tcmur_qos_limits_init(struct tcmur_qos_limits *limits)
+{
+	memset(limits, 0, sizeof(*limits));
+	limits->burst_ms = -1;
+}
+
+/*
+ * Remove the runner options from cfgstring. They are set on the device,
+ * or for a reconfig only the QoS limits are, in qos.
+ */
+static int tcmur_dev_strip_opts(struct tcmu_device *dev, char *cfgstring,
+				struct tcmur_qos_limits *qos)
+{
+	char *opt, *next, *val, *dst, *key;
+	size_t len;
+	int ret;
+
+	dst = strchr(cfgstring, ';');
+	if (!dst)
+		return 0;
+
+	for (opt = dst + 1; opt; opt = next) {
+		next = strchr(opt, ';');
+		if (next)
+			*next++ = '\0';
+
+		if (strncmp(opt, TCMUR_DEV_OPT_PREFIX,
+			    strlen(TCMUR_DEV_OPT_PREFIX))) {
+			/* handler option, so keep it */
+			len = strlen(opt);
+			*dst++ = ';';
+			memmove(dst, opt, len);
+			dst += len;
+			continue;
+		}
+
+		val = strchr(opt, '=');
+		if (!val) {
+			tcmu_dev_err(dev, "Missing value for option %s.\n", opt);
+			return -EINVAL;
+		}
+		*val++ = '\0';
+		key = opt + strlen(TCMUR_DEV_OPT_PREFIX);
+
+		if (!qos) {
+			ret = tcmur_dev_set_opt(dev, key, val);
+		} else if (!strncmp(key, "qos_", 4)) {
+			ret = tcmur_dev_set_qos_opt(dev, key, val, qos);
+		} else {
+			tcmu_dev_dbg(dev, "Option %s can not be changed at runtime.\n",
+				     opt);
+			ret = 0;
+		}
+		if (ret)
+			return ret;
+	}
+	*dst = '\0';
+	return 0;
+}
+
+/**
+ * tcmur_dev_parse_opts - parse runner options from the cfgstring
+ * @dev: device to parse options for
+ *
+ * Runner wide per device settings are passed in the handler's cfgstring
+ * as ";tcmur_<option>=<value>". They are removed from the cfgstring
+ * here, so the handler never sees them. Must be called before the
+ * handler's open callout.
+ */
+int tcmur_dev_parse_opts(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	char *cfgstring = tcmu_get_dev_cfgstring(dev);
+	int ret;
+
+	rdev->busy_poll_usecs = -1;
+	rdev->nr_threads = -1;
+	rdev->max_threads = -1;
+	rdev->affinity_mem = -1;
+	rdev->read_cache_mb = -1;
+	rdev->read_ahead_kb = -1;
+	rdev->write_back_mb = -1;
+	rdev->write_back_delay_ms = -1;
+	rdev->write_back_max_io_kb = -1;
+	rdev->zero_detect = -1;
+	rdev->tier_mb = -1;
+	rdev->tier_write_through = -1;
+	rdev->failover_queue_depth = -1;
+	rdev->failover_queue_timeout_ms = -1;
+	rdev->scratch_cache_mb = -1;
+	rdev->scratch_limit_mb = -1;
+	rdev->split_kb = -1;
+	tcmur_qos_limits_init(&rdev->qos_limits);
+
+	ret = tcmur_dev_strip_opts(dev, cfgstring, NULL);
+	if (ret)
+		return ret;
+
+	tcmu_dev_dbg(dev, "handler cfgstring %s\n", cfgstring);
+	return 0;
+}
+
+/**
+ * tcmur_dev_parse_reconfig_opts - parse runner options from a new cfgstring
+ * @dev: device being reconfigured
+ * @cfgstring: cfgstring of the reconfig, the runner options are removed
+ * @qos: filled in with the QoS limits of the new cfgstring
+ *
+ * Only the QoS limits can be changed at runtime, other runner options
+ * keep the value they had when the device was added.
+ */
+int tcmur_dev_parse_reconfig_opts(struct tcmu_device *dev, char *cfgstring,
+				  struct tcmur_qos_limits *qos)
+{
+	tcmur_qos_limits_init(qos);
+	return tcmur_dev_strip_opts(dev, cfgstring, qos);
+}
+
+/**
+ * tcmur_dev_set_split - set the length large READs and WRITEs are split in
+ * @dev: device whose handler has been opened
+ *
+ * Uses rdev->split_kb, rounded up to a multiple of the handler's
+ * opt_split_len so pieces start and end on backend boundaries. Splitting
+ * is disabled if split_kb is not positive.
+ */
+void tcmur_dev_set_split(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint64_t gran = tcmu_get_dev_opt_split_len(dev);
+	uint64_t lbas;
+
+	rdev->split_lbas = 0;
+	if (rdev->split_kb <= 0)
+		return;
+
+	lbas = (uint64_t)rdev->split_kb * 1024 / tcmu_get_dev_block_size(dev);
+	if (!lbas)
+		lbas = 1;
+	if (gran)
+		lbas = round_up(lbas, gran);
+	rdev->split_lbas = min(lbas, (uint64_t)UINT32_MAX);
+
+	tcmu_dev_dbg(dev, "Splitting READs and WRITEs into %u blocks\n",
+		     rdev->split_lbas);
+}
+
+#define TCMUR_NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+/* node ids can be sparse, this lists the ones that exist */
+#define TCMUR_NODES_ONLINE "/sys/devices/system/node/online"
+
+/* Parse a cpulist like "0-3,8,10-11" */
+static int tcmur_parse_cpulist(const char *list, cpu_set_t *cpus)
+{
+	unsigned long first, last;
+	const char *p = list;
+	char *end;
+
+	CPU_ZERO(cpus);
+
+	while (*p && *p != '\n') {
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			return -EINVAL;
+		last = first;
+
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p || last < first)
+				return -EINVAL;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+
+		p = end;
+		if (*p == ',')
+			p++;
+		else if (*p && *p != '\n')
+			return -EINVAL;
+	}
+
+	return CPU_COUNT(cpus) ? 0 : -EINVAL;
+}
+
+/* Read a cpulist formatted sysfs file, like a node's CPUs or node ids */
+static int tcmur_read_cpulist(const char *path, cpu_set_t *cpus)
+{
+	char buf[4096];
+	FILE *fp;
+	int ret;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	if (!fgets(buf, sizeof(buf), fp))
+		ret = -EIO;
+	else
+		ret = tcmur_parse_cpulist(buf, cpus);
+	fclose(fp);
+
+	return ret;
+}
+
+static int tcmur_get_node_cpus(int node, cpu_set_t *cpus)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), TCMUR_NODE_CPULIST, node);
+	return tcmur_read_cpulist(path, cpus);
+}
+
+/* Returns the node all of cpus are on, or -1 if they span nodes */
+static int tcmur_get_cpus_node(cpu_set_t *cpus)
+{
+	cpu_set_t nodes, node_cpus, both;
+	int node;
+
+	if (tcmur_read_cpulist(TCMUR_NODES_ONLINE, &nodes))
+		return -1;
+
+	for (node = 0; node < CPU_SETSIZE; node++) {
+		/* memory only nodes have no CPUs */
+		if (!CPU_ISSET(node, &nodes) ||
+		    tcmur_get_node_cpus(node, &node_cpus))
+			continue;
+
+		CPU_AND(&both, &node_cpus, cpus);
+		if (CPU_EQUAL(&both, cpus))
+			return node;
+	}
+
+	return -1;
+}
+
+/*
+ * An affinity is either "node:<N>" for all CPUs of NUMA node N, or
+ * "cpus:<cpulist>".
+ */
+static int tcmur_parse_affinity(const char *affinity, cpu_set_t *cpus,
+				int *node)
+{
+	char *end;
+	int ret;
+
+	if (!strncmp(affinity, "node:", 5)) {
+		*node = strtol(affinity + 5, &end, 10);
+		if (end == affinity + 5 || *end || *node < 0)
+			return -EINVAL;
+
+		ret = tcmur_get_node_cpus(*node, cpus);
+		return ret == -ENOENT ? -EINVAL : ret;
+	}
+
+	if (!strncmp(affinity, "cpus:", 5)) {
+		ret = tcmur_parse_cpulist(affinity + 5, cpus);
+		if (ret)
+			return ret;
+
+		*node = tcmur_get_cpus_node(cpus);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+int tcmur_check_affinity(const char *affinity)
+{
+	cpu_set_t cpus;
+	int node;
+
+	return tcmur_parse_affinity(affinity, &cpus, &node);
+}
+
+/**
+ * tcmur_set_thread_affinity - pin the calling thread
+ * @affinity: "node:<N>" or "cpus:<cpulist>"
+ * @local_mem: also prefer memory from the affinity's NUMA node
+ *
+ * With local_mem the thread's allocations, and the pages of shared
+ * buffers like the cmd pool it touches first, come from the node the
+ * CPUs are on, if they are all on one.
+ */
+int tcmur_set_thread_affinity(const char *affinity, bool local_mem)
+{
+	unsigned long nodemask;
+	cpu_set_t cpus;
+	int node, ret;
+
+	ret = tcmur_parse_affinity(affinity, &cpus, &node);
+	if (ret)
+		return ret;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (ret)
+		return -ret;
+
+	if (!local_mem || node < 0)
+		return 0;
+
+	if (node >= sizeof(nodemask) * 8)
+		return -ERANGE;
+	nodemask = 1UL << node;
+
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask,
+		    sizeof(nodemask) * 8))
+		return -errno;
+	return 0;
+}
+
+void tcmur_dev_set_thread_affinity(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	int ret;
+
+	if (!rdev->affinity)
+		return;
+
+	ret = tcmur_set_thread_affinity(rdev->affinity, rdev->affinity_mem > 0);
+	if (ret)
+		tcmu_dev_warn(dev, "Could not set thread affinity to %s %d\n",
+			      rdev->affinity, ret);
+}
+
+/**
+ * tcmur_stop_device - stop device for removal
+ * @arg: tcmu_device to stop
+ *
+ * Stop internal tcmur device operations like lock and recovery and close
+ * the device. Running IO must be stopped before calling this.
+ */
+void tcmur_stop_device(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	bool is_open = false;
+
+	pthread_mutex_lock(&rdev->state_lock);
+	/* check if this was already called due to thread cancelation */
+	if (rdev->flags & TCMUR_DEV_FLAG_STOPPED) {
+		pthread_mutex_unlock(&rdev->state_lock);
+		return;
+	}
+	tcmur_dev_set_flags(rdev, TCMUR_DEV_FLAG_STOPPING);
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	/*
+	 * The lock thread can fire off the recovery thread, so make sure
+	 * it is done first.
+	 */
+	tcmu_cancel_lock_thread(dev);
+	tcmu_cancel_recovery(dev);
+
+	pthread_mutex_lock(&rdev->state_lock);
+	if (rdev->flags & TCMUR_DEV_FLAG_IS_OPEN) {
+		tcmur_dev_clear_flags(rdev, TCMUR_DEV_FLAG_IS_OPEN);
+		is_open = true;
+	}
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	if (is_open) {
+		tcmu_release_dev_lock(dev);
+		rhandler->close(dev);
+	}
+	if (rhandler->removed)
+		rhandler->removed(dev);
+
+	pthread_mutex_lock(&rdev->state_lock);
+	tcmur_dev_set_flags(rdev, TCMUR_DEV_FLAG_STOPPED);
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	tcmu_dev_dbg(dev, "cmdproc cleanup done\n");
+}
+
+/*
+ * Pick the io worker thread bounds from the device's cfgstring options,
+ * then tcmu.conf, then the handler's default.
+ */
+static void tcmur_dev_set_io_threads(struct tcmu_device *dev,
+				     struct tcmu_config *cfg)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	int nr_threads = rdev->nr_threads;
+	int max_threads = rdev->max_threads;
+
+	if (nr_threads < 0)
+		nr_threads = cfg ? cfg->io_threads : 0;
+	if (!nr_threads)
+		nr_threads = rhandler->nr_threads;
+
+	if (max_threads < 0)
+		max_threads = cfg ? cfg->io_threads_max : 0;
+
+	if (!rhandler->nr_threads || !rhandler->max_threads) {
+		if (rdev->nr_threads >= 0 || rdev->max_threads >= 0)
+			tcmu_dev_warn(dev, "Handler does not support changing its io thread count of %d.\n",
+				      rhandler->nr_threads);
+		nr_threads = max_threads = rhandler->nr_threads;
+	} else {
+		nr_threads = min(nr_threads, rhandler->max_threads);
+		max_threads = min(max(max_threads, nr_threads),
+				  rhandler->max_threads);
+	}
+
+	rdev->nr_threads = nr_threads;
+	rdev->max_threads = max_threads;
+}
+
+/*
+ * Pick the thread affinity from the device's cfgstring options, then
+ * tcmu.conf.
+ */
+static int tcmur_dev_set_affinity(struct tcmu_device *dev,
+				  struct tcmu_config *cfg)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (rdev->affinity_mem < 0)
+		rdev->affinity_mem = cfg ? cfg->affinity_mem : 0;
+
+	if (rdev->affinity || !cfg || !cfg->affinity || !cfg->affinity[0])
+		return 0;
+
+	if (tcmur_check_affinity(cfg->affinity)) {
+		tcmu_dev_err(dev, "Invalid affinity %s in tcmu.conf.\n",
+			     cfg->affinity);
+		return -EINVAL;
+	}
+
+	rdev->affinity = strdup(cfg->affinity);
+	if (!rdev->affinity)
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * Size the read cache from the device's cfgstring options, then
+ * tcmu.conf.
+ */
+static int tcmur_dev_setup_read_cache(struct tcmu_device *dev,
+				      struct tcmu_config *cfg)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (rdev->read_cache_mb < 0)
+		rdev->read_cache_mb = cfg ? cfg->read_cache_mb : 0;
+	if (rdev->read_ahead_kb < 0 && cfg)
+		rdev->read_ahead_kb = cfg->read_ahead_kb;
+
+	return tcmur_cache_setup(dev, rdev->read_cache_mb, rdev->read_ahead_kb);
+}
+
+/* Same for the local flash tier below it */
+static int tcmur_dev_setup_tier(struct tcmu_device *dev,
+				struct tcmu_config *cfg)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (rdev->tier_mb < 0)
+		rdev->tier_mb = cfg ? cfg->tier_mb : TCMUR_TIER_DEF_MB;
+	if (rdev->tier_write_through < 0)
+		rdev->tier_write_through = cfg ? cfg->tier_write_through : 0;
+
+	return tcmur_tier_setup(dev, rdev->tier_path, rdev->tier_mb,
+				rdev->tier_write_through > 0);
+}
+
+/* Same for the write-back cache */
+static int tcmur_dev_setup_wcache(struct tcmu_device *dev,
+				  struct tcmu_config *cfg)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (rdev->write_back_mb < 0)
+		rdev->write_back_mb = cfg ? cfg->write_back_mb : 0;
+	if (rdev->write_back_delay_ms < 0 && cfg)
+		rdev->write_back_delay_ms = cfg->write_back_delay_ms;
+	if (rdev->write_back_max_io_kb < 0 && cfg)
+		rdev->write_back_max_io_kb = cfg->write_back_max_io_kb;
+
+	return tcmur_wcache_setup(dev, rdev->write_back_mb,
+				  rdev->write_back_delay_ms,
+				  rdev->write_back_max_io_kb);
+}
+
+/* Same for the failover queue */
+static int tcmur_dev_setup_pending(struct tcmu_device *dev,
+				   struct tcmu_config *cfg)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (rdev->failover_queue_depth < 0)
+		rdev->failover_queue_depth = cfg ? cfg->failover_queue_depth : 0;
+	if (rdev->failover_queue_timeout_ms < 0 && cfg)
+		rdev->failover_queue_timeout_ms =
+					cfg->failover_queue_timeout_ms;
+
+	return tcmur_pending_setup(dev, rdev->failover_queue_depth,
+				   rdev->failover_queue_timeout_ms);
+}
+
+/* Same for the scratch memory of compound cmds */
+static int tcmur_dev_setup_scratch(struct tcmu_device *dev,
+				   struct tcmu_config *cfg)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (rdev->scratch_cache_mb < 0 && cfg)
+		rdev->scratch_cache_mb = cfg->scratch_cache_mb;
+	if (rdev->scratch_limit_mb < 0)
+		rdev->scratch_limit_mb = cfg ? cfg->scratch_limit_mb : 0;
+
+	return tcmur_scratch_setup(dev, rdev->scratch_cache_mb,
+				   rdev->scratch_limit_mb);
+}
+
+/**
+ * tcmur_dev_setup - set up the runner's part of a device and open it
+ * @dev: device whose size and limits are set
+ * @cfg: tcmu.conf, or NULL to use the defaults
+ *
+ * Parses the runner options from the cfgstring, opens the handler and
+ * sets up the layers between it and the ring. Processing the ring is
+ * up to the caller. Undone by tcmur_dev_stop_io, tcmur_stop_device and
+ * tcmur_dev_cleanup.
+ */
+int tcmur_dev_setup(struct tcmu_device *dev, struct tcmu_config *cfg)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev;
+	int ret;
+
+	rdev = calloc(1, sizeof(*rdev));
+	if (!rdev)
+		return -ENOMEM;
+	tcmu_set_daemon_dev_private(dev, rdev);
+	list_node_init(&rdev->recovery_entry);
+	rdev->dev = dev;
+
+	ret = tcmur_dev_parse_opts(dev);
+	if (ret)
+		goto free_rdev;
+	tcmur_dev_set_io_threads(dev, cfg);
+
+	ret = tcmur_dev_set_affinity(dev, cfg);
+	if (ret)
+		goto free_rdev;
+
+	rdev->cmpl_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rdev->cmpl_efd < 0) {
+		ret = -errno;
+		goto free_rdev;
+	}
+
+	ret = tcmur_range_lock_init(&rdev->caw_lock);
+	if (ret != 0)
+		goto close_cmpl_efd;
+
+	ret = pthread_mutex_init(&rdev->format_lock, NULL);
+	if (ret != 0)
+		goto cleanup_caw_lock;
+
+	ret = pthread_mutex_init(&rdev->state_lock, NULL);
+	if (ret != 0)
+		goto cleanup_format_lock;
+
+	list_head_init(&rdev->alua_cache);
+	ret = pthread_mutex_init(&rdev->alua_cache_lock, NULL);
+	if (ret != 0)
+		goto cleanup_state_lock;
+
+	ret = setup_io_work_queue(dev);
+	if (ret < 0)
+		goto cleanup_alua_cache;
+
+	ret = setup_aio_tracking(rdev);
+	if (ret < 0)
+		goto cleanup_io_work_queue;
+
+	ret = rhandler->open(dev, false);
+	if (ret)
+		goto cleanup_aio_tracking;
+	tcmur_dev_set_flags(rdev, TCMUR_DEV_FLAG_IS_OPEN);
+
+	if (rdev->zero_detect < 0)
+		rdev->zero_detect = cfg ? cfg->zero_detect : 0;
+
+	/* after open, handlers set their split boundary there */
+	if (rdev->split_kb < 0)
+		rdev->split_kb = cfg ? cfg->split_kb : 0;
+	tcmur_dev_set_split(dev);
+
+	ret = tcmur_dev_setup_read_cache(dev, cfg);
+	if (ret)
+		goto close_dev;
+
+	ret = tcmur_dev_setup_tier(dev, cfg);
+	if (ret)
+		goto cleanup_read_cache;
+
+	ret = tcmur_dev_setup_wcache(dev, cfg);
+	if (ret)
+		goto cleanup_tier;
+
+	ret = tcmur_qos_setup(dev, &rdev->qos_limits);
+	if (ret)
+		goto cleanup_wcache;
+
+	ret = tcmur_dev_setup_pending(dev, cfg);
+	if (ret)
+		goto cleanup_qos;
+
+	ret = tcmur_dev_setup_scratch(dev, cfg);
+	if (ret)
+		goto cleanup_pending;
+
+	ret = pthread_cond_init(&rdev->lock_cond, NULL);
+	if (ret < 0)
+		goto cleanup_scratch;
+
+	return 0;
+
+cleanup_scratch:
+	tcmur_scratch_stop(dev);
+	tcmur_scratch_cleanup(dev);
+cleanup_pending:
+	tcmur_pending_stop(dev);
+	tcmur_pending_cleanup(dev);
+cleanup_qos:
+	tcmur_qos_stop(dev);
+	tcmur_qos_cleanup(dev);
+cleanup_wcache:
+	tcmur_wcache_stop(dev);
+	tcmur_wcache_cleanup(dev);
+cleanup_tier:
+	tcmur_tier_stop(dev);
+	tcmur_tier_cleanup(dev);
+cleanup_read_cache:
+	tcmur_cache_cleanup(dev);
+close_dev:
+	rhandler->close(dev);
+	if (rhandler->removed)
+		rhandler->removed(dev);
+cleanup_aio_tracking:
+	cleanup_aio_tracking(rdev);
+cleanup_io_work_queue:
+	cleanup_io_work_queue(dev, true);
+cleanup_alua_cache:
+	tcmu_invalidate_alua_grps(dev);
+	pthread_mutex_destroy(&rdev->alua_cache_lock);
+cleanup_state_lock:
+	pthread_mutex_destroy(&rdev->state_lock);
+cleanup_format_lock:
+	pthread_mutex_destroy(&rdev->format_lock);
+cleanup_caw_lock:
+	tcmur_range_lock_destroy(&rdev->caw_lock);
+close_cmpl_efd:
+	close(rdev->cmpl_efd);
+free_rdev:
+	free(rdev->affinity);
+	free(rdev->tier_path);
+	free(rdev);
+	return ret;
+}
+
+/**
+ * tcmur_dev_stop_io - stop the layers between the ring and the handler
+ * @dev: device being removed
+ *
+ * Their threads are stopped, so nothing new gets to the io workers or
+ * the handler.
+ */
+void tcmur_dev_stop_io(struct tcmu_device *dev)
+{
+	tcmur_scratch_stop(dev);
+	tcmur_pending_stop(dev);
+	tcmur_qos_stop(dev);
+	tcmur_wcache_stop(dev);
+	tcmur_cache_stop(dev);
+	tcmur_tier_stop(dev);
+}
+
+/**
+ * tcmur_dev_cleanup - free what tcmur_dev_setup set up
+ * @dev: device whose io workers and handler are stopped
+ */
+void tcmur_dev_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	int ret;
+
+	cleanup_io_work_queue(dev, false);
+	cleanup_aio_tracking(rdev);
+	tcmur_cache_cleanup(dev);
+	tcmur_tier_cleanup(dev);
+	tcmur_wcache_cleanup(dev);
+	tcmur_qos_cleanup(dev);
+	tcmur_pending_cleanup(dev);
+	tcmur_scratch_cleanup(dev);
+
+	ret = pthread_cond_destroy(&rdev->lock_cond);
+	if (ret != 0)
+		tcmu_err("could not cleanup lock cond %d\n", ret);
+
+	ret = pthread_mutex_destroy(&rdev->state_lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup state lock %d\n", ret);
+
+	tcmu_invalidate_alua_grps(dev);
+	ret = pthread_mutex_destroy(&rdev->alua_cache_lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup alua cache lock %d\n", ret);
+
+	ret = pthread_mutex_destroy(&rdev->format_lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup format lock %d\n", ret);
+
+	ret = tcmur_range_lock_destroy(&rdev->caw_lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup caw lock %d\n", ret);
+
+	close(rdev->cmpl_efd);
+
+	free(rdev->affinity);
+	free(rdev->tier_path);
+	free(rdev);
+}
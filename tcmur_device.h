@@ -10,10 +10,22 @@
 #define __TCMUR_DEVICE_H
 
 #include "pthread.h"
+#include <string.h>
 
 #include "ccan/list/list.h"
 
+#include "libtcmu_common.h"
+
 #include "tcmur_aio.h"
+#include "tcmur_stats.h"
+#include "tcmur_cache.h"
+#include "tcmur_wcache.h"
+#include "tcmur_qos.h"
+#include "tcmur_pending.h"
+#include "tcmur_scratch.h"
+#include "tcmur_tier.h"
+#include "tcmur_recovery.h"
+#include "tcmur_range_lock.h"
 
 #define TCMU_INVALID_LOCK_TAG USHRT_MAX
 
@@ -38,26 +50,36 @@ enum {
 	TCMUR_DEV_LOCK_UNKNOWN,
 };
 
+struct tcmur_cmdproc_worker;
+struct tgt_port_grp;
+
 struct tcmur_device {
 	struct tcmu_device *dev;
 
 	pthread_t cmdproc_thread;
+	/* set if the cmdproc thread is shared with other devices */
+	struct tcmur_cmdproc_worker *cmdproc_worker;
+	struct list_node cmdproc_entry;
 
-	/* TCMUR_DEV flags */
+	/* TCMUR_DEV flags, see tcmur_dev_get_flags */
 	uint32_t flags;
 	uint8_t failover_type;
 
-	pthread_t recovery_thread;
+	/* reopen after a lost connection, run by the recovery pool */
 	struct list_node recovery_entry;
+	struct tcmur_recovery_work recovery_work;
+	struct tgt_port_grp *recovery_tpg;
+	unsigned int recovery_attempts;
 
 	bool lock_lost;
 	uint8_t lock_state;
-	pthread_t lock_thread;
+	/* implicit lock acquisition, run by the recovery pool */
+	struct tcmur_recovery_work lock_work;
 	pthread_cond_t lock_cond;
 
 	/* General lock for lock state, thread, dev state, etc */
 	pthread_mutex_t state_lock;
-	int pending_uas;
+	int pending_uas;	/* set and cleared with atomics */
 
 	/*
 	 * lock order:
@@ -67,13 +89,182 @@ struct tcmur_device {
         struct tcmu_io_queue work_queue;
         struct tcmu_track_aio track_queue;
 
-	pthread_spinlock_t lock; /* protects concurrent updates to mailbox */
-	pthread_mutex_t caw_lock; /* for atomic CAW operation */
+	int cmpl_efd; /* kicks cmdproc to reap queued completions */
+	/* held by CAWs, overlapping CAWs and writes wait for it */
+	struct tcmur_range_lock caw_lock;
 
 	uint32_t format_progress;
 	pthread_mutex_t format_lock; /* for atomic format operations */
+
+	/*
+	 * Copy of the ALUA groups read from configfs, handed out by
+	 * tcmu_get_alua_grps while it is valid and fresh.
+	 */
+	pthread_mutex_t alua_cache_lock;
+	struct list_head alua_cache;
+	bool alua_cache_valid;
+	unsigned int alua_cache_gen;	/* bumped on every invalidation */
+	unsigned int alua_cache_epoch;	/* see tcmu_invalidate_all_alua_grps */
+	struct timespec alua_cache_time;
+
+	/*
+	 * io worker bounds. Set from the options below, tcmu.conf and the
+	 * handler's defaults before the work queue is setup.
+	 */
+	int nr_threads;
+	int max_threads;
+
+	/*
+	 * cmdproc and io worker thread placement, see
+	 * tcmur_set_thread_affinity. NULL/-1 means use tcmu.conf's value.
+	 */
+	char *affinity;
+	int affinity_mem;
+
+	/* cmdproc ring busy polling, -1 means use tcmu.conf's value */
+	int busy_poll_usecs;
+
+	/*
+	 * read cache size in MiB and readahead window in KiB, -1 means
+	 * use tcmu.conf's value. read_cache is NULL if it is disabled.
+	 */
+	int read_cache_mb;
+	int read_ahead_kb;
+	struct tcmur_cache *read_cache;
+
+	/*
+	 * write-back cache size in MiB, writeback delay in ms and largest
+	 * writeback IO in KiB, -1 means use tcmu.conf's value. wcache is
+	 * NULL if it is disabled.
+	 */
+	int write_back_mb;
+	int write_back_delay_ms;
+	int write_back_max_io_kb;
+	struct tcmur_wcache *wcache;
+
+	/*
+	 * send zeroed WRITEs to the handler as unmaps or zeroing WRITE
+	 * SAMEs, -1 means use tcmu.conf's value
+	 */
+	int zero_detect;
+
+	/*
+	 * local flash cache file below the read cache, its size in MiB and
+	 * whether WRITEs fill it too. NULL/-1 means use tcmu.conf's value.
+	 * tier is NULL if it is disabled.
+	 */
+	char *tier_path;
+	int tier_mb;
+	int tier_write_through;
+	struct tcmur_tier *tier;
+
+	/*
+	 * IOPS and bandwidth limits from the cfgstring, which can also be
+	 * changed by a reconfig. qos is NULL until a limit is set.
+	 */
+	struct tcmur_qos_limits qos_limits;
+	struct tcmur_qos *qos;
+
+	/*
+	 * cmds held while the device is reopened or the lock acquired, and
+	 * how long they may wait in ms. -1 means use tcmu.conf's value.
+	 * pending is NULL if it is disabled.
+	 */
+	int failover_queue_depth;
+	int failover_queue_timeout_ms;
+	struct tcmur_pending *pending;
+
+	/*
+	 * MiB of freed scratch memory kept for compound cmds and MiB in use
+	 * before they are held. -1 means use tcmu.conf's value.
+	 */
+	int scratch_cache_mb;
+	int scratch_limit_mb;
+	struct tcmur_scratch *scratch;
+
+	/*
+	 * KiB READs and WRITEs are split into, rounded up to the handler's
+	 * opt_split_len, -1 means use tcmu.conf's value. split_lbas is the
+	 * resulting length in blocks, 0 if splitting is disabled.
+	 */
+	int split_kb;
+	uint32_t split_lbas;
+
+	/* cmd counters and latencies exported over D-Bus */
+	struct list_node stats_entry;
+	struct tcmur_dev_stats stats;
 };
 
+/*
+ * flags and lock_state are changed with state_lock held (format_lock
+ * for FORMATTING) so slow paths see them consistent with the rest of
+ * the device state, but the cmd path reads them without any lock, so
+ * they are always updated with atomics. flags are seq_cst because a cmd
+ * bumps the tracked cmd count and then checks IN_RECOVERY while a reopen
+ * does the opposite, see track_aio_request_start.
+ */
+static inline uint32_t tcmur_dev_get_flags(struct tcmur_device *rdev)
+{
+	return __atomic_load_n(&rdev->flags, __ATOMIC_SEQ_CST);
+}
+
+static inline void tcmur_dev_set_flags(struct tcmur_device *rdev,
+				       uint32_t flags)
+{
+	__atomic_fetch_or(&rdev->flags, flags, __ATOMIC_SEQ_CST);
+}
+
+static inline void tcmur_dev_clear_flags(struct tcmur_device *rdev,
+					 uint32_t flags)
+{
+	__atomic_fetch_and(&rdev->flags, ~flags, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * tcmu-runner's part of a cmd. libtcmu hands it out with the cmds it
+ * gets from the ring, and the cmds the runner makes up itself carry
+ * their own, see tcmur_cmd_init.
+ */
+struct tcmur_cmd {
+	/* to queue the cmd to the io workers */
+	tcmu_work_fn_t work_fn;
+	struct tcmulib_cmd *work_next;
+
+	/* for the per device stats */
+	uint64_t start_ns;
+	uint64_t work_ns;
+	uint64_t bytes;
+
+	/* for the read cache */
+	uint64_t cache_gen;
+
+	/* flash tier fill the cmd reserved slots for */
+	struct tcmur_tier_job *tier_fill;
+};
+
+static inline struct tcmur_cmd *tcmur_cmd_priv(struct tcmulib_cmd *cmd)
+{
+	return cmd->d_private;
+}
+
+static inline void tcmur_cmd_init(struct tcmulib_cmd *cmd,
+				  struct tcmur_cmd *rcmd)
+{
+	memset(rcmd, 0, sizeof(*rcmd));
+	cmd->d_private = rcmd;
+}
+
+static inline uint8_t tcmur_dev_get_lock_state(struct tcmur_device *rdev)
+{
+	return __atomic_load_n(&rdev->lock_state, __ATOMIC_ACQUIRE);
+}
+
+static inline void tcmur_dev_set_lock_state(struct tcmur_device *rdev,
+					    uint8_t lock_state)
+{
+	__atomic_store_n(&rdev->lock_state, lock_state, __ATOMIC_RELEASE);
+}
+
 bool tcmu_dev_in_recovery(struct tcmu_device *dev);
 void tcmu_cancel_recovery(struct tcmu_device *dev);
 int tcmu_cancel_lock_thread(struct tcmu_device *dev);
@@ -81,9 +272,31 @@ int tcmu_cancel_lock_thread(struct tcmu_device *dev);
 void tcmu_notify_conn_lost(struct tcmu_device *dev);
 void tcmu_notify_lock_lost(struct tcmu_device *dev);
 
+int tcmu_reopen_dev_close(struct tcmu_device *dev, bool in_lock_thread);
+int tcmu_reopen_dev_open(struct tcmu_device *dev);
+void tcmu_reopen_dev_done(struct tcmu_device *dev);
 int __tcmu_reopen_dev(struct tcmu_device *dev, bool in_lock_thread, int retries);
 int tcmu_reopen_dev(struct tcmu_device *dev, bool in_lock_thread, int retries);
 
+struct tcmu_config;
+
+int tcmur_dev_setup(struct tcmu_device *dev, struct tcmu_config *cfg);
+void tcmur_dev_stop_io(struct tcmu_device *dev);
+void tcmur_stop_device(void *arg);
+void tcmur_dev_cleanup(struct tcmu_device *dev);
+
+/* Runner options in the cfgstring start with this, see tcmur_dev_parse_opts */
+#define TCMUR_DEV_OPT_PREFIX "tcmur_"
+
+int tcmur_dev_parse_opts(struct tcmu_device *dev);
+int tcmur_dev_parse_reconfig_opts(struct tcmu_device *dev, char *cfgstring,
+				  struct tcmur_qos_limits *qos);
+void tcmur_dev_set_split(struct tcmu_device *dev);
+
+int tcmur_check_affinity(const char *affinity);
+int tcmur_set_thread_affinity(const char *affinity, bool local_mem);
+void tcmur_dev_set_thread_affinity(struct tcmu_device *dev);
+
 int tcmu_acquire_dev_lock(struct tcmu_device *dev, bool is_sync, uint16_t tag);
 void tcmu_release_dev_lock(struct tcmu_device *dev);
 int tcmu_get_lock_tag(struct tcmu_device *dev, uint16_t *tag);
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Optional per device queue of cmds waiting for a failover.
+ *
+ * Without it, cmds that arrive while the device is being reopened or,
+ * with implicit failover, while the lock is being acquired are failed
+ * with BUSY and the initiator retries them after a backoff. With it, up
+ * to depth of them are put on hold instead and sent on as soon as the
+ * reopen or lock acquisition is done. They are only failed, with the
+ * BUSY they would have gotten, if the lock could not be acquired or
+ * they waited longer than timeout_ms.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_cmd_handler.h"
+#include "tcmur_pending.h"
+#include "tcmur_time.h"
+
+struct tcmur_pending_waiter {
+	struct list_node entry;
+	struct tcmulib_cmd *cmd;
+	bool for_lock;		/* else waiting for a reopen */
+	uint64_t deadline_ms;
+	int ret;		/* passed to cmd->done when woken up */
+};
+
+struct tcmur_pending {
+	struct tcmu_device *dev;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* wakes up the dispatcher and flushers */
+	pthread_t thread;
+
+	unsigned int nr_cmds;		/* taken off the ring, not completed */
+	unsigned int nr_flushers;	/* in tcmur_pending_flush_device */
+	struct list_head waiters;	/* oldest first */
+	unsigned int nr_waiters;
+	unsigned int depth;
+	uint64_t timeout_ms;
+	bool stopping;
+
+	uint64_t parked;
+	uint64_t timed_out;
+	uint64_t overflows;
+};
+
+/**
+ * tcmur_pending_park - hold a cmd until a failover has completed
+ * @dev: device the cmd was sent to
+ * @cmd: cmd that can not be executed yet
+ * @for_lock: true if waiting for the lock, else for a reopen
+ * @ret: status to return if the cmd can not be held
+ * @done: called with TCMU_STS_OK once the cmd can be executed, or with
+ *	  TCMU_STS_BUSY if it could not
+ *
+ * Returns TCMU_STS_ASYNC_HANDLED if the cmd was put on hold, else ret.
+ * Held cmds are not tracked, so a reopen does not wait for them.
+ */
+int tcmur_pending_park(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		       bool for_lock, int ret, cmd_done_t done)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_pending *pq = rdev->pending;
+	struct tcmur_pending_waiter *w;
+
+	if (!pq)
+		return ret;
+
+	pthread_mutex_lock(&pq->lock);
+	if (pq->stopping)
+		goto unlock;
+
+	if (pq->nr_waiters >= pq->depth) {
+		pq->overflows++;
+		goto unlock;
+	}
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		goto unlock;
+
+	w->cmd = cmd;
+	w->for_lock = for_lock;
+	w->deadline_ms = tcmur_now_ms() + pq->timeout_ms;
+	w->ret = TCMU_STS_OK;
+	cmd->done = done;
+	list_add_tail(&pq->waiters, &w->entry);
+	pq->nr_waiters++;
+	pq->parked++;
+	ret = TCMU_STS_ASYNC_HANDLED;
+
+	/* the failover may have completed before we got the lock */
+	pthread_cond_broadcast(&pq->cond);
+unlock:
+	pthread_mutex_unlock(&pq->lock);
+	return ret;
+}
+
+/* Called when the device is done with a reopen or a lock acquisition */
+void tcmur_pending_wake(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_pending *pq = rdev->pending;
+
+	if (!pq)
+		return;
+
+	pthread_mutex_lock(&pq->lock);
+	if (pq->nr_waiters)
+		pthread_cond_broadcast(&pq->cond);
+	pthread_mutex_unlock(&pq->lock);
+}
+
+/* Number of cmds on hold, used to reopen devices with waiting cmds first */
+unsigned int tcmur_pending_nr_held(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_pending *pq = rdev->pending;
+	unsigned int nr;
+
+	if (!pq)
+		return 0;
+
+	pthread_mutex_lock(&pq->lock);
+	nr = pq->nr_waiters;
+	pthread_mutex_unlock(&pq->lock);
+	return nr;
+}
+
+/* Called for every cmd taken off the ring, and when it is completed */
+void tcmur_pending_cmd_start(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (rdev->pending)
+		__atomic_add_fetch(&rdev->pending->nr_cmds, 1, __ATOMIC_RELAXED);
+}
+
+void tcmur_pending_cmd_done(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_pending *pq = rdev->pending;
+
+	if (!pq)
+		return;
+
+	__atomic_sub_fetch(&pq->nr_cmds, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&pq->nr_flushers, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&pq->lock);
+	pthread_cond_broadcast(&pq->cond);
+	pthread_mutex_unlock(&pq->lock);
+}
+
+/*
+ * Like tcmu_flush_device, but held cmds do not complete until the lock
+ * has been acquired, so only wait for the others.
+ */
+void tcmur_pending_flush_device(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_pending *pq = rdev->pending;
+
+	if (!pq) {
+		tcmu_flush_device(dev);
+		return;
+	}
+
+	tcmu_dev_dbg(dev, "waiting for cmds that are not held to complete\n");
+	pthread_mutex_lock(&pq->lock);
+	/* set before checking nr_cmds, so cmd_done sees it and wakes us */
+	__atomic_add_fetch(&pq->nr_flushers, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&pq->nr_cmds, __ATOMIC_SEQ_CST) >
+	       pq->nr_waiters)
+		pthread_cond_wait(&pq->cond, &pq->lock);
+	__atomic_sub_fetch(&pq->nr_flushers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pq->lock);
+	tcmu_dev_dbg(dev, "cmds not held are done\n");
+}
+
+/*
+ * Move the waiters that are done waiting to ready, and return when the
+ * next one times out, or 0 if none are left.
+ */
+static uint64_t pending_wake_waiters(struct tcmur_pending *pq,
+				     struct list_head *ready)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(pq->dev);
+	struct tcmur_pending_waiter *w, *next;
+	bool in_recovery, locking, locked, stopping;
+	uint64_t now, next_ms = 0;
+
+	pthread_mutex_lock(&rdev->state_lock);
+	in_recovery = !!(rdev->flags & TCMUR_DEV_FLAG_IN_RECOVERY);
+	stopping = pq->stopping || (rdev->flags & TCMUR_DEV_FLAG_STOPPING);
+	locking = rdev->lock_state == TCMUR_DEV_LOCK_LOCKING;
+	locked = rdev->lock_state == TCMUR_DEV_LOCK_LOCKED;
+	pthread_mutex_unlock(&rdev->state_lock);
+
+	now = tcmur_now_ms();
+	list_for_each_safe(&pq->waiters, w, next, entry) {
+		if (stopping) {
+			w->ret = TCMU_STS_BUSY;
+		} else if (w->for_lock && !locking) {
+			/* a failed lock acquisition fails its cmds */
+			w->ret = locked ? TCMU_STS_OK : TCMU_STS_BUSY;
+		} else if (!w->for_lock && !in_recovery) {
+			w->ret = TCMU_STS_OK;
+		} else if (now >= w->deadline_ms) {
+			w->ret = TCMU_STS_BUSY;
+			pq->timed_out++;
+		} else {
+			if (!next_ms || w->deadline_ms < next_ms)
+				next_ms = w->deadline_ms;
+			continue;
+		}
+
+		list_del(&w->entry);
+		list_add_tail(ready, &w->entry);
+		pq->nr_waiters--;
+	}
+	return next_ms;
+}
+
+static void pending_sleep(struct tcmur_pending *pq, uint64_t until_ms)
+{
+	if (!until_ms) {
+		pthread_cond_wait(&pq->cond, &pq->lock);
+		return;
+	}
+
+	tcmur_cond_wait_until_ms(&pq->cond, &pq->lock, until_ms);
+}
+
+static void *pending_dispatcher(void *arg)
+{
+	struct tcmur_pending *pq = arg;
+	struct tcmu_device *dev = pq->dev;
+	struct tcmur_pending_waiter *w;
+	struct list_head ready;
+	uint64_t next_ms;
+
+	list_head_init(&ready);
+
+	pthread_mutex_lock(&pq->lock);
+	while (!pq->stopping || pq->nr_waiters) {
+		next_ms = 0;
+		if (pq->nr_waiters)
+			next_ms = pending_wake_waiters(pq, &ready);
+		if (list_empty(&ready)) {
+			pending_sleep(pq, next_ms);
+			continue;
+		}
+		pthread_mutex_unlock(&pq->lock);
+
+		/* without the lock held, since the cmds are executed now */
+		while ((w = list_pop(&ready, struct tcmur_pending_waiter,
+				     entry))) {
+			w->cmd->done(dev, w->cmd, w->ret);
+			free(w);
+		}
+
+		pthread_mutex_lock(&pq->lock);
+	}
+	pthread_mutex_unlock(&pq->lock);
+
+	return NULL;
+}
+
+/**
+ * tcmur_pending_setup - start holding cmds during failovers
+ * @dev: device to hold cmds for
+ * @depth: most cmds held at once, 0 disables it
+ * @timeout_ms: longest a cmd is held, -1 or 0 for the default
+ *
+ * Must be called before the cmdproc thread is started.
+ */
+int tcmur_pending_setup(struct tcmu_device *dev, int depth, int timeout_ms)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_pending *pq;
+	int ret;
+
+	if (depth <= 0)
+		return 0;
+
+	if (tcmur_handler_is_passthrough_only(rhandler)) {
+		tcmu_dev_warn(dev, "Handler does not support the failover queue.\n");
+		return 0;
+	}
+
+	if (timeout_ms <= 0)
+		timeout_ms = TCMUR_PENDING_DEF_TIMEOUT_MS;
+
+	pq = calloc(1, sizeof(*pq));
+	if (!pq)
+		return -ENOMEM;
+
+	pq->dev = dev;
+	pq->depth = depth;
+	pq->timeout_ms = timeout_ms;
+	list_head_init(&pq->waiters);
+
+	ret = pthread_mutex_init(&pq->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto free_pq;
+	}
+
+	ret = tcmur_cond_init(&pq->cond);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	ret = pthread_create(&pq->thread, NULL, pending_dispatcher, pq);
+	if (ret) {
+		ret = -ret;
+		goto destroy_cond;
+	}
+	rdev->pending = pq;
+
+	tcmu_dev_dbg(dev, "failover queue depth %d, timeout %d ms\n",
+		     depth, timeout_ms);
+	return 0;
+
+destroy_cond:
+	pthread_cond_destroy(&pq->cond);
+destroy_lock:
+	pthread_mutex_destroy(&pq->lock);
+free_pq:
+	free(pq);
+	return ret;
+}
+
+/*
+ * Fail the held cmds with BUSY and stop the dispatcher. cmds that
+ * arrive afterwards are not held. Must be called once the device is
+ * marked as stopping.
+ */
+void tcmur_pending_stop(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_pending *pq = rdev->pending;
+
+	if (!pq)
+		return;
+
+	pthread_mutex_lock(&pq->lock);
+	pq->stopping = true;
+	pthread_cond_broadcast(&pq->cond);
+	pthread_mutex_unlock(&pq->lock);
+
+	pthread_join(pq->thread, NULL);
+}
+
+/* Must be called once all cmds have completed */
+void tcmur_pending_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_pending *pq = rdev->pending;
+
+	if (!pq)
+		return;
+
+	if (pq->parked)
+		tcmu_dev_info(dev, "failover queue held %"PRIu64" cmds, %"PRIu64" timed out, %"PRIu64" did not fit\n",
+			      pq->parked, pq->timed_out, pq->overflows);
+
+	rdev->pending = NULL;
+	pthread_cond_destroy(&pq->cond);
+	pthread_mutex_destroy(&pq->lock);
+	free(pq);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_PENDING_H
+#define __TCMUR_PENDING_H
+
+#include <stdbool.h>
+
+#include "libtcmu_common.h"
+
+struct tcmu_device;
+struct tcmulib_cmd;
+
+/* Used when neither tcmu.conf nor the device set it */
+#define TCMUR_PENDING_DEF_TIMEOUT_MS	10000
+
+struct tcmur_pending;
+
+int tcmur_pending_setup(struct tcmu_device *dev, int depth, int timeout_ms);
+void tcmur_pending_stop(struct tcmu_device *dev);
+void tcmur_pending_cleanup(struct tcmu_device *dev);
+
+int tcmur_pending_park(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		       bool for_lock, int ret, cmd_done_t done);
+void tcmur_pending_wake(struct tcmu_device *dev);
+unsigned int tcmur_pending_nr_held(struct tcmu_device *dev);
+void tcmur_pending_flush_device(struct tcmu_device *dev);
+void tcmur_pending_cmd_start(struct tcmu_device *dev);
+void tcmur_pending_cmd_done(struct tcmu_device *dev);
+
+#endif /* __TCMUR_PENDING_H */
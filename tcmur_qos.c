@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Optional per device IOPS and bandwidth limits.
+ *
+ * READs and WRITEs each have a token bucket for cmds and one for bytes.
+ * Buckets fill at the limit's rate up to burst_ms worth of tokens, and a
+ * cmd may go once every bucket of its direction holds what it costs, or
+ * is full. Larger cmds leave the bucket in debt, so the ones after them
+ * wait until it is paid back. Cmds that can not go yet are put on hold
+ * in the order they arrived, and a thread sends them on once there are
+ * tokens, so they are delayed and never failed.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <scsi/scsi.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_qos.h"
+#include "tcmur_time.h"
+
+#define QOS_NSEC_PER_SEC	1000000000ULL
+
+enum {
+	QOS_READ,
+	QOS_WRITE,
+	QOS_NR_DIRS,
+};
+
+struct tcmur_qos_bucket {
+	double rate;		/* tokens per second, 0 if unlimited */
+	double burst;		/* most tokens that can build up */
+	double tokens;		/* negative while in debt */
+};
+
+struct tcmur_qos_waiter {
+	struct list_node entry;
+	struct tcmulib_cmd *cmd;
+	uint64_t bytes;
+};
+
+struct tcmur_qos_queue {
+	struct tcmur_qos_bucket iops;
+	struct tcmur_qos_bucket bps;
+	struct list_head waiters;	/* oldest first */
+
+	uint64_t cmds;
+	uint64_t deferred;
+};
+
+struct tcmur_qos {
+	struct tcmu_device *dev;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* wakes up the dispatcher */
+	pthread_t thread;
+
+	uint64_t last_ns;	/* when the buckets were last filled */
+	struct tcmur_qos_queue queues[QOS_NR_DIRS];
+	bool stopping;
+};
+
+static void qos_bucket_set(struct tcmur_qos_bucket *b, double rate,
+			   int burst_ms)
+{
+	bool was_unlimited = !b->rate;
+
+	b->rate = rate;
+	b->burst = rate * burst_ms / 1000;
+	if (b->burst < 1)
+		b->burst = 1;
+	/* a new limit starts out with a full burst */
+	if (was_unlimited || b->tokens > b->burst)
+		b->tokens = b->burst;
+}
+
+static void qos_bucket_fill(struct tcmur_qos_bucket *b, uint64_t delta_ns)
+{
+	if (!b->rate)
+		return;
+
+	b->tokens += b->rate * delta_ns / QOS_NSEC_PER_SEC;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+}
+
+/* Called with the lock held */
+static void qos_fill(struct tcmur_qos *qos, uint64_t now)
+{
+	uint64_t delta_ns = now - qos->last_ns;
+	int i;
+
+	qos->last_ns = now;
+	for (i = 0; i < QOS_NR_DIRS; i++) {
+		qos_bucket_fill(&qos->queues[i].iops, delta_ns);
+		qos_bucket_fill(&qos->queues[i].bps, delta_ns);
+	}
+}
+
+/*
+ * Returns 0 if cost can be taken from the bucket, or else how long it
+ * has to fill until it can.
+ */
+static uint64_t qos_bucket_wait_ns(struct tcmur_qos_bucket *b, double cost)
+{
+	double need;
+
+	if (!b->rate)
+		return 0;
+
+	need = min(cost, b->burst) - b->tokens;
+	if (need <= 0)
+		return 0;
+	return need * QOS_NSEC_PER_SEC / b->rate + 1;
+}
+
+static uint64_t qos_wait_ns(struct tcmur_qos_queue *q, uint64_t bytes)
+{
+	return max(qos_bucket_wait_ns(&q->iops, 1),
+		   qos_bucket_wait_ns(&q->bps, bytes));
+}
+
+static void qos_take(struct tcmur_qos_queue *q, uint64_t bytes)
+{
+	if (q->iops.rate)
+		q->iops.tokens -= 1;
+	if (q->bps.rate)
+		q->bps.tokens -= bytes;
+}
+
+static bool qos_unlimited(struct tcmur_qos_queue *q)
+{
+	return !q->iops.rate && !q->bps.rate;
+}
+
+static int qos_cmd_dir(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		       uint64_t *bytes)
+{
+	uint8_t *cdb = cmd->cdb;
+	uint64_t nr_lbas;
+	int dir;
+
+	switch (cdb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		dir = QOS_READ;
+		nr_lbas = tcmu_get_xfer_length(cdb);
+		break;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+		dir = QOS_WRITE;
+		nr_lbas = tcmu_get_xfer_length(cdb);
+		break;
+	case COMPARE_AND_WRITE:
+		dir = QOS_WRITE;
+		nr_lbas = cdb[13];
+		break;
+	default:
+		return -1;
+	}
+
+	*bytes = nr_lbas * tcmu_get_dev_block_size(dev);
+	return dir;
+}
+
+/**
+ * tcmur_qos_start - apply the device's limits to a cmd
+ * @dev: device the cmd was sent to
+ * @cmd: cmd that is about to be executed
+ * @done: called with TCMU_STS_OK once a held cmd may go on
+ *
+ * Returns TCMU_STS_OK if the cmd can be executed now, or
+ * TCMU_STS_ASYNC_HANDLED if it was put on hold.
+ */
+int tcmur_qos_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		    cmd_done_t done)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_qos *qos = __atomic_load_n(&rdev->qos, __ATOMIC_ACQUIRE);
+	struct tcmur_qos_waiter *w;
+	struct tcmur_qos_queue *q;
+	uint64_t bytes;
+	int dir;
+
+	if (!qos)
+		return TCMU_STS_OK;
+
+	dir = qos_cmd_dir(dev, cmd, &bytes);
+	if (dir < 0)
+		return TCMU_STS_OK;
+	q = &qos->queues[dir];
+
+	pthread_mutex_lock(&qos->lock);
+	if (qos->stopping || qos_unlimited(q))
+		goto go;
+
+	qos_fill(qos, tcmur_now_ns());
+	if (list_empty(&q->waiters) && !qos_wait_ns(q, bytes)) {
+		qos_take(q, bytes);
+		goto go;
+	}
+
+	w = malloc(sizeof(*w));
+	if (!w) {
+		pthread_mutex_unlock(&qos->lock);
+		return TCMU_STS_NO_RESOURCE;
+	}
+	w->cmd = cmd;
+	w->bytes = bytes;
+
+	cmd->done = done;
+	list_add_tail(&q->waiters, &w->entry);
+	q->cmds++;
+	q->deferred++;
+	pthread_cond_signal(&qos->cond);
+	pthread_mutex_unlock(&qos->lock);
+	return TCMU_STS_ASYNC_HANDLED;
+
+go:
+	q->cmds++;
+	pthread_mutex_unlock(&qos->lock);
+	return TCMU_STS_OK;
+}
+
+/*
+ * Move the held cmds that can go on to ready, and return how long until
+ * the next one can, or 0 if none are held.
+ */
+static uint64_t qos_wake_waiters(struct tcmur_qos *qos,
+				 struct list_head *ready)
+{
+	struct tcmur_qos_waiter *w;
+	struct tcmur_qos_queue *q;
+	uint64_t wait_ns, next_ns = 0;
+	int i;
+
+	qos_fill(qos, tcmur_now_ns());
+
+	for (i = 0; i < QOS_NR_DIRS; i++) {
+		q = &qos->queues[i];
+
+		while ((w = list_top(&q->waiters, struct tcmur_qos_waiter,
+				     entry))) {
+			wait_ns = 0;
+			if (!qos->stopping)
+				wait_ns = qos_wait_ns(q, w->bytes);
+			if (wait_ns) {
+				if (!next_ns || wait_ns < next_ns)
+					next_ns = wait_ns;
+				break;
+			}
+
+			qos_take(q, w->bytes);
+			list_del(&w->entry);
+			list_add_tail(ready, &w->entry);
+		}
+	}
+	return next_ns;
+}
+
+static void qos_sleep(struct tcmur_qos *qos, uint64_t wait_ns)
+{
+	if (!wait_ns) {
+		pthread_cond_wait(&qos->cond, &qos->lock);
+		return;
+	}
+
+	/* same clock as the buckets are filled with */
+	tcmur_cond_wait_until_ns(&qos->cond, &qos->lock,
+				 tcmur_now_ns() + wait_ns);
+}
+
+static void *qos_dispatcher(void *arg)
+{
+	struct tcmur_qos *qos = arg;
+	struct tcmu_device *dev = qos->dev;
+	struct tcmur_qos_waiter *w;
+	struct list_head ready;
+	uint64_t wait_ns;
+	bool stopping;
+
+	list_head_init(&ready);
+
+	pthread_mutex_lock(&qos->lock);
+	for (;;) {
+		wait_ns = qos_wake_waiters(qos, &ready);
+		stopping = qos->stopping;
+		if (list_empty(&ready)) {
+			if (stopping)
+				break;
+			qos_sleep(qos, wait_ns);
+			continue;
+		}
+		pthread_mutex_unlock(&qos->lock);
+
+		/* without the lock held, since the cmds are executed now */
+		while ((w = list_pop(&ready, struct tcmur_qos_waiter, entry))) {
+			w->cmd->done(dev, w->cmd, TCMU_STS_OK);
+			free(w);
+		}
+
+		pthread_mutex_lock(&qos->lock);
+	}
+	pthread_mutex_unlock(&qos->lock);
+
+	return NULL;
+}
+
+static bool qos_limits_set(struct tcmur_qos_limits *limits)
+{
+	return limits->read_iops > 0 || limits->write_iops > 0 ||
+	       limits->read_kbps > 0 || limits->write_kbps > 0;
+}
+
+/* Called with the lock held, or before the dispatcher is started */
+static void qos_apply_limits(struct tcmur_qos *qos,
+			     struct tcmur_qos_limits *limits)
+{
+	int burst_ms = limits->burst_ms;
+
+	if (burst_ms <= 0)
+		burst_ms = TCMUR_QOS_DEF_BURST_MS;
+
+	qos_bucket_set(&qos->queues[QOS_READ].iops, limits->read_iops,
+		       burst_ms);
+	qos_bucket_set(&qos->queues[QOS_WRITE].iops, limits->write_iops,
+		       burst_ms);
+	qos_bucket_set(&qos->queues[QOS_READ].bps,
+		       (double)limits->read_kbps * 1024, burst_ms);
+	qos_bucket_set(&qos->queues[QOS_WRITE].bps,
+		       (double)limits->write_kbps * 1024, burst_ms);
+}
+
+static void qos_log_limits(struct tcmu_device *dev,
+			   struct tcmur_qos_limits *limits)
+{
+	tcmu_dev_info(dev, "qos read %d iops %d KiB/s, write %d iops %d KiB/s, burst %d ms\n",
+		      limits->read_iops, limits->read_kbps,
+		      limits->write_iops, limits->write_kbps,
+		      limits->burst_ms > 0 ? limits->burst_ms :
+					     TCMUR_QOS_DEF_BURST_MS);
+}
+
+static int qos_create(struct tcmu_device *dev, struct tcmur_qos_limits *limits,
+		      struct tcmur_qos **qos_ret)
+{
+	struct tcmur_qos *qos;
+	int ret, i;
+
+	qos = calloc(1, sizeof(*qos));
+	if (!qos)
+		return -ENOMEM;
+
+	qos->dev = dev;
+	for (i = 0; i < QOS_NR_DIRS; i++)
+		list_head_init(&qos->queues[i].waiters);
+	qos->last_ns = tcmur_now_ns();
+	qos_apply_limits(qos, limits);
+
+	ret = pthread_mutex_init(&qos->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto free_qos;
+	}
+
+	ret = tcmur_cond_init(&qos->cond);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	ret = pthread_create(&qos->thread, NULL, qos_dispatcher, qos);
+	if (ret) {
+		ret = -ret;
+		goto destroy_cond;
+	}
+
+	qos_log_limits(dev, limits);
+	*qos_ret = qos;
+	return 0;
+
+destroy_cond:
+	pthread_cond_destroy(&qos->cond);
+destroy_lock:
+	pthread_mutex_destroy(&qos->lock);
+free_qos:
+	free(qos);
+	return ret;
+}
+
+/**
+ * tcmur_qos_setup - start applying the device's IOPS and bandwidth limits
+ * @dev: device to limit
+ * @limits: the limits, nothing is set up if none are set
+ *
+ * Must be called before the cmdproc thread is started.
+ */
+int tcmur_qos_setup(struct tcmu_device *dev, struct tcmur_qos_limits *limits)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	if (!qos_limits_set(limits))
+		return 0;
+
+	return qos_create(dev, limits, &rdev->qos);
+}
+
+/**
+ * tcmur_qos_set_limits - change the device's limits at runtime
+ * @dev: device to change the limits of
+ * @limits: the new limits, unset ones become unlimited
+ *
+ * Held cmds are sent on at the new rate. If the device had no limits
+ * before, they are set up like tcmur_qos_setup does.
+ */
+int tcmur_qos_set_limits(struct tcmu_device *dev,
+			 struct tcmur_qos_limits *limits)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_qos *qos = rdev->qos;
+	int ret;
+
+	if (!qos) {
+		if (!qos_limits_set(limits))
+			return 0;
+
+		ret = qos_create(dev, limits, &qos);
+		if (ret)
+			return ret;
+		/* the cmdproc thread may be looking at it already */
+		__atomic_store_n(&rdev->qos, qos, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	pthread_mutex_lock(&qos->lock);
+	qos_fill(qos, tcmur_now_ns());
+	qos_apply_limits(qos, limits);
+	pthread_cond_signal(&qos->cond);
+	pthread_mutex_unlock(&qos->lock);
+
+	qos_log_limits(dev, limits);
+	return 0;
+}
+
+/*
+ * Send all held cmds on and stop the dispatcher. cmds that arrive
+ * afterwards are not limited. Must be called before the write-back
+ * cache and io workers are stopped.
+ */
+void tcmur_qos_stop(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_qos *qos = rdev->qos;
+
+	if (!qos)
+		return;
+
+	pthread_mutex_lock(&qos->lock);
+	qos->stopping = true;
+	pthread_cond_signal(&qos->cond);
+	pthread_mutex_unlock(&qos->lock);
+
+	pthread_join(qos->thread, NULL);
+}
+
+/* Must be called once all cmds have completed */
+void tcmur_qos_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_qos *qos = rdev->qos;
+
+	if (!qos)
+		return;
+
+	tcmu_dev_info(dev, "qos reads %"PRIu64" (%"PRIu64" delayed) writes %"PRIu64" (%"PRIu64" delayed)\n",
+		      qos->queues[QOS_READ].cmds,
+		      qos->queues[QOS_READ].deferred,
+		      qos->queues[QOS_WRITE].cmds,
+		      qos->queues[QOS_WRITE].deferred);
+
+	rdev->qos = NULL;
+	pthread_cond_destroy(&qos->cond);
+	pthread_mutex_destroy(&qos->lock);
+	free(qos);
+}
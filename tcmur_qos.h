@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_QOS_H
+#define __TCMUR_QOS_H
+
+#include "libtcmu_common.h"
+
+struct tcmu_device;
+struct tcmulib_cmd;
+
+/* Used when the device does not set the burst */
+#define TCMUR_QOS_DEF_BURST_MS		1000
+
+/* 0 means unlimited, burst_ms -1 means the default */
+struct tcmur_qos_limits {
+	int read_iops;
+	int write_iops;
+	int read_kbps;
+	int write_kbps;
+	int burst_ms;
+};
+
+struct tcmur_qos;
+
+int tcmur_qos_setup(struct tcmu_device *dev, struct tcmur_qos_limits *limits);
+int tcmur_qos_set_limits(struct tcmu_device *dev,
+			 struct tcmur_qos_limits *limits);
+void tcmur_qos_stop(struct tcmu_device *dev);
+void tcmur_qos_cleanup(struct tcmu_device *dev);
+
+int tcmur_qos_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		    cmd_done_t done);
+
+#endif /* __TCMUR_QOS_H */
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Ranges are kept on plain lists. They are only held by COMPARE AND
+ * WRITEs, so there are rarely more than a handful at once.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu_common.h"
+#include "tcmur_range_lock.h"
+
+int tcmur_range_lock_init(struct tcmur_range_lock *rl)
+{
+	list_head_init(&rl->held);
+	list_head_init(&rl->waiters);
+	rl->nr_held = 0;
+	return pthread_mutex_init(&rl->lock, NULL);
+}
+
+int tcmur_range_lock_destroy(struct tcmur_range_lock *rl)
+{
+	return pthread_mutex_destroy(&rl->lock);
+}
+
+static inline bool range_overlaps(struct tcmur_range *a, struct tcmur_range *b)
+{
+	return a->lba < b->lba + b->nr_lbas && b->lba < a->lba + a->nr_lbas;
+}
+
+static bool range_held(struct tcmur_range_lock *rl, struct tcmur_range *range)
+{
+	struct tcmur_range *r;
+
+	list_for_each(&rl->held, r, entry) {
+		if (range_overlaps(r, range))
+			return true;
+	}
+	return false;
+}
+
+/* Holders are granted in order, so a stream of them can not starve one */
+static bool range_queued_before(struct tcmur_range_lock *rl,
+				struct tcmur_range *range)
+{
+	struct tcmur_range *r;
+
+	list_for_each(&rl->waiters, r, wait_entry) {
+		if (r == range)
+			break;
+		if (r->hold && range_overlaps(r, range))
+			return true;
+	}
+	return false;
+}
+
+static void range_grant(struct tcmur_range_lock *rl, struct tcmur_range *range)
+{
+	if (range->hold) {
+		list_add_tail(&rl->held, &range->entry);
+		__atomic_add_fetch(&rl->nr_held, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * tcmur_range_lock - lock a range of lbas
+ * @dev: device the cmd was sent to
+ * @rl: lock to take
+ * @range: range with cmd, lba and nr_lbas set
+ *
+ * Returns TCMU_STS_OK if the range is locked now. Otherwise the range
+ * is queued and range->cmd->done is called with TCMU_STS_OK once it has
+ * been locked, possibly from the thread that unlocked an overlapping one.
+ */
+int tcmur_range_lock(struct tcmu_device *dev, struct tcmur_range_lock *rl,
+		     struct tcmur_range *range)
+{
+	int ret = TCMU_STS_OK;
+
+	range->hold = true;
+
+	pthread_mutex_lock(&rl->lock);
+	if (range_held(rl, range) || range_queued_before(rl, range)) {
+		list_add_tail(&rl->waiters, &range->wait_entry);
+		ret = TCMU_STS_ASYNC_HANDLED;
+	} else {
+		range_grant(rl, range);
+	}
+	pthread_mutex_unlock(&rl->lock);
+
+	return ret;
+}
+
+void tcmur_range_unlock(struct tcmu_device *dev, struct tcmur_range_lock *rl,
+			struct tcmur_range *range)
+{
+	struct tcmur_range *r, *next;
+	LIST_HEAD(ready);
+
+	pthread_mutex_lock(&rl->lock);
+	list_del(&range->entry);
+	__atomic_sub_fetch(&rl->nr_held, 1, __ATOMIC_RELEASE);
+
+	list_for_each_safe(&rl->waiters, r, next, wait_entry) {
+		if (!range_overlaps(r, range) || range_held(rl, r) ||
+		    (r->hold && range_queued_before(rl, r)))
+			continue;
+
+		list_del(&r->wait_entry);
+		range_grant(rl, r);
+		list_add_tail(&ready, &r->wait_entry);
+	}
+	pthread_mutex_unlock(&rl->lock);
+
+	while ((r = list_pop(&ready, struct tcmur_range, wait_entry))) {
+		r->cmd->done(dev, r->cmd, TCMU_STS_OK);
+		if (!r->hold)
+			free(r);
+	}
+}
+
+/**
+ * tcmur_range_wait - wait for the holders of a range of lbas
+ * @dev: device the cmd was sent to
+ * @rl: lock to wait for
+ * @cmd: cmd to queue
+ * @lba: first lba of the range
+ * @nr_lbas: number of lbas in the range
+ *
+ * Returns TCMU_STS_OK if no one holds part of the range. Otherwise cmd
+ * is queued and cmd->done is called with TCMU_STS_OK once the holders
+ * have unlocked it. The range is not locked for cmd.
+ */
+int tcmur_range_wait(struct tcmu_device *dev, struct tcmur_range_lock *rl,
+		     struct tcmulib_cmd *cmd, uint64_t lba, uint64_t nr_lbas)
+{
+	struct tcmur_range *range;
+	int ret = TCMU_STS_OK;
+
+	if (!__atomic_load_n(&rl->nr_held, __ATOMIC_ACQUIRE) || !nr_lbas)
+		return TCMU_STS_OK;
+
+	range = malloc(sizeof(*range));
+	if (!range)
+		return TCMU_STS_NO_RESOURCE;
+	range->cmd = cmd;
+	range->lba = lba;
+	range->nr_lbas = nr_lbas;
+	range->hold = false;
+
+	pthread_mutex_lock(&rl->lock);
+	if (range_held(rl, range)) {
+		list_add_tail(&rl->waiters, &range->wait_entry);
+		ret = TCMU_STS_ASYNC_HANDLED;
+	}
+	pthread_mutex_unlock(&rl->lock);
+
+	if (ret == TCMU_STS_OK)
+		free(range);
+	return ret;
+}
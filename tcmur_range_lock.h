@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_RANGE_LOCK_H
+#define __TCMUR_RANGE_LOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ccan/list/list.h"
+
+struct tcmu_device;
+struct tcmulib_cmd;
+
+/*
+ * LBA range lock that never blocks the caller: a cmd that can not get
+ * its range is queued, and its ->done is called with TCMU_STS_OK once
+ * it has it.
+ */
+struct tcmur_range {
+	struct list_node entry;		/* on the held list */
+	struct list_node wait_entry;	/* on the waiters list */
+	struct tcmulib_cmd *cmd;
+	uint64_t lba;
+	uint64_t nr_lbas;
+	bool hold;	/* false if only waiting for the holders to go */
+};
+
+struct tcmur_range_lock {
+	pthread_mutex_t lock;
+	struct list_head held;
+	struct list_head waiters;
+	unsigned int nr_held;
+};
+
+int tcmur_range_lock_init(struct tcmur_range_lock *rl);
+int tcmur_range_lock_destroy(struct tcmur_range_lock *rl);
+
+int tcmur_range_lock(struct tcmu_device *dev, struct tcmur_range_lock *rl,
+		     struct tcmur_range *range);
+void tcmur_range_unlock(struct tcmu_device *dev, struct tcmur_range_lock *rl,
+			struct tcmur_range *range);
+int tcmur_range_wait(struct tcmu_device *dev, struct tcmur_range_lock *rl,
+		     struct tcmulib_cmd *cmd, uint64_t lba, uint64_t nr_lbas);
+
+#endif /* __TCMUR_RANGE_LOCK_H */
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Shared pool of threads for device reopens and implicit lock
+ * acquisitions.
+ *
+ * After a backend outage every device on a tpg needs a reopen, and with
+ * implicit failover every device an initiator fails over to needs its
+ * lock. Doing the reopens one after another keeps the tpg down until the
+ * slowest is done, while a thread per device sends all of them to the
+ * backend at once. Work is run by at most nr_threads threads instead,
+ * urgent work (lock acquisitions and devices with held cmds) first, and
+ * work that has to be retried is queued again after a jittered backoff
+ * instead of keeping its thread asleep.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu_log.h"
+#include "tcmur_recovery.h"
+#include "tcmur_time.h"
+
+/*
+ * Lock ordering:
+ * rdev->state_lock
+ * recovery_lock
+ */
+static pthread_mutex_t recovery_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recovery_cond;
+static struct list_head recovery_urgent = LIST_HEAD_INIT(recovery_urgent);
+static struct list_head recovery_normal = LIST_HEAD_INIT(recovery_normal);
+static unsigned int recovery_nr_queued;
+static int recovery_nr_threads;
+static int recovery_nr_idle;
+static int recovery_max_threads = TCMUR_RECOVERY_DEF_THREADS;
+static unsigned int recovery_backoff_max_ms = TCMUR_RECOVERY_DEF_BACKOFF_MAX_MS;
+
+static unsigned int recovery_rand_seed;
+
+static pthread_once_t recovery_init_once = PTHREAD_ONCE_INIT;
+static int recovery_init_ret;
+
+static void recovery_init(void)
+{
+	recovery_init_ret = tcmur_cond_init(&recovery_cond);
+	if (recovery_init_ret)
+		tcmu_err("Could not init recovery cond (err %d).\n",
+			 recovery_init_ret);
+	recovery_rand_seed = time(NULL) ^ getpid();
+}
+
+/**
+ * tcmur_recovery_set_limits - set the pool's size and retry backoff
+ * @nr_threads: max threads running work at the same time
+ * @backoff_max_ms: longest delay tcmur_recovery_backoff_ms returns
+ *
+ * Threads are only started when there is work for them, so lowering
+ * nr_threads does not stop the ones already running.
+ */
+void tcmur_recovery_set_limits(int nr_threads, int backoff_max_ms)
+{
+	pthread_mutex_lock(&recovery_lock);
+	recovery_max_threads = nr_threads > 0 ? nr_threads : 1;
+	if (backoff_max_ms < TCMUR_RECOVERY_BACKOFF_MIN_MS)
+		backoff_max_ms = TCMUR_RECOVERY_BACKOFF_MIN_MS;
+	recovery_backoff_max_ms = backoff_max_ms;
+	pthread_mutex_unlock(&recovery_lock);
+}
+
+void tcmur_recovery_work_init(struct tcmur_recovery_work *work,
+			      tcmur_recovery_fn_t fn)
+{
+	list_node_init(&work->entry);
+	work->fn = fn;
+	work->queued = false;
+}
+
+/* Must be called with recovery_lock held */
+static struct tcmur_recovery_work *
+recovery_next_work(struct list_head *list, uint64_t now, uint64_t *next_ms)
+{
+	struct tcmur_recovery_work *work;
+
+	list_for_each(list, work, entry) {
+		if (work->run_at_ms <= now)
+			return work;
+		if (work->run_at_ms < *next_ms)
+			*next_ms = work->run_at_ms;
+	}
+	return NULL;
+}
+
+static void *recovery_thread_fn(void *arg)
+{
+	struct tcmur_recovery_work *work;
+	uint64_t now, next_ms;
+
+	pthread_mutex_lock(&recovery_lock);
+	for (;;) {
+		now = tcmur_now_ms();
+		next_ms = UINT64_MAX;
+
+		work = recovery_next_work(&recovery_urgent, now, &next_ms);
+		if (!work)
+			work = recovery_next_work(&recovery_normal, now,
+						  &next_ms);
+		if (work) {
+			list_del_init(&work->entry);
+			work->queued = false;
+			recovery_nr_queued--;
+			pthread_mutex_unlock(&recovery_lock);
+
+			work->fn(work);
+
+			pthread_mutex_lock(&recovery_lock);
+			continue;
+		}
+
+		recovery_nr_idle++;
+		if (next_ms == UINT64_MAX)
+			pthread_cond_wait(&recovery_cond, &recovery_lock);
+		else
+			tcmur_cond_wait_until_ms(&recovery_cond, &recovery_lock,
+						 next_ms);
+		recovery_nr_idle--;
+	}
+
+	return NULL;
+}
+
+/* Must be called with recovery_lock held */
+static int recovery_start_thread(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, recovery_thread_fn, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret)
+		return -ret;
+
+	recovery_nr_threads++;
+	return 0;
+}
+
+/**
+ * tcmur_recovery_queue - run work on the recovery pool
+ * @work: work to run, must not be queued already
+ * @urgent: run it before the non urgent work
+ * @delay_ms: do not run it for this many ms
+ *
+ * Returns 0 or a -errno if there is no thread to run the work.
+ */
+int tcmur_recovery_queue(struct tcmur_recovery_work *work, bool urgent,
+			 unsigned int delay_ms)
+{
+	int ret = 0;
+
+	pthread_once(&recovery_init_once, recovery_init);
+	if (recovery_init_ret)
+		return -recovery_init_ret;
+
+	pthread_mutex_lock(&recovery_lock);
+	work->run_at_ms = tcmur_now_ms() + delay_ms;
+	work->urgent = urgent;
+	work->queued = true;
+	list_add_tail(urgent ? &recovery_urgent : &recovery_normal,
+		      &work->entry);
+	recovery_nr_queued++;
+
+	if (recovery_nr_queued > recovery_nr_idle &&
+	    recovery_nr_threads < recovery_max_threads) {
+		ret = recovery_start_thread();
+		/* the running threads will get to it */
+		if (ret && recovery_nr_threads) {
+			tcmu_warn("Could not start recovery thread (err %d).\n",
+				  ret);
+			ret = 0;
+		}
+	}
+
+	if (ret) {
+		list_del_init(&work->entry);
+		work->queued = false;
+		recovery_nr_queued--;
+	} else {
+		pthread_cond_broadcast(&recovery_cond);
+	}
+	pthread_mutex_unlock(&recovery_lock);
+
+	return ret;
+}
+
+/**
+ * tcmur_recovery_kick - run queued work as soon as possible
+ * @work: work that may be waiting out its delay
+ *
+ * Does nothing if the work is not queued.
+ */
+void tcmur_recovery_kick(struct tcmur_recovery_work *work)
+{
+	pthread_mutex_lock(&recovery_lock);
+	if (work->queued) {
+		work->run_at_ms = 0;
+		pthread_cond_broadcast(&recovery_cond);
+	}
+	pthread_mutex_unlock(&recovery_lock);
+}
+
+/**
+ * tcmur_recovery_cancel - remove work that has not started running
+ * @work: work to remove
+ *
+ * Returns true if the work was queued and will not be run, false if it
+ * was not queued or is already running.
+ */
+bool tcmur_recovery_cancel(struct tcmur_recovery_work *work)
+{
+	bool canceled = false;
+
+	pthread_mutex_lock(&recovery_lock);
+	if (work->queued) {
+		list_del_init(&work->entry);
+		work->queued = false;
+		recovery_nr_queued--;
+		canceled = true;
+	}
+	pthread_mutex_unlock(&recovery_lock);
+
+	return canceled;
+}
+
+/**
+ * tcmur_recovery_backoff_ms - delay before retrying failed work
+ * @attempt: number of times the work has been retried before
+ *
+ * The delay doubles with each attempt, starting at
+ * TCMUR_RECOVERY_BACKOFF_MIN_MS and capped at backoff_max_ms, and is
+ * picked at random from its upper half, so work that failed together
+ * does not all hit the backend again at the same time.
+ */
+unsigned int tcmur_recovery_backoff_ms(unsigned int attempt)
+{
+	uint64_t delay = TCMUR_RECOVERY_BACKOFF_MIN_MS;
+	unsigned int rnd;
+
+	pthread_once(&recovery_init_once, recovery_init);
+
+	if (attempt > 16)
+		attempt = 16;
+	delay <<= attempt;
+
+	pthread_mutex_lock(&recovery_lock);
+	if (delay > recovery_backoff_max_ms)
+		delay = recovery_backoff_max_ms;
+	rnd = rand_r(&recovery_rand_seed);
+	pthread_mutex_unlock(&recovery_lock);
+
+	return delay / 2 + rnd % (delay / 2 + 1);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_RECOVERY_H
+#define __TCMUR_RECOVERY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ccan/list/list.h"
+
+/* Used when tcmu.conf does not set them */
+#define TCMUR_RECOVERY_DEF_THREADS		8
+#define TCMUR_RECOVERY_DEF_BACKOFF_MAX_MS	8000
+#define TCMUR_RECOVERY_BACKOFF_MIN_MS		1000
+
+struct tcmur_recovery_work;
+typedef void (*tcmur_recovery_fn_t)(struct tcmur_recovery_work *work);
+
+/* Embedded in the object the work is for, taken with container_of */
+struct tcmur_recovery_work {
+	struct list_node entry;
+	tcmur_recovery_fn_t fn;
+	uint64_t run_at_ms;
+	bool urgent;
+	bool queued;
+};
+
+void tcmur_recovery_set_limits(int nr_threads, int backoff_max_ms);
+
+void tcmur_recovery_work_init(struct tcmur_recovery_work *work,
+			      tcmur_recovery_fn_t fn);
+int tcmur_recovery_queue(struct tcmur_recovery_work *work, bool urgent,
+			 unsigned int delay_ms);
+void tcmur_recovery_kick(struct tcmur_recovery_work *work);
+bool tcmur_recovery_cancel(struct tcmur_recovery_work *work);
+unsigned int tcmur_recovery_backoff_ms(unsigned int attempt);
+
+#endif /* __TCMUR_RECOVERY_H */
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Per device pool of the scratch memory compound cmds (COMPARE AND
+ * WRITE, WRITE AND VERIFY, emulated WRITE SAME, EXTENDED COPY and
+ * FORMAT UNIT) need for their sub-cmds, state and data buffers.
+ *
+ * Memory is handed out in power of 2 size classes and freed memory is
+ * kept per class, up to cache_mb for the device, so cmds that come in
+ * bursts reuse each other's buffers instead of going to the allocator
+ * for megabytes at a time. With limit_mb set, compound cmds that would
+ * take more than that in use are held until enough of it is freed
+ * instead of being started or failed with NO_RESOURCE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_scratch.h"
+
+#define SCRATCH_MIN_SHIFT	8	/* 256 bytes */
+#define SCRATCH_MAX_SHIFT	24	/* 16 MiB */
+#define SCRATCH_NR_CLASSES	(SCRATCH_MAX_SHIFT - SCRATCH_MIN_SHIFT + 1)
+
+/*
+ * In front of every buffer, the memory after it is handed out. It is a
+ * multiple of 16 bytes, so buffers are aligned like calloc'd ones.
+ */
+struct scratch_hdr {
+	struct tcmur_scratch *sc;	/* NULL if it was not pooled */
+	struct scratch_hdr *next;	/* on its class's free list */
+	size_t size;			/* including the header */
+	long class;			/* -1 if too large to keep */
+};
+
+struct tcmur_scratch_waiter {
+	struct list_node entry;
+	struct tcmulib_cmd *cmd;
+	size_t len;
+};
+
+struct tcmur_scratch {
+	struct tcmu_device *dev;
+
+	pthread_mutex_t lock;
+	struct scratch_hdr *free[SCRATCH_NR_CLASSES];
+	size_t cached;		/* bytes on the free lists */
+	size_t cache_max;
+	size_t used;		/* bytes handed out */
+	size_t limit;		/* 0 if cmds are never held */
+
+	/* held cmds, only used with a limit */
+	pthread_cond_t cond;	/* wakes up the dispatcher */
+	pthread_t thread;
+	struct list_head waiters;	/* oldest first */
+	struct list_head free_waiters;	/* kept so holding does not malloc */
+	unsigned int nr_waiters;
+	bool stopping;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t held;
+};
+
+/* Classes are by the bytes handed out, so 1 MiB buffers are not 2 MiB */
+static long scratch_class(size_t len)
+{
+	int shift = SCRATCH_MIN_SHIFT;
+
+	while (shift <= SCRATCH_MAX_SHIFT && ((size_t)1 << shift) < len)
+		shift++;
+	if (shift > SCRATCH_MAX_SHIFT)
+		return -1;
+	return shift - SCRATCH_MIN_SHIFT;
+}
+
+/**
+ * tcmur_scratch_alloc - get zeroed scratch memory for a compound cmd
+ * @dev: device the cmd is for
+ * @len: bytes needed
+ *
+ * Returns NULL if there is no memory. It must be freed with
+ * tcmur_scratch_free.
+ */
+void *tcmur_scratch_alloc(struct tcmu_device *dev, size_t len)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_scratch *sc = rdev->scratch;
+	struct scratch_hdr *hdr = NULL;
+	size_t size = sizeof(*hdr) + len;
+	long class;
+
+	if (!sc) {
+		hdr = calloc(1, size);
+		if (!hdr)
+			return NULL;
+		hdr->size = size;
+		hdr->class = -1;
+		return hdr + 1;
+	}
+
+	class = scratch_class(len);
+	if (class >= 0)
+		size = sizeof(*hdr) + ((size_t)1 << (class + SCRATCH_MIN_SHIFT));
+
+	pthread_mutex_lock(&sc->lock);
+	if (class >= 0 && sc->free[class]) {
+		hdr = sc->free[class];
+		sc->free[class] = hdr->next;
+		sc->cached -= size;
+		sc->used += size;
+		sc->hits++;
+	}
+	pthread_mutex_unlock(&sc->lock);
+
+	if (hdr) {
+		memset(hdr + 1, 0, len);
+		return hdr + 1;
+	}
+
+	hdr = calloc(1, size);
+	if (!hdr)
+		return NULL;
+	hdr->sc = sc;
+	hdr->size = size;
+	hdr->class = class;
+
+	pthread_mutex_lock(&sc->lock);
+	sc->used += size;
+	sc->misses++;
+	pthread_mutex_unlock(&sc->lock);
+
+	return hdr + 1;
+}
+
+void tcmur_scratch_free(void *buf)
+{
+	struct scratch_hdr *hdr;
+	struct tcmur_scratch *sc;
+
+	if (!buf)
+		return;
+
+	hdr = (struct scratch_hdr *)buf - 1;
+	sc = hdr->sc;
+	if (!sc) {
+		free(hdr);
+		return;
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	sc->used -= hdr->size;
+	if (hdr->class >= 0 && sc->cached + hdr->size <= sc->cache_max) {
+		hdr->next = sc->free[hdr->class];
+		sc->free[hdr->class] = hdr;
+		sc->cached += hdr->size;
+		hdr = NULL;
+	}
+	if (sc->nr_waiters)
+		pthread_cond_signal(&sc->cond);
+	pthread_mutex_unlock(&sc->lock);
+
+	free(hdr);
+}
+
+/* A cmd always fits when nothing is in use, so it can not wait forever */
+static bool scratch_fits(struct tcmur_scratch *sc, size_t len)
+{
+	return !sc->used || sc->used + len <= sc->limit;
+}
+
+/**
+ * tcmur_scratch_throttle - hold a compound cmd until its memory fits
+ * @dev: device the cmd is for
+ * @cmd: cmd about to allocate its scratch memory
+ * @len: bytes it will need
+ * @done: called with TCMU_STS_OK when the cmd should be started again,
+ *	  or with TCMU_STS_BUSY if the device is being removed
+ *
+ * Returns TCMU_STS_OK if the cmd can go on now, or TCMU_STS_ASYNC_HANDLED
+ * if it was put on hold. Held cmds stay tracked, they only wait for
+ * running ones to complete.
+ */
+int tcmur_scratch_throttle(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   size_t len, cmd_done_t done)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_scratch *sc = rdev->scratch;
+	struct tcmur_scratch_waiter *w;
+	int ret = TCMU_STS_OK;
+
+	if (!sc || !sc->limit)
+		return TCMU_STS_OK;
+
+	pthread_mutex_lock(&sc->lock);
+	/* the dispatcher only restarts cmds that fit */
+	if (sc->stopping || pthread_equal(pthread_self(), sc->thread))
+		goto unlock;
+
+	/* do not let new cmds pass the ones already waiting */
+	if (!sc->nr_waiters && scratch_fits(sc, len))
+		goto unlock;
+
+	w = list_pop(&sc->free_waiters, struct tcmur_scratch_waiter, entry);
+	if (!w)
+		w = malloc(sizeof(*w));
+	if (!w)
+		goto unlock;
+
+	w->cmd = cmd;
+	w->len = len;
+	cmd->done = done;
+	list_add_tail(&sc->waiters, &w->entry);
+	sc->nr_waiters++;
+	sc->held++;
+	ret = TCMU_STS_ASYNC_HANDLED;
+
+	/* memory may have been freed before we got the lock */
+	pthread_cond_signal(&sc->cond);
+unlock:
+	pthread_mutex_unlock(&sc->lock);
+	return ret;
+}
+
+static void *scratch_dispatcher(void *arg)
+{
+	struct tcmur_scratch *sc = arg;
+	struct tcmur_scratch_waiter *w;
+	int ret;
+
+	pthread_mutex_lock(&sc->lock);
+	while (!sc->stopping || sc->nr_waiters) {
+		w = list_top(&sc->waiters, struct tcmur_scratch_waiter, entry);
+		if (!w || (!sc->stopping && !scratch_fits(sc, w->len))) {
+			pthread_cond_wait(&sc->cond, &sc->lock);
+			continue;
+		}
+		list_del(&w->entry);
+		sc->nr_waiters--;
+		ret = sc->stopping ? TCMU_STS_BUSY : TCMU_STS_OK;
+		pthread_mutex_unlock(&sc->lock);
+
+		/* without the lock held, the cmd allocates its memory now */
+		w->cmd->done(sc->dev, w->cmd, ret);
+
+		pthread_mutex_lock(&sc->lock);
+		list_add(&sc->free_waiters, &w->entry);
+	}
+	pthread_mutex_unlock(&sc->lock);
+
+	return NULL;
+}
+
+/**
+ * tcmur_scratch_setup - start pooling a device's scratch memory
+ * @dev: device to pool memory for
+ * @cache_mb: MiB of freed memory kept for reuse, -1 for the default
+ * @limit_mb: MiB in use before compound cmds are held, 0 for no limit
+ *
+ * Must be called before the cmdproc thread is started.
+ */
+int tcmur_scratch_setup(struct tcmu_device *dev, int cache_mb, int limit_mb)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_scratch *sc;
+	int ret;
+
+	if (cache_mb < 0)
+		cache_mb = TCMUR_SCRATCH_DEF_CACHE_MB;
+	if (limit_mb < 0)
+		limit_mb = 0;
+
+	sc = calloc(1, sizeof(*sc));
+	if (!sc)
+		return -ENOMEM;
+
+	sc->dev = dev;
+	sc->cache_max = (size_t)cache_mb * 1024 * 1024;
+	sc->limit = (size_t)limit_mb * 1024 * 1024;
+	list_head_init(&sc->waiters);
+	list_head_init(&sc->free_waiters);
+
+	ret = pthread_mutex_init(&sc->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto free_sc;
+	}
+
+	ret = pthread_cond_init(&sc->cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	if (sc->limit) {
+		ret = pthread_create(&sc->thread, NULL, scratch_dispatcher, sc);
+		if (ret) {
+			ret = -ret;
+			goto destroy_cond;
+		}
+	}
+	rdev->scratch = sc;
+
+	tcmu_dev_dbg(dev, "scratch cache %d MiB, limit %d MiB\n", cache_mb,
+		     limit_mb);
+	return 0;
+
+destroy_cond:
+	pthread_cond_destroy(&sc->cond);
+destroy_lock:
+	pthread_mutex_destroy(&sc->lock);
+free_sc:
+	free(sc);
+	return ret;
+}
+
+/*
+ * Fail the held cmds with BUSY and stop the dispatcher. cmds that
+ * arrive afterwards are not held. Must be called once the device is
+ * marked as stopping.
+ */
+void tcmur_scratch_stop(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_scratch *sc = rdev->scratch;
+
+	if (!sc || !sc->limit)
+		return;
+
+	pthread_mutex_lock(&sc->lock);
+	sc->stopping = true;
+	pthread_cond_signal(&sc->cond);
+	pthread_mutex_unlock(&sc->lock);
+
+	pthread_join(sc->thread, NULL);
+}
+
+/* Must be called once all cmds have completed */
+void tcmur_scratch_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_scratch *sc = rdev->scratch;
+	struct tcmur_scratch_waiter *w;
+	struct scratch_hdr *hdr;
+	int i;
+
+	if (!sc)
+		return;
+
+	if (sc->used)
+		tcmu_dev_warn(dev, "%zu bytes of scratch memory still in use\n",
+			      sc->used);
+	tcmu_dev_dbg(dev, "scratch memory reused %"PRIu64" times, allocated %"PRIu64" times\n",
+		     sc->hits, sc->misses);
+	if (sc->held)
+		tcmu_dev_info(dev, "%"PRIu64" cmds were held for scratch memory\n",
+			      sc->held);
+
+	for (i = 0; i < SCRATCH_NR_CLASSES; i++) {
+		while ((hdr = sc->free[i])) {
+			sc->free[i] = hdr->next;
+			free(hdr);
+		}
+	}
+
+	while ((w = list_pop(&sc->free_waiters, struct tcmur_scratch_waiter,
+			     entry)))
+		free(w);
+
+	rdev->scratch = NULL;
+	pthread_cond_destroy(&sc->cond);
+	pthread_mutex_destroy(&sc->lock);
+	free(sc);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_SCRATCH_H
+#define __TCMUR_SCRATCH_H
+
+#include <stddef.h>
+
+#include "libtcmu_common.h"
+
+struct tcmu_device;
+struct tcmulib_cmd;
+
+/* Used when neither tcmu.conf nor the device set it */
+#define TCMUR_SCRATCH_DEF_CACHE_MB	8
+
+struct tcmur_scratch;
+
+int tcmur_scratch_setup(struct tcmu_device *dev, int cache_mb, int limit_mb);
+void tcmur_scratch_stop(struct tcmu_device *dev);
+void tcmur_scratch_cleanup(struct tcmu_device *dev);
+
+void *tcmur_scratch_alloc(struct tcmu_device *dev, size_t len);
+void tcmur_scratch_free(void *buf);
+int tcmur_scratch_throttle(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   size_t len, cmd_done_t done);
+
+#endif /* __TCMUR_SCRATCH_H */
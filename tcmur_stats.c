@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <time.h>
+#include <scsi/scsi.h>
+
+#include "libtcmu.h"
+#include "libtcmu_common.h"
+#include "scsi_defs.h"
+#include "tcmur_device.h"
+#include "tcmur_stats.h"
+
+const char *tcmur_stats_op_names[TCMUR_STATS_OP_MAX] = {
+	[TCMUR_STATS_OP_READ]		= "read",
+	[TCMUR_STATS_OP_WRITE]		= "write",
+	[TCMUR_STATS_OP_UNMAP]		= "unmap",
+	[TCMUR_STATS_OP_WRITE_SAME]	= "write_same",
+	[TCMUR_STATS_OP_CAW]		= "compare_and_write",
+	[TCMUR_STATS_OP_XCOPY]		= "xcopy",
+	[TCMUR_STATS_OP_SYNC_CACHE]	= "sync_cache",
+	[TCMUR_STATS_OP_OTHER]		= "other",
+};
+
+static uint64_t tcmur_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int tcmur_stats_op(uint8_t *cdb)
+{
+	switch (cdb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		return TCMUR_STATS_OP_READ;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+		return TCMUR_STATS_OP_WRITE;
+	case UNMAP:
+		return TCMUR_STATS_OP_UNMAP;
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		return TCMUR_STATS_OP_WRITE_SAME;
+	case COMPARE_AND_WRITE:
+		return TCMUR_STATS_OP_CAW;
+	case EXTENDED_COPY:
+		return TCMUR_STATS_OP_XCOPY;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		return TCMUR_STATS_OP_SYNC_CACHE;
+	default:
+		return TCMUR_STATS_OP_OTHER;
+	}
+}
+
+static int tcmur_stats_bucket(uint64_t ns)
+{
+	uint64_t usecs = ns / 1000;
+	int bucket;
+
+	if (!usecs)
+		return 0;
+
+	bucket = 64 - __builtin_clzll(usecs);
+	if (bucket >= TCMUR_STATS_NR_BUCKETS)
+		bucket = TCMUR_STATS_NR_BUCKETS - 1;
+	return bucket;
+}
+
+#define tcmur_stats_inc(var, val) \
+	__atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED)
+
+/*
+ * The data the cmd reads or writes, from its cdb as handlers may have
+ * consumed the iovec by the time it completes. UNMAP and EXTENDED COPY
+ * only carry parameter lists, so they count no bytes.
+ */
+static uint64_t tcmur_stats_bytes(struct tcmu_device *dev, uint8_t *cdb,
+				  int op)
+{
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+
+	switch (op) {
+	case TCMUR_STATS_OP_READ:
+	case TCMUR_STATS_OP_WRITE:
+	case TCMUR_STATS_OP_WRITE_SAME:
+		return (uint64_t)tcmu_get_xfer_length(cdb) * block_size;
+	case TCMUR_STATS_OP_CAW:
+		return (uint64_t)cdb[13] * block_size;
+	default:
+		return 0;
+	}
+}
+
+/* Called by the cmdproc thread when it takes the cmd off the ring */
+void tcmur_stats_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_cmd *rcmd = tcmur_cmd_priv(cmd);
+
+	rcmd->start_ns = tcmur_stats_now();
+	rcmd->work_ns = 0;
+	rcmd->bytes = tcmur_stats_bytes(dev, cmd->cdb,
+					tcmur_stats_op(cmd->cdb));
+}
+
+/* Called by the io worker when it hands the cmd to the handler */
+void tcmur_stats_cmd_work(struct tcmulib_cmd *cmd)
+{
+	tcmur_cmd_priv(cmd)->work_ns = tcmur_stats_now();
+}
+
+/*
+ * Cmds the handler runs without going through an io worker, or only
+ * queues sub cmds for, have no work time and count as no queue time.
+ */
+void tcmur_stats_cmd_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  int rc)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_cmd *rcmd = tcmur_cmd_priv(cmd);
+	struct tcmur_op_stats *op;
+	uint64_t now, work_ns;
+
+	if (!rcmd->start_ns)
+		return;
+
+	op = &rdev->stats.ops[tcmur_stats_op(cmd->cdb)];
+	now = tcmur_stats_now();
+	work_ns = rcmd->work_ns ? rcmd->work_ns : rcmd->start_ns;
+
+	tcmur_stats_inc(op->cmds, 1);
+	tcmur_stats_inc(op->bytes, rcmd->bytes);
+	if (rc != TCMU_STS_OK)
+		tcmur_stats_inc(op->errors, 1);
+	tcmur_stats_inc(op->queue_lat[tcmur_stats_bucket(work_ns - rcmd->start_ns)], 1);
+	tcmur_stats_inc(op->handler_lat[tcmur_stats_bucket(now - work_ns)], 1);
+}
+
+/* Called by the cmdproc thread when a busy poll ends */
+void tcmur_stats_busy_poll(struct tcmur_dev_stats *stats, bool hit)
+{
+	if (hit)
+		tcmur_stats_inc(stats->busy_poll_hits, 1);
+	else
+		tcmur_stats_inc(stats->busy_poll_misses, 1);
+}
+
+void tcmur_stats_read(struct tcmur_dev_stats *stats,
+		      struct tcmur_dev_stats *snap)
+{
+	uint64_t *src = (uint64_t *)stats;
+	uint64_t *dst = (uint64_t *)snap;
+	int i;
+
+	for (i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_STATS_H
+#define __TCMUR_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct tcmu_device;
+struct tcmulib_cmd;
+
+/*
+ * Latency bucket 0 counts cmds that took less than 1 usec, bucket N
+ * those that took [2^(N-1), 2^N) usecs. The last one counts the rest.
+ */
+#define TCMUR_STATS_NR_BUCKETS	32
+
+enum {
+	TCMUR_STATS_OP_READ,
+	TCMUR_STATS_OP_WRITE,
+	TCMUR_STATS_OP_UNMAP,
+	TCMUR_STATS_OP_WRITE_SAME,
+	TCMUR_STATS_OP_CAW,
+	TCMUR_STATS_OP_XCOPY,
+	TCMUR_STATS_OP_SYNC_CACHE,
+	TCMUR_STATS_OP_OTHER,
+	TCMUR_STATS_OP_MAX,
+};
+
+/*
+ * Updated with relaxed atomics from the cmdproc thread and the io
+ * workers, read with relaxed atomics by the D-Bus stats method.
+ */
+struct tcmur_op_stats {
+	uint64_t cmds;
+	uint64_t bytes;
+	uint64_t errors;
+	/* ring to handler start, and handler start to completion */
+	uint64_t queue_lat[TCMUR_STATS_NR_BUCKETS];
+	uint64_t handler_lat[TCMUR_STATS_NR_BUCKETS];
+};
+
+struct tcmur_dev_stats {
+	struct tcmur_op_stats ops[TCMUR_STATS_OP_MAX];
+	/* cmdproc busy polling, see tcmur_stats_busy_poll */
+	uint64_t busy_poll_hits;	/* new cmds found while spinning */
+	uint64_t busy_poll_misses;	/* budget ran out, fell back to ppoll */
+};
+
+extern const char *tcmur_stats_op_names[TCMUR_STATS_OP_MAX];
+
+void tcmur_stats_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+void tcmur_stats_cmd_work(struct tcmulib_cmd *cmd);
+void tcmur_stats_cmd_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  int rc);
+void tcmur_stats_busy_poll(struct tcmur_dev_stats *stats, bool hit);
+void tcmur_stats_read(struct tcmur_dev_stats *stats,
+		      struct tcmur_dev_stats *snap);
+
+#endif
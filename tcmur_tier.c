@@ -0,0 +1,1224 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Optional per device cache of READ data in a file on local flash.
+ *
+ * It sits below the memory read cache: READs that miss there are served
+ * from the file if every slot they touch is in it, and the whole slots
+ * READs from the handler return are written to it. In write through
+ * mode the whole slots WRITEs cover are written to it too once the
+ * handler has completed them, otherwise WRITEs only drop what they
+ * overlap. The file is read and written by a few threads of its own, so
+ * the cmdproc thread never waits on it.
+ *
+ * Slots being filled are reserved before the data is read from the
+ * handler. A write type cmd that starts meanwhile marks them stale, so
+ * data that may be older than it is never inserted. Like the memory
+ * cache, READs do not fill while write type cmds are running, nor when
+ * one started or ended before the READ completed, as their data could
+ * predate a write to the same range. The memory read cache's hooks
+ * (tcmur_cache_write_start/done, tcmur_cache_invalidate and
+ * tcmur_cache_invalidate_all) call into here, so the tier is dropped
+ * everywhere the memory cache is, including on reopens and lock changes.
+ *
+ * The slot index is written to the file when the device is removed, and
+ * loaded when it is added again if the file was closed cleanly and was
+ * created for the same cfgstring and size. Otherwise the tier starts
+ * empty. Devices another node writes to while this daemon is not running
+ * must use a handler with locking, which drops the tier when the lock is
+ * taken, or must not use the tier.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <scsi/scsi.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_tier.h"
+
+/* Threads reading and writing the cache file */
+#define TCMUR_TIER_NR_THREADS		4
+/* Larger cmds bypass the tier */
+#define TCMUR_TIER_MAX_IO_SLOTS		256
+/* Fills waiting for their data or for the cache file */
+#define TCMUR_TIER_MAX_FILLS		64
+/* Freed jobs of up to TCMUR_TIER_JOB_SLOTS slots kept for reuse */
+#define TCMUR_TIER_JOB_SLOTS		16
+#define TCMUR_TIER_NR_FREE_JOBS		32
+
+#define TCMUR_TIER_MAGIC		"TCMUTIER"
+#define TCMUR_TIER_VERSION		1
+#define TCMUR_TIER_SB_SIZE		4096
+/* The index is read and written in chunks of this size */
+#define TCMUR_TIER_INDEX_CHUNK		(1 << 20)
+#define TCMUR_TIER_DATA_ALIGN		(1 << 20)
+
+#define TIER_NIL			UINT32_MAX
+
+enum {
+	TIER_FREE,	/* on the free list */
+	TIER_FILLING,	/* reserved by the fill with its token */
+	TIER_VALID,
+	/* out of the hash, freed once its fill or last read is done */
+	TIER_STALE,
+};
+
+struct tcmur_tier_slot {
+	uint64_t idx;
+	uint32_t next;		/* hash chain, or free list */
+	uint32_t token;		/* fill that reserved it */
+	uint16_t pins;		/* read hits copying it out */
+	uint8_t state;
+	uint8_t ref;		/* CLOCK referenced bit */
+};
+
+/* At offset 0 of the cache file, the index starts at TCMUR_TIER_SB_SIZE */
+struct tcmur_tier_sb {
+	char magic[8];
+	uint32_t version;
+	uint32_t clean;
+	uint32_t slot_size;
+	uint32_t block_size;
+	uint64_t nr_slots;
+	uint64_t num_lbas;
+	uint64_t ident;		/* hash of the cfgstring */
+	uint64_t index_sum;	/* hash of the index */
+};
+
+struct tcmur_tier_job {
+	struct list_node entry;
+	/* read hit to complete, NULL for fills */
+	struct tcmulib_cmd *cmd;
+	/* hits copy len bytes at off out of the slots, fills into them */
+	uint64_t off;
+	size_t len;
+
+	uint64_t first_idx;
+	unsigned int nr_slots;
+	unsigned int max_slots;
+	uint32_t token;
+	/* the tier's gen a READ fill was reserved at, 0 for WRITE fills */
+	uint64_t gen;
+	/* slot holding first_idx + i, TIER_NIL if a fill did not get one */
+	uint32_t *slots;
+	char *buf;
+	/*
+	 * Copy of the fill cmd's iovec, as handlers that seek in it while
+	 * copying leave nothing to read the data back from.
+	 */
+	struct iovec *iov;
+	size_t iov_cnt;
+};
+
+/* iovec entries a job of n slots can hold */
+#define TIER_JOB_IOV_CNT(n)		((n) + 2)
+
+struct tcmur_tier {
+	struct tcmu_device *dev;
+	int fd;
+	bool direct;
+	bool write_through;
+	uint64_t index_off;
+	uint64_t data_off;
+	uint64_t ident;
+
+	pthread_mutex_t lock;
+
+	struct tcmur_tier_slot *slots;
+	uint32_t nr_slots;
+	uint32_t *hash;
+	uint32_t hash_mask;
+	uint32_t free_head;
+	uint32_t clock_hand;
+	uint32_t next_token;
+	unsigned int nr_writes;	/* write type cmds running */
+	uint64_t gen;		/* bumped when one starts or ends */
+
+	struct list_head jobs;
+	pthread_cond_t jobs_cond;
+	unsigned int nr_jobs;	/* queued or running */
+	pthread_cond_t idle_cond;
+	unsigned int nr_fills;
+	struct list_head free_jobs;
+	unsigned int nr_free_jobs;
+	bool stopping;
+	bool exiting;
+
+	pthread_t threads[TCMUR_TIER_NR_THREADS];
+	int nr_threads;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t slots_filled;
+	uint64_t fills_dropped;
+	uint64_t io_errors;
+};
+
+/* Walks an iovec array without consuming it like tcmu_memcpy_*_iovec */
+struct tcmur_tier_iter {
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t i;
+	size_t off;
+};
+
+static void tier_iter_copy(struct tcmur_tier_iter *iter, char *buf,
+			   size_t len, bool to_iov)
+{
+	size_t n;
+	char *p;
+
+	while (len && iter->i < iter->iov_cnt) {
+		n = min(len, iter->iov[iter->i].iov_len - iter->off);
+		p = (char *)iter->iov[iter->i].iov_base + iter->off;
+
+		if (buf) {
+			if (to_iov)
+				memcpy(p, buf, n);
+			else
+				memcpy(buf, p, n);
+			buf += n;
+		}
+		len -= n;
+
+		iter->off += n;
+		if (iter->off == iter->iov[iter->i].iov_len) {
+			iter->i++;
+			iter->off = 0;
+		}
+	}
+}
+
+/* FNV-1a */
+static uint64_t tier_hash_buf(const void *buf, size_t len, uint64_t h)
+{
+	const unsigned char *p = buf;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+#define TIER_HASH_INIT	0xcbf29ce484222325ULL
+
+static inline uint32_t *tier_bucket(struct tcmur_tier *tier, uint64_t idx)
+{
+	return &tier->hash[(uint32_t)((idx * 0x9E3779B97F4A7C15ULL) >> 32) &
+			   tier->hash_mask];
+}
+
+static uint32_t tier_lookup(struct tcmur_tier *tier, uint64_t idx)
+{
+	uint32_t s;
+
+	for (s = *tier_bucket(tier, idx); s != TIER_NIL;
+	     s = tier->slots[s].next) {
+		if (tier->slots[s].idx == idx)
+			return s;
+	}
+	return TIER_NIL;
+}
+
+static void tier_hash_add(struct tcmur_tier *tier, uint32_t s)
+{
+	uint32_t *bucket = tier_bucket(tier, tier->slots[s].idx);
+
+	tier->slots[s].next = *bucket;
+	*bucket = s;
+}
+
+static void tier_hash_del(struct tcmur_tier *tier, uint32_t s)
+{
+	uint32_t *p = tier_bucket(tier, tier->slots[s].idx);
+
+	while (*p != s)
+		p = &tier->slots[*p].next;
+	*p = tier->slots[s].next;
+}
+
+static void tier_slot_free(struct tcmur_tier *tier, uint32_t s)
+{
+	struct tcmur_tier_slot *slot = &tier->slots[s];
+
+	slot->state = TIER_FREE;
+	slot->pins = 0;
+	slot->next = tier->free_head;
+	tier->free_head = s;
+}
+
+/* Remove a slot in the hash, freeing it unless it is still being used */
+static void tier_slot_drop(struct tcmur_tier *tier, uint32_t s)
+{
+	struct tcmur_tier_slot *slot = &tier->slots[s];
+
+	tier_hash_del(tier, s);
+	if (slot->state == TIER_VALID && !slot->pins)
+		tier_slot_free(tier, s);
+	else
+		slot->state = TIER_STALE;
+}
+
+/* Get an unused slot, evicting a valid one with CLOCK if needed */
+static uint32_t tier_get_slot(struct tcmur_tier *tier)
+{
+	struct tcmur_tier_slot *slot;
+	uint64_t n;
+	uint32_t s;
+
+	s = tier->free_head;
+	if (s != TIER_NIL) {
+		tier->free_head = tier->slots[s].next;
+		return s;
+	}
+
+	for (n = 0; n < 2 * (uint64_t)tier->nr_slots; n++) {
+		s = tier->clock_hand;
+		if (++tier->clock_hand == tier->nr_slots)
+			tier->clock_hand = 0;
+
+		slot = &tier->slots[s];
+		if (slot->state != TIER_VALID || slot->pins)
+			continue;
+		if (slot->ref) {
+			slot->ref = 0;
+			continue;
+		}
+		tier_hash_del(tier, s);
+		return s;
+	}
+	return TIER_NIL;
+}
+
+static struct tcmur_tier_job *tier_job_get(struct tcmur_tier *tier,
+					   unsigned int nr_slots)
+{
+	struct tcmur_tier_job *job;
+	unsigned int max_slots = max(nr_slots, (unsigned int)TCMUR_TIER_JOB_SLOTS);
+
+	if (nr_slots <= TCMUR_TIER_JOB_SLOTS) {
+		job = list_pop(&tier->free_jobs, struct tcmur_tier_job, entry);
+		if (job) {
+			tier->nr_free_jobs--;
+			goto init;
+		}
+	}
+
+	job = calloc(1, sizeof(*job) +
+			TIER_JOB_IOV_CNT(max_slots) * sizeof(*job->iov) +
+			max_slots * sizeof(*job->slots));
+	if (!job)
+		return NULL;
+	/* O_DIRECT needs aligned buffers */
+	if (posix_memalign((void **)&job->buf, TCMUR_TIER_SLOT_SIZE,
+			   (size_t)max_slots << TCMUR_TIER_SLOT_SHIFT)) {
+		free(job);
+		return NULL;
+	}
+	job->iov = (struct iovec *)(job + 1);
+	job->slots = (uint32_t *)(job->iov + TIER_JOB_IOV_CNT(max_slots));
+	job->max_slots = max_slots;
+init:
+	job->cmd = NULL;
+	job->nr_slots = nr_slots;
+	job->gen = 0;
+	return job;
+}
+
+static void tier_job_put(struct tcmur_tier *tier, struct tcmur_tier_job *job)
+{
+	if (job->max_slots == TCMUR_TIER_JOB_SLOTS &&
+	    tier->nr_free_jobs < TCMUR_TIER_NR_FREE_JOBS) {
+		list_add(&tier->free_jobs, &job->entry);
+		tier->nr_free_jobs++;
+		return;
+	}
+	free(job->buf);
+	free(job);
+}
+
+/*
+ * Reserve the slots for the whole slots in off and len that are not in
+ * the tier yet, for cmd to fill once it completes. Returns the fill job,
+ * or NULL if no slot was reserved. Must be called with the lock held.
+ */
+static struct tcmur_tier_job *tier_reserve(struct tcmur_tier *tier,
+					   struct tcmulib_cmd *cmd,
+					   uint64_t off, uint64_t len)
+{
+	uint64_t first = (off + TCMUR_TIER_SLOT_SIZE - 1) >>
+						TCMUR_TIER_SLOT_SHIFT;
+	uint64_t end = (off + len) >> TCMUR_TIER_SLOT_SHIFT;
+	struct tcmur_tier_job *job;
+	struct tcmur_tier_slot *slot;
+	unsigned int i, nr_reserved = 0;
+	uint32_t s;
+
+	if (tier->stopping || first >= end ||
+	    end - first > TCMUR_TIER_MAX_IO_SLOTS)
+		return NULL;
+
+	if (tier->nr_fills >= TCMUR_TIER_MAX_FILLS) {
+		tier->fills_dropped++;
+		return NULL;
+	}
+
+	job = tier_job_get(tier, end - first);
+	if (!job)
+		return NULL;
+	if (cmd->iov_cnt > TIER_JOB_IOV_CNT(job->max_slots)) {
+		tier->fills_dropped++;
+		tier_job_put(tier, job);
+		return NULL;
+	}
+	memcpy(job->iov, cmd->iovec, cmd->iov_cnt * sizeof(*job->iov));
+	job->iov_cnt = cmd->iov_cnt;
+	job->off = off;
+	job->len = len;
+	job->first_idx = first;
+	if (!++tier->next_token)
+		tier->next_token = 1;
+	job->token = tier->next_token;
+
+	for (i = 0; i < job->nr_slots; i++) {
+		job->slots[i] = TIER_NIL;
+		if (tier_lookup(tier, first + i) != TIER_NIL)
+			continue;
+
+		s = tier_get_slot(tier);
+		if (s == TIER_NIL)
+			continue;
+
+		slot = &tier->slots[s];
+		slot->idx = first + i;
+		slot->token = job->token;
+		slot->state = TIER_FILLING;
+		slot->ref = 0;
+		slot->pins = 0;
+		tier_hash_add(tier, s);
+		job->slots[i] = s;
+		nr_reserved++;
+	}
+
+	if (!nr_reserved) {
+		tier_job_put(tier, job);
+		return NULL;
+	}
+	tier->nr_fills++;
+	return job;
+}
+
+/* Mark a fill's slots valid if ok, and free them otherwise */
+static void tier_fill_done(struct tcmur_tier *tier, struct tcmur_tier_job *job,
+			   bool ok)
+{
+	struct tcmur_tier_slot *slot;
+	unsigned int i;
+	uint32_t s;
+
+	for (i = 0; i < job->nr_slots; i++) {
+		s = job->slots[i];
+		if (s == TIER_NIL)
+			continue;
+
+		slot = &tier->slots[s];
+		if (slot->token != job->token)
+			continue;
+
+		if (slot->state == TIER_FILLING && ok) {
+			slot->state = TIER_VALID;
+			tier->slots_filled++;
+		} else if (slot->state == TIER_FILLING) {
+			tier_hash_del(tier, s);
+			tier_slot_free(tier, s);
+		} else if (slot->state == TIER_STALE) {
+			tier_slot_free(tier, s);
+		}
+	}
+	tier->nr_fills--;
+}
+
+/* Unpin a hit's slots, dropping them if they could not be read */
+static void tier_hit_done(struct tcmur_tier *tier, struct tcmur_tier_job *job,
+			  bool ok)
+{
+	struct tcmur_tier_slot *slot;
+	unsigned int i;
+	uint32_t s;
+
+	for (i = 0; i < job->nr_slots; i++) {
+		s = job->slots[i];
+		slot = &tier->slots[s];
+
+		if (!ok && slot->state == TIER_VALID)
+			tier_slot_drop(tier, s);
+		if (!--slot->pins && slot->state == TIER_STALE)
+			tier_slot_free(tier, s);
+	}
+}
+
+/* Read or write the job's slots, a run of slots next to each other at a time */
+static bool tier_job_io(struct tcmur_tier *tier, struct tcmur_tier_job *job,
+			bool write)
+{
+	unsigned int i, n;
+	size_t len;
+	ssize_t ret;
+	off_t off;
+
+	for (i = 0; i < job->nr_slots; i += n) {
+		n = 1;
+		if (job->slots[i] == TIER_NIL)
+			continue;
+		while (i + n < job->nr_slots &&
+		       job->slots[i + n] == job->slots[i] + n)
+			n++;
+
+		len = (size_t)n << TCMUR_TIER_SLOT_SHIFT;
+		off = tier->data_off +
+			((off_t)job->slots[i] << TCMUR_TIER_SLOT_SHIFT);
+		if (write)
+			ret = pwrite(tier->fd,
+				     job->buf + ((size_t)i << TCMUR_TIER_SLOT_SHIFT),
+				     len, off);
+		else
+			ret = pread(tier->fd,
+				    job->buf + ((size_t)i << TCMUR_TIER_SLOT_SHIFT),
+				    len, off);
+		if (ret != len) {
+			tcmu_dev_err(tier->dev, "Could not %s tier slots at %"PRIu64" (%zd/%d).\n",
+				     write ? "write" : "read",
+				     (uint64_t)off, ret, ret < 0 ? -errno : 0);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void tier_run_job(struct tcmur_tier *tier, struct tcmur_tier_job *job)
+{
+	struct tcmulib_cmd *cmd = job->cmd;
+	struct tcmur_tier_iter iter;
+	bool ok;
+
+	ok = tier_job_io(tier, job, !cmd);
+	if (cmd && ok) {
+		iter = (struct tcmur_tier_iter){ cmd->iovec, cmd->iov_cnt, 0, 0 };
+		tier_iter_copy(&iter, job->buf + (job->off -
+				(job->first_idx << TCMUR_TIER_SLOT_SHIFT)),
+			       job->len, true);
+	}
+
+	pthread_mutex_lock(&tier->lock);
+	if (!ok)
+		tier->io_errors++;
+	if (cmd)
+		tier_hit_done(tier, job, ok);
+	else
+		tier_fill_done(tier, job, ok);
+	tier_job_put(tier, job);
+	pthread_mutex_unlock(&tier->lock);
+
+	/* the caller reads from the handler instead */
+	if (cmd)
+		cmd->done(tier->dev, cmd, ok ? TCMU_STS_OK :
+						TCMU_STS_NOT_HANDLED);
+}
+
+static void *tier_thread_fn(void *arg)
+{
+	struct tcmur_tier *tier = arg;
+	struct tcmur_tier_job *job;
+
+	pthread_mutex_lock(&tier->lock);
+	for (;;) {
+		job = list_pop(&tier->jobs, struct tcmur_tier_job, entry);
+		if (!job) {
+			if (tier->exiting)
+				break;
+			pthread_cond_wait(&tier->jobs_cond, &tier->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&tier->lock);
+
+		tier_run_job(tier, job);
+
+		pthread_mutex_lock(&tier->lock);
+		if (!--tier->nr_jobs && tier->stopping)
+			pthread_cond_broadcast(&tier->idle_cond);
+	}
+	pthread_mutex_unlock(&tier->lock);
+
+	return NULL;
+}
+
+/* Must be called with the lock held */
+static void tier_queue_job(struct tcmur_tier *tier, struct tcmur_tier_job *job)
+{
+	list_add_tail(&tier->jobs, &job->entry);
+	tier->nr_jobs++;
+	pthread_cond_signal(&tier->jobs_cond);
+}
+
+/**
+ * tcmur_tier_read - try to complete a READ from the tier
+ * @dev: device the cmd was sent to
+ * @cmd: READ cmd that passed the lba and length checks
+ *
+ * Returns TCMU_STS_ASYNC_HANDLED if the data is read from the tier, and
+ * cmd->done is called with TCMU_STS_OK, or with TCMU_STS_NOT_HANDLED if
+ * the cmd has to be read from the handler after all. Otherwise returns
+ * TCMU_STS_NOT_HANDLED and the slots the cmd covers may be reserved, to
+ * be filled by tcmur_tier_cmd_done.
+ */
+int tcmur_tier_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_tier *tier = rdev->tier;
+	uint64_t off = tcmu_get_lba(cmd->cdb) * tcmu_get_dev_block_size(dev);
+	size_t len = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	struct tcmur_tier_job *job;
+	uint64_t first, last;
+	unsigned int i;
+	uint32_t s;
+
+	if (!tier || !len)
+		return TCMU_STS_NOT_HANDLED;
+
+	first = off >> TCMUR_TIER_SLOT_SHIFT;
+	last = (off + len - 1) >> TCMUR_TIER_SLOT_SHIFT;
+	if (last - first >= TCMUR_TIER_MAX_IO_SLOTS)
+		return TCMU_STS_NOT_HANDLED;
+
+	pthread_mutex_lock(&tier->lock);
+	if (tier->stopping)
+		goto unlock;
+
+	for (i = 0; first + i <= last; i++) {
+		s = tier_lookup(tier, first + i);
+		if (s == TIER_NIL || tier->slots[s].state != TIER_VALID)
+			goto miss;
+	}
+
+	job = tier_job_get(tier, last - first + 1);
+	if (!job)
+		goto miss;
+	job->cmd = cmd;
+	job->off = off;
+	job->len = len;
+	job->first_idx = first;
+	for (i = 0; i < job->nr_slots; i++) {
+		s = tier_lookup(tier, first + i);
+		tier->slots[s].pins++;
+		tier->slots[s].ref = 1;
+		job->slots[i] = s;
+	}
+	tier->hits++;
+	tier_queue_job(tier, job);
+	pthread_mutex_unlock(&tier->lock);
+	return TCMU_STS_ASYNC_HANDLED;
+
+miss:
+	tier->misses++;
+	if (tier->nr_writes)
+		goto unlock;
+	job = tier_reserve(tier, cmd, off, len);
+	if (job)
+		job->gen = tier->gen;
+	tcmur_cmd_priv(cmd)->tier_fill = job;
+unlock:
+	pthread_mutex_unlock(&tier->lock);
+	return TCMU_STS_NOT_HANDLED;
+}
+
+/*
+ * Called for every cmd before it is executed, after the ranges it writes
+ * have been dropped. In write through mode, WRITEs reserve the slots
+ * they cover.
+ */
+void tcmur_tier_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_tier *tier = rdev->tier;
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	uint8_t *cdb = cmd->cdb;
+
+	if (!tier)
+		return;
+	tcmur_cmd_priv(cmd)->tier_fill = NULL;
+
+	if (!tier->write_through)
+		return;
+
+	switch (cdb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		break;
+	default:
+		return;
+	}
+
+	pthread_mutex_lock(&tier->lock);
+	tcmur_cmd_priv(cmd)->tier_fill = tier_reserve(tier, cmd,
+					tcmu_get_lba(cdb) * block_size,
+					(uint64_t)tcmu_get_xfer_length(cdb) *
+								block_size);
+	pthread_mutex_unlock(&tier->lock);
+}
+
+/*
+ * Called for every cmd when it completes. If the cmd reserved slots and
+ * succeeded, its data is copied out and written to them.
+ */
+void tcmur_tier_cmd_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			 int rc)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_tier *tier = rdev->tier;
+	struct tcmur_cmd *rcmd = tcmur_cmd_priv(cmd);
+	struct tcmur_tier_job *job = rcmd->tier_fill;
+	struct tcmur_tier_iter iter;
+	bool ok;
+
+	if (!tier || !job)
+		return;
+	rcmd->tier_fill = NULL;
+
+	ok = rc == TCMU_STS_OK &&
+		tcmu_iovec_length(job->iov, job->iov_cnt) >= job->len;
+	if (ok) {
+		iter = (struct tcmur_tier_iter){ job->iov, job->iov_cnt, 0, 0 };
+		tier_iter_copy(&iter, NULL, (job->first_idx <<
+					     TCMUR_TIER_SLOT_SHIFT) - job->off,
+			       false);
+		tier_iter_copy(&iter, job->buf,
+			       (size_t)job->nr_slots << TCMUR_TIER_SLOT_SHIFT,
+			       false);
+	}
+
+	pthread_mutex_lock(&tier->lock);
+	if (ok && job->gen && job->gen != tier->gen) {
+		/* a write ran meanwhile, the READ's data may predate it */
+		tier->fills_dropped++;
+		ok = false;
+	}
+	if (ok && !tier->stopping) {
+		tier_queue_job(tier, job);
+	} else {
+		tier_fill_done(tier, job, false);
+		tier_job_put(tier, job);
+	}
+	pthread_mutex_unlock(&tier->lock);
+}
+
+static void tier_invalidate(struct tcmu_device *dev, struct tcmur_tier *tier,
+			    uint64_t lba, uint64_t nr_lbas)
+{
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	uint64_t num_lbas = tcmu_get_dev_num_lbas(dev);
+	struct tcmur_tier_slot *slot;
+	uint64_t idx, last;
+	uint32_t s;
+
+	if (lba >= num_lbas || !nr_lbas)
+		return;
+	nr_lbas = min(nr_lbas, num_lbas - lba);
+
+	idx = (lba * block_size) >> TCMUR_TIER_SLOT_SHIFT;
+	last = ((lba + nr_lbas) * block_size - 1) >> TCMUR_TIER_SLOT_SHIFT;
+
+	if (last - idx >= tier->nr_slots) {
+		for (s = 0; s < tier->nr_slots; s++) {
+			slot = &tier->slots[s];
+			if ((slot->state == TIER_VALID ||
+			     slot->state == TIER_FILLING) &&
+			    slot->idx >= idx && slot->idx <= last)
+				tier_slot_drop(tier, s);
+		}
+		return;
+	}
+
+	for (; idx <= last; idx++) {
+		s = tier_lookup(tier, idx);
+		if (s != TIER_NIL)
+			tier_slot_drop(tier, s);
+	}
+}
+
+/**
+ * tcmur_tier_write_start - drop the slots a write type cmd is writing
+ * @dev: device the cmd was sent to
+ * @lba: first lba written
+ * @nr_lbas: number of lbas written, 0 if the caller drops the ranges
+ *	     itself with tcmur_tier_invalidate
+ *
+ * Must be paired with a tcmur_tier_write_done call when the write has
+ * completed, successfully or not.
+ */
+void tcmur_tier_write_start(struct tcmu_device *dev, uint64_t lba,
+			    uint64_t nr_lbas)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_tier *tier = rdev->tier;
+
+	if (!tier)
+		return;
+
+	pthread_mutex_lock(&tier->lock);
+	tier->gen++;
+	tier->nr_writes++;
+	tier_invalidate(dev, tier, lba, nr_lbas);
+	pthread_mutex_unlock(&tier->lock);
+}
+
+void tcmur_tier_write_done(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_tier *tier = rdev->tier;
+
+	if (!tier)
+		return;
+
+	pthread_mutex_lock(&tier->lock);
+	tier->gen++;
+	tier->nr_writes--;
+	pthread_mutex_unlock(&tier->lock);
+}
+
+/* Drop the slots in a range, and any fill of them that is running */
+void tcmur_tier_invalidate(struct tcmu_device *dev, uint64_t lba,
+			   uint64_t nr_lbas)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_tier *tier = rdev->tier;
+
+	if (!tier)
+		return;
+
+	pthread_mutex_lock(&tier->lock);
+	tier_invalidate(dev, tier, lba, nr_lbas);
+	pthread_mutex_unlock(&tier->lock);
+}
+
+void tcmur_tier_invalidate_all(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_tier *tier = rdev->tier;
+
+	if (!tier)
+		return;
+
+	pthread_mutex_lock(&tier->lock);
+	tier->gen++;
+	tier_invalidate(dev, tier, 0, UINT64_MAX);
+	pthread_mutex_unlock(&tier->lock);
+}
+
+static int tier_write_sb(struct tcmur_tier *tier, bool clean,
+			 uint64_t index_sum)
+{
+	struct tcmu_device *dev = tier->dev;
+	struct tcmur_tier_sb *sb;
+	int ret = 0;
+
+	if (posix_memalign((void **)&sb, TCMUR_TIER_SB_SIZE,
+			   TCMUR_TIER_SB_SIZE))
+		return -ENOMEM;
+	memset(sb, 0, TCMUR_TIER_SB_SIZE);
+
+	memcpy(sb->magic, TCMUR_TIER_MAGIC, sizeof(sb->magic));
+	sb->version = TCMUR_TIER_VERSION;
+	sb->clean = clean;
+	sb->slot_size = TCMUR_TIER_SLOT_SIZE;
+	sb->block_size = tcmu_get_dev_block_size(dev);
+	sb->nr_slots = tier->nr_slots;
+	sb->num_lbas = tcmu_get_dev_num_lbas(dev);
+	sb->ident = tier->ident;
+	sb->index_sum = index_sum;
+
+	if (pwrite(tier->fd, sb, TCMUR_TIER_SB_SIZE, 0) != TCMUR_TIER_SB_SIZE ||
+	    fdatasync(tier->fd))
+		ret = errno ? -errno : -EIO;
+	free(sb);
+	return ret;
+}
+
+/* Returns true if the file's index was loaded */
+static bool tier_load(struct tcmur_tier *tier)
+{
+	struct tcmu_device *dev = tier->dev;
+	uint64_t nr_idx = (tcmu_get_dev_num_lbas(dev) *
+			   tcmu_get_dev_block_size(dev)) >> TCMUR_TIER_SLOT_SHIFT;
+	uint64_t sum = TIER_HASH_INIT, expected, done, *entries;
+	struct tcmur_tier_sb *sb;
+	size_t len, i;
+	uint32_t s = 0;
+	bool loaded = false;
+	char *buf;
+
+	if (posix_memalign((void **)&buf, TCMUR_TIER_SB_SIZE,
+			   TCMUR_TIER_INDEX_CHUNK))
+		return false;
+	sb = (struct tcmur_tier_sb *)buf;
+
+	if (pread(tier->fd, buf, TCMUR_TIER_SB_SIZE, 0) != TCMUR_TIER_SB_SIZE)
+		goto free_buf;
+	if (memcmp(sb->magic, TCMUR_TIER_MAGIC, sizeof(sb->magic)) ||
+	    sb->version != TCMUR_TIER_VERSION) {
+		tcmu_dev_info(dev, "Tier file is empty or not a tier, formatting it.\n");
+		goto free_buf;
+	}
+	if (!sb->clean || sb->slot_size != TCMUR_TIER_SLOT_SIZE ||
+	    sb->block_size != tcmu_get_dev_block_size(dev) ||
+	    sb->nr_slots != tier->nr_slots ||
+	    sb->num_lbas != tcmu_get_dev_num_lbas(dev) ||
+	    sb->ident != tier->ident) {
+		tcmu_dev_info(dev, "Tier was not closed cleanly or belongs to another device, starting empty.\n");
+		goto free_buf;
+	}
+	/* buf is reused for the index */
+	expected = sb->index_sum;
+
+	for (done = 0; done < tier->nr_slots; done += len / sizeof(*entries)) {
+		len = min((uint64_t)TCMUR_TIER_INDEX_CHUNK,
+			  (tier->nr_slots - done) * sizeof(*entries));
+		/* O_DIRECT reads whole blocks */
+		if (pread(tier->fd, buf,
+			  round_up(len, (size_t)TCMUR_TIER_SB_SIZE),
+			  tier->index_off + done * sizeof(*entries)) <
+		    (ssize_t)len)
+			goto reset;
+
+		entries = (uint64_t *)buf;
+		for (i = 0; i < len / sizeof(*entries); i++, s++) {
+			if (!entries[i])
+				continue;
+			if (entries[i] > nr_idx ||
+			    tier_lookup(tier, entries[i] - 1) != TIER_NIL)
+				goto reset;
+
+			tier->slots[s].idx = entries[i] - 1;
+			tier->slots[s].state = TIER_VALID;
+			tier_hash_add(tier, s);
+		}
+		sum = tier_hash_buf(buf, len, sum);
+	}
+	if (sum != expected)
+		goto reset;
+	loaded = true;
+	goto free_buf;
+
+reset:
+	tcmu_dev_warn(dev, "Tier index is corrupt, starting empty.\n");
+	for (s = 0; s < tier->nr_slots; s++)
+		tier->slots[s].state = TIER_FREE;
+	for (s = 0; s <= tier->hash_mask; s++)
+		tier->hash[s] = TIER_NIL;
+free_buf:
+	free(buf);
+	return loaded;
+}
+
+/* Write out the index of the valid slots and mark the file clean */
+static int tier_save(struct tcmur_tier *tier)
+{
+	uint64_t sum = TIER_HASH_INIT, done, *entries;
+	size_t n, len, i;
+	char *buf;
+	int ret = 0;
+
+	if (posix_memalign((void **)&buf, TCMUR_TIER_SB_SIZE,
+			   TCMUR_TIER_INDEX_CHUNK))
+		return -ENOMEM;
+	entries = (uint64_t *)buf;
+
+	for (done = 0; done < tier->nr_slots; done += n) {
+		n = min((uint64_t)TCMUR_TIER_INDEX_CHUNK / sizeof(*entries),
+			tier->nr_slots - done);
+		for (i = 0; i < n; i++) {
+			struct tcmur_tier_slot *slot = &tier->slots[done + i];
+
+			entries[i] = slot->state == TIER_VALID ?
+							slot->idx + 1 : 0;
+		}
+		sum = tier_hash_buf(buf, n * sizeof(*entries), sum);
+
+		len = round_up(n * sizeof(*entries), (size_t)TCMUR_TIER_SB_SIZE);
+		memset(buf + n * sizeof(*entries), 0,
+		       len - n * sizeof(*entries));
+		if (pwrite(tier->fd, buf, len,
+			   tier->index_off + done * sizeof(*entries)) != len) {
+			ret = errno ? -errno : -EIO;
+			goto free_buf;
+		}
+	}
+
+	if (fdatasync(tier->fd)) {
+		ret = -errno;
+		goto free_buf;
+	}
+	ret = tier_write_sb(tier, true, sum);
+free_buf:
+	free(buf);
+	return ret;
+}
+
+static void tier_stop_threads(struct tcmur_tier *tier)
+{
+	int i;
+
+	pthread_mutex_lock(&tier->lock);
+	tier->stopping = true;
+	while (tier->nr_jobs)
+		pthread_cond_wait(&tier->idle_cond, &tier->lock);
+	tier->exiting = true;
+	pthread_cond_broadcast(&tier->jobs_cond);
+	pthread_mutex_unlock(&tier->lock);
+
+	for (i = 0; i < tier->nr_threads; i++)
+		pthread_join(tier->threads[i], NULL);
+	tier->nr_threads = 0;
+}
+
+/**
+ * tcmur_tier_setup - open the device's tier cache file
+ * @dev: device to create the tier for
+ * @path: cache file, created if needed. NULL or "" disables the tier.
+ * @size_mb: cache file size in MiB
+ * @write_through: also write the data of WRITEs to the tier
+ *
+ * Must be called after the handler's open so the block size is final,
+ * and before the cmdproc thread is started.
+ */
+int tcmur_tier_setup(struct tcmu_device *dev, const char *path, int size_mb,
+		     bool write_through)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	const char *cfgstring = tcmu_get_dev_cfgstring(dev);
+	uint64_t nr_slots, file_size, i;
+	struct tcmur_tier *tier;
+	uint32_t nr_buckets, s;
+	struct stat st;
+	bool loaded;
+	int ret = -ENOMEM;
+
+	if (!path || !path[0] || size_mb <= 0)
+		return 0;
+
+	if (!rhandler->read) {
+		tcmu_dev_warn(dev, "Handler does not support the tier cache.\n");
+		return 0;
+	}
+
+	if (block_size > TCMUR_TIER_SLOT_SIZE ||
+	    TCMUR_TIER_SLOT_SIZE % block_size) {
+		tcmu_dev_warn(dev, "Tier cache does not support block size %u.\n",
+			      block_size);
+		return 0;
+	}
+
+	nr_slots = ((uint64_t)size_mb << 20) >> TCMUR_TIER_SLOT_SHIFT;
+	if (nr_slots > (1U << 30)) {
+		tcmu_dev_err(dev, "Tier cache size %d MiB is too large.\n",
+			     size_mb);
+		return -EINVAL;
+	}
+
+	tier = calloc(1, sizeof(*tier));
+	if (!tier)
+		return -ENOMEM;
+
+	tier->dev = dev;
+	tier->write_through = write_through;
+	tier->nr_slots = nr_slots;
+	tier->free_head = TIER_NIL;
+	tier->gen = 1;
+	tier->ident = tier_hash_buf(cfgstring, strlen(cfgstring),
+				    TIER_HASH_INIT);
+	tier->index_off = TCMUR_TIER_SB_SIZE;
+	tier->data_off = round_up(tier->index_off + nr_slots * sizeof(uint64_t),
+				  (uint64_t)TCMUR_TIER_DATA_ALIGN);
+	list_head_init(&tier->jobs);
+	list_head_init(&tier->free_jobs);
+
+	for (nr_buckets = 1; nr_buckets < nr_slots; nr_buckets <<= 1)
+		;
+	tier->hash_mask = nr_buckets - 1;
+
+	tier->hash = malloc(nr_buckets * sizeof(*tier->hash));
+	if (!tier->hash)
+		goto free_tier;
+	for (i = 0; i < nr_buckets; i++)
+		tier->hash[i] = TIER_NIL;
+
+	tier->slots = calloc(nr_slots, sizeof(*tier->slots));
+	if (!tier->slots)
+		goto free_hash;
+
+	/* keep the data out of the page cache, unless the fs can not */
+	tier->direct = true;
+	tier->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_DIRECT, 0600);
+	if (tier->fd == -1 && errno == EINVAL) {
+		tier->direct = false;
+		tier->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	}
+	if (tier->fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open tier file %s (%d).\n", path,
+			     ret);
+		goto free_slots;
+	}
+
+	loaded = tier_load(tier);
+	for (s = nr_slots; s-- > 0;) {
+		if (tier->slots[s].state == TIER_FREE)
+			tier_slot_free(tier, s);
+	}
+
+	/* from here on a crash leaves the file to be started empty */
+	ret = tier_write_sb(tier, false, 0);
+	if (ret) {
+		tcmu_dev_err(dev, "Could not write tier file %s (%d).\n", path,
+			     ret);
+		goto close_fd;
+	}
+
+	file_size = tier->data_off + (nr_slots << TCMUR_TIER_SLOT_SHIFT);
+	if (fstat(tier->fd, &st) || (st.st_size != file_size &&
+				     ftruncate(tier->fd, file_size))) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not size tier file %s (%d).\n", path,
+			     ret);
+		goto close_fd;
+	}
+	/* allocate it up front where the fs can, so fills do not ENOSPC */
+	fallocate(tier->fd, 0, 0, file_size);
+
+	ret = pthread_mutex_init(&tier->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto close_fd;
+	}
+
+	ret = pthread_cond_init(&tier->jobs_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	ret = pthread_cond_init(&tier->idle_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_jobs_cond;
+	}
+
+	for (; tier->nr_threads < TCMUR_TIER_NR_THREADS; tier->nr_threads++) {
+		ret = pthread_create(&tier->threads[tier->nr_threads], NULL,
+				     tier_thread_fn, tier);
+		if (ret) {
+			ret = -ret;
+			goto stop_threads;
+		}
+	}
+
+	tcmu_dev_dbg(dev, "tier %s %d MiB%s%s%s\n", path, size_mb,
+		     tier->direct ? ", direct" : "",
+		     write_through ? ", write through" : "",
+		     loaded ? ", index loaded" : "");
+	rdev->tier = tier;
+	return 0;
+
+stop_threads:
+	tier_stop_threads(tier);
+	pthread_cond_destroy(&tier->idle_cond);
+destroy_jobs_cond:
+	pthread_cond_destroy(&tier->jobs_cond);
+destroy_lock:
+	pthread_mutex_destroy(&tier->lock);
+close_fd:
+	close(tier->fd);
+free_slots:
+	free(tier->slots);
+free_hash:
+	free(tier->hash);
+free_tier:
+	free(tier);
+	return ret;
+}
+
+/*
+ * Stop serving and filling the tier and wait for its running IOs. Must
+ * be called before the io workers are stopped, since a hit the tier
+ * could not read is sent to the handler.
+ */
+void tcmur_tier_stop(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_tier *tier = rdev->tier;
+
+	if (!tier)
+		return;
+
+	tier_stop_threads(tier);
+}
+
+/* Must be called once all cmds have completed */
+void tcmur_tier_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_tier *tier = rdev->tier;
+	struct tcmur_tier_job *job;
+	int ret;
+
+	if (!tier)
+		return;
+
+	tcmu_dev_info(dev, "tier hits %"PRIu64" misses %"PRIu64" slots filled %"PRIu64" fills dropped %"PRIu64" io errors %"PRIu64"\n",
+		      tier->hits, tier->misses, tier->slots_filled,
+		      tier->fills_dropped, tier->io_errors);
+
+	ret = tier_save(tier);
+	if (ret)
+		tcmu_dev_warn(dev, "Could not save tier index (%d), it will start empty.\n",
+			      ret);
+
+	rdev->tier = NULL;
+	close(tier->fd);
+	while ((job = list_pop(&tier->free_jobs, struct tcmur_tier_job,
+			       entry))) {
+		free(job->buf);
+		free(job);
+	}
+	pthread_cond_destroy(&tier->idle_cond);
+	pthread_cond_destroy(&tier->jobs_cond);
+	pthread_mutex_destroy(&tier->lock);
+	free(tier->slots);
+	free(tier->hash);
+	free(tier);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_TIER_H
+#define __TCMUR_TIER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct tcmu_device;
+struct tcmulib_cmd;
+
+/* Cached data is tracked in slots of this size */
+#define TCMUR_TIER_SLOT_SHIFT		12
+#define TCMUR_TIER_SLOT_SIZE		(1 << TCMUR_TIER_SLOT_SHIFT)
+
+/* Cache file size used when neither tcmu.conf nor the device set one */
+#define TCMUR_TIER_DEF_MB		1024
+
+struct tcmur_tier;
+struct tcmur_tier_job;
+
+int tcmur_tier_setup(struct tcmu_device *dev, const char *path, int size_mb,
+		     bool write_through);
+void tcmur_tier_stop(struct tcmu_device *dev);
+void tcmur_tier_cleanup(struct tcmu_device *dev);
+
+int tcmur_tier_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+
+void tcmur_tier_cmd_start(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+void tcmur_tier_cmd_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			 int rc);
+void tcmur_tier_write_start(struct tcmu_device *dev, uint64_t lba,
+			    uint64_t nr_lbas);
+void tcmur_tier_write_done(struct tcmu_device *dev);
+void tcmur_tier_invalidate(struct tcmu_device *dev, uint64_t lba,
+			   uint64_t nr_lbas);
+void tcmur_tier_invalidate_all(struct tcmu_device *dev);
+
+#endif /* __TCMUR_TIER_H */
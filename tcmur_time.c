@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Deadlines and timer waits of the runner's threads. They all use
+ * CLOCK_MONOTONIC, so stepping the wall clock neither stalls them nor
+ * makes them fire early.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "tcmur_time.h"
+
+uint64_t tcmur_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t tcmur_now_ms(void)
+{
+	return tcmur_now_ns() / 1000000;
+}
+
+/**
+ * tcmur_cond_init - init a cond for tcmur_cond_wait_until_*
+ * @cond: cond to init
+ *
+ * Returns 0 or a positive errno like pthread_cond_init.
+ */
+int tcmur_cond_init(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	ret = pthread_condattr_init(&attr);
+	if (ret)
+		return ret;
+
+	ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if (!ret)
+		ret = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return ret;
+}
+
+/**
+ * tcmur_cond_wait_until_ns - wait on a cond until a tcmur_now_ns time
+ * @cond: cond set up by tcmur_cond_init
+ * @lock: mutex held by the caller
+ * @until_ns: give up at this tcmur_now_ns time
+ *
+ * Returns like pthread_cond_timedwait.
+ */
+int tcmur_cond_wait_until_ns(pthread_cond_t *cond, pthread_mutex_t *lock,
+			     uint64_t until_ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = until_ns / 1000000000;
+	ts.tv_nsec = until_ns % 1000000000;
+	return pthread_cond_timedwait(cond, lock, &ts);
+}
+
+int tcmur_cond_wait_until_ms(pthread_cond_t *cond, pthread_mutex_t *lock,
+			     uint64_t until_ms)
+{
+	return tcmur_cond_wait_until_ns(cond, lock, until_ms * 1000000);
+}
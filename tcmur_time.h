@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_TIME_H
+#define __TCMUR_TIME_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+uint64_t tcmur_now_ns(void);
+uint64_t tcmur_now_ms(void);
+
+int tcmur_cond_init(pthread_cond_t *cond);
+int tcmur_cond_wait_until_ns(pthread_cond_t *cond, pthread_mutex_t *lock,
+			     uint64_t until_ns);
+int tcmur_cond_wait_until_ms(pthread_cond_t *cond, pthread_mutex_t *lock,
+			     uint64_t until_ms);
+
+#endif /* __TCMUR_TIME_H */
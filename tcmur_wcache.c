@@ -0,0 +1,1092 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Optional per device write-back cache.
+ *
+ * WRITEs are copied into a fixed pool of pages and completed right away.
+ * A flusher thread writes the dirty data back in the order it was
+ * dirtied once it is older than the delay or the pool is half full,
+ * merging dirty blocks that are next to each other into one IO of up to
+ * max_io.
+ *
+ * Blocks that are being written back are not changed until their IO
+ * completes, so a block is never part of two IOs at once and WRITEs to
+ * it wait. cmds that need the data on the backing storage, like
+ * SYNCHRONIZE CACHE, WRITE SAME or FUA WRITEs, wait until the data
+ * written before they arrived has been written back. Every write gets
+ * a sequence number for this, and each page remembers the oldest one
+ * it holds data for.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <scsi/scsi.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_aio.h"
+#include "tcmur_cache.h"
+#include "tcmur_wcache.h"
+#include "tcmur_time.h"
+
+/* Writeback IOs running at once per device */
+#define TCMUR_WCACHE_MAX_INFLIGHT	16
+/* How often the flusher checks if a recovery has completed */
+#define TCMUR_WCACHE_POLL_MS		100
+
+struct tcmur_wcache_page {
+	struct list_node hash_entry;
+	/* on the dirty list when dirty, or on the free list when unused */
+	struct list_node dirty_entry;
+	uint64_t idx;
+	uint64_t seq;		/* write that dirtied the page first */
+	uint64_t wb_seq;	/* oldest write that is being written back */
+	uint64_t dirtied_ms;
+	uint8_t dirty;		/* bitmap of blocks to write back */
+	uint8_t wb;		/* bitmap of blocks being written back */
+};
+
+struct tcmur_wcache_waiter {
+	struct list_node entry;
+	struct tcmulib_cmd *cmd;
+	bool write;		/* buffer the WRITE once it fits */
+	uint64_t lba;
+	uint64_t nr_lbas;	/* 0 for the whole device */
+	uint64_t seq;		/* wait for the writes up to this one */
+	int ret;		/* passed to cmd->done when woken up */
+};
+
+struct tcmur_wcache_seg {
+	struct tcmur_wcache_page *page;
+	uint8_t mask;
+};
+
+struct tcmur_wcache_io {
+	struct tcmulib_cmd cmd;
+	struct tcmur_cmd rcmd;
+	uint8_t cdb[16];
+	struct list_node entry;
+	uint64_t seq;		/* oldest write the IO carries data for */
+	uint64_t lba;
+	uint32_t nr_lbas;
+
+	unsigned int nr_segs;
+	struct tcmur_wcache_seg *segs;
+	struct iovec iov[];
+};
+
+struct tcmur_wcache {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* wakes up the flusher */
+	pthread_t thread;
+
+	struct tcmur_wcache_page *pages;
+	char *data;
+	unsigned int nr_pages;
+	unsigned int nr_free;
+	unsigned int nr_dirty;
+	unsigned int high_wm;
+
+	struct list_head *hash;
+	unsigned int hash_mask;
+	struct list_head dirty;	/* dirty pages, oldest first */
+	struct list_head free;
+
+	uint32_t block_size;
+	uint64_t blocks_per_page;
+	uint64_t delay_ms;
+	uint32_t max_io_lbas;
+
+	uint64_t seq;
+	struct list_head waiters;
+	unsigned int nr_write_waiters;
+	struct list_head inflight;
+	unsigned int nr_inflight;
+
+	bool backend_wce;	/* what the handler set before we took over */
+	bool error;		/* data was lost since the last SYNCHRONIZE CACHE */
+	bool stopping;
+
+	uint64_t writes;
+	uint64_t writes_through;
+	uint64_t read_hits;
+	uint64_t wb_ios;
+	uint64_t wb_lbas;
+};
+
+/* Walks an iovec array without consuming it like tcmu_memcpy_*_iovec */
+struct tcmur_wcache_iter {
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t i;
+	size_t off;
+};
+
+static void wcache_iter_copy(struct tcmur_wcache_iter *iter, char *buf,
+			     size_t len, bool to_iov)
+{
+	size_t n;
+	char *p;
+
+	while (len && iter->i < iter->iov_cnt) {
+		n = min(len, iter->iov[iter->i].iov_len - iter->off);
+		p = (char *)iter->iov[iter->i].iov_base + iter->off;
+
+		if (to_iov)
+			memcpy(p, buf, n);
+		else
+			memcpy(buf, p, n);
+		buf += n;
+		len -= n;
+
+		iter->off += n;
+		if (iter->off == iter->iov[iter->i].iov_len) {
+			iter->i++;
+			iter->off = 0;
+		}
+	}
+}
+
+static inline uint8_t wcache_mask(uint64_t bit, uint64_t nr)
+{
+	return ((1U << nr) - 1) << bit;
+}
+
+static inline char *wcache_block_data(struct tcmur_wcache *wc,
+				      struct tcmur_wcache_page *page,
+				      uint64_t bit)
+{
+	return wc->data +
+		((size_t)(page - wc->pages) << TCMUR_WCACHE_PAGE_SHIFT) +
+		bit * wc->block_size;
+}
+
+static inline struct list_head *wcache_bucket(struct tcmur_wcache *wc,
+					      uint64_t idx)
+{
+	return &wc->hash[(unsigned int)((idx * 0x9E3779B97F4A7C15ULL) >> 32) &
+			 wc->hash_mask];
+}
+
+static struct tcmur_wcache_page *wcache_lookup(struct tcmur_wcache *wc,
+					       uint64_t idx)
+{
+	struct tcmur_wcache_page *page;
+
+	list_for_each(wcache_bucket(wc, idx), page, hash_entry) {
+		if (page->idx == idx)
+			return page;
+	}
+	return NULL;
+}
+
+static struct tcmur_wcache_page *wcache_get_page(struct tcmur_wcache *wc,
+						 uint64_t idx)
+{
+	struct tcmur_wcache_page *page;
+
+	page = list_pop(&wc->free, struct tcmur_wcache_page, dirty_entry);
+	if (!page)
+		return NULL;
+	wc->nr_free--;
+
+	page->idx = idx;
+	page->dirty = 0;
+	page->wb = 0;
+	list_add_tail(wcache_bucket(wc, idx), &page->hash_entry);
+	return page;
+}
+
+static void wcache_put_page(struct tcmur_wcache *wc,
+			    struct tcmur_wcache_page *page)
+{
+	list_del(&page->hash_entry);
+	list_add(&wc->free, &page->dirty_entry);
+	wc->nr_free++;
+}
+
+/*
+ * The blocks of a range are walked one page at a time: idx is the page,
+ * bit the first block in it and n the number of blocks in it.
+ */
+#define wcache_for_each_page(wc, lba, nr_lbas, blk, idx, bit, n)	\
+	for (blk = lba;							\
+	     blk < (lba) + (nr_lbas) &&					\
+	     (idx = blk / (wc)->blocks_per_page,			\
+	      bit = blk % (wc)->blocks_per_page,			\
+	      n = min((lba) + (nr_lbas) - blk,				\
+		      (wc)->blocks_per_page - bit), true);		\
+	     blk += n)
+
+/* Returns true if a WRITE to the range can be buffered now */
+static bool wcache_can_buffer(struct tcmur_wcache *wc, uint64_t lba,
+			      uint64_t nr_lbas)
+{
+	struct tcmur_wcache_page *page;
+	uint64_t blk, idx, bit, n;
+	unsigned int needed = 0;
+
+	wcache_for_each_page(wc, lba, nr_lbas, blk, idx, bit, n) {
+		page = wcache_lookup(wc, idx);
+		if (!page)
+			needed++;
+		else if (page->wb & wcache_mask(bit, n))
+			return false;
+	}
+	return needed <= wc->nr_free;
+}
+
+static void wcache_buffer(struct tcmur_wcache *wc, struct tcmulib_cmd *cmd,
+			  uint64_t lba, uint64_t nr_lbas)
+{
+	struct tcmur_wcache_iter iter = { cmd->iovec, cmd->iov_cnt, 0, 0 };
+	uint64_t now = tcmur_now_ms(), seq = ++wc->seq;
+	struct tcmur_wcache_page *page;
+	uint64_t blk, idx, bit, n;
+
+	wcache_for_each_page(wc, lba, nr_lbas, blk, idx, bit, n) {
+		page = wcache_lookup(wc, idx);
+		if (!page)
+			page = wcache_get_page(wc, idx);
+
+		wcache_iter_copy(&iter, wcache_block_data(wc, page, bit),
+				 n * wc->block_size, false);
+
+		if (!page->dirty) {
+			page->seq = seq;
+			page->dirtied_ms = now;
+			list_add_tail(&wc->dirty, &page->dirty_entry);
+			wc->nr_dirty++;
+		}
+		page->dirty |= wcache_mask(bit, n);
+	}
+	wc->writes++;
+}
+
+/* Returns true once the writes up to seq to the range are written back */
+static bool wcache_range_clean(struct tcmur_wcache *wc, uint64_t lba,
+			       uint64_t nr_lbas, uint64_t seq)
+{
+	struct tcmur_wcache_page *page;
+	struct tcmur_wcache_io *io;
+	uint64_t blk, idx, bit, n;
+	uint8_t mask;
+
+	if (!nr_lbas || nr_lbas / wc->blocks_per_page >= wc->nr_pages) {
+		page = list_top(&wc->dirty, struct tcmur_wcache_page,
+				dirty_entry);
+		if (page && page->seq <= seq)
+			return false;
+
+		list_for_each(&wc->inflight, io, entry) {
+			if (io->seq <= seq)
+				return false;
+		}
+		return true;
+	}
+
+	wcache_for_each_page(wc, lba, nr_lbas, blk, idx, bit, n) {
+		page = wcache_lookup(wc, idx);
+		if (!page)
+			continue;
+
+		mask = wcache_mask(bit, n);
+		if ((page->dirty & mask) && page->seq <= seq)
+			return false;
+		if ((page->wb & mask) && page->wb_seq <= seq)
+			return false;
+	}
+	return true;
+}
+
+static int wcache_park(struct tcmur_wcache *wc, struct tcmulib_cmd *cmd,
+		       bool write, uint64_t lba, uint64_t nr_lbas, int ret)
+{
+	struct tcmur_wcache_waiter *w;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return TCMU_STS_NO_RESOURCE;
+
+	w->cmd = cmd;
+	w->write = write;
+	w->lba = lba;
+	w->nr_lbas = nr_lbas;
+	w->seq = wc->seq;
+	w->ret = ret;
+	list_add_tail(&wc->waiters, &w->entry);
+	if (write)
+		wc->nr_write_waiters++;
+
+	pthread_cond_signal(&wc->cond);
+	return TCMU_STS_ASYNC_HANDLED;
+}
+
+/*
+ * Move the waiters that can go on to ready. WRITEs are buffered in the
+ * order they arrived.
+ */
+static void wcache_wake_waiters(struct tcmur_wcache *wc,
+				struct list_head *ready, bool fail)
+{
+	struct tcmur_wcache_waiter *w, *next;
+	bool write_blocked = false;
+
+	list_for_each_safe(&wc->waiters, w, next, entry) {
+		if (fail) {
+			w->ret = TCMU_STS_BUSY;
+		} else if (w->write) {
+			if (write_blocked ||
+			    !wcache_can_buffer(wc, w->lba, w->nr_lbas)) {
+				write_blocked = true;
+				continue;
+			}
+			wcache_buffer(wc, w->cmd, w->lba, w->nr_lbas);
+		} else if (!wcache_range_clean(wc, w->lba, w->nr_lbas, w->seq)) {
+			continue;
+		}
+
+		if (w->write)
+			wc->nr_write_waiters--;
+		list_del(&w->entry);
+		list_add_tail(ready, &w->entry);
+	}
+}
+
+/* Called without the lock held, since the cmds may be resubmitted */
+static void wcache_run_waiters(struct tcmu_device *dev, struct list_head *ready)
+{
+	struct tcmur_wcache_waiter *w;
+
+	while ((w = list_pop(ready, struct tcmur_wcache_waiter, entry))) {
+		w->cmd->done(dev, w->cmd, w->ret);
+		free(w);
+	}
+}
+
+/**
+ * tcmur_wcache_read - read the data of a READ from the write-back cache
+ * @dev: device the cmd was sent to
+ * @cmd: READ cmd that passed the lba and length checks
+ *
+ * Returns TCMU_STS_OK if all the data was in the cache and has been
+ * copied, or TCMU_STS_NOT_HANDLED if none of it was and the caller must
+ * read it from the handler. If only some of it was the cmd is put on hold
+ * until it has been written back, then cmd->done is called with
+ * TCMU_STS_NOT_HANDLED and the read must be issued, or an error.
+ */
+int tcmur_wcache_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache *wc = rdev->wcache;
+	struct tcmur_wcache_iter iter = { cmd->iovec, cmd->iov_cnt, 0, 0 };
+	uint64_t lba = tcmu_get_lba(cmd->cdb);
+	uint64_t nr_lbas = tcmu_get_xfer_length(cmd->cdb);
+	struct tcmur_wcache_page *page;
+	uint64_t blk, idx, bit, n;
+	bool any = false, all = true;
+	uint8_t mask, cached;
+	int ret;
+
+	if (!wc || !nr_lbas)
+		return TCMU_STS_NOT_HANDLED;
+
+	pthread_mutex_lock(&wc->lock);
+	wcache_for_each_page(wc, lba, nr_lbas, blk, idx, bit, n) {
+		page = wcache_lookup(wc, idx);
+		mask = wcache_mask(bit, n);
+		cached = page ? (page->dirty | page->wb) & mask : 0;
+
+		if (cached)
+			any = true;
+		if (cached != mask)
+			all = false;
+	}
+
+	if (!any) {
+		ret = TCMU_STS_NOT_HANDLED;
+	} else if (all) {
+		wcache_for_each_page(wc, lba, nr_lbas, blk, idx, bit, n) {
+			page = wcache_lookup(wc, idx);
+			wcache_iter_copy(&iter, wcache_block_data(wc, page, bit),
+					 n * wc->block_size, true);
+		}
+		wc->read_hits++;
+		ret = TCMU_STS_OK;
+	} else {
+		ret = wcache_park(wc, cmd, false, lba, nr_lbas,
+				  TCMU_STS_NOT_HANDLED);
+	}
+	pthread_mutex_unlock(&wc->lock);
+
+	return ret;
+}
+
+/**
+ * tcmur_wcache_write - buffer the data of a WRITE in the write-back cache
+ * @dev: device the cmd was sent to
+ * @cmd: WRITE cmd that passed the lba and length checks
+ *
+ * Returns TCMU_STS_OK if the data was buffered, or TCMU_STS_NOT_HANDLED
+ * if the WRITE must go to the handler directly, like FUA WRITEs. If the
+ * cmd had to be put on hold, cmd->done is called later with one of the
+ * above or an error.
+ */
+int tcmur_wcache_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache *wc = rdev->wcache;
+	uint8_t *cdb = cmd->cdb;
+	uint64_t lba = tcmu_get_lba(cdb);
+	uint64_t nr_lbas = tcmu_get_xfer_length(cdb);
+	bool fua = cdb[0] != WRITE_6 && (cdb[1] & 0x08);
+	int ret;
+
+	if (!wc || !nr_lbas)
+		return TCMU_STS_NOT_HANDLED;
+
+	pthread_mutex_lock(&wc->lock);
+	if (fua || nr_lbas > wc->max_io_lbas || wc->stopping) {
+		/* older data must not be written back over it later */
+		wc->writes_through++;
+		if (wcache_range_clean(wc, lba, nr_lbas, wc->seq))
+			ret = TCMU_STS_NOT_HANDLED;
+		else
+			ret = wcache_park(wc, cmd, false, lba, nr_lbas,
+					  TCMU_STS_NOT_HANDLED);
+	} else if (!wc->nr_write_waiters &&
+		   wcache_can_buffer(wc, lba, nr_lbas)) {
+		wcache_buffer(wc, cmd, lba, nr_lbas);
+		if (wc->nr_dirty >= wc->high_wm)
+			pthread_cond_signal(&wc->cond);
+		ret = TCMU_STS_OK;
+	} else {
+		ret = wcache_park(wc, cmd, true, lba, nr_lbas, TCMU_STS_OK);
+	}
+	pthread_mutex_unlock(&wc->lock);
+
+	return ret;
+}
+
+/**
+ * tcmur_wcache_wait - wait for the data written to a range to be written back
+ * @dev: device to wait for
+ * @cmd: cmd to put on hold
+ * @lba: first lba of the range
+ * @nr_lbas: number of lbas in the range, or 0 for the whole device
+ *
+ * Returns TCMU_STS_OK if there is nothing to wait for. Otherwise the cmd
+ * is put on hold and cmd->done is called with TCMU_STS_OK or an error
+ * once the data written before it has been written back.
+ */
+int tcmur_wcache_wait(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		      uint64_t lba, uint64_t nr_lbas)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache *wc = rdev->wcache;
+	int ret = TCMU_STS_OK;
+
+	if (!wc)
+		return TCMU_STS_OK;
+
+	pthread_mutex_lock(&wc->lock);
+	if (!wcache_range_clean(wc, lba, nr_lbas, wc->seq))
+		ret = wcache_park(wc, cmd, false, lba, nr_lbas, TCMU_STS_OK);
+	pthread_mutex_unlock(&wc->lock);
+
+	return ret;
+}
+
+/*
+ * Put cmds that access the backing storage other than by READ and WRITE
+ * on hold until the data they depend on has been written back. Returns
+ * TCMU_STS_OK if the cmd can go on now, otherwise done is called once it
+ * can.
+ */
+int tcmur_wcache_barrier(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			 cmd_done_t done)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint8_t *cdb = cmd->cdb;
+	uint64_t lba, nr_lbas;
+
+	if (!rdev->wcache)
+		return TCMU_STS_OK;
+
+	switch (cdb[0]) {
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		lba = tcmu_get_lba(cdb);
+		nr_lbas = tcmu_get_xfer_length(cdb);
+		break;
+	case COMPARE_AND_WRITE:
+		lba = tcmu_get_lba(cdb);
+		nr_lbas = cdb[13];
+		break;
+	case SERVICE_ACTION_IN_16:
+		/*
+		 * Dirty blocks may still be holes in the backing storage,
+		 * and how far the reported range goes is not known yet.
+		 */
+		if ((cdb[1] & 0x1f) != GET_LBA_STATUS)
+			return TCMU_STS_OK;
+		lba = 0;
+		nr_lbas = 0;
+		break;
+	case UNMAP:
+	case FORMAT_UNIT:
+		/* EXTENDED COPY waits for its src and dst ranges itself */
+		lba = 0;
+		nr_lbas = 0;
+		break;
+	default:
+		return TCMU_STS_OK;
+	}
+
+	cmd->done = done;
+	return tcmur_wcache_wait(dev, cmd, lba, nr_lbas);
+}
+
+/* Returns true if dirty data was lost since the last call */
+bool tcmur_wcache_take_error(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache *wc = rdev->wcache;
+	bool error;
+
+	if (!wc)
+		return false;
+
+	pthread_mutex_lock(&wc->lock);
+	error = wc->error;
+	wc->error = false;
+	pthread_mutex_unlock(&wc->lock);
+
+	return error;
+}
+
+/* Returns true if the handler has a volatile cache of its own */
+bool tcmur_wcache_backend_wce(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+
+	return rdev->wcache && rdev->wcache->backend_wce;
+}
+
+/*
+ * The handler's open sets the WCE bit to what the backend does, so after
+ * a reopen take note of it again and report our cache on top.
+ */
+void tcmur_wcache_reopened(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache *wc = rdev->wcache;
+
+	if (!wc)
+		return;
+
+	/* no cmds are running while the device is reopened */
+	wc->backend_wce = tcmu_get_dev_write_cache_enabled(dev);
+	tcmu_set_dev_write_cache_enabled(dev, 1);
+}
+
+/*
+ * Drop the dirty data, for when writing it back could overwrite data
+ * another node wrote after it took the lock. The next SYNCHRONIZE CACHE
+ * fails.
+ */
+void tcmur_wcache_discard(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache *wc = rdev->wcache;
+	struct tcmur_wcache_page *page;
+	unsigned int nr_dropped;
+	LIST_HEAD(ready);
+
+	if (!wc)
+		return;
+
+	pthread_mutex_lock(&wc->lock);
+	nr_dropped = wc->nr_dirty;
+	while ((page = list_pop(&wc->dirty, struct tcmur_wcache_page,
+				dirty_entry))) {
+		page->dirty = 0;
+		wc->nr_dirty--;
+		if (!page->wb)
+			wcache_put_page(wc, page);
+	}
+	if (nr_dropped) {
+		wc->error = true;
+		tcmu_dev_warn(dev, "Dropped %u dirty pages.\n", nr_dropped);
+	}
+	wcache_wake_waiters(wc, &ready, false);
+	pthread_mutex_unlock(&wc->lock);
+
+	wcache_run_waiters(dev, &ready);
+}
+
+static bool wcache_need_flush(struct tcmur_wcache *wc, uint64_t *wait_ms)
+{
+	struct tcmur_wcache_page *page;
+	uint64_t now;
+
+	page = list_top(&wc->dirty, struct tcmur_wcache_page, dirty_entry);
+	if (!page)
+		return false;
+
+	if (wc->stopping || !list_empty(&wc->waiters) ||
+	    wc->nr_dirty >= wc->high_wm)
+		return true;
+
+	now = tcmur_now_ms();
+	if (now >= page->dirtied_ms + wc->delay_ms)
+		return true;
+
+	*wait_ms = page->dirtied_ms + wc->delay_ms - now;
+	return false;
+}
+
+static void wcache_sleep(struct tcmur_wcache *wc, uint64_t wait_ms)
+{
+	if (!wait_ms) {
+		pthread_cond_wait(&wc->cond, &wc->lock);
+		return;
+	}
+
+	tcmur_cond_wait_until_ms(&wc->cond, &wc->lock,
+				 tcmur_now_ms() + wait_ms);
+}
+
+/*
+ * Pick the page to start the next IO at: the oldest dirty page, unless a
+ * cmd is waiting for a range that holds older dirty data.
+ */
+static struct tcmur_wcache_page *wcache_pick_page(struct tcmur_wcache *wc)
+{
+	struct tcmur_wcache_waiter *w;
+	struct tcmur_wcache_page *page;
+	uint64_t blk, idx, bit, n;
+
+	w = list_top(&wc->waiters, struct tcmur_wcache_waiter, entry);
+	if (w && !w->write && w->nr_lbas &&
+	    w->nr_lbas / wc->blocks_per_page < wc->nr_pages) {
+		wcache_for_each_page(wc, w->lba, w->nr_lbas, blk, idx, bit, n) {
+			page = wcache_lookup(wc, idx);
+			if (page && (page->dirty & wcache_mask(bit, n)) &&
+			    page->seq <= w->seq)
+				return page;
+		}
+	}
+	return list_top(&wc->dirty, struct tcmur_wcache_page, dirty_entry);
+}
+
+static bool wcache_block_dirty(struct tcmur_wcache *wc, uint64_t blk,
+			       struct tcmur_wcache_page **page)
+{
+	uint64_t idx = blk / wc->blocks_per_page;
+
+	if (!*page || (*page)->idx != idx)
+		*page = wcache_lookup(wc, idx);
+	return *page && ((*page)->dirty & (1U << (blk % wc->blocks_per_page)));
+}
+
+/*
+ * Take the dirty blocks next to the picked page's first dirty block,
+ * and mark them as being written back.
+ */
+static struct tcmur_wcache_io *wcache_build_io(struct tcmu_device *dev,
+					       struct tcmur_wcache *wc)
+{
+	uint64_t num_lbas = tcmu_get_dev_num_lbas(dev);
+	struct tcmur_wcache_page *page, *p;
+	struct tcmur_wcache_io *io;
+	struct tcmur_wcache_seg *seg;
+	uint64_t start, end, blk, idx, bit, n, lba;
+	unsigned int max_segs;
+	uint32_t nr_lbas;
+
+	page = wcache_pick_page(wc);
+	if (!page)
+		return NULL;
+
+	start = page->idx * wc->blocks_per_page + ffs(page->dirty) - 1;
+	end = start + 1;
+
+	p = page;
+	while (end - start < wc->max_io_lbas && start > 0 &&
+	       wcache_block_dirty(wc, start - 1, &p))
+		start--;
+	p = page;
+	while (end - start < wc->max_io_lbas && end < num_lbas &&
+	       wcache_block_dirty(wc, end, &p))
+		end++;
+
+	max_segs = (end - start) / wc->blocks_per_page + 2;
+	io = calloc(1, sizeof(*io) + max_segs * (sizeof(struct iovec) +
+						  sizeof(*io->segs)));
+	if (!io)
+		return NULL;
+	io->segs = (struct tcmur_wcache_seg *)&io->iov[max_segs];
+	io->seq = UINT64_MAX;
+
+	wcache_for_each_page(wc, start, end - start, blk, idx, bit, n) {
+		page = wcache_lookup(wc, idx);
+
+		seg = &io->segs[io->nr_segs];
+		seg->page = page;
+		seg->mask = wcache_mask(bit, n);
+		io->iov[io->nr_segs].iov_base = wcache_block_data(wc, page, bit);
+		io->iov[io->nr_segs].iov_len = n * wc->block_size;
+		io->nr_segs++;
+
+		io->seq = min(io->seq, page->seq);
+		if (!page->wb || page->seq < page->wb_seq)
+			page->wb_seq = page->seq;
+		page->wb |= seg->mask;
+		page->dirty &= ~seg->mask;
+		if (!page->dirty) {
+			list_del(&page->dirty_entry);
+			wc->nr_dirty--;
+		}
+	}
+
+	io->lba = start;
+	io->nr_lbas = end - start;
+
+	/* a real cdb so the io tracing and debug output make sense */
+	lba = htobe64(io->lba);
+	nr_lbas = htobe32(io->nr_lbas);
+	io->cdb[0] = WRITE_16;
+	memcpy(&io->cdb[2], &lba, 8);
+	memcpy(&io->cdb[10], &nr_lbas, 4);
+
+	tcmur_cmd_init(&io->cmd, &io->rcmd);
+	io->cmd.cdb = io->cdb;
+	io->cmd.iovec = io->iov;
+	io->cmd.iov_cnt = io->nr_segs;
+
+	list_add_tail(&wc->inflight, &io->entry);
+	wc->nr_inflight++;
+	return io;
+}
+
+static void wcache_io_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   int ret)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache_io *io = container_of(cmd, struct tcmur_wcache_io,
+						  cmd);
+	struct tcmur_wcache *wc = rdev->wcache;
+	struct tcmur_wcache_page *page;
+	LIST_HEAD(ready);
+	unsigned int i;
+
+	pthread_mutex_lock(&wc->lock);
+	if (ret != TCMU_STS_OK) {
+		tcmu_dev_err(dev, "Write back of lba %"PRIu64" len %u failed %d, data lost.\n",
+			     io->lba, io->nr_lbas, ret);
+		wc->error = true;
+	}
+
+	for (i = 0; i < io->nr_segs; i++) {
+		page = io->segs[i].page;
+		page->wb &= ~io->segs[i].mask;
+		if (!page->wb && !page->dirty)
+			wcache_put_page(wc, page);
+	}
+
+	list_del(&io->entry);
+	wc->nr_inflight--;
+	wc->wb_ios++;
+	wc->wb_lbas += io->nr_lbas;
+
+	wcache_wake_waiters(wc, &ready, false);
+	pthread_cond_signal(&wc->cond);
+	pthread_mutex_unlock(&wc->lock);
+
+	tcmur_cache_write_done(dev);
+	wcache_run_waiters(dev, &ready);
+	free(io);
+	track_aio_request_finish(rdev);
+}
+
+static int wcache_io_work_fn(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_wcache_io *io = container_of(cmd, struct tcmur_wcache_io,
+						  cmd);
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+
+	return rhandler->write(dev, cmd, cmd->iovec, cmd->iov_cnt,
+			       (size_t)io->nr_lbas * block_size,
+			       io->lba * block_size);
+}
+
+/*
+ * The handler is being reopened. cmds waiting for us are failed so the
+ * initiator retries them, since the recovery waits for the cmds that are
+ * running. If the device is being removed too the dirty data is lost.
+ */
+static void wcache_recovery_wait(struct tcmu_device *dev,
+				 struct tcmur_wcache *wc)
+{
+	LIST_HEAD(ready);
+
+	wcache_wake_waiters(wc, &ready, true);
+	pthread_mutex_unlock(&wc->lock);
+
+	wcache_run_waiters(dev, &ready);
+	if (wc->stopping)
+		tcmur_wcache_discard(dev);
+
+	pthread_mutex_lock(&wc->lock);
+	wcache_sleep(wc, TCMUR_WCACHE_POLL_MS);
+}
+
+static void *wcache_flusher(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache *wc = rdev->wcache;
+	struct tcmur_wcache_io *io;
+	uint64_t wait_ms;
+	int ret;
+
+	pthread_mutex_lock(&wc->lock);
+	while (!wc->stopping || wc->nr_dirty || wc->nr_inflight) {
+		wait_ms = 0;
+		if (wc->nr_inflight >= TCMUR_WCACHE_MAX_INFLIGHT ||
+		    !wcache_need_flush(wc, &wait_ms)) {
+			wcache_sleep(wc, wait_ms);
+			continue;
+		}
+		pthread_mutex_unlock(&wc->lock);
+
+		/* tracked like a cmd, so a reopen waits for it */
+		track_aio_request_start(rdev);
+		if (tcmu_dev_in_recovery(dev)) {
+			track_aio_request_finish(rdev);
+			pthread_mutex_lock(&wc->lock);
+			wcache_recovery_wait(dev, wc);
+			continue;
+		}
+
+		pthread_mutex_lock(&wc->lock);
+		io = wcache_build_io(dev, wc);
+		if (!io) {
+			pthread_mutex_unlock(&wc->lock);
+			track_aio_request_finish(rdev);
+			pthread_mutex_lock(&wc->lock);
+			if (wc->nr_dirty)
+				wcache_sleep(wc, TCMUR_WCACHE_POLL_MS);
+			continue;
+		}
+		pthread_mutex_unlock(&wc->lock);
+
+		tcmur_cache_write_start(dev, io->lba, io->nr_lbas);
+		io->cmd.done = wcache_io_done;
+		ret = async_handle_cmd(dev, &io->cmd, wcache_io_work_fn);
+		if (ret != TCMU_STS_ASYNC_HANDLED)
+			wcache_io_done(dev, &io->cmd, ret);
+
+		pthread_mutex_lock(&wc->lock);
+	}
+	pthread_mutex_unlock(&wc->lock);
+
+	return NULL;
+}
+
+/**
+ * tcmur_wcache_setup - create the device's write-back cache
+ * @dev: device to create the cache for
+ * @size_mb: cache size in MiB, 0 disables the cache
+ * @delay_ms: how long data may stay dirty, -1 for the default
+ * @max_io_kb: largest writeback IO in KiB, -1 for the default
+ *
+ * Must be called after the handler's open so the block size and write
+ * cache setting are final, and before the cmdproc thread is started.
+ */
+int tcmur_wcache_setup(struct tcmu_device *dev, int size_mb, int delay_ms,
+		       int max_io_kb)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	uint32_t block_size = tcmu_get_dev_block_size(dev);
+	struct tcmur_wcache *wc;
+	unsigned int i, nr_buckets;
+	uint64_t nr_pages, max_io_lbas;
+	int ret = -ENOMEM;
+
+	if (size_mb <= 0)
+		return 0;
+
+	if (!rhandler->read || !rhandler->write) {
+		tcmu_dev_warn(dev, "Handler does not support the write-back cache.\n");
+		return 0;
+	}
+
+	if (block_size < 512 || block_size > TCMUR_WCACHE_PAGE_SIZE ||
+	    TCMUR_WCACHE_PAGE_SIZE % block_size) {
+		tcmu_dev_warn(dev, "Write-back cache does not support block size %u.\n",
+			      block_size);
+		return 0;
+	}
+
+	nr_pages = ((uint64_t)size_mb << 20) >> TCMUR_WCACHE_PAGE_SHIFT;
+	if (nr_pages > (1U << 30)) {
+		tcmu_dev_err(dev, "Write-back cache size %d MiB is too large.\n",
+			     size_mb);
+		return -EINVAL;
+	}
+
+	if (delay_ms < 0)
+		delay_ms = TCMUR_WCACHE_DEF_DELAY_MS;
+	if (max_io_kb <= 0)
+		max_io_kb = TCMUR_WCACHE_DEF_MAX_IO_KB;
+
+	wc = calloc(1, sizeof(*wc));
+	if (!wc)
+		return -ENOMEM;
+
+	wc->nr_pages = nr_pages;
+	wc->nr_free = nr_pages;
+	wc->high_wm = nr_pages / 2;
+	wc->block_size = block_size;
+	wc->blocks_per_page = TCMUR_WCACHE_PAGE_SIZE / block_size;
+	wc->delay_ms = delay_ms;
+	/* a WRITE that is let in must always fit eventually */
+	max_io_lbas = ((uint64_t)max_io_kb << 10) / block_size;
+	wc->max_io_lbas = min(max_io_lbas,
+			      (nr_pages / 4) * wc->blocks_per_page);
+	wc->backend_wce = tcmu_get_dev_write_cache_enabled(dev);
+	list_head_init(&wc->dirty);
+	list_head_init(&wc->free);
+	list_head_init(&wc->waiters);
+	list_head_init(&wc->inflight);
+
+	for (nr_buckets = 1; nr_buckets < nr_pages; nr_buckets <<= 1)
+		;
+	wc->hash_mask = nr_buckets - 1;
+
+	wc->hash = malloc(nr_buckets * sizeof(*wc->hash));
+	if (!wc->hash)
+		goto free_wc;
+	for (i = 0; i < nr_buckets; i++)
+		list_head_init(&wc->hash[i]);
+
+	wc->pages = calloc(nr_pages, sizeof(*wc->pages));
+	if (!wc->pages)
+		goto free_hash;
+	for (i = 0; i < nr_pages; i++)
+		list_add_tail(&wc->free, &wc->pages[i].dirty_entry);
+
+	if (posix_memalign((void **)&wc->data, TCMUR_WCACHE_PAGE_SIZE,
+			   nr_pages << TCMUR_WCACHE_PAGE_SHIFT))
+		goto free_pages;
+
+	ret = pthread_mutex_init(&wc->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto free_data;
+	}
+
+	ret = tcmur_cond_init(&wc->cond);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	rdev->wcache = wc;
+	ret = pthread_create(&wc->thread, NULL, wcache_flusher, dev);
+	if (ret) {
+		ret = -ret;
+		goto destroy_cond;
+	}
+
+	/* we complete WRITEs before the data is on the backing storage */
+	tcmu_set_dev_write_cache_enabled(dev, 1);
+
+	tcmu_dev_dbg(dev, "write-back cache %d MiB, delay %d ms, max io %u lbas\n",
+		     size_mb, delay_ms, wc->max_io_lbas);
+	return 0;
+
+destroy_cond:
+	rdev->wcache = NULL;
+	pthread_cond_destroy(&wc->cond);
+destroy_lock:
+	pthread_mutex_destroy(&wc->lock);
+free_data:
+	free(wc->data);
+free_pages:
+	free(wc->pages);
+free_hash:
+	free(wc->hash);
+free_wc:
+	free(wc);
+	return ret;
+}
+
+/*
+ * Write back all the dirty data and stop the flusher. WRITEs that arrive
+ * afterwards go to the handler directly. Must be called before the io
+ * workers are stopped.
+ */
+void tcmur_wcache_stop(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache *wc = rdev->wcache;
+
+	if (!wc)
+		return;
+
+	pthread_mutex_lock(&wc->lock);
+	wc->stopping = true;
+	pthread_cond_signal(&wc->cond);
+	pthread_mutex_unlock(&wc->lock);
+
+	pthread_join(wc->thread, NULL);
+}
+
+/* Must be called once all cmds have completed */
+void tcmur_wcache_cleanup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_get_daemon_dev_private(dev);
+	struct tcmur_wcache *wc = rdev->wcache;
+
+	if (!wc)
+		return;
+
+	tcmu_dev_info(dev, "write-back cache writes %"PRIu64" (%"PRIu64" write through) read hits %"PRIu64" writeback ios %"PRIu64" lbas %"PRIu64"\n",
+		      wc->writes, wc->writes_through, wc->read_hits,
+		      wc->wb_ios, wc->wb_lbas);
+
+	rdev->wcache = NULL;
+	pthread_cond_destroy(&wc->cond);
+	pthread_mutex_destroy(&wc->lock);
+	free(wc->data);
+	free(wc->pages);
+	free(wc->hash);
+	free(wc);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2026 The tcmu-runner Authors
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_WCACHE_H
+#define __TCMUR_WCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libtcmu_common.h"
+
+struct tcmu_device;
+struct tcmulib_cmd;
+
+/* Dirty data is tracked in pages of this size */
+#define TCMUR_WCACHE_PAGE_SHIFT		12
+#define TCMUR_WCACHE_PAGE_SIZE		(1 << TCMUR_WCACHE_PAGE_SHIFT)
+
+/* Used when neither tcmu.conf nor the device set them */
+#define TCMUR_WCACHE_DEF_DELAY_MS	50
+#define TCMUR_WCACHE_DEF_MAX_IO_KB	1024
+
+struct tcmur_wcache;
+
+int tcmur_wcache_setup(struct tcmu_device *dev, int size_mb, int delay_ms,
+		       int max_io_kb);
+void tcmur_wcache_stop(struct tcmu_device *dev);
+void tcmur_wcache_cleanup(struct tcmu_device *dev);
+
+int tcmur_wcache_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+int tcmur_wcache_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+int tcmur_wcache_wait(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		      uint64_t lba, uint64_t nr_lbas);
+int tcmur_wcache_barrier(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			 cmd_done_t done);
+bool tcmur_wcache_take_error(struct tcmu_device *dev);
+bool tcmur_wcache_backend_wce(struct tcmu_device *dev);
+void tcmur_wcache_reopened(struct tcmu_device *dev);
+void tcmur_wcache_discard(struct tcmu_device *dev);
+
+#endif /* __TCMUR_WCACHE_H */